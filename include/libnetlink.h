@@ -8,6 +8,17 @@
 #include <linux/if_addr.h>
 #include <linux/neighbour.h>
 
+struct rtnl_window;
+struct rtnl_rcvq;
+
+struct rtnl_stats
+{
+	unsigned long		syscalls;
+	unsigned long long	bytes;
+	unsigned long		msgs;
+	unsigned long		truncs;
+};
+
 struct rtnl_handle
 {
 	int			fd;
@@ -15,6 +26,9 @@ struct rtnl_handle
 	struct sockaddr_nl	peer;
 	__u32			seq;
 	__u32			dump;
+	struct rtnl_window	*window;
+	struct rtnl_rcvq	*rcvq;
+	struct rtnl_stats	stats;
 };
 
 extern int rcvbuf;
@@ -34,22 +48,110 @@ struct rtnl_dump_filter_arg
 	void *arg1;
 	rtnl_filter_t junk;
 	void *arg2;
+	rtnl_filter_t peek;	/* a received batch, before filter sees it */
 };
 
 extern int rtnl_dump_filter_l(struct rtnl_handle *rth,
 			      const struct rtnl_dump_filter_arg *arg);
+extern int rtnl_dump_filter_quiet(struct rtnl_handle *rth,
+				  const struct rtnl_dump_filter_arg *arg);
 extern int rtnl_dump_filter(struct rtnl_handle *rth, rtnl_filter_t filter,
 			    void *arg1,
 			    rtnl_filter_t junk,
 			    void *arg2);
 
+struct rtnl_dump_multi_arg
+{
+	int family;
+	int type;
+	rtnl_filter_t filter;
+	void *arg1;
+};
+
+extern int rtnl_dump_multi(struct rtnl_handle *rth,
+			   const struct rtnl_dump_multi_arg *arg, int n);
+
 extern int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 		     unsigned groups, struct nlmsghdr *answer,
 		     rtnl_filter_t junk,
 		     void *jarg);
+extern int rtnl_talk_quiet(struct rtnl_handle *rtnl, struct nlmsghdr *n,
+			   struct nlmsghdr *answer);
 extern int rtnl_send(struct rtnl_handle *rth, const char *buf, int);
 extern int rtnl_send_check(struct rtnl_handle *rth, const char *buf, int);
 
+/* Pipelined requests: while a window is attached to the handle,
+ * rtnl_talk() calls which only want an ACK return as soon as the
+ * request is sent. ACKs are collected later and matched back to the
+ * tag which was current when the request was issued.
+ */
+typedef int (*rtnl_window_err_t)(int tag, int error, void *arg);
+
+struct rtnl_window_slot
+{
+	__u32			seq;
+	int			tag;
+};
+
+struct rtnl_window
+{
+	unsigned		size;
+	unsigned		head;
+	unsigned		inflight;
+	int			tag;
+	unsigned long		sent;
+	unsigned long long	bytes;
+	unsigned long		errors;
+	rtnl_window_err_t	error;
+	void			*arg;
+	struct rtnl_window_slot	slot[0];
+};
+
+extern int rtnl_window_open(struct rtnl_handle *rth, unsigned size,
+			    rtnl_window_err_t error, void *arg);
+extern int rtnl_window_flush(struct rtnl_handle *rth);
+extern int rtnl_window_close(struct rtnl_handle *rth);
+
+static inline void rtnl_window_tag(struct rtnl_handle *rth, int tag)
+{
+	if (rth->window)
+		rth->window->tag = tag;
+}
+
+/* Bulk deletion for the "flush" commands: requests are collected while
+ * walking a dump and sent in large batches once it is over. "changed"
+ * is set when anything besides our own deletions happened meanwhile,
+ * i.e. when another dump is worth doing.
+ */
+struct rtnl_flush
+{
+	char			*buf;
+	int			len;
+	int			size;
+	int			queued;
+	int			count;
+	int			type;
+	int			seen;
+	int			gone;
+	int			errors;
+	int			error;
+	int			changed;
+	unsigned long		sends;
+	unsigned long long	usecs;
+	struct rtnl_handle	mon;
+};
+
+extern int rtnl_flush_open(struct rtnl_flush *f, unsigned groups);
+extern int rtnl_flush_open_byproto(struct rtnl_flush *f, unsigned groups,
+				   int protocol);
+extern void rtnl_flush_reset(struct rtnl_flush *f);
+extern int rtnl_flush_add(struct rtnl_flush *f, const struct nlmsghdr *n,
+			  int type);
+extern int rtnl_flush_commit(struct rtnl_handle *rth, struct rtnl_flush *f);
+extern int rtnl_flush_stream(struct rtnl_handle *rth, struct rtnl_flush *f);
+extern void rtnl_flush_print_round(FILE *fp, const struct rtnl_flush *f);
+extern void rtnl_flush_close(struct rtnl_flush *f);
+
 extern int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data);
 extern int addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data, int alen);
 extern int addraw_l(struct nlmsghdr *n, int maxlen, const void *data, int len);
@@ -73,6 +175,7 @@ extern int __parse_rtattr_nested_compat(struct rtattr *tb[], int max, struct rta
 
 extern int rtnl_listen(struct rtnl_handle *, rtnl_filter_t handler,
 		       void *jarg);
+extern void rtnl_print_stats(FILE *fp, const struct rtnl_handle *rth);
 extern int rtnl_from_file(FILE *, rtnl_filter_t handler,
 		       void *jarg);
 
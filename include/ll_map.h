@@ -3,7 +3,9 @@
 
 extern int ll_remember_index(const struct sockaddr_nl *who,
 			     struct nlmsghdr *n, void *arg);
+extern int ll_map_lazy;
 extern int ll_init_map(struct rtnl_handle *rth);
+extern int ll_init_map_full(struct rtnl_handle *rth);
 extern unsigned ll_name_to_index(const char *name);
 extern const char *ll_index_to_name(unsigned idx);
 extern const char *ll_idx_n2a(unsigned idx, char *buf);
@@ -0,0 +1,10 @@
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__ 1
+
+extern const char *resolve_host(int af, int len, const void *addr,
+				char *buf, int blen);
+extern void resolve_host_prefetch(int af, int len, const void *addr);
+extern const char *resolve_service_name(int port, const char *proto,
+					char *buf, int len);
+
+#endif /* __RESOLVE_H__ */
@@ -148,6 +148,19 @@ extern int cmdlineno;
 extern ssize_t getcmdline(char **line, size_t *len, FILE *in);
 extern int makeargs(char *line, char *argv[], int maxargs);
 
+#define CMD_SERVER_STDOUT	1
+#define CMD_SERVER_STDERR	2
+#define CMD_SERVER_STATUS	3
+
+struct cmd_server_hdr
+{
+	__u32	type;
+	__u32	len;
+};
+
+extern int cmd_server(const char *path, struct rtnl_handle *rth,
+		      int (*cmd)(int argc, char **argv));
+
 struct iplink_req;
 int iplink_parse(int argc, char **argv, struct iplink_req *req,
 		char **name, char **type, char **link, char **dev);
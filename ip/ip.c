@@ -31,7 +31,9 @@ int oneline = 0;
 int timestamp = 0;
 char * _SL_ = NULL;
 char *batch_file = NULL;
+static char *server_path = NULL;
 int force = 0;
+static unsigned batch_window = 0;
 struct rtnl_handle rth = { .fd = -1 };
 
 static void usage(void) __attribute__((noreturn));
@@ -40,16 +42,22 @@ static void usage(void)
 {
 	fprintf(stderr,
 "Usage: ip [ OPTIONS ] OBJECT { COMMAND | help }\n"
-"       ip [ -force ] -batch filename\n"
+"       ip [ -force ] [ -window SIZE ] -batch filename\n"
+"       ip [ OPTIONS ] -server SOCKET\n"
 "where  OBJECT := { link | addr | addrlabel | route | rule | neigh | ntable |\n"
 "                   tunnel | tuntap | maddr | mroute | mrule | monitor | xfrm }\n"
 "       OPTIONS := { -V[ersion] | -s[tatistics] | -d[etails] | -r[esolve] |\n"
 "                    -f[amily] { inet | inet6 | ipx | dnet | link } |\n"
 "                    -o[neline] | -t[imestamp] | -b[atch] [filename] |\n"
-"                    -rc[vbuf] [size]}\n");
+"                    -rc[vbuf] [size] | -w[indow] [size]}\n");
 	exit(-1);
 }
 
+static void print_nlstats(void)
+{
+	rtnl_print_stats(stderr, &rth);
+}
+
 static int do_help(int argc, char **argv)
 {
 	usage();
@@ -94,6 +102,17 @@ static int do_cmd(const char *argv0, int argc, char **argv)
 	return -1;
 }
 
+static int batch_error(int lineno, int error, void *arg)
+{
+	fprintf(stderr, "Command failed %s:%d\n", (const char *)arg, lineno);
+	return 0;
+}
+
+static int server_cmd(int argc, char **argv)
+{
+	return do_cmd(argv[0], argc, argv);
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
@@ -113,6 +132,12 @@ static int batch(const char *name)
 		return -1;
 	}
 
+	if (batch_window &&
+	    rtnl_window_open(&rth, batch_window, batch_error, (void *)name) < 0) {
+		rtnl_close(&rth);
+		return -1;
+	}
+
 	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
 		char *largv[100];
@@ -122,16 +147,25 @@ static int batch(const char *name)
 		if (largc == 0)
 			continue;	/* blank line */
 
+		rtnl_window_tag(&rth, cmdlineno);
 		if (do_cmd(largv[0], largc, largv)) {
 			fprintf(stderr, "Command failed %s:%d\n", name, cmdlineno);
 			ret = 1;
 			if (!force)
 				break;
 		}
+		if (rth.window && rth.window->errors) {
+			ret = 1;
+			if (!force)
+				break;
+		}
 	}
 	if (line)
 		free(line);
 
+	if (rtnl_window_flush(&rth) < 0 || (rth.window && rth.window->errors))
+		ret = 1;
+	rtnl_window_close(&rth);
 	rtnl_close(&rth);
 	return ret;
 }
@@ -212,6 +246,22 @@ int main(int argc, char **argv)
 			if (argc <= 1)
 				usage();
 			batch_file = argv[1];
+		} else if (matches(opt, "-server") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			server_path = argv[1];
+		} else if (matches(opt, "-window") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			if (get_unsigned(&batch_window, argv[1], 0)) {
+				fprintf(stderr, "Invalid window size '%s'\n",
+					argv[1]);
+				exit(-1);
+			}
 		} else if (matches(opt, "-rcvbuf") == 0) {
 			unsigned int size;
 
@@ -235,6 +285,11 @@ int main(int argc, char **argv)
 	}
 
 	_SL_ = oneline ? "\\" : "\n" ;
+	/* Commands show a few links, not the table of the host */
+	ll_map_lazy = 1;
+
+	if (show_stats > 1)
+		atexit(print_nlstats);
 
 	if (batch_file)
 		return batch(batch_file);
@@ -242,6 +297,9 @@ int main(int argc, char **argv)
 	if (rtnl_open(&rth, 0) < 0)
 		exit(1);
 
+	if (server_path)
+		return cmd_server(server_path, &rth, server_cmd) < 0 ? 1 : 0;
+
 	if (strlen(basename) > 2)
 		return do_cmd(basename+2, argc, argv);
 
@@ -47,9 +47,7 @@ static struct
 	int up;
 	char *label;
 	int flushed;
-	char *flushb;
-	int flushp;
-	int flushe;
+	struct rtnl_flush *flushb;
 } filter;
 
 static int do_link;
@@ -428,11 +426,10 @@ int print_linkinfo(const struct sockaddr_nl *who,
 
 static int flush_update(void)
 {
-	if (rtnl_send_check(&rth, filter.flushb, filter.flushp) < 0) {
+	if (rtnl_flush_commit(&rth, filter.flushb) < 0) {
 		perror("Failed to send flush request");
 		return -1;
 	}
-	filter.flushp = 0;
 	return 0;
 }
 
@@ -506,17 +503,8 @@ int print_addrinfo(const struct sockaddr_nl *who, struct nlmsghdr *n,
 		return 0;
 
 	if (filter.flushb) {
-		struct nlmsghdr *fn;
-		if (NLMSG_ALIGN(filter.flushp) + n->nlmsg_len > filter.flushe) {
-			if (flush_update())
-				return -1;
-		}
-		fn = (struct nlmsghdr*)(filter.flushb + NLMSG_ALIGN(filter.flushp));
-		memcpy(fn, n, n->nlmsg_len);
-		fn->nlmsg_type = RTM_DELADDR;
-		fn->nlmsg_flags = NLM_F_REQUEST;
-		fn->nlmsg_seq = ++rth.seq;
-		filter.flushp = (((char*)fn) + n->nlmsg_len) - filter.flushb;
+		if (rtnl_flush_add(filter.flushb, n, RTM_DELADDR) < 0)
+			return -1;
 		filter.flushed++;
 		if (show_stats < 2)
 			return 0;
@@ -661,6 +649,65 @@ struct nlmsg_list
 	struct nlmsghdr	  h;
 };
 
+struct nlmsg_chain
+{
+	struct nlmsg_list *head;
+	struct nlmsg_list *tail;
+};
+
+/* Dumped messages are carved out of large chunks, which are kept
+ * from one command to the next and only recycled as a whole.
+ */
+#define NLMSG_ARENA_CHUNK	(256*1024)
+
+struct nlmsg_arena
+{
+	struct nlmsg_arena *next;
+	size_t		    size;
+	size_t		    used;
+	char		    data[0];
+};
+
+static struct nlmsg_arena *arena_head;
+static struct nlmsg_arena *arena_cur;
+
+static void *nlmsg_arena_alloc(size_t len)
+{
+	struct nlmsg_arena *a = arena_cur;
+
+	len = NLMSG_ALIGN(len);
+	while (a && a->used + len > a->size)
+		a = a->next;
+
+	if (a == NULL) {
+		size_t size = len > NLMSG_ARENA_CHUNK ? len : NLMSG_ARENA_CHUNK;
+
+		a = malloc(sizeof(*a) + size);
+		if (a == NULL)
+			return NULL;
+		a->size = size;
+		a->used = 0;
+		a->next = NULL;
+		if (arena_cur) {
+			a->next = arena_cur->next;
+			arena_cur->next = a;
+		} else
+			arena_head = a;
+	}
+	arena_cur = a;
+	a->used += len;
+	return a->data + a->used - len;
+}
+
+static void nlmsg_arena_reset(void)
+{
+	struct nlmsg_arena *a;
+
+	for (a = arena_head; a; a = a->next)
+		a->used = 0;
+	arena_cur = arena_head;
+}
+
 static int print_selected_addrinfo(int ifindex, struct nlmsg_list *ainfo, FILE *fp)
 {
 	for ( ;ainfo ;  ainfo = ainfo->next) {
@@ -686,32 +733,188 @@ static int print_selected_addrinfo(int ifindex, struct nlmsg_list *ainfo, FILE *
 static int store_nlmsg(const struct sockaddr_nl *who, struct nlmsghdr *n,
 		       void *arg)
 {
-	struct nlmsg_list **linfo = (struct nlmsg_list**)arg;
+	struct nlmsg_chain *lchain = (struct nlmsg_chain *)arg;
 	struct nlmsg_list *h;
-	struct nlmsg_list **lp;
 
-	h = malloc(n->nlmsg_len+sizeof(void*));
+	h = nlmsg_arena_alloc(n->nlmsg_len+sizeof(void*));
 	if (h == NULL)
 		return -1;
 
 	memcpy(&h->h, n, n->nlmsg_len);
 	h->next = NULL;
 
-	for (lp = linfo; *lp; lp = &(*lp)->next) /* NOTHING */;
-	*lp = h;
+	if (lchain->tail)
+		lchain->tail->next = h;
+	else
+		lchain->head = h;
+	lchain->tail = h;
 
 	ll_remember_index(who, n, NULL);
 	return 0;
 }
 
+/* Addresses regrouped per interface, keeping the dump order within
+ * each group, so that every link finds its own in one lookup.
+ */
+struct ifaddr_group
+{
+	int		   ifindex;
+	struct nlmsg_chain addrs;
+};
+
+static struct ifaddr_group *ifaddr_groups;
+static unsigned ifaddr_groups_size;
+
+static struct ifaddr_group *ifaddr_group_find(int ifindex, int create)
+{
+	unsigned mask = ifaddr_groups_size - 1;
+	unsigned i;
+
+	for (i = (ifindex * 2654435761U) & mask; ifaddr_groups[i].ifindex;
+	     i = (i + 1) & mask)
+		if (ifaddr_groups[i].ifindex == ifindex)
+			return &ifaddr_groups[i];
+	if (!create)
+		return NULL;
+	ifaddr_groups[i].ifindex = ifindex;
+	return &ifaddr_groups[i];
+}
+
+static int ifaddr_group_build(struct nlmsg_chain *ainfo)
+{
+	struct nlmsg_list *a, *next;
+	unsigned count = 0, size = 16;
+
+	for (a = ainfo->head; a; a = a->next)
+		count++;
+	while (size < 2 * count)
+		size *= 2;
+
+	free(ifaddr_groups);
+	ifaddr_groups = calloc(size, sizeof(*ifaddr_groups));
+	if (ifaddr_groups == NULL)
+		return -1;
+	ifaddr_groups_size = size;
+
+	for (a = ainfo->head; a; a = next) {
+		struct ifaddrmsg *ifa = NLMSG_DATA(&a->h);
+		struct ifaddr_group *g;
+
+		next = a->next;
+		a->next = NULL;
+		if (a->h.nlmsg_type != RTM_NEWADDR || ifa->ifa_index == 0)
+			continue;
+		g = ifaddr_group_find(ifa->ifa_index, 1);
+		if (g->addrs.tail)
+			g->addrs.tail->next = a;
+		else
+			g->addrs.head = a;
+		g->addrs.tail = a;
+	}
+	ainfo->head = ainfo->tail = NULL;
+	return 0;
+}
+
+static struct nlmsg_list *ifaddr_group_get(int ifindex)
+{
+	struct ifaddr_group *g;
+
+	if (ifaddr_groups == NULL)
+		return NULL;
+	g = ifaddr_group_find(ifindex, 0);
+	return g ? g->addrs.head : NULL;
+}
+
+static int ipaddr_filter_and_print(struct nlmsg_chain *linfo,
+				   struct nlmsg_chain *ainfo)
+{
+	struct nlmsg_list *l;
+	int no_link = 0;
+
+	if (filter.family != AF_PACKET && ifaddr_group_build(ainfo) < 0) {
+		perror("Cannot group addresses");
+		return -1;
+	}
+
+	if (filter.family && filter.family != AF_PACKET) {
+		struct nlmsg_list **lp;
+		lp=&linfo->head;
+
+		if (filter.oneline)
+			no_link = 1;
+
+		while ((l=*lp)!=NULL) {
+			int ok = 0;
+			struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
+			struct nlmsg_list *a;
+
+			for (a=ifaddr_group_get(ifi->ifi_index); a; a=a->next) {
+				struct nlmsghdr *n = &a->h;
+				struct ifaddrmsg *ifa = NLMSG_DATA(n);
+
+				if (filter.family && filter.family != ifa->ifa_family)
+					continue;
+				if ((filter.scope^ifa->ifa_scope)&filter.scopemask)
+					continue;
+				if ((filter.flags^ifa->ifa_flags)&filter.flagmask)
+					continue;
+				if (filter.pfx.family || filter.label) {
+					struct rtattr *tb[IFA_MAX+1];
+					parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+					if (!tb[IFA_LOCAL])
+						tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+
+					if (filter.pfx.family && tb[IFA_LOCAL]) {
+						inet_prefix dst;
+						memset(&dst, 0, sizeof(dst));
+						dst.family = ifa->ifa_family;
+						memcpy(&dst.data, RTA_DATA(tb[IFA_LOCAL]), RTA_PAYLOAD(tb[IFA_LOCAL]));
+						if (inet_addr_match(&dst, &filter.pfx, filter.pfx.bitlen))
+							continue;
+					}
+					if (filter.label) {
+						SPRINT_BUF(b1);
+						const char *label;
+						if (tb[IFA_LABEL])
+							label = RTA_DATA(tb[IFA_LABEL]);
+						else
+							label = ll_idx_n2a(ifa->ifa_index, b1);
+						if (fnmatch(filter.label, label, 0) != 0)
+							continue;
+					}
+				}
+
+				ok = 1;
+				break;
+			}
+			if (!ok)
+				*lp = l->next;
+			else
+				lp = &l->next;
+		}
+	}
+
+	for (l=linfo->head; l; l = l->next) {
+		if (no_link || print_linkinfo(NULL, &l->h, stdout) == 0) {
+			struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
+			if (filter.family != AF_PACKET)
+				print_selected_addrinfo(ifi->ifi_index,
+							ifaddr_group_get(ifi->ifi_index),
+							stdout);
+		}
+		fflush(stdout);
+	}
+
+	return 0;
+}
+
 static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 {
-	struct nlmsg_list *linfo = NULL;
-	struct nlmsg_list *ainfo = NULL;
-	struct nlmsg_list *l, *n;
+	struct nlmsg_chain linfo = { NULL, NULL };
+	struct nlmsg_chain ainfo = { NULL, NULL };
 	char *filter_dev = NULL;
-	int no_link = 0;
 
+	nlmsg_arena_reset();
 	ipaddr_reset_filter(oneline);
 	filter.showqueue = 1;
 
@@ -792,14 +995,37 @@ static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 		argv++; argc--;
 	}
 
-	if (rtnl_wilddump_request(&rth, preferred_family, RTM_GETLINK) < 0) {
-		perror("Cannot send dump request");
-		exit(1);
-	}
+	if (!flush && filter.family != AF_PACKET) {
+		/* Links and addresses are dumped side by side */
+		const struct rtnl_dump_multi_arg a[2] = {
+			{
+				.family = preferred_family,
+				.type = RTM_GETLINK,
+				.filter = store_nlmsg,
+				.arg1 = &linfo
+			},
+			{
+				.family = filter.family,
+				.type = RTM_GETADDR,
+				.filter = store_nlmsg,
+				.arg1 = &ainfo
+			},
+		};
+
+		if (rtnl_dump_multi(&rth, a, 2) < 0) {
+			fprintf(stderr, "Dump terminated\n");
+			exit(1);
+		}
+	} else {
+		if (rtnl_wilddump_request(&rth, preferred_family, RTM_GETLINK) < 0) {
+			perror("Cannot send dump request");
+			exit(1);
+		}
 
-	if (rtnl_dump_filter(&rth, store_nlmsg, &linfo, NULL, NULL) < 0) {
-		fprintf(stderr, "Dump terminated\n");
-		exit(1);
+		if (rtnl_dump_filter(&rth, store_nlmsg, &linfo, NULL, NULL) < 0) {
+			fprintf(stderr, "Dump terminated\n");
+			exit(1);
+		}
 	}
 
 	if (filter_dev) {
@@ -812,11 +1038,16 @@ static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 
 	if (flush) {
 		int round = 0;
-		char flushb[4096-512];
-
-		filter.flushb = flushb;
-		filter.flushp = 0;
-		filter.flushe = sizeof(flushb);
+		struct rtnl_flush flushb;
+		unsigned groups = 0;
+
+		if (filter.family == AF_UNSPEC || filter.family == AF_INET)
+			groups |= RTMGRP_IPV4_IFADDR;
+		if (filter.family == AF_UNSPEC || filter.family == AF_INET6)
+			groups |= RTMGRP_IPV6_IFADDR;
+		if (rtnl_flush_open(&flushb, groups) < 0)
+			exit(1);
+		filter.flushb = &flushb;
 
 		while (round < MAX_ROUNDS) {
 			const struct rtnl_dump_filter_arg a[3] = {
@@ -839,6 +1070,7 @@ static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 					.arg2 = NULL
 				},
 			};
+			rtnl_flush_reset(&flushb);
 			if (rtnl_wilddump_request(&rth, filter.family, RTM_GETADDR) < 0) {
 				perror("Cannot send dump request");
 				exit(1);
@@ -856,105 +1088,34 @@ static int ipaddr_list_or_flush(int argc, char **argv, int flush)
 						printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
 				}
 				fflush(stdout);
+				rtnl_flush_close(&flushb);
 				return 0;
 			}
 			round++;
-			if (flush_update() < 0)
+			if (flush_update() < 0) {
+				rtnl_flush_close(&flushb);
 				return 1;
+			}
 
 			if (show_stats) {
 				printf("\n*** Round %d, deleting %d addresses ***\n", round, filter.flushed);
+				rtnl_flush_print_round(stdout, &flushb);
+				fflush(stdout);
+			}
+			if (!flushb.changed) {
+				if (show_stats)
+					printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
 				fflush(stdout);
+				rtnl_flush_close(&flushb);
+				return 0;
 			}
 		}
 		fprintf(stderr, "*** Flush remains incomplete after %d rounds. ***\n", MAX_ROUNDS); fflush(stderr);
+		rtnl_flush_close(&flushb);
 		return 1;
 	}
 
-	if (filter.family != AF_PACKET) {
-		if (rtnl_wilddump_request(&rth, filter.family, RTM_GETADDR) < 0) {
-			perror("Cannot send dump request");
-			exit(1);
-		}
-
-		if (rtnl_dump_filter(&rth, store_nlmsg, &ainfo, NULL, NULL) < 0) {
-			fprintf(stderr, "Dump terminated\n");
-			exit(1);
-		}
-	}
-
-
-	if (filter.family && filter.family != AF_PACKET) {
-		struct nlmsg_list **lp;
-		lp=&linfo;
-
-		if (filter.oneline)
-			no_link = 1;
-
-		while ((l=*lp)!=NULL) {
-			int ok = 0;
-			struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
-			struct nlmsg_list *a;
-
-			for (a=ainfo; a; a=a->next) {
-				struct nlmsghdr *n = &a->h;
-				struct ifaddrmsg *ifa = NLMSG_DATA(n);
-
-				if (ifa->ifa_index != ifi->ifi_index ||
-				    (filter.family && filter.family != ifa->ifa_family))
-					continue;
-				if ((filter.scope^ifa->ifa_scope)&filter.scopemask)
-					continue;
-				if ((filter.flags^ifa->ifa_flags)&filter.flagmask)
-					continue;
-				if (filter.pfx.family || filter.label) {
-					struct rtattr *tb[IFA_MAX+1];
-					parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
-					if (!tb[IFA_LOCAL])
-						tb[IFA_LOCAL] = tb[IFA_ADDRESS];
-
-					if (filter.pfx.family && tb[IFA_LOCAL]) {
-						inet_prefix dst;
-						memset(&dst, 0, sizeof(dst));
-						dst.family = ifa->ifa_family;
-						memcpy(&dst.data, RTA_DATA(tb[IFA_LOCAL]), RTA_PAYLOAD(tb[IFA_LOCAL]));
-						if (inet_addr_match(&dst, &filter.pfx, filter.pfx.bitlen))
-							continue;
-					}
-					if (filter.label) {
-						SPRINT_BUF(b1);
-						const char *label;
-						if (tb[IFA_LABEL])
-							label = RTA_DATA(tb[IFA_LABEL]);
-						else
-							label = ll_idx_n2a(ifa->ifa_index, b1);
-						if (fnmatch(filter.label, label, 0) != 0)
-							continue;
-					}
-				}
-
-				ok = 1;
-				break;
-			}
-			if (!ok)
-				*lp = l->next;
-			else
-				lp = &l->next;
-		}
-	}
-
-	for (l=linfo; l; l = n) {
-		n = l->next;
-		if (no_link || print_linkinfo(NULL, &l->h, stdout) == 0) {
-			struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
-			if (filter.family != AF_PACKET)
-				print_selected_addrinfo(ifi->ifi_index, ainfo, stdout);
-		}
-		fflush(stdout);
-		free(l);
-	}
-
-	return 0;
+	return ipaddr_filter_and_print(&linfo, &ainfo);
 }
 
 int ipaddr_list_link(int argc, char **argv)
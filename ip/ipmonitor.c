@@ -188,7 +188,7 @@ int do_ipmonitor(int argc, char **argv)
 
 	if (rtnl_open(&rth, groups) < 0)
 		exit(1);
-	ll_init_map(&rth);
+	ll_init_map_full(&rth);
 
 	if (rtnl_listen(&rth, accept_msg, stdout) < 0)
 		exit(2);
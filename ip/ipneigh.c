@@ -36,9 +36,7 @@ static struct
 	int unused_only;
 	inet_prefix pfx;
 	int flushed;
-	char *flushb;
-	int flushp;
-	int flushe;
+	struct rtnl_flush *flushb;
 } filter;
 
 static void usage(void) __attribute__((noreturn));
@@ -83,11 +81,10 @@ int nud_state_a2n(unsigned *state, char *arg)
 
 static int flush_update(void)
 {
-	if (rtnl_send_check(&rth, filter.flushb, filter.flushp) < 0) {
+	if (rtnl_flush_commit(&rth, filter.flushb) < 0) {
 		perror("Failed to send flush request");
 		return -1;
 	}
-	filter.flushp = 0;
 	return 0;
 }
 
@@ -232,17 +229,8 @@ int print_neigh(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 	}
 
 	if (filter.flushb) {
-		struct nlmsghdr *fn;
-		if (NLMSG_ALIGN(filter.flushp) + n->nlmsg_len > filter.flushe) {
-			if (flush_update())
-				return -1;
-		}
-		fn = (struct nlmsghdr*)(filter.flushb + NLMSG_ALIGN(filter.flushp));
-		memcpy(fn, n, n->nlmsg_len);
-		fn->nlmsg_type = RTM_DELNEIGH;
-		fn->nlmsg_flags = NLM_F_REQUEST;
-		fn->nlmsg_seq = ++rth.seq;
-		filter.flushp = (((char*)fn) + n->nlmsg_len) - filter.flushb;
+		if (rtnl_flush_add(filter.flushb, n, RTM_DELNEIGH) < 0)
+			return -1;
 		filter.flushed++;
 		if (show_stats < 2)
 			return 0;
@@ -380,14 +368,15 @@ int do_show_or_flush(int argc, char **argv, int flush)
 
 	if (flush) {
 		int round = 0;
-		char flushb[4096-512];
+		struct rtnl_flush flushb;
 
-		filter.flushb = flushb;
-		filter.flushp = 0;
-		filter.flushe = sizeof(flushb);
+		if (rtnl_flush_open(&flushb, RTMGRP_NEIGH) < 0)
+			exit(1);
+		filter.flushb = &flushb;
 		filter.state &= ~NUD_FAILED;
 
 		while (round < MAX_ROUNDS) {
+			rtnl_flush_reset(&flushb);
 			if (rtnl_wilddump_request(&rth, filter.family, RTM_GETNEIGH) < 0) {
 				perror("Cannot send dump request");
 				exit(1);
@@ -405,6 +394,7 @@ int do_show_or_flush(int argc, char **argv, int flush)
 						printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
 				}
 				fflush(stdout);
+				rtnl_flush_close(&flushb);
 				return 0;
 			}
 			round++;
@@ -412,11 +402,20 @@ int do_show_or_flush(int argc, char **argv, int flush)
 				exit(1);
 			if (show_stats) {
 				printf("\n*** Round %d, deleting %d entries ***\n", round, filter.flushed);
+				rtnl_flush_print_round(stdout, &flushb);
 				fflush(stdout);
 			}
+			if (!flushb.changed) {
+				if (show_stats)
+					printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
+				fflush(stdout);
+				rtnl_flush_close(&flushb);
+				return 0;
+			}
 		}
 		printf("*** Flush not complete bailing out after %d rounds\n",
 			MAX_ROUNDS);
+		rtnl_flush_close(&flushb);
 		return 1;
 	}
 
@@ -87,9 +87,7 @@ static struct
 	int tb;
 	int cloned;
 	int flushed;
-	char *flushb;
-	int flushp;
-	int flushe;
+	struct rtnl_flush *flushb;
 	int protocol, protocolmask;
 	int scope, scopemask;
 	int type, typemask;
@@ -107,11 +105,10 @@ static struct
 
 static int flush_update(void)
 {
-	if (rtnl_send_check(&rth, filter.flushb, filter.flushp) < 0) {
+	if (rtnl_flush_commit(&rth, filter.flushb) < 0) {
 		perror("Failed to send flush request");
 		return -1;
 	}
-	filter.flushp = 0;
 	return 0;
 }
 
@@ -275,17 +272,8 @@ int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 		return 0;
 
 	if (filter.flushb) {
-		struct nlmsghdr *fn;
-		if (NLMSG_ALIGN(filter.flushp) + n->nlmsg_len > filter.flushe) {
-			if (flush_update())
-				return -1;
-		}
-		fn = (struct nlmsghdr*)(filter.flushb + NLMSG_ALIGN(filter.flushp));
-		memcpy(fn, n, n->nlmsg_len);
-		fn->nlmsg_type = RTM_DELROUTE;
-		fn->nlmsg_flags = NLM_F_REQUEST;
-		fn->nlmsg_seq = ++rth.seq;
-		filter.flushp = (((char*)fn) + n->nlmsg_len) - filter.flushb;
+		if (rtnl_flush_add(filter.flushb, n, RTM_DELROUTE) < 0)
+			return -1;
 		filter.flushed++;
 		if (show_stats < 2)
 			return 0;
@@ -1196,7 +1184,8 @@ static int iproute_list_or_flush(int argc, char **argv, int flush)
 
 	if (flush) {
 		int round = 0;
-		char flushb[4096-512];
+		struct rtnl_flush flushb;
+		unsigned groups = 0;
 		time_t start = time(0);
 
 		if (filter.cloned) {
@@ -1209,11 +1198,18 @@ static int iproute_list_or_flush(int argc, char **argv, int flush)
 				return 0;
 		}
 
-		filter.flushb = flushb;
-		filter.flushp = 0;
-		filter.flushe = sizeof(flushb);
+		if (do_ipv6 == AF_UNSPEC || do_ipv6 == AF_INET)
+			groups |= RTMGRP_IPV4_ROUTE;
+		if (do_ipv6 == AF_UNSPEC || do_ipv6 == AF_INET6)
+			groups |= RTMGRP_IPV6_ROUTE;
+		if (do_ipv6 == AF_UNSPEC || do_ipv6 == AF_DECnet)
+			groups |= RTMGRP_DECnet_ROUTE;
+		if (rtnl_flush_open(&flushb, groups) < 0)
+			exit(1);
+		filter.flushb = &flushb;
 
 		for (;;) {
+			rtnl_flush_reset(&flushb);
 			if (rtnl_wilddump_request(&rth, do_ipv6, RTM_GETROUTE) < 0) {
 				perror("Cannot send dump request");
 				exit(1);
@@ -1231,7 +1227,7 @@ static int iproute_list_or_flush(int argc, char **argv, int flush)
 						printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
 				}
 				fflush(stdout);
-				return 0;
+				break;
 			}
 			round++;
 			if (flush_update() < 0)
@@ -1245,9 +1241,20 @@ static int iproute_list_or_flush(int argc, char **argv, int flush)
 
 			if (show_stats) {
 				printf("\n*** Round %d, deleting %d entries ***\n", round, filter.flushed);
+				rtnl_flush_print_round(stdout, &flushb);
 				fflush(stdout);
 			}
+
+			/* Nothing else moved: no need to look again */
+			if (!flushb.changed) {
+				if (show_stats)
+					printf("*** Flush is complete after %d round%s ***\n", round, round>1?"s":"");
+				fflush(stdout);
+				break;
+			}
 		}
+		rtnl_flush_close(&flushb);
+		return 0;
 	}
 
 	if (!filter.cloned) {
@@ -67,9 +67,7 @@
 	} while(0)
 
 struct xfrm_buffer {
-	char *buf;
-	int size;
-	int offset;
+	struct rtnl_flush flush;
 
 	int nlmsg_count;
 	struct rtnl_handle *rth;
@@ -35,9 +35,6 @@
 #include "xfrm.h"
 #include "ip_common.h"
 
-//#define NLMSG_DELETEALL_BUF_SIZE (4096-512)
-#define NLMSG_DELETEALL_BUF_SIZE 8192
-
 /*
  * Receiving buffer defines:
  * nlmsg
@@ -648,13 +645,14 @@ static int xfrm_policy_keep(const struct sockaddr_nl *who,
 			    void *arg)
 {
 	struct xfrm_buffer *xb = (struct xfrm_buffer *)arg;
-	struct rtnl_handle *rth = xb->rth;
 	struct xfrm_userpolicy_info *xpinfo = NLMSG_DATA(n);
 	int len = n->nlmsg_len;
 	struct rtattr *tb[XFRMA_MAX+1];
 	__u8 ptype = XFRM_POLICY_TYPE_MAIN;
-	struct nlmsghdr *new_n;
-	struct xfrm_userpolicy_id *xpid;
+	struct {
+		struct nlmsghdr			n;
+		struct xfrm_userpolicy_id	xpid;
+	} req;
 
 	if (n->nlmsg_type != XFRM_MSG_NEWPOLICY) {
 		fprintf(stderr, "Not a policy: %08x %08x %08x\n",
@@ -684,25 +682,23 @@ static int xfrm_policy_keep(const struct sockaddr_nl *who,
 	if (!xfrm_policy_filter_match(xpinfo, ptype))
 		return 0;
 
-	if (xb->offset > xb->size) {
-		fprintf(stderr, "Policy buffer overflow\n");
-		return -1;
-	}
-
-	new_n = (struct nlmsghdr *)(xb->buf + xb->offset);
-	new_n->nlmsg_len = NLMSG_LENGTH(sizeof(*xpid));
-	new_n->nlmsg_flags = NLM_F_REQUEST;
-	new_n->nlmsg_type = XFRM_MSG_DELPOLICY;
-	new_n->nlmsg_seq = ++rth->seq;
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.xpid));
 
-	xpid = NLMSG_DATA(new_n);
-	memcpy(&xpid->sel, &xpinfo->sel, sizeof(xpid->sel));
-	xpid->dir = xpinfo->dir;
-	xpid->index = xpinfo->index;
+	memcpy(&req.xpid.sel, &xpinfo->sel, sizeof(req.xpid.sel));
+	req.xpid.dir = xpinfo->dir;
+	req.xpid.index = xpinfo->index;
 
-	xb->offset += new_n->nlmsg_len;
+	if (rtnl_flush_add(&xb->flush, &req.n, XFRM_MSG_DELPOLICY) < 0)
+		return -1;
 	xb->nlmsg_count ++;
 
+	/* Deletes go out on their own socket while the dump goes on */
+	if (rtnl_flush_stream(xb->rth, &xb->flush) < 0) {
+		perror("Failed to send delete-all request");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -779,15 +775,17 @@ static int xfrm_policy_list_or_deleteall(int argc, char **argv, int deleteall)
 
 	if (deleteall) {
 		struct xfrm_buffer xb;
-		char buf[NLMSG_DELETEALL_BUF_SIZE];
+		struct rtnl_handle drth;
 		int i;
 
-		xb.buf = buf;
-		xb.size = sizeof(buf);
-		xb.rth = &rth;
+		if (rtnl_open_byproto(&drth, 0, NETLINK_XFRM) < 0)
+			exit(1);
+		if (rtnl_flush_open_byproto(&xb.flush, XFRMGRP_POLICY, NETLINK_XFRM) < 0)
+			exit(1);
+		xb.rth = &drth;
 
 		for (i = 0; ; i++) {
-			xb.offset = 0;
+			rtnl_flush_reset(&xb.flush);
 			xb.nlmsg_count = 0;
 
 			if (show_stats > 1)
@@ -808,16 +806,25 @@ static int xfrm_policy_list_or_deleteall(int argc, char **argv, int deleteall)
 				break;
 			}
 
-			if (rtnl_send_check(&rth, xb.buf, xb.offset) < 0) {
+			if (rtnl_flush_commit(&drth, &xb.flush) < 0) {
 				perror("Failed to send delete-all request");
 				exit(1);
 			}
-			if (show_stats > 1)
+			if (show_stats > 1) {
 				fprintf(stderr, "Delete-all nlmsg count = %d\n", xb.nlmsg_count);
+				rtnl_flush_print_round(stderr, &xb.flush);
+			}
 
-			xb.offset = 0;
-			xb.nlmsg_count = 0;
+			/* Nobody else touched the SPD: everything is gone */
+			if (!xb.flush.changed) {
+				if (show_stats > 1)
+					fprintf(stderr, "Delete-all completed\n");
+				break;
+			}
 		}
+
+		rtnl_flush_close(&xb.flush);
+		rtnl_close(&drth);
 	} else {
 		if (rtnl_wilddump_request(&rth, preferred_family, XFRM_MSG_GETPOLICY) < 0) {
 			perror("Cannot send dump request");
@@ -34,9 +34,6 @@
 #include "xfrm.h"
 #include "ip_common.h"
 
-//#define NLMSG_DELETEALL_BUF_SIZE (4096-512)
-#define NLMSG_DELETEALL_BUF_SIZE 8192
-
 /*
  * Receiving buffer defines:
  * nlmsg
@@ -870,11 +867,13 @@ static int xfrm_state_keep(const struct sockaddr_nl *who,
 			   void *arg)
 {
 	struct xfrm_buffer *xb = (struct xfrm_buffer *)arg;
-	struct rtnl_handle *rth = xb->rth;
 	struct xfrm_usersa_info *xsinfo = NLMSG_DATA(n);
 	int len = n->nlmsg_len;
-	struct nlmsghdr *new_n;
-	struct xfrm_usersa_id *xsid;
+	struct {
+		struct nlmsghdr		n;
+		struct xfrm_usersa_id	xsid;
+		char			buf[RTA_SPACE(sizeof(xfrm_address_t))];
+	} req;
 
 	if (n->nlmsg_type != XFRM_MSG_NEWSA) {
 		fprintf(stderr, "Not a state: %08x %08x %08x\n",
@@ -891,29 +890,27 @@ static int xfrm_state_keep(const struct sockaddr_nl *who,
 	if (!xfrm_state_filter_match(xsinfo))
 		return 0;
 
-	if (xb->offset > xb->size) {
-		fprintf(stderr, "State buffer overflow\n");
-		return -1;
-	}
-
-	new_n = (struct nlmsghdr *)(xb->buf + xb->offset);
-	new_n->nlmsg_len = NLMSG_LENGTH(sizeof(*xsid));
-	new_n->nlmsg_flags = NLM_F_REQUEST;
-	new_n->nlmsg_type = XFRM_MSG_DELSA;
-	new_n->nlmsg_seq = ++rth->seq;
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(req.xsid));
 
-	xsid = NLMSG_DATA(new_n);
-	xsid->family = xsinfo->family;
-	memcpy(&xsid->daddr, &xsinfo->id.daddr, sizeof(xsid->daddr));
-	xsid->spi = xsinfo->id.spi;
-	xsid->proto = xsinfo->id.proto;
+	req.xsid.family = xsinfo->family;
+	memcpy(&req.xsid.daddr, &xsinfo->id.daddr, sizeof(req.xsid.daddr));
+	req.xsid.spi = xsinfo->id.spi;
+	req.xsid.proto = xsinfo->id.proto;
 
-	addattr_l(new_n, xb->size, XFRMA_SRCADDR, &xsinfo->saddr,
-		  sizeof(xsid->daddr));
+	addattr_l(&req.n, sizeof(req), XFRMA_SRCADDR, &xsinfo->saddr,
+		  sizeof(req.xsid.daddr));
 
-	xb->offset += new_n->nlmsg_len;
+	if (rtnl_flush_add(&xb->flush, &req.n, XFRM_MSG_DELSA) < 0)
+		return -1;
 	xb->nlmsg_count ++;
 
+	/* Deletes go out on their own socket while the dump goes on */
+	if (rtnl_flush_stream(xb->rth, &xb->flush) < 0) {
+		perror("Failed to send delete-all request");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -964,15 +961,17 @@ static int xfrm_state_list_or_deleteall(int argc, char **argv, int deleteall)
 
 	if (deleteall) {
 		struct xfrm_buffer xb;
-		char buf[NLMSG_DELETEALL_BUF_SIZE];
+		struct rtnl_handle drth;
 		int i;
 
-		xb.buf = buf;
-		xb.size = sizeof(buf);
-		xb.rth = &rth;
+		if (rtnl_open_byproto(&drth, 0, NETLINK_XFRM) < 0)
+			exit(1);
+		if (rtnl_flush_open_byproto(&xb.flush, XFRMGRP_SA, NETLINK_XFRM) < 0)
+			exit(1);
+		xb.rth = &drth;
 
 		for (i = 0; ; i++) {
-			xb.offset = 0;
+			rtnl_flush_reset(&xb.flush);
 			xb.nlmsg_count = 0;
 
 			if (show_stats > 1)
@@ -993,17 +992,25 @@ static int xfrm_state_list_or_deleteall(int argc, char **argv, int deleteall)
 				break;
 			}
 
-			if (rtnl_send_check(&rth, xb.buf, xb.offset) < 0) {
+			if (rtnl_flush_commit(&drth, &xb.flush) < 0) {
 				perror("Failed to send delete-all request\n");
 				exit(1);
 			}
-			if (show_stats > 1)
+			if (show_stats > 1) {
 				fprintf(stderr, "Delete-all nlmsg count = %d\n", xb.nlmsg_count);
+				rtnl_flush_print_round(stderr, &xb.flush);
+			}
 
-			xb.offset = 0;
-			xb.nlmsg_count = 0;
+			/* Nobody else touched the SAD: everything is gone */
+			if (!xb.flush.changed) {
+				if (show_stats > 1)
+					fprintf(stderr, "Delete-all completed\n");
+				break;
+			}
 		}
 
+		rtnl_flush_close(&xb.flush);
+		rtnl_close(&drth);
 	} else {
 		if (rtnl_wilddump_request(&rth, preferred_family, XFRM_MSG_GETSA) < 0) {
 			perror("Cannot send dump request");
@@ -0,0 +1,478 @@
+/*
+ * cmd_server.c	Serve ip/tc command lines over a unix socket.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Clients write command lines in batch file syntax. Each one runs in a
+ * child forked from the server, so it starts with the interface map and
+ * name tables already loaded, and may exit() as it pleases. The child
+ * opens a netlink socket of its own. Commands of one client run one
+ * after the other; those of different clients run side by side, and a
+ * long running one (monitor) holds up nobody else. The output comes
+ * back as frames of a struct cmd_server_hdr followed by "len" bytes:
+ * CMD_SERVER_STDOUT and CMD_SERVER_STDERR data as it is written, then
+ * one CMD_SERVER_STATUS frame with the exit status as an int.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "rt_names.h"
+
+#define CMD_SERVER_CLIENTS	64
+#define CMD_SERVER_LINE		8192
+
+struct cmd_client
+{
+	int	fd;
+	int	len;
+	pid_t	pid;		/* command running, 0 if none */
+	int	out, err;	/* its stdout and stderr, -1 once at EOF */
+	int	status;		/* its exit status, -1 until reaped */
+	int	gone;		/* client hung up or stopped reading */
+	char	buf[CMD_SERVER_LINE];
+};
+
+static struct cmd_client *clients[CMD_SERVER_CLIENTS];
+static int server_fds[3] = { -1, -1, -1 };	/* listener, monitor, SIGCHLD */
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void server_sigchld(int sig)
+{
+	int saved_errno = errno;
+
+	if (write(sigchld_pipe[1], "", 1) < 0)
+		;
+	errno = saved_errno;
+}
+
+static int send_all(int fd, const void *data, int len)
+{
+	const char *buf = data;
+
+	while (len > 0) {
+		int n = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_frame(int fd, int type, const void *data, int len)
+{
+	struct cmd_server_hdr h = { .type = type, .len = len };
+
+	if (send_all(fd, &h, sizeof(h)) < 0)
+		return -1;
+	return send_all(fd, data, len);
+}
+
+/* Keep the interface map current between commands */
+static void server_refresh(struct rtnl_handle *mon, struct rtnl_handle *rth)
+{
+	char buf[32768];
+
+	for (;;) {
+		struct nlmsghdr *h;
+		int status;
+
+		status = recv(mon->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS)
+				ll_init_map_full(rth);
+			return;
+		}
+		if (status == 0)
+			return;
+
+		for (h = (struct nlmsghdr*)buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			if (h->nlmsg_type == RTM_NEWLINK ||
+			    h->nlmsg_type == RTM_DELLINK)
+				ll_remember_index(NULL, h, NULL);
+		}
+	}
+}
+
+/* Only the command's own descriptors survive into it */
+static void server_child(struct rtnl_handle *rth, int out, int err)
+{
+	int i, fd;
+
+	for (i = 0; i < CMD_SERVER_CLIENTS; i++) {
+		if (clients[i] == NULL)
+			continue;
+		close(clients[i]->fd);
+		if (clients[i]->out >= 0)
+			close(clients[i]->out);
+		if (clients[i]->err >= 0)
+			close(clients[i]->err);
+	}
+	for (i = 0; i < 3; i++)
+		close(server_fds[i]);
+	close(sigchld_pipe[1]);
+
+	dup2(out, STDOUT_FILENO);
+	dup2(err, STDERR_FILENO);
+	close(out);
+	close(err);
+	fd = open("/dev/null", O_RDONLY);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+	}
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+
+	/* Sequence numbers and unread replies are not shared */
+	rtnl_close(rth);
+	if (rtnl_open(rth, 0) < 0)
+		exit(1);
+}
+
+static int server_start(struct cmd_client *c, char *line,
+			struct rtnl_handle *rth,
+			int (*cmd)(int argc, char **argv))
+{
+	int out[2], err[2];
+	pid_t pid;
+
+	if (pipe(out) < 0)
+		return -1;
+	if (pipe(err) < 0) {
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid < 0) {
+		close(out[0]); close(out[1]);
+		close(err[0]); close(err[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		char *argv[100];
+		int argc;
+
+		close(out[0]);
+		close(err[0]);
+		server_child(rth, out[1], err[1]);
+		argc = makeargs(line, argv, 100);
+		exit(cmd(argc, argv));
+	}
+
+	close(out[1]);
+	close(err[1]);
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	fcntl(err[0], F_SETFD, FD_CLOEXEC);
+	c->pid = pid;
+	c->out = out[0];
+	c->err = err[0];
+	c->status = -1;
+	return 0;
+}
+
+/* Pass on what the command wrote, stop it if nobody listens */
+static void server_output(struct cmd_client *c, int *fd, int type)
+{
+	char buf[4096];
+	int n;
+
+	n = read(*fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n <= 0) {
+		close(*fd);
+		*fd = -1;
+		return;
+	}
+	if (!c->gone && send_frame(c->fd, type, buf, n) < 0) {
+		kill(c->pid, SIGTERM);
+		c->gone = 1;
+	}
+}
+
+static void server_reap(void)
+{
+	char buf[64];
+	int status, i;
+	pid_t pid;
+
+	while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+		;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (WIFEXITED(status))
+			status = WEXITSTATUS(status);
+		else
+			status = 128 + WTERMSIG(status);
+		for (i = 0; i < CMD_SERVER_CLIENTS; i++)
+			if (clients[i] && clients[i]->pid == pid)
+				clients[i]->status = status;
+	}
+}
+
+/* Run the command lines buffered so far, up to the first that forks */
+static int server_lines(struct cmd_client *c, struct rtnl_handle *rth,
+			int (*cmd)(int argc, char **argv))
+{
+	char *line = c->buf, *nl;
+
+	while (c->pid == 0 &&
+	       (nl = memchr(line, '\n', c->buf + c->len - line)) != NULL) {
+		char *cp;
+
+		*nl = 0;
+		cp = strchr(line, '#');
+		if (cp)
+			*cp = 0;
+		cp = line + strspn(line, " \t\r");
+		if (*cp && server_start(c, line, rth, cmd) < 0)
+			return -1;
+		line = nl + 1;
+	}
+
+	c->len -= line - c->buf;
+	memmove(c->buf, line, c->len);
+
+	if (c->pid == 0 && c->len == sizeof(c->buf)) {
+		static const char msg[] = "Command line too long\n";
+		int status = 1;
+
+		c->len = 0;
+		if (send_frame(c->fd, CMD_SERVER_STDERR, msg, sizeof(msg) - 1) < 0 ||
+		    send_frame(c->fd, CMD_SERVER_STATUS, &status, sizeof(status)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* A command is over once it exited and its output is all passed on */
+static int server_finish(struct cmd_client *c, struct rtnl_handle *rth,
+			 int (*cmd)(int argc, char **argv))
+{
+	if (c->pid == 0 || c->out >= 0 || c->err >= 0 || c->status < 0)
+		return 0;
+	c->pid = 0;
+	if (c->gone ||
+	    send_frame(c->fd, CMD_SERVER_STATUS, &c->status, sizeof(c->status)) < 0)
+		return -1;
+	return server_lines(c, rth, cmd);
+}
+
+static void server_drop(int i)
+{
+	struct cmd_client *c = clients[i];
+
+	if (c->pid) {
+		/* server_reap() collects it like any other */
+		kill(c->pid, SIGTERM);
+		if (c->out >= 0)
+			close(c->out);
+		if (c->err >= 0)
+			close(c->err);
+	}
+	close(c->fd);
+	free(c);
+	clients[i] = NULL;
+}
+
+/* A socket left behind by a server that is gone, not a live one or a file */
+static int server_stale(struct sockaddr_un *sun)
+{
+	struct stat st;
+	int fd, stale;
+
+	if (lstat(sun->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return 0;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 0;
+	stale = connect(fd, (struct sockaddr *)sun, sizeof(*sun)) < 0 &&
+		errno == ECONNREFUSED;
+	close(fd);
+	return stale;
+}
+
+int cmd_server(const char *path, struct rtnl_handle *rth,
+	       int (*cmd)(int argc, char **argv))
+{
+	struct pollfd pfd[3 + 3 * CMD_SERVER_CLIENTS];
+	struct sockaddr_un sun;
+	struct rtnl_handle mon;
+	mode_t mask;
+	int lfd, i, err;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "Socket path \"%s\" is too long\n", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		perror("Cannot create server socket");
+		return -1;
+	}
+	if (server_stale(&sun))
+		unlink(path);
+	/* Commands run as whoever started the server, so only they connect */
+	mask = umask(0177);
+	err = bind(lfd, (struct sockaddr *)&sun, sizeof(sun));
+	umask(mask);
+	if (err < 0 || listen(lfd, 16) < 0) {
+		fprintf(stderr, "Cannot listen on \"%s\": %s\n", path,
+			strerror(errno));
+		close(lfd);
+		return -1;
+	}
+	fcntl(lfd, F_SETFD, FD_CLOEXEC);
+
+	if (rtnl_open(&mon, RTMGRP_LINK) < 0) {
+		close(lfd);
+		return -1;
+	}
+	fcntl(mon.fd, F_SETFD, FD_CLOEXEC);
+
+	if (pipe(sigchld_pipe) < 0) {
+		perror("pipe");
+		rtnl_close(&mon);
+		close(lfd);
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	server_fds[0] = lfd;
+	server_fds[1] = mon.fd;
+	server_fds[2] = sigchld_pipe[0];
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, server_sigchld);
+	ll_init_map_full(rth);
+	rtnl_names_init();
+
+	for (;;) {
+		int n = 0;
+
+		for (i = 0; i < 3; i++) {
+			pfd[n].fd = server_fds[i];
+			pfd[n++].events = POLLIN;
+		}
+		for (i = 0; i < CMD_SERVER_CLIENTS; i++) {
+			struct cmd_client *c = clients[i];
+
+			/*
+			 * Lines wait in the socket while a command runs; once
+			 * the client hung up its hangup would wake us forever.
+			 */
+			pfd[n].fd = c && !c->gone ? c->fd : -1;
+			pfd[n++].events = c && c->pid ? POLLRDHUP : POLLIN;
+			pfd[n].fd = c && c->pid ? c->out : -1;
+			pfd[n++].events = POLLIN;
+			pfd[n].fd = c && c->pid ? c->err : -1;
+			pfd[n++].events = POLLIN;
+		}
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (pfd[1].revents)
+			server_refresh(&mon, rth);
+		if (pfd[2].revents)
+			server_reap();
+
+		if (pfd[0].revents) {
+			int fd = accept(lfd, NULL, NULL);
+
+			for (i = 0; fd >= 0 && i < CMD_SERVER_CLIENTS; i++)
+				if (clients[i] == NULL)
+					break;
+			if (fd >= 0 && i < CMD_SERVER_CLIENTS &&
+			    (clients[i] = calloc(1, sizeof(struct cmd_client)))) {
+				fcntl(fd, F_SETFD, FD_CLOEXEC);
+				clients[i]->fd = fd;
+				clients[i]->out = clients[i]->err = -1;
+			} else if (fd >= 0)
+				close(fd);
+		}
+
+		for (i = 0; i < CMD_SERVER_CLIENTS; i++) {
+			struct cmd_client *c = clients[i];
+			struct pollfd *p = &pfd[3 + 3 * i];
+			int len;
+
+			if (c == NULL)
+				continue;
+
+			if (c->pid) {
+				/* Long running commands end with their client */
+				if (p[0].revents & (POLLRDHUP|POLLHUP|POLLERR) &&
+				    !c->gone) {
+					kill(c->pid, SIGTERM);
+					c->gone = 1;
+				}
+				if (p[1].revents && c->out >= 0)
+					server_output(c, &c->out, CMD_SERVER_STDOUT);
+				if (p[2].revents && c->err >= 0)
+					server_output(c, &c->err, CMD_SERVER_STDERR);
+				if (server_finish(c, rth, cmd) < 0)
+					server_drop(i);
+				continue;
+			}
+			if (p[0].revents == 0)
+				continue;
+
+			len = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+			if (len < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (len > 0) {
+				c->len += len;
+				if (server_lines(c, rth, cmd) == 0)
+					continue;
+			}
+			server_drop(i);
+		}
+	}
+
+	for (i = 0; i < CMD_SERVER_CLIENTS; i++)
+		if (clients[i])
+			server_drop(i);
+	signal(SIGCHLD, SIG_DFL);
+	close(sigchld_pipe[0]);
+	close(sigchld_pipe[1]);
+	rtnl_close(&mon);
+	close(lfd);
+	return -1;
+}
@@ -21,18 +21,154 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/uio.h>
+#include <sys/poll.h>
 
 #include "libnetlink.h"
 
 int rcvbuf = 1024 * 1024;
 
+/* Datagrams are received several at a time into slots which are sized
+ * once, and grown after a datagram did not fit, so that a dump of a
+ * million objects costs a few thousand syscalls rather than hundreds of
+ * thousands. The kernel does not fill dump datagrams past 32k. What is
+ * received after the end of a dump waits in the queue for the next
+ * reader.
+ */
+#define RTNL_RCV_BATCH	16
+#define RTNL_RCV_MIN	32768
+
+struct rtnl_rcvq
+{
+	int			size;
+	int			want;
+	int			head;		/* next one to look at */
+	int			cnt;
+	char			*buf;
+	struct mmsghdr		mm[RTNL_RCV_BATCH];
+	struct iovec		iov[RTNL_RCV_BATCH];
+	struct sockaddr_nl	addr[RTNL_RCV_BATCH];
+};
+
 void rtnl_close(struct rtnl_handle *rth)
 {
 	if (rth->fd >= 0) {
 		close(rth->fd);
 		rth->fd = -1;
 	}
+	if (rth->rcvq) {
+		free(rth->rcvq->buf);
+		free(rth->rcvq);
+		rth->rcvq = NULL;
+	}
+}
+
+static int rtnl_rcvq_resize(struct rtnl_handle *rth, int len)
+{
+	struct rtnl_rcvq *q = rth->rcvq;
+	char *buf;
+	int size;
+
+	if (q == NULL) {
+		q = calloc(1, sizeof(*q));
+		if (q == NULL)
+			return -1;
+		rth->rcvq = q;
+	}
+
+	size = q->size ? q->size : RTNL_RCV_MIN;
+	while (size < len)
+		size *= 2;
+	if (size == q->size)
+		return 0;
+
+	buf = malloc(size * RTNL_RCV_BATCH);
+	if (buf == NULL)
+		return -1;
+	free(q->buf);
+	q->buf = buf;
+	q->size = size;
+	return 0;
+}
+
+/* Receive up to "batch" datagrams, waiting only for the first one.
+ * Returns the number received, 0 on EOF or -1 with errno set.
+ */
+static int rtnl_recv(struct rtnl_handle *rth, int batch)
+{
+	struct rtnl_rcvq *q = rth->rcvq;
+	int i, n;
+
+	if ((q == NULL || q->want > q->size) &&
+	    rtnl_rcvq_resize(rth, q ? q->want : 0) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	q = rth->rcvq;
+	q->head = q->cnt = 0;
+
+	if (batch > RTNL_RCV_BATCH)
+		batch = RTNL_RCV_BATCH;
+	for (i = 0; i < batch; i++) {
+		q->iov[i].iov_base = q->buf + i * q->size;
+		q->iov[i].iov_len = q->size;
+		q->mm[i].msg_hdr = (struct msghdr) {
+			.msg_name = &q->addr[i],
+			.msg_namelen = sizeof(q->addr[i]),
+			.msg_iov = &q->iov[i],
+			.msg_iovlen = 1,
+		};
+		q->mm[i].msg_len = 0;
+	}
+
+	n = recvmmsg(rth->fd, q->mm, batch, MSG_WAITFORONE|MSG_TRUNC, NULL);
+	if (n < 0 && errno == ENOSYS) {
+		n = recvmsg(rth->fd, &q->mm[0].msg_hdr, MSG_TRUNC);
+		if (n >= 0) {
+			q->mm[0].msg_len = n;
+			n = 1;
+		}
+	}
+	rth->stats.syscalls++;
+	if (n <= 0)
+		return n;
+
+	q->cnt = n;
+	for (i = 0; i < n; i++) {
+		rth->stats.bytes += q->mm[i].msg_len;
+		if (q->mm[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			/* Lost; make room for the next one that large */
+			rth->stats.truncs++;
+			if (q->want < q->mm[i].msg_len)
+				q->want = q->mm[i].msg_len;
+			q->mm[i].msg_len = q->size;
+		}
+	}
+	return n;
+}
+
+/* Datagrams received but not looked at yet */
+static inline int rtnl_rcvq_pending(const struct rtnl_handle *rth)
+{
+	return rth->rcvq ? rth->rcvq->cnt - rth->rcvq->head : 0;
+}
+
+static inline char *rtnl_rcvq_buf(struct rtnl_handle *rth, int i,
+				  int *len, struct msghdr **msg)
+{
+	struct rtnl_rcvq *q = rth->rcvq;
+
+	*len = q->mm[i].msg_len;
+	*msg = &q->mm[i].msg_hdr;
+	return q->iov[i].iov_base;
+}
+
+void rtnl_print_stats(FILE *fp, const struct rtnl_handle *rth)
+{
+	fprintf(fp, "netlink: %lu syscalls, %llu bytes, %lu messages, "
+		"%lu truncated\n", rth->stats.syscalls, rth->stats.bytes,
+		rth->stats.msgs, rth->stats.truncs);
 }
 
 int rtnl_open_byproto(struct rtnl_handle *rth, unsigned subscriptions,
@@ -96,6 +232,9 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 		struct rtgenmsg g;
 	} req;
 
+	if (rtnl_window_flush(rth) < 0)
+		return -1;
+
 	memset(&req, 0, sizeof(req));
 	req.nlh.nlmsg_len = sizeof(req);
 	req.nlh.nlmsg_type = type;
@@ -109,6 +248,8 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 
 int rtnl_send(struct rtnl_handle *rth, const char *buf, int len)
 {
+	if (rtnl_window_flush(rth) < 0)
+		return -1;
 	return send(rth->fd, buf, len, 0);
 }
 
@@ -118,6 +259,9 @@ int rtnl_send_check(struct rtnl_handle *rth, const char *buf, int len)
 	int status;
 	char resp[1024];
 
+	if (rtnl_window_flush(rth) < 0)
+		return -1;
+
 	status = send(rth->fd, buf, len, 0);
 	if (status < 0)
 		return status;
@@ -160,6 +304,9 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 		.msg_iovlen = 2,
 	};
 
+	if (rtnl_window_flush(rth) < 0)
+		return -1;
+
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 
@@ -172,51 +319,74 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 	return sendmsg(rth->fd, &msg, 0);
 }
 
-int rtnl_dump_filter_l(struct rtnl_handle *rth,
-		       const struct rtnl_dump_filter_arg *arg)
+/* Show "peek" the messages of the dump among the received datagrams,
+ * so that it can start work on all of them before they are filtered.
+ */
+static void rtnl_dump_peek(struct rtnl_handle *rth,
+			   const struct rtnl_dump_filter_arg *a)
 {
-	struct sockaddr_nl nladdr;
-	struct iovec iov;
-	struct msghdr msg = {
-		.msg_name = &nladdr,
-		.msg_namelen = sizeof(nladdr),
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-	};
-	char buf[16384];
+	struct rtnl_rcvq *q = rth->rcvq;
+	int i;
+
+	for (i = q->head; i < q->cnt; i++) {
+		struct sockaddr_nl *nladdr;
+		struct msghdr *msg;
+		struct nlmsghdr *h;
+		int len;
+
+		h = (struct nlmsghdr *)rtnl_rcvq_buf(rth, i, &len, &msg);
+		nladdr = msg->msg_name;
+		for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (nladdr->nl_pid != 0 ||
+			    h->nlmsg_pid != rth->local.nl_pid ||
+			    h->nlmsg_seq != rth->dump)
+				continue;
+			if (h->nlmsg_type == NLMSG_DONE ||
+			    h->nlmsg_type == NLMSG_ERROR)
+				return;
+			a->peek(nladdr, h, a->arg1);
+		}
+	}
+}
 
-	iov.iov_base = buf;
-	while (1) {
-		int status;
-		const struct rtnl_dump_filter_arg *a;
+/* Run the received datagrams through the filters, up to the end of the
+ * dump; those after it stay queued. Returns 1 once the dump is done, 0
+ * if more is to come.
+ */
+static int rtnl_dump_batch(struct rtnl_handle *rth,
+			   const struct rtnl_dump_filter_arg *arg,
+			   int show_errors)
+{
+	struct rtnl_rcvq *q = rth->rcvq;
+	const struct rtnl_dump_filter_arg *a;
 
-		iov.iov_len = sizeof(buf);
-		status = recvmsg(rth->fd, &msg, 0);
+	for (a = arg; a->filter; a++)
+		if (a->peek)
+			rtnl_dump_peek(rth, a);
 
-		if (status < 0) {
-			if (errno == EINTR || errno == EAGAIN)
-				continue;
-			fprintf(stderr, "netlink receive error %s (%d)\n",
-				strerror(errno), errno);
-			return -1;
-		}
+	while (q->head < q->cnt) {
+		struct sockaddr_nl *nladdr;
+		struct msghdr *msg;
+		char *buf;
+		int len, status = 0;
 
-		if (status == 0) {
-			fprintf(stderr, "EOF on netlink\n");
-			return -1;
-		}
+		buf = rtnl_rcvq_buf(rth, q->head++, &len, &msg);
+		nladdr = msg->msg_name;
 
 		for (a = arg; a->filter; a++) {
 			struct nlmsghdr *h = (struct nlmsghdr*)buf;
 
+			status = len;
 			while (NLMSG_OK(h, status)) {
 				int err;
 
-				if (nladdr.nl_pid != 0 ||
+				if (a == arg)
+					rth->stats.msgs++;
+				if (nladdr->nl_pid != 0 ||
 				    h->nlmsg_pid != rth->local.nl_pid ||
 				    h->nlmsg_seq != rth->dump) {
 					if (a->junk) {
-						err = a->junk(&nladdr, h,
+						err = a->junk(nladdr, h,
 							      a->arg2);
 						if (err < 0)
 							return err;
@@ -224,28 +394,41 @@ int rtnl_dump_filter_l(struct rtnl_handle *rth,
 					goto skip_it;
 				}
 
-				if (h->nlmsg_type == NLMSG_DONE)
-					return 0;
+				if (h->nlmsg_type == NLMSG_DONE) {
+					int *done = NLMSG_DATA(h);
+
+					/* A dump that failed to start ends here */
+					if (h->nlmsg_len >= NLMSG_LENGTH(sizeof(int)) &&
+					    *done < 0) {
+						errno = -*done;
+						if (show_errors)
+							perror("RTNETLINK answers");
+						return -1;
+					}
+					return 1;
+				}
 				if (h->nlmsg_type == NLMSG_ERROR) {
 					struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
 					if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
 						fprintf(stderr,
 							"ERROR truncated\n");
+						errno = EINVAL;
 					} else {
 						errno = -err->error;
-						perror("RTNETLINK answers");
+						if (show_errors)
+							perror("RTNETLINK answers");
 					}
 					return -1;
 				}
-				err = a->filter(&nladdr, h, a->arg1);
+				err = a->filter(nladdr, h, a->arg1);
 				if (err < 0)
 					return err;
 
 skip_it:
 				h = NLMSG_NEXT(h, status);
 			}
-		} while (0);
-		if (msg.msg_flags & MSG_TRUNC) {
+		}
+		if (msg->msg_flags & MSG_TRUNC) {
 			fprintf(stderr, "Message truncated\n");
 			continue;
 		}
@@ -254,6 +437,153 @@ skip_it:
 			exit(1);
 		}
 	}
+	return 0;
+}
+
+static int __rtnl_dump_filter_l(struct rtnl_handle *rth,
+				const struct rtnl_dump_filter_arg *arg,
+				int show_errors)
+{
+	while (1) {
+		int n, err;
+
+		/* Left over from an earlier dump, seen as junk by this one */
+		if (!rtnl_rcvq_pending(rth)) {
+			n = rtnl_recv(rth, RTNL_RCV_BATCH);
+
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				fprintf(stderr, "netlink receive error %s (%d)\n",
+					strerror(errno), errno);
+				return -1;
+			}
+
+			if (n == 0) {
+				fprintf(stderr, "EOF on netlink\n");
+				return -1;
+			}
+		}
+
+		err = rtnl_dump_batch(rth, arg, show_errors);
+		if (err)
+			return err > 0 ? 0 : err;
+	}
+}
+
+int rtnl_dump_filter_l(struct rtnl_handle *rth,
+		       const struct rtnl_dump_filter_arg *arg)
+{
+	return __rtnl_dump_filter_l(rth, arg, 1);
+}
+
+/* Same as rtnl_dump_filter_l(), but leaves reporting of negative answers
+ * to the caller, which finds the error in errno.
+ */
+int rtnl_dump_filter_quiet(struct rtnl_handle *rth,
+			   const struct rtnl_dump_filter_arg *arg)
+{
+	return __rtnl_dump_filter_l(rth, arg, 0);
+}
+
+/* Issue several wildcard dumps at once and serve them from one poll
+ * loop. The first one runs on "rth", each of the others on a socket
+ * of its own, so the kernel fills all of them while we are parsing.
+ */
+int rtnl_dump_multi(struct rtnl_handle *rth,
+		    const struct rtnl_dump_multi_arg *arg, int n)
+{
+	struct rtnl_handle *h;
+	struct pollfd *pfd;
+	int i, pending = 0, ret = -1;
+
+	if (n <= 0)
+		return 0;
+
+	h = calloc(n, sizeof(*h));
+	pfd = calloc(n, sizeof(*pfd));
+	if (h == NULL || pfd == NULL) {
+		perror("rtnl_dump_multi");
+		free(h);
+		free(pfd);
+		return -1;
+	}
+
+	h[0] = *rth;
+	for (i = 1; i < n; i++)
+		h[i].fd = -1;
+
+	for (i = 0; i < n; i++) {
+		if (i > 0 && rtnl_open(&h[i], 0) < 0)
+			goto out;
+
+		if (rtnl_wilddump_request(&h[i], arg[i].family,
+					  arg[i].type) < 0) {
+			perror("Cannot send dump request");
+			goto out;
+		}
+		pfd[i].fd = h[i].fd;
+		pfd[i].events = POLLIN;
+		pending++;
+	}
+
+	while (pending) {
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			const struct rtnl_dump_filter_arg a[2] = {
+				{ .filter = arg[i].filter, .arg1 = arg[i].arg1 },
+				{ .filter = NULL },
+			};
+			int cnt, err;
+
+			if (!(pfd[i].revents & (POLLIN|POLLERR|POLLHUP)))
+				continue;
+
+			cnt = rtnl_recv(&h[i], RTNL_RCV_BATCH);
+			if (cnt < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				fprintf(stderr, "netlink receive error %s (%d)\n",
+					strerror(errno), errno);
+				goto out;
+			}
+			if (cnt == 0) {
+				fprintf(stderr, "EOF on netlink\n");
+				goto out;
+			}
+
+			err = rtnl_dump_batch(&h[i], a, 1);
+			if (err < 0)
+				goto out;
+			if (err > 0) {
+				/* Negative fds are skipped by poll() */
+				pfd[i].fd = -1;
+				pfd[i].revents = 0;
+				pending--;
+			}
+		}
+	}
+	ret = 0;
+
+out:
+	/* The first dump ran on the caller's socket; the others count too */
+	*rth = h[0];
+	for (i = 1; i < n; i++) {
+		rth->stats.syscalls += h[i].stats.syscalls;
+		rth->stats.bytes += h[i].stats.bytes;
+		rth->stats.msgs += h[i].stats.msgs;
+		rth->stats.truncs += h[i].stats.truncs;
+		rtnl_close(&h[i]);
+	}
+	free(h);
+	free(pfd);
+	return ret;
 }
 
 int rtnl_dump_filter(struct rtnl_handle *rth,
@@ -270,10 +600,510 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 	return rtnl_dump_filter_l(rth, a);
 }
 
-int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
-	      unsigned groups, struct nlmsghdr *answer,
-	      rtnl_filter_t junk,
-	      void *jarg)
+static struct rtnl_window_slot *rtnl_window_find(struct rtnl_window *w,
+						 __u32 seq)
+{
+	unsigned i;
+
+	for (i = 0; i < w->inflight; i++) {
+		struct rtnl_window_slot *s;
+
+		s = &w->slot[(w->head + w->size - w->inflight + i) % w->size];
+		if (s->seq == seq)
+			return s;
+	}
+	return NULL;
+}
+
+/* Receive ACKs until no more than "limit" requests are outstanding. */
+static int rtnl_window_reap(struct rtnl_handle *rth, unsigned limit)
+{
+	struct rtnl_window *w = rth->window;
+	struct sockaddr_nl nladdr;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	char buf[16384];
+
+	iov.iov_base = buf;
+	while (w->inflight > limit) {
+		struct nlmsghdr *h;
+		int status;
+
+		iov.iov_len = sizeof(buf);
+		status = recvmsg(rth->fd, &msg, 0);
+
+		if (status < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "netlink receive error %s (%d)\n",
+				strerror(errno), errno);
+			return -1;
+		}
+		if (status == 0) {
+			fprintf(stderr, "EOF on netlink\n");
+			return -1;
+		}
+
+		for (h = (struct nlmsghdr*)buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
+			struct rtnl_window_slot *s;
+
+			if (nladdr.nl_pid != 0 ||
+			    h->nlmsg_pid != rth->local.nl_pid)
+				continue;
+
+			s = rtnl_window_find(w, h->nlmsg_seq);
+			if (s == NULL)
+				continue;
+
+			if (h->nlmsg_type != NLMSG_ERROR) {
+				fprintf(stderr, "Unexpected reply!!!\n");
+				continue;
+			}
+			if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+				fprintf(stderr, "ERROR truncated\n");
+				w->errors++;
+				if (w->error)
+					w->error(s->tag, EIO, w->arg);
+			} else if (err->error) {
+				fprintf(stderr, "RTNETLINK answers: %s\n",
+					strerror(-err->error));
+				w->errors++;
+				if (w->error)
+					w->error(s->tag, -err->error, w->arg);
+			}
+
+			/* ACKs normally come back in order, holes left by
+			 * out of order ones are skipped once they get oldest.
+			 */
+			s->seq = 0;
+			while (w->inflight &&
+			       w->slot[(w->head + w->size - w->inflight) % w->size].seq == 0)
+				w->inflight--;
+		}
+		if (msg.msg_flags & MSG_TRUNC) {
+			fprintf(stderr, "Message truncated\n");
+			continue;
+		}
+		if (status) {
+			fprintf(stderr, "!!!Remnant of size %d\n", status);
+			exit(1);
+		}
+	}
+	return 0;
+}
+
+static int rtnl_window_send(struct rtnl_handle *rth, struct nlmsghdr *n)
+{
+	struct rtnl_window *w = rth->window;
+	struct rtnl_window_slot *s;
+	struct sockaddr_nl nladdr;
+	struct iovec iov = {
+		.iov_base = (void*) n,
+		.iov_len = n->nlmsg_len
+	};
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (w->inflight >= w->size && rtnl_window_reap(rth, w->size - 1) < 0)
+		return -1;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	n->nlmsg_seq = ++rth->seq;
+	n->nlmsg_flags |= NLM_F_ACK;
+
+	if (sendmsg(rth->fd, &msg, 0) < 0) {
+		perror("Cannot talk to rtnetlink");
+		return -1;
+	}
+
+	w->sent++;
+	w->bytes += n->nlmsg_len;
+
+	s = &w->slot[w->head];
+	s->seq = n->nlmsg_seq;
+	s->tag = w->tag;
+	w->head = (w->head + 1) % w->size;
+	w->inflight++;
+	return 0;
+}
+
+int rtnl_window_open(struct rtnl_handle *rth, unsigned size,
+		     rtnl_window_err_t error, void *arg)
+{
+	struct rtnl_window *w;
+
+	if (size == 0)
+		size = 1;
+
+	w = malloc(sizeof(*w) + size * sizeof(struct rtnl_window_slot));
+	if (w == NULL) {
+		perror("rtnl_window_open");
+		return -1;
+	}
+	memset(w, 0, sizeof(*w));
+	w->size = size;
+	w->error = error;
+	w->arg = arg;
+	rth->window = w;
+	return 0;
+}
+
+int rtnl_window_flush(struct rtnl_handle *rth)
+{
+	if (rth->window == NULL || rth->window->inflight == 0)
+		return 0;
+	return rtnl_window_reap(rth, 0);
+}
+
+int rtnl_window_close(struct rtnl_handle *rth)
+{
+	int ret;
+
+	if (rth->window == NULL)
+		return 0;
+
+	ret = rtnl_window_flush(rth);
+	free(rth->window);
+	rth->window = NULL;
+	return ret;
+}
+
+/* Bulk deletion used by the "flush" commands.
+ *
+ * Requests are queued while a dump is walked and sent afterwards in
+ * datagrams of up to RTNL_FLUSH_CHUNK bytes. Only the last request of
+ * the whole batch asks for an ACK; the kernel reports failures of the
+ * others anyway. A second socket subscribed to the groups of the
+ * objects being flushed tells whether anything besides our own
+ * deletions happened meanwhile, so that the caller only has to dump
+ * again when it did.
+ */
+#define RTNL_FLUSH_CHUNK	32768
+#define RTNL_FLUSH_MIN		65536
+
+int rtnl_flush_open_byproto(struct rtnl_flush *f, unsigned groups,
+			    int protocol)
+{
+	int bufsize = 4 * rcvbuf;
+
+	memset(f, 0, sizeof(*f));
+	f->mon.fd = -1;
+	if (groups == 0)
+		return 0;
+	if (rtnl_open_byproto(&f->mon, groups, protocol) < 0) {
+		rtnl_close(&f->mon);
+		return -1;
+	}
+	fcntl(f->mon.fd, F_SETFL, O_NONBLOCK);
+	/* Notifications for a whole chunk queue up before we get to read
+	 * them; try to get past rmem_max, losing some only costs a dump.
+	 */
+	setsockopt(f->mon.fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		   &bufsize, sizeof(bufsize));
+	return 0;
+}
+
+int rtnl_flush_open(struct rtnl_flush *f, unsigned groups)
+{
+	return rtnl_flush_open_byproto(f, groups, NETLINK_ROUTE);
+}
+
+void rtnl_flush_close(struct rtnl_flush *f)
+{
+	rtnl_close(&f->mon);
+	free(f->buf);
+	f->buf = NULL;
+	f->size = 0;
+}
+
+/* Read everything pending on the monitor socket. Our own deletions
+ * are counted, anything else means the table changed under us.
+ */
+static void rtnl_flush_monitor(struct rtnl_flush *f, int count)
+{
+	char buf[16384];
+
+	if (f->mon.fd < 0) {
+		f->changed = 1;
+		return;
+	}
+
+	for (;;) {
+		struct nlmsghdr *h;
+		int status;
+
+		status = recv(f->mon.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		f->mon.stats.syscalls++;
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Overruns included: we cannot tell any more */
+			if (errno != EAGAIN)
+				f->changed = 1;
+			return;
+		}
+		if (status == 0)
+			return;
+		if (!count)
+			continue;
+		for (h = (struct nlmsghdr*)buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			if (h->nlmsg_type == f->type)
+				f->seen++;
+			else
+				f->changed = 1;
+		}
+	}
+}
+
+void rtnl_flush_reset(struct rtnl_flush *f)
+{
+	rtnl_flush_monitor(f, 0);
+	f->len = 0;
+	f->queued = 0;
+	f->count = 0;
+	f->type = 0;
+	f->seen = 0;
+	f->gone = 0;
+	f->errors = 0;
+	f->error = 0;
+	f->changed = 0;
+	f->sends = 0;
+	f->usecs = 0;
+}
+
+int rtnl_flush_add(struct rtnl_flush *f, const struct nlmsghdr *n, int type)
+{
+	struct nlmsghdr *fn;
+	int len = NLMSG_ALIGN(n->nlmsg_len);
+
+	if (f->len + len > f->size) {
+		int size = f->size ? f->size : RTNL_FLUSH_MIN;
+		char *buf;
+
+		while (size < f->len + len)
+			size *= 2;
+		buf = realloc(f->buf, size);
+		if (buf == NULL) {
+			perror("rtnl_flush_add");
+			return -1;
+		}
+		f->buf = buf;
+		f->size = size;
+	}
+
+	fn = (struct nlmsghdr*)(f->buf + f->len);
+	memcpy(fn, n, n->nlmsg_len);
+	fn->nlmsg_type = type;
+	fn->nlmsg_flags = NLM_F_REQUEST;
+	f->len += len;
+	f->queued++;
+	if (f->type && f->type != type)
+		f->changed = 1;
+	f->type = type;
+	return 0;
+}
+
+/* Handle the answers found in one datagram; returns 1 once the answer
+ * to the last request was seen.
+ */
+static int rtnl_flush_answers(struct rtnl_handle *rth, struct rtnl_flush *f,
+			      char *buf, int status, __u32 first, __u32 last)
+{
+	struct nlmsghdr *h;
+	int done = 0;
+
+	for (h = (struct nlmsghdr*)buf; NLMSG_OK(h, status);
+	     h = NLMSG_NEXT(h, status)) {
+		struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
+
+		rth->stats.msgs++;
+		if (h->nlmsg_pid != rth->local.nl_pid ||
+		    h->nlmsg_seq - first > last - first ||
+		    h->nlmsg_type != NLMSG_ERROR)
+			continue;
+		if (h->nlmsg_seq == last)
+			done = 1;
+		if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+			f->errors++;
+			if (!f->error)
+				f->error = EIO;
+			continue;
+		}
+		switch (-err->error) {
+		case 0:
+			break;
+		case ESRCH:
+		case ENOENT:
+		case EADDRNOTAVAIL:
+			/* Went away by itself, e.g. secondary addresses
+			 * together with their primary.
+			 */
+			f->gone++;
+			break;
+		default:
+			f->errors++;
+			if (!f->error)
+				f->error = -err->error;
+		}
+	}
+	return done;
+}
+
+/* Returns 1 once the answer to the last request was seen, 2 if some
+ * answers were lost to an overrun and waiting makes no sense any more.
+ */
+static int rtnl_flush_reap(struct rtnl_handle *rth, struct rtnl_flush *f,
+			   __u32 first, __u32 last, int wait)
+{
+	char buf[16384];
+	int lost = 0;
+
+	for (;;) {
+		int status;
+
+		status = recv(rth->fd, buf, sizeof(buf), wait ? 0 : MSG_DONTWAIT);
+		rth->stats.syscalls++;
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return lost;
+			if (errno == ENOBUFS) {
+				/* Answers were lost, perhaps the final ACK
+				 * too; read what is left and dump again.
+				 */
+				f->changed = 1;
+				wait = 0;
+				lost = 2;
+				continue;
+			}
+			return -1;
+		}
+		if (status == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		rth->stats.bytes += status;
+		if (rtnl_flush_answers(rth, f, buf, status, first, last))
+			return 1;
+	}
+}
+
+static int __rtnl_flush_commit(struct rtnl_handle *rth, struct rtnl_flush *f)
+{
+	__u32 first = rth->seq + 1;
+	__u32 last = rth->seq + f->queued;
+	int off = 0, done = 0;
+
+	if (rtnl_window_flush(rth) < 0)
+		return -1;
+
+	while (off < f->len) {
+		struct nlmsghdr *h = (struct nlmsghdr*)(f->buf + off);
+		int len = 0;
+
+		while (off + len < f->len) {
+			struct nlmsghdr *fn = (struct nlmsghdr*)(f->buf + off + len);
+			int l = NLMSG_ALIGN(fn->nlmsg_len);
+
+			if (len && len + l > RTNL_FLUSH_CHUNK)
+				break;
+			fn->nlmsg_seq = ++rth->seq;
+			if (fn->nlmsg_seq == last)
+				fn->nlmsg_flags |= NLM_F_ACK;
+			len += l;
+		}
+
+		if (send(rth->fd, h, len, 0) < 0)
+			return -1;
+		f->sends++;
+		off += len;
+
+		/* rtnetlink handles the chunk before send() returns, so
+		 * whatever it had to say about it is already queued.
+		 */
+		if (done != 1) {
+			int ret = rtnl_flush_reap(rth, f, first, last, 0);
+
+			if (ret < 0)
+				return -1;
+			if (ret > done)
+				done = ret;
+		}
+		rtnl_flush_monitor(f, 1);
+	}
+
+	if (done != 1 && rtnl_flush_reap(rth, f, first, last, !done) < 0)
+		return -1;
+	f->count += f->queued;
+	f->queued = 0;
+	f->len = 0;
+	rtnl_flush_monitor(f, 1);
+
+	if (f->gone || f->seen > f->count - f->errors - f->gone)
+		f->changed = 1;
+	if (f->errors) {
+		errno = f->error;
+		return -1;
+	}
+	return 0;
+}
+
+int rtnl_flush_commit(struct rtnl_handle *rth, struct rtnl_flush *f)
+{
+	struct timeval t0, t1;
+	int ret;
+
+	if (f->queued == 0)
+		return 0;
+
+	gettimeofday(&t0, NULL);
+	ret = __rtnl_flush_commit(rth, f);
+	gettimeofday(&t1, NULL);
+	f->usecs += (t1.tv_sec - t0.tv_sec) * 1000000ULL +
+		    t1.tv_usec - t0.tv_usec;
+	return ret;
+}
+
+/* For callers which delete while still reading the dump: commit as
+ * soon as another request of the usual size would not fit in one
+ * datagram.
+ */
+int rtnl_flush_stream(struct rtnl_handle *rth, struct rtnl_flush *f)
+{
+	if (f->queued == 0 || f->len + f->len / f->queued <= RTNL_FLUSH_CHUNK)
+		return 0;
+	return rtnl_flush_commit(rth, f);
+}
+
+void rtnl_flush_print_round(FILE *fp, const struct rtnl_flush *f)
+{
+	double secs = f->usecs / 1000000.;
+
+	fprintf(fp, "*** %d requests in %lu datagrams, %.3f sec, %.0f/sec",
+		f->count, f->sends, secs, secs > 0 ? f->count / secs : 0.);
+	if (f->gone)
+		fprintf(fp, ", %d already gone", f->gone);
+	fprintf(fp, " ***\n");
+}
+
+static int __rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n,
+		       pid_t peer, unsigned groups, struct nlmsghdr *answer,
+		       rtnl_filter_t junk, void *jarg, int show_errors)
 {
 	int status;
 	unsigned seq;
@@ -291,6 +1121,13 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	};
 	char   buf[16384];
 
+	if (rtnl->window) {
+		if (answer == NULL && peer == 0 && groups == 0 && junk == NULL)
+			return rtnl_window_send(rtnl, n);
+		if (rtnl_window_flush(rtnl) < 0)
+			return -1;
+	}
+
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 	nladdr.nl_pid = peer;
@@ -370,7 +1207,8 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 							memcpy(answer, h, h->nlmsg_len);
 						return 0;
 					}
-					perror("RTNETLINK answers");
+					if (show_errors)
+						perror("RTNETLINK answers");
 				}
 				return -1;
 			}
@@ -395,33 +1233,36 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	}
 }
 
+int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
+	      unsigned groups, struct nlmsghdr *answer,
+	      rtnl_filter_t junk,
+	      void *jarg)
+{
+	return __rtnl_talk(rtnl, n, peer, groups, answer, junk, jarg, 1);
+}
+
+/* Same as rtnl_talk() to the kernel, but leaves reporting of negative
+ * answers to the caller, which finds the error in errno.
+ */
+int rtnl_talk_quiet(struct rtnl_handle *rtnl, struct nlmsghdr *n,
+		    struct nlmsghdr *answer)
+{
+	return __rtnl_talk(rtnl, n, 0, 0, answer, NULL, NULL, 0);
+}
+
 int rtnl_listen(struct rtnl_handle *rtnl,
 		rtnl_filter_t handler,
 		void *jarg)
 {
-	int status;
-	struct nlmsghdr *h;
-	struct sockaddr_nl nladdr;
-	struct iovec iov;
-	struct msghdr msg = {
-		.msg_name = &nladdr,
-		.msg_namelen = sizeof(nladdr),
-		.msg_iov = &iov,
-		.msg_iovlen = 1,
-	};
-	char   buf[8192];
-
-	memset(&nladdr, 0, sizeof(nladdr));
-	nladdr.nl_family = AF_NETLINK;
-	nladdr.nl_pid = 0;
-	nladdr.nl_groups = 0;
-
-	iov.iov_base = buf;
 	while (1) {
-		iov.iov_len = sizeof(buf);
-		status = recvmsg(rtnl->fd, &msg, 0);
+		int n;
 
-		if (status < 0) {
+		/* What came after the end of a dump goes first */
+		n = rtnl_rcvq_pending(rtnl);
+		if (n == 0)
+			n = rtnl_recv(rtnl, RTNL_RCV_BATCH);
+
+		if (n < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
 			fprintf(stderr, "netlink receive error %s (%d)\n",
@@ -430,42 +1271,56 @@ int rtnl_listen(struct rtnl_handle *rtnl,
 				continue;
 			return -1;
 		}
-		if (status == 0) {
+		if (n == 0) {
 			fprintf(stderr, "EOF on netlink\n");
 			return -1;
 		}
-		if (msg.msg_namelen != sizeof(nladdr)) {
-			fprintf(stderr, "Sender address length == %d\n", msg.msg_namelen);
-			exit(1);
-		}
-		for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
-			int err;
-			int len = h->nlmsg_len;
-			int l = len - sizeof(*h);
 
-			if (l<0 || len>status) {
-				if (msg.msg_flags & MSG_TRUNC) {
-					fprintf(stderr, "Truncated message\n");
-					return -1;
-				}
-				fprintf(stderr, "!!!malformed message: len=%d\n", len);
+		while (rtnl_rcvq_pending(rtnl)) {
+			struct sockaddr_nl *nladdr;
+			struct msghdr *msg;
+			struct nlmsghdr *h;
+			char *buf;
+			int status;
+
+			buf = rtnl_rcvq_buf(rtnl, rtnl->rcvq->head++, &status,
+					    &msg);
+			nladdr = msg->msg_name;
+
+			if (msg->msg_namelen != sizeof(*nladdr)) {
+				fprintf(stderr, "Sender address length == %d\n", msg->msg_namelen);
 				exit(1);
 			}
+			for (h = (struct nlmsghdr*)buf; status >= sizeof(*h); ) {
+				int err;
+				int len = h->nlmsg_len;
+				int l = len - sizeof(*h);
 
-			err = handler(&nladdr, h, jarg);
-			if (err < 0)
-				return err;
+				if (l<0 || len>status) {
+					if (msg->msg_flags & MSG_TRUNC) {
+						fprintf(stderr, "Truncated message\n");
+						return -1;
+					}
+					fprintf(stderr, "!!!malformed message: len=%d\n", len);
+					exit(1);
+				}
 
-			status -= NLMSG_ALIGN(len);
-			h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
-		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			fprintf(stderr, "Message truncated\n");
-			continue;
-		}
-		if (status) {
-			fprintf(stderr, "!!!Remnant of size %d\n", status);
-			exit(1);
+				rtnl->stats.msgs++;
+				err = handler(nladdr, h, jarg);
+				if (err < 0)
+					return err;
+
+				status -= NLMSG_ALIGN(len);
+				h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
+			}
+			if (msg->msg_flags & MSG_TRUNC) {
+				fprintf(stderr, "Message truncated\n");
+				continue;
+			}
+			if (status) {
+				fprintf(stderr, "!!!Remnant of size %d\n", status);
+				exit(1);
+			}
 		}
 	}
 }
@@ -26,50 +26,231 @@ extern unsigned int if_nametoindex (const char *);
 
 struct idxmap
 {
-	struct idxmap * next;
 	unsigned	index;
 	int		type;
 	int		alen;
 	unsigned	flags;
 	unsigned char	addr[20];
 	char		name[16];
+	unsigned	missed;		/* nameless: round the kernel did not know it */
 };
 
-static struct idxmap *idxmap[16];
+/* Two open addressing tables with linear probing point to the same
+ * entries: one keyed by ifindex, one keyed by name. Slot keys are kept
+ * inline so that a probe touches only the table itself.
+ */
+struct idxslot
+{
+	unsigned	index;		/* 0 - free slot */
+	struct idxmap	*im;
+};
+
+struct nameslot
+{
+	unsigned	hash;
+	struct idxmap	*im;		/* NULL - free slot */
+};
+
+#define IDXMAP_MIN_SIZE	64
+
+/* Tools whose commands look at a few links set this before the first
+ * ll_init_map(), the rest get the whole table dumped as they always did.
+ */
+int ll_map_lazy;
+static unsigned ll_round = 1;	/* bumped by each lazy ll_init_map() */
+
+static struct idxslot *idx_tab;
+static struct nameslot *name_tab;
+static unsigned tab_size;		/* power of two, same for both */
+static unsigned tab_count;
+
+static inline unsigned idx_hash(unsigned idx)
+{
+	return idx * 2654435761U;
+}
+
+static unsigned name_hash(const char *name)
+{
+	unsigned h = 2166136261U;
+	int i;
+
+	for (i = 0; i < 16 && name[i]; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static struct idxslot *idx_find(unsigned idx)
+{
+	unsigned mask = tab_size - 1;
+	unsigned i;
+
+	if (tab_size == 0)
+		return NULL;
+
+	for (i = idx_hash(idx) & mask; idx_tab[i].index; i = (i + 1) & mask)
+		if (idx_tab[i].index == idx)
+			return &idx_tab[i];
+	return NULL;
+}
+
+static struct idxmap *idx_lookup(unsigned idx)
+{
+	struct idxslot *s = idx_find(idx);
+
+	return s ? s->im : NULL;
+}
+
+static struct idxmap *name_lookup(const char *name)
+{
+	unsigned mask = tab_size - 1;
+	unsigned h, i;
+
+	if (tab_size == 0)
+		return NULL;
+
+	h = name_hash(name);
+	for (i = h & mask; name_tab[i].im; i = (i + 1) & mask)
+		if (name_tab[i].hash == h &&
+		    strncmp(name_tab[i].im->name, name, 16) == 0)
+			return name_tab[i].im;
+	return NULL;
+}
+
+static void idx_insert(struct idxmap *im)
+{
+	unsigned mask = tab_size - 1;
+	unsigned i;
+
+	for (i = idx_hash(im->index) & mask; idx_tab[i].index;
+	     i = (i + 1) & mask)
+		;
+	idx_tab[i].index = im->index;
+	idx_tab[i].im = im;
+}
+
+static void name_insert(struct idxmap *im)
+{
+	unsigned mask = tab_size - 1;
+	unsigned h = name_hash(im->name);
+	unsigned i;
+
+	for (i = h & mask; name_tab[i].im; i = (i + 1) & mask) {
+		/* A stale entry may still carry the name, the newest wins */
+		if (name_tab[i].hash == h &&
+		    strcmp(name_tab[i].im->name, im->name) == 0)
+			break;
+	}
+	name_tab[i].hash = h;
+	name_tab[i].im = im;
+}
+
+/* Backward shift deletion: pull following entries of the probe
+ * sequence into the hole so that lookups never need tombstones.
+ */
+static inline int slot_movable(unsigned hole, unsigned j, unsigned home)
+{
+	if (hole <= j)
+		return home <= hole || home > j;
+	return home <= hole && home > j;
+}
+
+static void name_delete(struct idxmap *im)
+{
+	unsigned mask = tab_size - 1;
+	unsigned hole, j;
+
+	for (hole = name_hash(im->name) & mask; name_tab[hole].im != im;
+	     hole = (hole + 1) & mask)
+		if (name_tab[hole].im == NULL)
+			return;
+
+	for (j = hole;;) {
+		j = (j + 1) & mask;
+		if (name_tab[j].im == NULL)
+			break;
+		if (slot_movable(hole, j, name_tab[j].hash & mask)) {
+			name_tab[hole] = name_tab[j];
+			hole = j;
+		}
+	}
+	name_tab[hole].hash = 0;
+	name_tab[hole].im = NULL;
+}
+
+static int idxmap_grow(void)
+{
+	struct idxslot *old_idx = idx_tab;
+	struct nameslot *old_name = name_tab;
+	unsigned old_size = tab_size;
+	unsigned size = tab_size ? tab_size * 2 : IDXMAP_MIN_SIZE;
+	unsigned i;
+
+	idx_tab = calloc(size, sizeof(*idx_tab));
+	name_tab = calloc(size, sizeof(*name_tab));
+	if (idx_tab == NULL || name_tab == NULL) {
+		free(idx_tab);
+		free(name_tab);
+		idx_tab = old_idx;
+		name_tab = old_name;
+		return -1;
+	}
+	tab_size = size;
+
+	for (i = 0; i < old_size; i++) {
+		if (old_idx[i].index)
+			idx_insert(old_idx[i].im);
+		if (old_name[i].im)
+			name_insert(old_name[i].im);
+	}
+	free(old_idx);
+	free(old_name);
+	return 0;
+}
 
 int ll_remember_index(const struct sockaddr_nl *who,
 		      struct nlmsghdr *n, void *arg)
 {
-	int h;
 	struct ifinfomsg *ifi = NLMSG_DATA(n);
-	struct idxmap *im, **imp;
+	struct idxmap *im;
 	struct rtattr *tb[IFLA_MAX+1];
+	const char *name;
 
-	if (n->nlmsg_type != RTM_NEWLINK)
+	if (n->nlmsg_type != RTM_NEWLINK && n->nlmsg_type != RTM_DELLINK)
 		return 0;
 
 	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(ifi)))
 		return -1;
 
+	/* A deleted link keeps its entry: events about it may still be
+	 * on their way, and a reused name or index simply overwrites it.
+	 */
 
 	memset(tb, 0, sizeof(tb));
 	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n));
 	if (tb[IFLA_IFNAME] == NULL)
 		return 0;
+	name = RTA_DATA(tb[IFLA_IFNAME]);
 
-	h = ifi->ifi_index&0xF;
-
-	for (imp=&idxmap[h]; (im=*imp)!=NULL; imp = &im->next)
-		if (im->index == ifi->ifi_index)
-			break;
-
+	im = idx_lookup(ifi->ifi_index);
 	if (im == NULL) {
+		if ((tab_count + 1) * 4 > tab_size * 3 && idxmap_grow() < 0)
+			return 0;
 		im = malloc(sizeof(*im));
 		if (im == NULL)
 			return 0;
-		im->next = *imp;
 		im->index = ifi->ifi_index;
-		*imp = im;
+		strncpy(im->name, name, sizeof(im->name) - 1);
+		im->name[sizeof(im->name) - 1] = 0;
+		idx_insert(im);
+		name_insert(im);
+		tab_count++;
+	} else if (strncmp(im->name, name, sizeof(im->name) - 1) != 0) {
+		name_delete(im);
+		strncpy(im->name, name, sizeof(im->name) - 1);
+		im->name[sizeof(im->name) - 1] = 0;
+		name_insert(im);
 	}
 
 	im->type = ifi->ifi_type;
@@ -84,19 +265,92 @@ int ll_remember_index(const struct sockaddr_nl *who,
 		im->alen = 0;
 		memset(im->addr, 0, sizeof(im->addr));
 	}
-	strcpy(im->name, RTA_DATA(tb[IFLA_IFNAME]));
 	return 0;
 }
 
+/* Lookups which miss the map ask the kernel for that single link.
+ * They may happen from inside a dump callback, so they go through a
+ * private socket rather than the caller's handle.
+ */
+static struct rtnl_handle ll_rth = { .fd = -1 };
+
+static struct idxmap *ll_link_get(const char *name, unsigned idx)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct ifinfomsg	ifm;
+		char			buf[64];
+	} req;
+	struct {
+		struct nlmsghdr		n;
+		char			buf[16384];
+	} answer;
+
+	if (ll_rth.fd < 0 && rtnl_open(&ll_rth, 0) < 0)
+		return NULL;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_type = RTM_GETLINK;
+	req.ifm.ifi_family = AF_UNSPEC;
+	req.ifm.ifi_index = idx;
+	if (name)
+		addattr_l(&req.n, sizeof(req), IFLA_IFNAME, name,
+			  strlen(name) + 1);
+
+	if (rtnl_talk_quiet(&ll_rth, &req.n, &answer.n) < 0)
+		return NULL;
+	if (ll_remember_index(NULL, &answer.n, NULL) < 0)
+		return NULL;
+	return name ? name_lookup(name) : idx_lookup(idx);
+}
+
+/* An index the kernel does not know gets a nameless entry, so that it
+ * is asked about only once per command; a batch or server may create
+ * the link before the next one. RTM_NEWLINK for it fills the entry in.
+ */
+static void ll_remember_miss(struct idxmap *im, unsigned idx)
+{
+	if (im == NULL) {
+		if ((tab_count + 1) * 4 > tab_size * 3 && idxmap_grow() < 0)
+			return;
+		im = calloc(1, sizeof(*im));
+		if (im == NULL)
+			return;
+		im->index = idx;
+		im->type = -1;
+		idx_insert(im);
+		tab_count++;
+	}
+	im->missed = ll_round;
+}
+
+static struct idxmap *ll_lookup(unsigned idx)
+{
+	struct idxmap *im = idx_lookup(idx);
+
+	if (ll_map_lazy &&
+	    (im == NULL || (im->name[0] == 0 && im->missed != ll_round))) {
+		struct idxmap *got = ll_link_get(NULL, idx);
+
+		if (got)
+			im = got;
+		else
+			ll_remember_miss(im, idx);
+	}
+	return im && im->name[0] ? im : NULL;
+}
+
 const char *ll_idx_n2a(unsigned idx, char *buf)
 {
 	struct idxmap *im;
 
 	if (idx == 0)
 		return "*";
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->name;
+	im = ll_lookup(idx);
+	if (im)
+		return im->name;
 	snprintf(buf, 16, "if%d", idx);
 	return buf;
 }
@@ -115,10 +369,8 @@ int ll_index_to_type(unsigned idx)
 
 	if (idx == 0)
 		return -1;
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->type;
-	return -1;
+	im = ll_lookup(idx);
+	return im ? im->type : -1;
 }
 
 unsigned ll_index_to_flags(unsigned idx)
@@ -127,11 +379,8 @@ unsigned ll_index_to_flags(unsigned idx)
 
 	if (idx == 0)
 		return 0;
-
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->flags;
-	return 0;
+	im = ll_lookup(idx);
+	return im ? im->flags : 0;
 }
 
 unsigned ll_index_to_addr(unsigned idx, unsigned char *addr,
@@ -142,55 +391,65 @@ unsigned ll_index_to_addr(unsigned idx, unsigned char *addr,
 	if (idx == 0)
 		return 0;
 
-	for (im = idxmap[idx&0xF]; im; im = im->next) {
-		if (im->index == idx) {
-			if (alen > sizeof(im->addr))
-				alen = sizeof(im->addr);
-			if (alen > im->alen)
-				alen = im->alen;
-			memcpy(addr, im->addr, alen);
-			return alen;
-		}
-	}
-	return 0;
+	im = ll_lookup(idx);
+	if (im == NULL)
+		return 0;
+	if (alen > sizeof(im->addr))
+		alen = sizeof(im->addr);
+	if (alen > im->alen)
+		alen = im->alen;
+	memcpy(addr, im->addr, alen);
+	return alen;
 }
 
 unsigned ll_name_to_index(const char *name)
 {
-	static char ncache[16];
-	static int icache;
 	struct idxmap *im;
-	int i;
 	unsigned idx;
 
 	if (name == NULL)
 		return 0;
-	if (icache && strcmp(name, ncache) == 0)
-		return icache;
-	for (i=0; i<16; i++) {
-		for (im = idxmap[i]; im; im = im->next) {
-			if (strcmp(im->name, name) == 0) {
-				icache = im->index;
-				strcpy(ncache, name);
-				return im->index;
-			}
-		}
+	im = name_lookup(name);
+	if (im)
+		return im->index;
+
+	if (ll_map_lazy) {
+		/* Kernels which can not look links up by name want an index */
+		im = ll_link_get(name, 0);
+		if (im)
+			return im->index;
 	}
 
 	idx = if_nametoindex(name);
 	if (idx == 0)
 		sscanf(name, "if%u", &idx);
+	else if (ll_map_lazy)
+		ll_link_get(NULL, idx);
 	return idx;
 }
 
 int ll_init_map(struct rtnl_handle *rth)
+{
+	/* A dump would drain the requests in flight, so a windowed batch
+	 * asks for links one at a time on a socket of its own instead.
+	 */
+	if (rth->window)
+		ll_map_lazy = 1;
+	if (ll_map_lazy) {
+		ll_round++;
+		return 0;
+	}
+	return ll_init_map_full(rth);
+}
+
+int ll_init_map_full(struct rtnl_handle *rth)
 {
 	if (rtnl_wilddump_request(rth, AF_UNSPEC, RTM_GETLINK) < 0) {
 		perror("Cannot send dump request");
 		exit(1);
 	}
 
-	if (rtnl_dump_filter(rth, ll_remember_index, &idxmap, NULL, NULL) < 0) {
+	if (rtnl_dump_filter(rth, ll_remember_index, NULL, NULL, NULL) < 0) {
 		fprintf(stderr, "Dump terminated\n");
 		exit(1);
 	}
@@ -0,0 +1,459 @@
+/*
+ * resolve.c	Cached, parallel reverse lookups of host addresses.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Names, and failures to find one, are kept in an LRU cache of at most
+ * RESOLVE_CACHE_MAX entries. resolve_host() looks up what is missing on
+ * the spot and copies the name out, entries may be evicted as soon as
+ * the lock is dropped. Callers that know in advance what they are going
+ * to print pass the addresses to resolve_host_prefetch() first; those
+ * lookups run on a pool of threads, and resolve_host() waits for the
+ * one it needs.
+ *
+ * The environment variables RESOLVE_HOSTS and RESOLVE_SERVICES name
+ * files in /etc/hosts and /etc/services format to be used instead of
+ * the system resolver, so output can be checked offline.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "resolve.h"
+
+#define RESOLVE_CACHE_MAX	65536
+#define RESOLVE_THREADS		16
+
+struct resolve_ent
+{
+	struct resolve_ent *hnext;
+	struct resolve_ent *prev, *next;	/* LRU, most recent first */
+	struct resolve_ent *qnext;		/* prefetch queue */
+	unsigned	hash;
+	int		af;
+	int		len;
+	unsigned char	addr[16];
+	char		*name;
+	int		done;
+};
+
+static struct resolve_ent **rhash;
+static unsigned rhash_size, rcnt;
+static struct resolve_ent rlru = { .prev = &rlru, .next = &rlru };
+static struct resolve_ent *rqueue, **rqueue_tail = &rqueue;
+static int rpending, rthreads;
+static pthread_mutex_t rlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rdone = PTHREAD_COND_INITIALIZER;
+
+/* Stand-in for the system resolver, see RESOLVE_HOSTS */
+struct resolve_file
+{
+	struct resolve_file *next;
+	int		af;
+	int		port;
+	unsigned char	addr[16];
+	char		*name;
+	char		proto[8];
+};
+
+static struct resolve_file *rhosts, *rservices;
+static int rhosts_loaded, rservices_loaded;
+
+static void resolve_load(const char *env, struct resolve_file **list,
+			 int services)
+{
+	const char *path = getenv(env);
+	char buf[512];
+	FILE *fp;
+
+	if (!path || (fp = fopen(path, "r")) == NULL)
+		return;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *p = strchr(buf, '#');
+		char *tok[2], *slash;
+		struct resolve_file *f;
+
+		if (p)
+			*p = 0;
+		if ((tok[0] = strtok(buf, " \t\n")) == NULL ||
+		    (tok[1] = strtok(NULL, " \t\n")) == NULL)
+			continue;
+		if ((f = calloc(1, sizeof(*f))) == NULL)
+			break;
+
+		if (services) {
+			/* name port/proto */
+			if ((slash = strchr(tok[1], '/')) == NULL) {
+				free(f);
+				continue;
+			}
+			*slash = 0;
+			f->port = atoi(tok[1]);
+			strncpy(f->proto, slash + 1, sizeof(f->proto) - 1);
+			f->name = strdup(tok[0]);
+		} else {
+			/* address name */
+			if (inet_pton(AF_INET, tok[0], f->addr) > 0)
+				f->af = AF_INET;
+			else if (inet_pton(AF_INET6, tok[0], f->addr) > 0)
+				f->af = AF_INET6;
+			else {
+				free(f);
+				continue;
+			}
+			f->name = strdup(tok[1]);
+		}
+		f->next = *list;
+		*list = f;
+	}
+	fclose(fp);
+}
+
+static const char *resolve_file_host(int af, int len, const void *addr)
+{
+	struct resolve_file *f, *found = NULL;
+
+	/* The first line for an address wins, the list is reversed */
+	for (f = rhosts; f; f = f->next)
+		if (f->af == af && memcmp(f->addr, addr, len) == 0)
+			found = f;
+	return found ? found->name : NULL;
+}
+
+/* The name is copied to "buf", which is returned, NULL if none is found */
+const char *resolve_service_name(int port, const char *proto,
+				 char *buf, int len)
+{
+	struct resolve_file *f, *found = NULL;
+	struct servent se, *res;
+	char tmp[1024];
+	const char *name = NULL;
+
+	if (getenv("RESOLVE_SERVICES")) {
+		if (!rservices_loaded) {
+			resolve_load("RESOLVE_SERVICES", &rservices, 1);
+			rservices_loaded = 1;
+		}
+		for (f = rservices; f; f = f->next)
+			if (f->port == port && strcmp(f->proto, proto) == 0)
+				found = f;
+		if (found)
+			name = found->name;
+	} else if (getservbyport_r(htons(port), proto, &se, tmp, sizeof(tmp),
+				   &res) == 0 && res)
+		name = res->s_name;
+
+	if (!name || len <= 0)
+		return NULL;
+	strncpy(buf, name, len - 1);
+	buf[len - 1] = 0;
+	return buf;
+}
+
+/* Called without the lock, the name is stored by the caller */
+static char *resolve_lookup(int af, int len, const void *addr)
+{
+	struct sockaddr_storage ss;
+	char host[NI_MAXHOST];
+	socklen_t slen;
+
+	if (rhosts_loaded) {
+		const char *n = resolve_file_host(af, len, addr);
+
+		return n ? strdup(n) : NULL;
+	}
+
+	memset(&ss, 0, sizeof(ss));
+	if (af == AF_INET && len == 4) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, addr, 4);
+		slen = sizeof(*sin);
+	} else if (af == AF_INET6 && len == 16) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, addr, 16);
+		slen = sizeof(*sin6);
+	} else {
+		/* gethostbyaddr() is not reentrant */
+		static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+		struct hostent *h_ent;
+		char *name = NULL;
+
+		pthread_mutex_lock(&lock);
+		if ((h_ent = gethostbyaddr(addr, len, af)) != NULL)
+			name = strdup(h_ent->h_name);
+		pthread_mutex_unlock(&lock);
+		return name;
+	}
+
+	if (getnameinfo((struct sockaddr *)&ss, slen, host, sizeof(host),
+			NULL, 0, NI_NAMEREQD) != 0)
+		return NULL;
+	return strdup(host);
+}
+
+static unsigned resolve_hashfn(int af, int len, const unsigned char *addr)
+{
+	unsigned h = 2166136261U ^ af;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ addr[i]) * 16777619U;
+	return h;
+}
+
+static void lru_unlink(struct resolve_ent *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void lru_push(struct resolve_ent *e)
+{
+	e->next = rlru.next;
+	e->prev = &rlru;
+	rlru.next->prev = e;
+	rlru.next = e;
+}
+
+static struct resolve_ent *resolve_find(int af, int len, const void *addr,
+					unsigned h)
+{
+	struct resolve_ent *e;
+
+	if (!rhash)
+		return NULL;
+	for (e = rhash[h & (rhash_size - 1)]; e; e = e->hnext)
+		if (e->hash == h && e->af == af && e->len == len &&
+		    memcmp(e->addr, addr, len) == 0)
+			return e;
+	return NULL;
+}
+
+static void resolve_evict(void)
+{
+	struct resolve_ent *e = rlru.prev;
+
+	/* Lookups in flight stay, they are near the head anyway */
+	while (rcnt > RESOLVE_CACHE_MAX && e != &rlru) {
+		struct resolve_ent *prev = e->prev, **pp;
+
+		if (e->done) {
+			pp = &rhash[e->hash & (rhash_size - 1)];
+			while (*pp != e)
+				pp = &(*pp)->hnext;
+			*pp = e->hnext;
+			lru_unlink(e);
+			free(e->name);
+			free(e);
+			rcnt--;
+		}
+		e = prev;
+	}
+}
+
+static struct resolve_ent *resolve_insert(int af, int len, const void *addr,
+					  unsigned h)
+{
+	struct resolve_ent *e;
+
+	if (rcnt >= rhash_size && rhash_size < RESOLVE_CACHE_MAX) {
+		unsigned size = rhash_size ? 2*rhash_size : 256;
+		struct resolve_ent **nh = calloc(size, sizeof(*nh));
+		unsigned i;
+
+		if (nh) {
+			for (i = 0; i < rhash_size; i++) {
+				while ((e = rhash[i]) != NULL) {
+					rhash[i] = e->hnext;
+					e->hnext = nh[e->hash & (size - 1)];
+					nh[e->hash & (size - 1)] = e;
+				}
+			}
+			free(rhash);
+			rhash = nh;
+			rhash_size = size;
+		}
+	}
+	if (!rhash || (e = calloc(1, sizeof(*e))) == NULL)
+		return NULL;
+
+	e->hash = h;
+	e->af = af;
+	e->len = len;
+	memcpy(e->addr, addr, len);
+	e->hnext = rhash[h & (rhash_size - 1)];
+	rhash[h & (rhash_size - 1)] = e;
+	lru_push(e);
+	rcnt++;
+	resolve_evict();
+	return e;
+}
+
+static void *resolve_thread(void *arg)
+{
+	pthread_mutex_lock(&rlock);
+	for (;;) {
+		struct resolve_ent *e;
+		char *name;
+
+		while (!rqueue)
+			pthread_cond_wait(&rwork, &rlock);
+		e = rqueue;
+		if ((rqueue = e->qnext) == NULL)
+			rqueue_tail = &rqueue;
+		pthread_mutex_unlock(&rlock);
+
+		name = resolve_lookup(e->af, e->len, e->addr);
+
+		pthread_mutex_lock(&rlock);
+		e->name = name;
+		e->done = 1;
+		rpending--;
+		pthread_cond_broadcast(&rdone);
+	}
+	return NULL;
+}
+
+/* An IPv4 address in IPv6 clothes is looked up as what it is */
+static void resolve_unmap(int *af, int *len, const void **addr)
+{
+	const __u32 *a = *addr;
+
+	if (*af == AF_INET6 && *len == 16 &&
+	    a[0] == 0 && a[1] == 0 && a[2] == htonl(0xffff)) {
+		*af = AF_INET;
+		*addr = &a[3];
+		*len = 4;
+	}
+}
+
+static void resolve_setup(void)
+{
+	if (!rhosts_loaded && getenv("RESOLVE_HOSTS")) {
+		resolve_load("RESOLVE_HOSTS", &rhosts, 0);
+		rhosts_loaded = 1;
+	}
+}
+
+void resolve_host_prefetch(int af, int len, const void *addr)
+{
+	struct resolve_ent *e;
+	unsigned h;
+
+	if ((af != AF_INET && af != AF_INET6) || len > 16)
+		return;
+	resolve_unmap(&af, &len, &addr);
+	h = resolve_hashfn(af, len, addr);
+
+	pthread_mutex_lock(&rlock);
+	resolve_setup();
+	if (resolve_find(af, len, addr, h) ||
+	    (e = resolve_insert(af, len, addr, h)) == NULL)
+		goto out;
+
+	*rqueue_tail = e;
+	rqueue_tail = &e->qnext;
+	rpending++;
+	if (rthreads < RESOLVE_THREADS && rthreads < rpending) {
+		pthread_t t;
+
+		if (pthread_create(&t, NULL, resolve_thread, NULL) == 0) {
+			pthread_detach(t);
+			rthreads++;
+		}
+	}
+	if (!rthreads) {
+		char *name;
+
+		/* No threads to be had, do it the slow way */
+		rqueue = NULL;
+		rqueue_tail = &rqueue;
+		pthread_mutex_unlock(&rlock);
+		name = resolve_lookup(af, len, addr);
+		pthread_mutex_lock(&rlock);
+		e->name = name;
+		e->done = 1;
+		rpending--;
+		pthread_cond_broadcast(&rdone);
+	} else
+		pthread_cond_signal(&rwork);
+out:
+	pthread_mutex_unlock(&rlock);
+}
+
+static const char *resolve_copy(const char *name, char *buf, int blen)
+{
+	if (!name || blen <= 0)
+		return NULL;
+	strncpy(buf, name, blen - 1);
+	buf[blen - 1] = 0;
+	return buf;
+}
+
+/* The name is copied to "buf", which is returned, NULL if none is found */
+const char *resolve_host(int af, int len, const void *addr, char *buf,
+			 int blen)
+{
+	struct resolve_ent *e;
+	const char *ret;
+	char *name;
+	unsigned h;
+
+	if (len > 16)
+		return NULL;
+	resolve_unmap(&af, &len, &addr);
+	h = resolve_hashfn(af, len, addr);
+
+	pthread_mutex_lock(&rlock);
+	resolve_setup();
+	if ((e = resolve_find(af, len, addr, h)) != NULL) {
+		while (!e->done)
+			pthread_cond_wait(&rdone, &rlock);
+		lru_unlink(e);
+		lru_push(e);
+		ret = resolve_copy(e->name, buf, blen);
+		pthread_mutex_unlock(&rlock);
+		return ret;
+	}
+	pthread_mutex_unlock(&rlock);
+
+	/* Whatever was printed so far goes out before we stall */
+	fflush(stdout);
+	name = resolve_lookup(af, len, addr);
+
+	pthread_mutex_lock(&rlock);
+	if ((e = resolve_find(af, len, addr, h)) != NULL) {
+		/* Someone else got there first */
+		while (!e->done)
+			pthread_cond_wait(&rdone, &rlock);
+		free(name);
+		ret = resolve_copy(e->name, buf, blen);
+	} else if ((e = resolve_insert(af, len, addr, h)) != NULL) {
+		/* Even if we fail, "negative" entry is remembered. */
+		e->name = name;
+		e->done = 1;
+		ret = resolve_copy(name, buf, blen);
+	} else {
+		ret = resolve_copy(name, buf, blen);
+		free(name);
+	}
+	pthread_mutex_unlock(&rlock);
+	return ret;
+}
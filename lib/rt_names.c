@@ -447,3 +447,17 @@ int rtnl_dsfield_a2n(__u32 *id, char *arg)
 	return 0;
 }
 
+/* Read all the tables up front, for long lived processes */
+void rtnl_names_init(void)
+{
+	if (!rtnl_rtprot_init)
+		rtnl_rtprot_initialize();
+	if (!rtnl_rtscope_init)
+		rtnl_rtscope_initialize();
+	if (!rtnl_rtrealm_init)
+		rtnl_rtrealm_initialize();
+	if (!rtnl_rttable_init)
+		rtnl_rttable_initialize();
+	if (!rtnl_rtdsfield_init)
+		rtnl_rtdsfield_initialize();
+}
@@ -28,6 +28,7 @@
 
 
 #include "utils.h"
+#include "resolve.h"
 
 int get_integer(int *val, const char *arg, int base)
 {
@@ -532,60 +533,6 @@ const char *rt_addr_n2a(int af, int len, const void *addr, char *buf, int buflen
 	}
 }
 
-#ifdef RESOLVE_HOSTNAMES
-struct namerec
-{
-	struct namerec *next;
-	const char *name;
-	inet_prefix addr;
-};
-
-#define NHASH 257
-static struct namerec *nht[NHASH];
-
-static const char *resolve_address(const void *addr, int len, int af)
-{
-	struct namerec *n;
-	struct hostent *h_ent;
-	unsigned hash;
-	static int notfirst;
-
-
-	if (af == AF_INET6 && ((__u32*)addr)[0] == 0 &&
-	    ((__u32*)addr)[1] == 0 && ((__u32*)addr)[2] == htonl(0xffff)) {
-		af = AF_INET;
-		addr += 12;
-		len = 4;
-	}
-
-	hash = *(__u32 *)(addr + len - 4) % NHASH;
-
-	for (n = nht[hash]; n; n = n->next) {
-		if (n->addr.family == af &&
-		    n->addr.bytelen == len &&
-		    memcmp(n->addr.data, addr, len) == 0)
-			return n->name;
-	}
-	if ((n = malloc(sizeof(*n))) == NULL)
-		return NULL;
-	n->addr.family = af;
-	n->addr.bytelen = len;
-	n->name = NULL;
-	memcpy(n->addr.data, addr, len);
-	n->next = nht[hash];
-	nht[hash] = n;
-	if (++notfirst == 1)
-		sethostent(1);
-	fflush(stdout);
-
-	if ((h_ent = gethostbyaddr(addr, len, af)) != NULL)
-		n->name = strdup(h_ent->h_name);
-
-	/* Even if we fail, "negative" entry is remembered. */
-	return n->name;
-}
-#endif
-
 
 const char *format_host(int af, int len, const void *addr,
 			char *buf, int buflen)
@@ -616,7 +563,7 @@ const char *format_host(int af, int len, const void *addr,
 			}
 		}
 		if (len > 0 &&
-		    (n = resolve_address(addr, len, af)) != NULL)
+		    (n = resolve_host(af, len, addr, buf, buflen)) != NULL)
 			return n;
 	}
 #endif
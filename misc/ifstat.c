@@ -33,6 +33,8 @@
 
 #include <SNAPSHOT.h>
 
+#include "shmstat.h"
+
 int dump_zeros = 0;
 int reset_history = 0;
 int ignore_history = 0;
@@ -423,60 +425,276 @@ void sigchild(int signo)
 {
 }
 
-void update_db(int interval)
+/*
+ * The daemon keeps its database as a structure of arrays: one array per
+ * counter with a slot per interface, so the rate update runs down
+ * contiguous memory. Slots are found by ifindex through a hash and are
+ * reused from one sample to the next.
+ */
+struct ifstat_tab
 {
-	struct ifstat_ent *n, *h;
+	int			cnt;
+	int			size;
+	unsigned		gen;
+	int			*ifindex;
+	char			**name;
+	unsigned		*seen;
+	unsigned long		*cur[MAXS];	/* as read this sample */
+	unsigned long		*ival[MAXS];
+	unsigned long long	*val[MAXS];
+	double			*rate[MAXS];
+	int			*hash;		/* slot + 1, 0 is free */
+	int			hsize;
+};
 
-	n = kern_db;
-	kern_db = NULL;
+struct ifstat_tab tab;
 
-	load_info();
+static void *tab_realloc(void *ptr, int size)
+{
+	if ((ptr = realloc(ptr, size)) == NULL)
+		abort();
+	return ptr;
+}
 
-	h = kern_db;
-	kern_db = n;
+static int *tab_bucket(int ifindex)
+{
+	unsigned h = ifindex * 2654435761U;
+	int *b;
 
-	for (n = kern_db; n; n = n->next) {
-		struct ifstat_ent *h1;
-		for (h1 = h; h1; h1 = h1->next) {
-			if (h1->ifindex == n->ifindex) {
-				int i;
-				for (i = 0; i < MAXS; i++) {
-					if ((long)(h1->ival[i] - n->ival[i]) < 0) {
-						memset(n->ival, 0, sizeof(n->ival));
-						break;
-					}
-				}
-				for (i = 0; i < MAXS; i++) {
-					double sample;
-					unsigned long incr = h1->ival[i] - n->ival[i];
-					n->val[i] += incr;
-					n->ival[i] = h1->ival[i];
-					sample = (double)(incr*1000)/interval;
-					if (interval >= scan_interval) {
-						n->rate[i] += W*(sample-n->rate[i]);
-					} else if (interval >= 1000) {
-						if (interval >= time_constant) {
-							n->rate[i] = sample;
-						} else {
-							double w = W*(double)interval/scan_interval;
-							n->rate[i] += w*(sample-n->rate[i]);
-						}
-					}
-				}
+	for (;; h++) {
+		b = &tab.hash[h & (tab.hsize - 1)];
+		if (*b == 0 || tab.ifindex[*b - 1] == ifindex)
+			return b;
+	}
+}
 
-				while (h != h1) {
-					struct ifstat_ent *tmp = h;
-					h = h->next;
-					free(tmp->name);
-					free(tmp);
-				};
-				h = h1->next;
-				free(h1->name);
-				free(h1);
-				break;
+static void tab_rehash(int hsize)
+{
+	int i;
+
+	free(tab.hash);
+	tab.hsize = hsize;
+	tab.hash = calloc(hsize, sizeof(int));
+	if (!tab.hash)
+		abort();
+	for (i = 0; i < tab.cnt; i++)
+		*tab_bucket(tab.ifindex[i]) = i + 1;
+}
+
+static void tab_grow(void)
+{
+	int i, size = tab.size ? 2*tab.size : 256;
+
+	tab.ifindex = tab_realloc(tab.ifindex, size*sizeof(int));
+	tab.name = tab_realloc(tab.name, size*sizeof(char *));
+	tab.seen = tab_realloc(tab.seen, size*sizeof(unsigned));
+	for (i = 0; i < MAXS; i++) {
+		tab.cur[i] = tab_realloc(tab.cur[i], size*sizeof(unsigned long));
+		tab.ival[i] = tab_realloc(tab.ival[i], size*sizeof(unsigned long));
+		tab.val[i] = tab_realloc(tab.val[i], size*sizeof(unsigned long long));
+		tab.rate[i] = tab_realloc(tab.rate[i], size*sizeof(double));
+	}
+	tab.size = size;
+	/* Keep the hash at most half full */
+	tab_rehash(2*size);
+}
+
+static int get_tab_nlmsg(const struct sockaddr_nl *who,
+			 struct nlmsghdr *m, void *arg)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(m);
+	struct rtattr * tb[IFLA_MAX+1];
+	int len = m->nlmsg_len;
+	unsigned long ival[MAXS];
+	const char *name;
+	int i, k, *b;
+
+	if (m->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	len -= NLMSG_LENGTH(sizeof(*ifi));
+	if (len < 0)
+		return -1;
+
+	if (!(ifi->ifi_flags&IFF_UP))
+		return 0;
+
+	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), len);
+	if (tb[IFLA_IFNAME] == NULL || tb[IFLA_STATS] == NULL)
+		return 0;
+	name = RTA_DATA(tb[IFLA_IFNAME]);
+	memcpy(ival, RTA_DATA(tb[IFLA_STATS]), sizeof(ival));
+
+	if (tab.cnt == tab.size)
+		tab_grow();
+
+	b = tab_bucket(ifi->ifi_index);
+	if ((k = *b - 1) < 0) {
+		/* New interface, it starts out with no rate */
+		k = tab.cnt++;
+		*b = k + 1;
+		tab.ifindex[k] = ifi->ifi_index;
+		tab.name[k] = strdup(name);
+		for (i = 0; i < MAXS; i++) {
+			tab.ival[i][k] = ival[i];
+			tab.val[i][k] = ival[i];
+			tab.rate[i][k] = 0;
+		}
+	} else if (strcmp(tab.name[k], name)) {
+		free(tab.name[k]);
+		tab.name[k] = strdup(name);
+	}
+	tab.seen[k] = tab.gen;
+	for (i = 0; i < MAXS; i++)
+		tab.cur[i][k] = ival[i];
+	return 0;
+}
+
+void load_tab(void)
+{
+	struct rtnl_handle rth;
+
+	if (rtnl_open(&rth, 0) < 0)
+		exit(1);
+
+	if (rtnl_wilddump_request(&rth, AF_INET, RTM_GETLINK) < 0) {
+		perror("Cannot send dump request");
+		exit(1);
+	}
+
+	tab.gen++;
+	if (rtnl_dump_filter(&rth, get_tab_nlmsg, NULL, NULL, NULL) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		exit(1);
+	}
+
+	rtnl_close(&rth);
+}
+
+/* Interfaces that went away or down are forgotten */
+static void tab_sweep(void)
+{
+	int i, k, removed = 0;
+
+	for (k = 0; k < tab.cnt; ) {
+		int last = tab.cnt - 1;
+
+		if (tab.seen[k] == tab.gen) {
+			k++;
+			continue;
+		}
+		free(tab.name[k]);
+		tab.ifindex[k] = tab.ifindex[last];
+		tab.name[k] = tab.name[last];
+		tab.seen[k] = tab.seen[last];
+		for (i = 0; i < MAXS; i++) {
+			tab.cur[i][k] = tab.cur[i][last];
+			tab.ival[i][k] = tab.ival[i][last];
+			tab.val[i][k] = tab.val[i][last];
+			tab.rate[i][k] = tab.rate[i][last];
+		}
+		tab.cnt--;
+		removed++;
+	}
+	if (removed)
+		tab_rehash(tab.hsize);
+}
+
+void update_tab(int interval)
+{
+	double w = 0;
+	int i, k, set = 0;
+
+	if (interval >= scan_interval)
+		w = W;
+	else if (interval >= 1000) {
+		if (interval >= time_constant)
+			set = 1;
+		else
+			w = W*(double)interval/scan_interval;
+	}
+
+	/* A counter went back, the device was reset */
+	for (i = 0; i < MAXS; i++) {
+		for (k = 0; k < tab.cnt; k++) {
+			if ((long)(tab.cur[i][k] - tab.ival[i][k]) < 0) {
+				int j;
+
+				for (j = 0; j < MAXS; j++)
+					tab.ival[j][k] = 0;
 			}
 		}
 	}
+
+	for (i = 0; i < MAXS; i++) {
+		unsigned long *cur = tab.cur[i];
+		unsigned long *ival = tab.ival[i];
+		unsigned long long *val = tab.val[i];
+		double *rate = tab.rate[i];
+
+		for (k = 0; k < tab.cnt; k++) {
+			unsigned long incr = cur[k] - ival[k];
+			double sample = (double)(incr*1000)/interval;
+
+			val[k] += incr;
+			ival[k] = cur[k];
+			if (set)
+				rate[k] = sample;
+			else
+				rate[k] += w*(sample-rate[k]);
+		}
+	}
+}
+
+void update_db(int interval)
+{
+	load_tab();
+	tab_sweep();
+	update_tab(interval);
+}
+
+static int tab_cmp(const void *a, const void *b)
+{
+	return tab.ifindex[*(int *)a] - tab.ifindex[*(int *)b];
+}
+
+void dump_raw_tab(FILE *fp)
+{
+	int *order = malloc(tab.cnt*sizeof(int) + 1);
+	int i, k, j;
+
+	if (!order)
+		abort();
+	for (k = 0; k < tab.cnt; k++)
+		order[k] = k;
+	qsort(order, tab.cnt, sizeof(int), tab_cmp);
+
+	fprintf(fp, "#%s\n", info_source);
+	for (j = 0; j < tab.cnt; j++) {
+		k = order[j];
+		fprintf(fp, "%d %s ", tab.ifindex[k], tab.name[k]);
+		for (i=0; i<MAXS; i++)
+			fprintf(fp, "%llu %u ", tab.val[i][k],
+				(unsigned)tab.rate[i][k]);
+		fprintf(fp, "\n");
+	}
+	free(order);
+}
+
+static struct shmstat shm;
+
+static void publish_db(void)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if ((fp = open_memstream(&buf, &len)) == NULL)
+		return;
+	dump_raw_tab(fp);
+	fclose(fp);
+	shmstat_publish(&shm, buf, len);
+	free(buf);
 }
 
 #define T_DIFF(a,b) (((a).tv_sec-(b).tv_sec)*1000 + ((a).tv_usec-(b).tv_usec)/1000)
@@ -492,7 +710,7 @@ void server_loop(int fd)
 	sprintf(info_source, "%d.%lu sampling_interval=%d time_const=%d",
 		getpid(), (unsigned long)random(), scan_interval/1000, time_constant/1000);
 
-	load_info();
+	load_tab();
 
 	for (;;) {
 		int status;
@@ -503,6 +721,7 @@ void server_loop(int fd)
 		tdiff = T_DIFF(now, snaptime);
 		if (tdiff >= scan_interval) {
 			update_db(tdiff);
+			publish_db();
 			snaptime = now;
 			tdiff = 0;
 		}
@@ -523,7 +742,7 @@ void server_loop(int fd)
 					if (fp) {
 						if (tdiff > 0)
 							update_db(tdiff);
-						dump_raw_db(fp, 0);
+						dump_raw_tab(fp);
 					}
 					exit(0);
 				}
@@ -547,6 +766,26 @@ int verify_forging(int fd)
 	return -1;
 }
 
+/* Our own daemon's, or root's: its shared snapshot, else ask it */
+static FILE *daemon_open(struct sockaddr_un *sun)
+{
+	FILE *fp;
+	int fd;
+
+	if ((fp = shmstat_fopen("IFSTAT_SHM", "ifstat")) != NULL)
+		return fp;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return NULL;
+	if ((connect(fd, (struct sockaddr*)sun, 2+1+strlen(sun->sun_path+1)) == 0
+	     || (strcpy(sun->sun_path+1, "ifstat0"),
+		 connect(fd, (struct sockaddr*)sun, 2+1+strlen(sun->sun_path+1)) == 0))
+	    && verify_forging(fd) == 0)
+		return fdopen(fd, "r");
+	close(fd);
+	return NULL;
+}
+
 static void usage(void) __attribute__((noreturn));
 
 static void usage(void)
@@ -590,6 +829,7 @@ int main(int argc, char *argv[])
 	char hist_name[128];
 	struct sockaddr_un sun;
 	FILE *hist_fp = NULL;
+	FILE *sfp;
 	int ch;
 	int fd;
 
@@ -663,6 +903,8 @@ int main(int argc, char *argv[])
 			perror("ifstat: listen");
 			exit(-1);
 		}
+		if (shmstat_create(&shm, "IFSTAT_SHM", "ifstat", scan_interval))
+			perror("ifstat: shared snapshot disabled");
 		if (daemon(0, 0)) {
 			perror("ifstat: daemon");
 			exit(-1);
@@ -728,12 +970,7 @@ int main(int argc, char *argv[])
 		kern_db = NULL;
 	}
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
-	    (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
-	     || (strcpy(sun.sun_path+1, "ifstat0"),
-		 connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
-	    && verify_forging(fd) == 0) {
-		FILE *sfp = fdopen(fd, "r");
+	if ((sfp = daemon_open(&sun)) != NULL) {
 		load_raw_table(sfp);
 		if (hist_db && source_mismatch) {
 			fprintf(stderr, "ifstat: history is stale, ignoring it.\n");
@@ -741,8 +978,6 @@ int main(int argc, char *argv[])
 		}
 		fclose(sfp);
 	} else {
-		if (fd >= 0)
-			close(fd);
 		if (hist_db && info_source[0] && strcmp(info_source, "kernel")) {
 			fprintf(stderr, "ifstat: history is stale, ignoring it.\n");
 			hist_db = NULL;
@@ -29,6 +29,8 @@
 
 #include <SNAPSHOT.h>
 
+#include "shmstat.h"
+
 int dump_zeros = 0;
 int reset_history = 0;
 int ignore_history = 0;
@@ -364,6 +366,22 @@ void update_db(int interval)
 	}
 }
 
+static struct shmstat shm;
+
+static void publish_db(void)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	if ((fp = open_memstream(&buf, &len)) == NULL)
+		return;
+	dump_kern_db(fp, 0);
+	fclose(fp);
+	shmstat_publish(&shm, buf, len);
+	free(buf);
+}
+
 #define T_DIFF(a,b) (((a).tv_sec-(b).tv_sec)*1000 + ((a).tv_usec-(b).tv_usec)/1000)
 
 
@@ -389,6 +407,7 @@ void server_loop(int fd)
 		tdiff = T_DIFF(now, snaptime);
 		if (tdiff >= scan_interval) {
 			update_db(tdiff);
+			publish_db();
 			snaptime = now;
 			tdiff = 0;
 		}
@@ -432,6 +451,26 @@ int verify_forging(int fd)
 	return -1;
 }
 
+/* Our own daemon's, or root's: its shared snapshot, else ask it */
+static FILE *daemon_open(struct sockaddr_un *sun)
+{
+	FILE *fp;
+	int fd;
+
+	if ((fp = shmstat_fopen("NSTAT_SHM", "nstat")) != NULL)
+		return fp;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return NULL;
+	if ((connect(fd, (struct sockaddr*)sun, 2+1+strlen(sun->sun_path+1)) == 0
+	     || (strcpy(sun->sun_path+1, "nstat0"),
+		 connect(fd, (struct sockaddr*)sun, 2+1+strlen(sun->sun_path+1)) == 0))
+	    && verify_forging(fd) == 0)
+		return fdopen(fd, "r");
+	close(fd);
+	return NULL;
+}
+
 static void usage(void) __attribute__((noreturn));
 
 static void usage(void)
@@ -448,6 +487,7 @@ int main(int argc, char *argv[])
 	char *hist_name;
 	struct sockaddr_un sun;
 	FILE *hist_fp = NULL;
+	FILE *sfp;
 	int ch;
 	int fd;
 
@@ -513,6 +553,8 @@ int main(int argc, char *argv[])
 			perror("nstat: listen");
 			exit(-1);
 		}
+		if (shmstat_create(&shm, "NSTAT_SHM", "nstat", scan_interval))
+			perror("nstat: shared snapshot disabled");
 		if (daemon(0, 0)) {
 			perror("nstat: daemon");
 			exit(-1);
@@ -578,12 +620,7 @@ int main(int argc, char *argv[])
 		kern_db = NULL;
 	}
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
-	    (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
-	     || (strcpy(sun.sun_path+1, "nstat0"),
-		 connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
-	    && verify_forging(fd) == 0) {
-		FILE *sfp = fdopen(fd, "r");
+	if ((sfp = daemon_open(&sun)) != NULL) {
 		load_good_table(sfp);
 		if (hist_db && source_mismatch) {
 			fprintf(stderr, "nstat: history is stale, ignoring it.\n");
@@ -591,8 +628,6 @@ int main(int argc, char *argv[])
 		}
 		fclose(sfp);
 	} else {
-		if (fd >= 0)
-			close(fd);
 		if (hist_db && info_source[0] && strcmp(info_source, "kernel")) {
 			fprintf(stderr, "nstat: history is stale, ignoring it.\n");
 			hist_db = NULL;
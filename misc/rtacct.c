@@ -30,6 +30,7 @@
 #include <math.h>
 
 #include "rt_names.h"
+#include "shmstat.h"
 
 #include <SNAPSHOT.h>
 
@@ -348,6 +349,8 @@ void send_db(int fd)
 
 
 
+static struct shmstat shm;
+
 #define T_DIFF(a,b) (((a).tv_sec-(b).tv_sec)*1000 + ((a).tv_usec-(b).tv_usec)/1000)
 
 
@@ -383,6 +386,7 @@ void server_loop(int fd)
 		tdiff = T_DIFF(now, snaptime);
 		if (tdiff >= scan_interval) {
 			update_db(tdiff);
+			shmstat_publish(&shm, kern_db, sizeof(*kern_db));
 			snaptime = now;
 			tdiff = 0;
 		}
@@ -423,6 +427,34 @@ int verify_forging(int fd)
 	return -1;
 }
 
+/* Our own daemon's, or root's: its shared snapshot, else ask it */
+static int load_daemon_db(struct sockaddr_un *sun)
+{
+	void *snap;
+	int len, fd;
+
+	if ((snap = shmstat_snapshot("RTACCT_SHM", "rtacct", &len)) != NULL) {
+		if (len == sizeof(*kern_db))
+			memcpy(kern_db, snap, len);
+		free(snap);
+		if (len == sizeof(*kern_db))
+			return 0;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	if ((connect(fd, (struct sockaddr*)sun, 2+1+strlen(sun->sun_path+1)) == 0
+	     || (strcpy(sun->sun_path+1, "rtacct0"),
+		 connect(fd, (struct sockaddr*)sun, 2+1+strlen(sun->sun_path+1)) == 0))
+	    && verify_forging(fd) == 0) {
+		nread(fd, (char*)kern_db, sizeof(*kern_db));
+		close(fd);
+		return 0;
+	}
+	close(fd);
+	return -1;
+}
+
 static void usage(void) __attribute__((noreturn));
 
 static void usage(void)
@@ -524,6 +556,8 @@ int main(int argc, char *argv[])
 			perror("rtacct: listen");
 			exit(-1);
 		}
+		if (shmstat_create(&shm, "RTACCT_SHM", "rtacct", scan_interval))
+			perror("rtacct: shared snapshot disabled");
 		if (daemon(0, 0)) {
 			perror("rtacct: daemon");
 			exit(-1);
@@ -593,22 +627,13 @@ int main(int argc, char *argv[])
 		close(fd);
 	}
 
-	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
-	    (connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0
-	     || (strcpy(sun.sun_path+1, "rtacct0"),
-		 connect(fd, (struct sockaddr*)&sun, 2+1+strlen(sun.sun_path+1)) == 0))
-	    && verify_forging(fd) == 0) {
-		nread(fd, (char*)kern_db, sizeof(*kern_db));
+	if (load_daemon_db(&sun) == 0) {
 		if (hist_db && hist_db->signature[0] &&
 		    strcmp(kern_db->signature, hist_db->signature)) {
 			fprintf(stderr, "rtacct: history is stale, ignoring it.\n");
 			hist_db = NULL;
 		}
-		close(fd);
 	} else {
-		if (fd >= 0)
-			close(fd);
-
 		if (hist_db && hist_db->signature[0] &&
 		    strcmp(hist_db->signature, "kernel")) {
 			fprintf(stderr, "rtacct: history is stale, ignoring it.\n");
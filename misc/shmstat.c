@@ -0,0 +1,261 @@
+/*
+ * shmstat.c	Shared snapshot of a statistics daemon.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmstat.h"
+
+/*
+ * A torn read is retried, a daemon that died mid write is not waited for.
+ * The first retries only yield, later ones sleep twice as long each time
+ * up to SHMSTAT_BACKOFF_MAX us, about 0.1s in all.
+ */
+#define SHMSTAT_TRIES		100
+#define SHMSTAT_YIELDS		4
+#define SHMSTAT_BACKOFF_MAX	1000
+
+static __u64 shmstat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void shmstat_path(char *buf, int len, const char *env,
+			 const char *name, uid_t uid)
+{
+	if (getenv(env))
+		snprintf(buf, len, "%s", getenv(env));
+	else
+		snprintf(buf, len, "%s/%s.u%d", SHMSTAT_DIR, name, uid);
+}
+
+static int shmstat_map(struct shmstat *s, size_t size, int prot)
+{
+	void *map;
+
+	map = mmap(NULL, size, prot, MAP_SHARED, s->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	if (s->hdr)
+		munmap(s->hdr, s->maplen);
+	s->hdr = map;
+	s->maplen = size;
+	return 0;
+}
+
+static int shmstat_grow(struct shmstat *s, size_t size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	size = (size + page - 1) & ~(page - 1);
+	if (ftruncate(s->fd, size) < 0 ||
+	    shmstat_map(s, size, PROT_READ|PROT_WRITE) < 0)
+		return -1;
+	s->hdr->size = size;
+	return 0;
+}
+
+int shmstat_create(struct shmstat *s, const char *env, const char *name,
+		   int interval)
+{
+	char path[128];
+
+	memset(s, 0, sizeof(*s));
+	shmstat_path(path, sizeof(path), env, name, getuid());
+	unlink(path);
+	s->fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW, 0644);
+	if (s->fd < 0)
+		return -1;
+	fcntl(s->fd, F_SETFD, FD_CLOEXEC);
+	if (shmstat_grow(s, sizeof(struct shmstat_hdr)) < 0) {
+		close(s->fd);
+		unlink(path);
+		s->fd = -1;
+		return -1;
+	}
+	s->hdr->version = SHMSTAT_VERSION;
+	s->hdr->interval = interval;
+	__sync_synchronize();
+	s->hdr->magic = SHMSTAT_MAGIC;
+	return 0;
+}
+
+void shmstat_publish(struct shmstat *s, const void *data, int len)
+{
+	struct shmstat_hdr *h;
+
+	if (s->hdr == NULL)
+		return;
+	if (sizeof(*h) + len > s->maplen &&
+	    shmstat_grow(s, 2 * (sizeof(*h) + len)) < 0)
+		return;
+
+	h = s->hdr;
+	h->seq++;
+	__sync_synchronize();
+	memcpy(h + 1, data, len);
+	h->len = len;
+	h->stamp = shmstat_now();
+	__sync_synchronize();
+	h->seq++;
+}
+
+static int shmstat_open(struct shmstat *s, const char *path, uid_t uid)
+{
+	struct stat stb;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = open(path, O_RDONLY|O_NOFOLLOW);
+	if (s->fd < 0)
+		return -1;
+	/* The same trust as the socket gives: our own daemon or root's */
+	if (fstat(s->fd, &stb) < 0 || !S_ISREG(stb.st_mode) ||
+	    stb.st_uid != uid || stb.st_size < sizeof(struct shmstat_hdr) ||
+	    shmstat_map(s, stb.st_size, PROT_READ) < 0 ||
+	    s->hdr->magic != SHMSTAT_MAGIC ||
+	    s->hdr->version != SHMSTAT_VERSION) {
+		if (s->hdr)
+			munmap(s->hdr, s->maplen);
+		close(s->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void shmstat_close(struct shmstat *s)
+{
+	munmap(s->hdr, s->maplen);
+	close(s->fd);
+}
+
+static void shmstat_backoff(int tries)
+{
+	struct timespec ts = { 0 };
+	long us = SHMSTAT_BACKOFF_MAX;
+
+	if (tries < SHMSTAT_YIELDS) {
+		sched_yield();
+		return;
+	}
+	tries -= SHMSTAT_YIELDS;
+	if (tries < 10 && (1L << tries) < us)
+		us = 1L << tries;
+	ts.tv_nsec = us * 1000;
+	nanosleep(&ts, NULL);
+}
+
+static void *shmstat_copy(struct shmstat *s, int *lenp)
+{
+	struct shmstat_hdr *h;
+	char *buf = NULL;
+	int tries;
+
+	for (tries = 0; tries < SHMSTAT_TRIES; tries++) {
+		__u32 seq, len, size;
+		__u64 stamp;
+
+		if (tries)
+			shmstat_backoff(tries - 1);
+
+		h = s->hdr;
+		seq = h->seq;
+		__sync_synchronize();
+		if (seq & 1)
+			continue;
+		len = h->len;
+		size = h->size;
+		stamp = h->stamp;
+
+		if (size > s->maplen) {
+			/* The daemon grew the file since we mapped it */
+			if (shmstat_map(s, size, PROT_READ) < 0)
+				break;
+			continue;
+		}
+		if (len > s->maplen - sizeof(*h))
+			continue;
+
+		buf = realloc(buf, len + 1);
+		if (buf == NULL)
+			return NULL;
+		memcpy(buf, h + 1, len);
+		__sync_synchronize();
+		if (h->seq != seq)
+			continue;
+
+		/* Nothing published yet, or the daemon is gone */
+		if (stamp == 0 ||
+		    shmstat_now() - stamp > 3 * (__u64)h->interval + 1000)
+			break;
+		buf[len] = 0;
+		*lenp = len;
+		return buf;
+	}
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Copy of the latest snapshot from our own daemon or, failing that,
+ * from root's. The caller frees it.
+ */
+void *shmstat_snapshot(const char *env, const char *name, int *len)
+{
+	struct shmstat s;
+	char path[128];
+	uid_t uid = getuid();
+	void *snap;
+
+	for (;;) {
+		shmstat_path(path, sizeof(path), env, name, uid);
+		if (shmstat_open(&s, path, uid) == 0) {
+			snap = shmstat_copy(&s, len);
+			shmstat_close(&s);
+			if (snap)
+				return snap;
+		}
+		if (uid == 0 || getenv(env))
+			return NULL;
+		uid = 0;
+	}
+}
+
+/*
+ * The snapshot as a stream for the text parsers of ifstat and nstat.
+ * The stream owns its copy, so fclose() releases everything.
+ */
+FILE *shmstat_fopen(const char *env, const char *name)
+{
+	FILE *fp;
+	void *snap;
+	int len;
+
+	if ((snap = shmstat_snapshot(env, name, &len)) == NULL)
+		return NULL;
+	if (len > 0 && (fp = fmemopen(NULL, len, "w+")) != NULL) {
+		if (fwrite(snap, 1, len, fp) == len) {
+			rewind(fp);
+			free(snap);
+			return fp;
+		}
+		fclose(fp);
+	}
+	free(snap);
+	return NULL;
+}
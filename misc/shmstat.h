@@ -0,0 +1,45 @@
+#ifndef _SHMSTAT_H
+#define _SHMSTAT_H
+
+#include <stdio.h>
+#include <linux/types.h>
+
+/*
+ * Snapshot a statistics daemon (ifstat, nstat, rtacct -d) publishes in
+ * a shared file after every sample, so clients can map it instead of
+ * asking over the socket. The payload is exactly what the daemon would
+ * write to a socket client. It is guarded by a sequence count that is
+ * odd while the daemon writes: readers copy the payload and retry if
+ * the count moved under them. A snapshot holds the counters as of the
+ * daemon's last sample, so it may be up to one interval old.
+ */
+
+#define SHMSTAT_MAGIC	0x53544154	/* "STAT" */
+#define SHMSTAT_VERSION	1
+#define SHMSTAT_DIR	"/dev/shm"
+
+struct shmstat_hdr
+{
+	__u32		magic;
+	__u32		version;
+	volatile __u32	seq;
+	__u32		len;		/* of the payload following us */
+	__u32		size;		/* of the file, it only grows */
+	__u32		interval;	/* ms between samples */
+	__u64		stamp;		/* CLOCK_MONOTONIC ms of the last one */
+};
+
+struct shmstat
+{
+	int			fd;
+	struct shmstat_hdr	*hdr;
+	size_t			maplen;
+};
+
+extern int shmstat_create(struct shmstat *s, const char *env,
+			  const char *name, int interval);
+extern void shmstat_publish(struct shmstat *s, const void *data, int len);
+extern void *shmstat_snapshot(const char *env, const char *name, int *len);
+extern FILE *shmstat_fopen(const char *env, const char *name);
+
+#endif /* _SHMSTAT_H */
@@ -19,6 +19,7 @@
 #include <sys/uio.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -26,15 +27,23 @@
 #include <dirent.h>
 #include <fnmatch.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include "utils.h"
 #include "rt_names.h"
 #include "ll_map.h"
+#include "resolve.h"
 #include "libnetlink.h"
 #include "SNAPSHOT.h"
 
 #include <netinet/tcp.h>
 #include <linux/inet_diag.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+#include <linux/packet_diag.h>
 
 int resolve_hosts = 0;
 int resolve_services = 1;
@@ -55,6 +64,7 @@ int screen_width;
 static const char *TCP_PROTO = "tcp";
 static const char *UDP_PROTO = "udp";
 static const char *RAW_PROTO = "raw";
+static const char *DCCP_PROTO = "dccp";
 static const char *dg_proto = NULL;
 
 enum
@@ -101,6 +111,7 @@ struct filter
 	int states;
 	int families;
 	struct ssfilter *f;
+	struct ssf_prog *prog;
 };
 
 struct filter default_filter = {
@@ -198,24 +209,44 @@ static FILE *ephemeral_ports_open(void)
 struct user_ent {
 	struct user_ent	*next;
 	unsigned int	ino;
-	int		pid;
+	int		pid;		/* 0 while the owner is wanted */
 	int		fd;
 	char		process[0];
 };
 
-#define USER_ENT_HASH_SIZE	256
-struct user_ent *user_ent_hash[USER_ENT_HASH_SIZE];
-
-static int user_ent_hashfn(unsigned int ino)
+/*
+ * Owners are looked up for -p and for -G process by walking /proc/PID/fd.
+ * The inodes of a batch of sockets about to be shown are wanted first
+ * (user_want()), the walk then goes only as far as it takes to find all
+ * of them, and picks up where it stopped for the next batch. Every
+ * socket fd seen on the way is kept, so no process is read twice. A
+ * socket shared by several processes lists those found by the time it
+ * is printed.
+ */
+static struct user_ent **user_ent_hash;
+static unsigned int user_ent_hash_size, user_ent_cnt;
+static pthread_mutex_t user_ent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define USER_ENT_THREADS	8
+
+static struct user_walk {
+	char		root[256];
+	int		*pids;
+	int		npids;
+	int		next;		/* first pid not walked yet */
+	int		started;
+	unsigned int	wanted;
+} uw;
+
+static unsigned int user_ent_hashfn(unsigned int ino)
 {
-	int val = (ino >> 24) ^ (ino >> 16) ^ (ino >> 8) ^ ino;
-
-	return val & (USER_ENT_HASH_SIZE - 1);
+	return (ino * 2654435761U) & (user_ent_hash_size - 1);
 }
 
-static void user_ent_add(unsigned int ino, const char *process, int pid, int fd)
+static struct user_ent *user_ent_alloc(unsigned int ino, const char *process,
+				       int pid, int fd)
 {
-	struct user_ent *p, **pp;
+	struct user_ent *p;
 	int str_len;
 
 	str_len = strlen(process) + 1;
@@ -227,94 +258,247 @@ static void user_ent_add(unsigned int ino, const char *process, int pid, int fd)
 	p->pid = pid;
 	p->fd = fd;
 	strcpy(p->process, process);
+	return p;
+}
 
-	pp = &user_ent_hash[user_ent_hashfn(ino)];
-	p->next = *pp;
+/* Called with user_ent_lock held, or before any walk thread runs */
+static void user_ent_add(struct user_ent *p)
+{
+	struct user_ent **pp;
+
+	if (user_ent_cnt >= user_ent_hash_size) {
+		struct user_ent **old = user_ent_hash;
+		unsigned int i, size = user_ent_hash_size;
+
+		user_ent_hash_size = size ? 2 * size : 1024;
+		user_ent_hash = calloc(user_ent_hash_size,
+				       sizeof(struct user_ent *));
+		if (!user_ent_hash)
+			abort();
+		for (i = 0; i < size; i++) {
+			struct user_ent *q, *next;
+
+			for (q = old[i]; q; q = next) {
+				next = q->next;
+				pp = &user_ent_hash[user_ent_hashfn(q->ino)];
+				while (*pp)
+					pp = &(*pp)->next;
+				q->next = NULL;
+				*pp = q;
+			}
+		}
+		free(old);
+	}
+	/* Owners are listed in the order they were found */
+	pp = &user_ent_hash[user_ent_hashfn(p->ino)];
+	while (*pp)
+		pp = &(*pp)->next;
+	p->next = NULL;
 	*pp = p;
+	user_ent_cnt++;
 }
 
-static void user_ent_hash_build(void)
+static struct user_ent *user_ent_find(unsigned int ino)
 {
-	const char *root = getenv("PROC_ROOT") ? : "/proc/";
-	struct dirent *d;
-	char name[1024];
-	int nameoff;
-	DIR *dir;
+	struct user_ent *p;
 
-	strcpy(name, root);
-	if (strlen(name) == 0 || name[strlen(name)-1] != '/')
-		strcat(name, "/");
+	if (!user_ent_hash)
+		return NULL;
+	for (p = user_ent_hash[user_ent_hashfn(ino)]; p; p = p->next)
+		if (p->ino == ino)
+			return p;
+	return NULL;
+}
 
-	nameoff = strlen(name);
+/* The socket is going to be shown, have the walk look for its owner */
+static void user_want(unsigned int ino)
+{
+	if (!ino || (uw.started && uw.next >= uw.npids))
+		return;
+	pthread_mutex_lock(&user_ent_lock);
+	if (!user_ent_find(ino)) {
+		user_ent_add(user_ent_alloc(ino, "", 0, 0));
+		uw.wanted++;
+	}
+	pthread_mutex_unlock(&user_ent_lock);
+}
 
-	dir = opendir(name);
-	if (!dir)
+static void user_found(unsigned int ino, const char *process, int pid, int fd)
+{
+	struct user_ent **pp, *p = user_ent_alloc(ino, process, pid, fd);
+
+	pthread_mutex_lock(&user_ent_lock);
+	for (pp = &user_ent_hash[user_ent_hashfn(ino)]; *pp;
+	     pp = &(*pp)->next) {
+		struct user_ent *q = *pp;
+
+		if (q->ino == ino && !q->pid) {
+			*pp = q->next;
+			free(q);
+			user_ent_cnt--;
+			uw.wanted--;
+			break;
+		}
+	}
+	user_ent_add(p);
+	pthread_mutex_unlock(&user_ent_lock);
+}
+
+static void user_walk_pid(int pid)
+{
+	struct dirent *d1;
+	char name[1024];
+	char process[16];
+	DIR *dir1;
+	char crap;
+
+	snprintf(name, sizeof(name), "%s%d/fd/", uw.root, pid);
+	if ((dir1 = opendir(name)) == NULL)
 		return;
 
-	while ((d = readdir(dir)) != NULL) {
-		struct dirent *d1;
-		char process[16];
-		int pid, pos;
-		DIR *dir1;
-		char crap;
+	process[0] = '\0';
 
-		if (sscanf(d->d_name, "%d%c", &pid, &crap) != 1)
+	while ((d1 = readdir(dir1)) != NULL) {
+		const char *pattern = "socket:[";
+		unsigned int ino;
+		char lnk[64];
+		int fd, n;
+
+		if (sscanf(d1->d_name, "%d%c", &fd, &crap) != 1)
 			continue;
 
-		sprintf(name + nameoff, "%d/fd/", pid);
-		pos = strlen(name);
-		if ((dir1 = opendir(name)) == NULL)
+		n = readlinkat(dirfd(dir1), d1->d_name, lnk, sizeof(lnk)-1);
+		if (n <= 0)
+			continue;
+		lnk[n] = 0;
+		if (strncmp(lnk, pattern, strlen(pattern)))
 			continue;
 
-		process[0] = '\0';
+		if (sscanf(lnk, "socket:[%u]", &ino) != 1)
+			continue;
 
-		while ((d1 = readdir(dir1)) != NULL) {
-			const char *pattern = "socket:[";
-			unsigned int ino;
-			char lnk[64];
-			int fd, n;
+		if (process[0] == '\0') {
+			char tmp[1024];
+			FILE *fp;
 
-			if (sscanf(d1->d_name, "%d%c", &fd, &crap) != 1)
-				continue;
+			snprintf(tmp, sizeof(tmp), "%s/%d/stat", uw.root, pid);
+			if ((fp = fopen(tmp, "r")) != NULL) {
+				fscanf(fp, "%*d (%[^)])", process);
+				fclose(fp);
+			}
+		}
 
-			sprintf(name+pos, "%d", fd);
-			n = readlink(name, lnk, sizeof(lnk)-1);
-			if (strncmp(lnk, pattern, strlen(pattern)))
-				continue;
+		user_found(ino, process, pid, fd);
+	}
+	closedir(dir1);
+}
 
-			sscanf(lnk, "socket:[%u]", &ino);
+static void *user_walk_thread(void *arg)
+{
+	for (;;) {
+		int i, more;
 
-			if (process[0] == '\0') {
-				char tmp[1024];
-				FILE *fp;
+		pthread_mutex_lock(&user_ent_lock);
+		more = uw.wanted != 0;
+		pthread_mutex_unlock(&user_ent_lock);
+		if (!more || (i = __sync_fetch_and_add(&uw.next, 1)) >= uw.npids)
+			break;
+		user_walk_pid(uw.pids[i]);
+	}
+	return NULL;
+}
 
-				snprintf(tmp, sizeof(tmp), "%s/%d/stat", root, pid);
-				if ((fp = fopen(tmp, "r")) != NULL) {
-					fscanf(fp, "%*d (%[^)])", process);
-					fclose(fp);
-				}
-			}
+static void user_walk_start(void)
+{
+	const char *root = getenv("PROC_ROOT") ? : "/proc/";
+	struct dirent *d;
+	int size = 0;
+	DIR *dir;
+
+	uw.started = 1;
+	snprintf(uw.root, sizeof(uw.root), "%s", root);
+	if (strlen(uw.root) == 0 || uw.root[strlen(uw.root)-1] != '/')
+		strcat(uw.root, "/");
+
+	dir = opendir(uw.root);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir)) != NULL) {
+		int pid;
+		char crap;
 
-			user_ent_add(ino, process, pid, fd);
+		if (sscanf(d->d_name, "%d%c", &pid, &crap) != 1)
+			continue;
+		if (uw.npids == size) {
+			size = size ? 2 * size : 1024;
+			uw.pids = realloc(uw.pids, size * sizeof(int));
+			if (!uw.pids)
+				abort();
 		}
-		closedir(dir1);
+		uw.pids[uw.npids++] = pid;
 	}
 	closedir(dir);
 }
 
+/* Walk on until every wanted socket has its owner or /proc runs out */
+static void user_walk(void)
+{
+	pthread_t threads[USER_ENT_THREADS];
+	int nthreads, i;
+
+	if (!uw.started)
+		user_walk_start();
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > USER_ENT_THREADS)
+		nthreads = USER_ENT_THREADS;
+	if (uw.next < uw.npids && nthreads > (uw.npids - uw.next) / 64)
+		nthreads = (uw.npids - uw.next) / 64;
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, user_walk_thread, NULL))
+			break;
+	nthreads = i;
+	/* The main thread takes its share too */
+	user_walk_thread(NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Nobody owns what is still wanted */
+	if (uw.next >= uw.npids) {
+		uw.wanted = 0;
+		free(uw.pids);
+		uw.pids = NULL;
+		uw.npids = 0;
+	}
+}
+
+static struct user_ent *user_ent_first(unsigned ino)
+{
+	if (!ino)
+		return NULL;
+
+	/* A socket nobody wanted before has the walk go on until it is found */
+	user_want(ino);
+	if (uw.wanted)
+		user_walk();
+	if (!user_ent_hash)
+		return NULL;
+
+	return user_ent_hash[user_ent_hashfn(ino)];
+}
+
 int find_users(unsigned ino, char *buf, int buflen)
 {
 	struct user_ent *p;
 	int cnt = 0;
 	char *ptr;
 
-	if (!ino)
-		return 0;
-
-	p = user_ent_hash[user_ent_hashfn(ino)];
+	p = user_ent_first(ino);
 	ptr = buf;
 	while (p) {
-		if (p->ino != ino)
+		if (p->ino != ino || !p->pid)
 			goto next;
 
 		if (ptr - buf >= buflen - 1)
@@ -336,6 +520,17 @@ int find_users(unsigned ino, char *buf, int buflen)
 	return cnt;
 }
 
+/* Name of the first process owning the socket, for -G process */
+static const char *find_process(unsigned ino)
+{
+	struct user_ent *p;
+
+	for (p = user_ent_first(ino); p; p = p->next)
+		if (p->ino == ino && p->pid)
+			return p->process;
+	return NULL;
+}
+
 /* Get stats from slab */
 
 struct slabstat
@@ -547,7 +742,7 @@ static int is_ephemeral(int port)
 }
 
 
-const char *__resolve_service(int port)
+const char *__resolve_service(int port, char *buf, int len)
 {
 	struct scache *c;
 
@@ -558,14 +753,15 @@ const char *__resolve_service(int port)
 
 	if (!is_ephemeral(port)) {
 		static int notfirst;
-		struct servent *se;
+		const char *name;
+
 		if (!notfirst) {
 			setservent(1);
 			notfirst = 1;
 		}
-		se = getservbyport(htons(port), dg_proto);
-		if (se)
-			return se->s_name;
+		if ((name = resolve_service_name(port, dg_proto,
+						 buf, len)) != NULL)
+			return name;
 	}
 
 	return NULL;
@@ -589,6 +785,7 @@ const char *resolve_service(int port)
 		} else {
 			struct scache *c;
 			const char *res;
+			char name[128];
 			int hash = (port^(((unsigned long)dg_proto)>>2))&255;
 
 			for (c = &cache[hash]; c; c = c->next) {
@@ -600,7 +797,8 @@ const char *resolve_service(int port)
 				}
 			}
 
-			if ((res = __resolve_service(port)) != NULL) {
+			if ((res = __resolve_service(port, name,
+						     sizeof(name))) != NULL) {
 				if ((c = malloc(sizeof(*c))) == NULL)
 					goto do_numeric;
 			} else {
@@ -690,291 +888,739 @@ int unix_match(const inet_prefix *a, const inet_prefix *p)
 	return !fnmatch(pattern, addr, 0);
 }
 
-int run_ssfilter(struct ssfilter *f, struct tcpstat *s)
+/*
+ * Filter compiler.
+ *
+ * The parsed tree is rebuilt with n-ary AND/OR nodes and simplified:
+ * constants are folded, repeated subexpressions dropped, port tests
+ * joined into sorted range sets and cheap tests moved to the front.
+ * It is then flattened into a program with inet_diag bytecode
+ * semantics: a test falls through when true and jumps to "no" when
+ * false, running off the end accepts and jumping one past it rejects.
+ * The kernel gets the program as bytecode, sockets read from /proc are
+ * run through the same program here.
+ */
+
+#define SSF_TRUE	16
+#define SSF_FALSE	17
+#define SSF_S_SET	18
+#define SSF_D_SET	19
+
+struct ssf_range
 {
-	switch (f->type) {
-		case SSF_S_AUTO:
-	{
-                static int low, high=65535;
+	int	lo, hi;
+};
 
-		if (s->local.family == AF_UNIX) {
-			char *p;
-			memcpy(&p, s->local.data, sizeof(p));
-			return p == NULL || (p[0] == '@' && strlen(p) == 6 &&
-					     strspn(p+1, "0123456789abcdef") == 5);
-		}
-		if (s->local.family == AF_PACKET)
-			return s->lport == 0 && s->local.data == 0;
-		if (s->local.family == AF_NETLINK)
-			return s->lport < 0;
+struct ssf_node
+{
+	int		type;
+	int		cost;
+	int		seq;
+	int		cnt;
+	struct ssf_node	**kid;
+	struct ssf_range *range;
+	struct aafilter	*a;
+};
 
-                if (!low) {
-			FILE *fp = ephemeral_ports_open();
-			if (fp) {
-				fscanf(fp, "%d%d", &low, &high);
-				fclose(fp);
-			}
-		}
-		return s->lport >= low && s->lport <= high;
+struct ssf_insn
+{
+	int		code;
+	int		no;
+	int		port;
+	struct aafilter	*a;
+};
+
+struct ssf_prog
+{
+	int		len;
+	struct ssf_insn	*insn;
+};
+
+static struct ssf_node *ssf_new(int type)
+{
+	struct ssf_node *n = calloc(1, sizeof(*n));
+
+	if (!n)
+		abort();
+	n->type = type;
+	return n;
+}
+
+static void ssf_add(struct ssf_node *n, struct ssf_node *k)
+{
+	if ((n->cnt & (n->cnt - 1)) == 0) {
+		n->kid = realloc(n->kid, (n->cnt ? 2*n->cnt : 1)*sizeof(k));
+		if (!n->kid)
+			abort();
 	}
-		case SSF_DCOND:
-	{
-		struct aafilter *a = (void*)f->pred;
-		if (a->addr.family == AF_UNIX)
-			return unix_match(&s->remote, &a->addr);
-		if (a->port != -1 && a->port != s->rport)
-			return 0;
-		if (a->addr.bitlen) {
-			do {
-				if (!inet2_addr_match(&s->remote, &a->addr, a->addr.bitlen))
-					return 1;
-			} while ((a = a->next) != NULL);
+	n->kid[n->cnt++] = k;
+}
+
+static int ssf_is_set(const struct ssf_node *n)
+{
+	return n->type == SSF_S_SET || n->type == SSF_D_SET;
+}
+
+static int ssf_equal(const struct ssf_node *x, const struct ssf_node *y)
+{
+	int i;
+
+	if (x->type != y->type || x->cnt != y->cnt)
+		return 0;
+
+	switch (x->type) {
+	case SSF_SCOND:
+	case SSF_DCOND:
+		if (x->a->addr.family != y->a->addr.family ||
+		    x->a->addr.bitlen != y->a->addr.bitlen ||
+		    x->a->port != y->a->port)
 			return 0;
+		if (x->a->addr.family == AF_UNIX) {
+			char *px, *py;
+
+			memcpy(&px, x->a->addr.data, sizeof(px));
+			memcpy(&py, y->a->addr.data, sizeof(py));
+			return strcmp(px, py) == 0;
 		}
+		return memcmp(x->a->addr.data, y->a->addr.data,
+			      sizeof(x->a->addr.data)) == 0;
+	case SSF_S_GE:
+	case SSF_S_LE:
+	case SSF_D_GE:
+	case SSF_D_LE:
+		return x->a->port == y->a->port;
+	case SSF_S_SET:
+	case SSF_D_SET:
+		return memcmp(x->range, y->range, x->cnt*sizeof(*x->range)) == 0;
+	case SSF_AND:
+	case SSF_OR:
+	case SSF_NOT:
+		for (i = 0; i < x->cnt; i++)
+			if (!ssf_equal(x->kid[i], y->kid[i]))
+				return 0;
 		return 1;
 	}
-		case SSF_SCOND:
-	{
-		struct aafilter *a = (void*)f->pred;
-		if (a->addr.family == AF_UNIX)
-			return unix_match(&s->local, &a->addr);
-		if (a->port != -1 && a->port != s->lport)
-			return 0;
-		if (a->addr.bitlen) {
-			do {
-				if (!inet2_addr_match(&s->local, &a->addr, a->addr.bitlen))
-					return 1;
-			} while ((a = a->next) != NULL);
+	return 1;
+}
+
+/* Port tests that can be folded into a range set, side is 'S' or 'D' */
+static int ssf_port_range(const struct ssf_node *n, int *side,
+			  struct ssf_range *r)
+{
+	switch (n->type) {
+	case SSF_SCOND:
+	case SSF_DCOND:
+		if (n->a->addr.family != AF_UNSPEC ||
+		    n->a->addr.bitlen || n->a->port == -1)
 			return 0;
-		}
+		r->lo = r->hi = n->a->port;
+		*side = n->type == SSF_SCOND ? 'S' : 'D';
+		return 1;
+	case SSF_S_GE:
+	case SSF_D_GE:
+		r->lo = n->a->port;
+		r->hi = 65535;
+		*side = n->type == SSF_S_GE ? 'S' : 'D';
+		return 1;
+	case SSF_S_LE:
+	case SSF_D_LE:
+		r->lo = 0;
+		r->hi = n->a->port;
+		*side = n->type == SSF_S_LE ? 'S' : 'D';
 		return 1;
 	}
-		case SSF_D_GE:
-	{
-		struct aafilter *a = (void*)f->pred;
-		return s->rport >= a->port;
-	}
-		case SSF_D_LE:
-	{
-		struct aafilter *a = (void*)f->pred;
-		return s->rport <= a->port;
-	}
-		case SSF_S_GE:
-	{
-		struct aafilter *a = (void*)f->pred;
-		return s->lport >= a->port;
-	}
-		case SSF_S_LE:
-	{
-		struct aafilter *a = (void*)f->pred;
-		return s->lport <= a->port;
-	}
+	return 0;
+}
 
-		/* Yup. It is recursion. Sorry. */
-		case SSF_AND:
-		return run_ssfilter(f->pred, s) && run_ssfilter(f->post, s);
-		case SSF_OR:
-		return run_ssfilter(f->pred, s) || run_ssfilter(f->post, s);
-		case SSF_NOT:
-		return !run_ssfilter(f->pred, s);
-		default:
-		abort();
-	}
+static int ssf_range_cmp(const void *a, const void *b)
+{
+	const struct ssf_range *x = a, *y = b;
+
+	return x->lo - y->lo;
 }
 
-/* Relocate external jumps by reloc. */
-static void ssfilter_patch(char *a, int len, int reloc)
+static void ssf_set_add(struct ssf_node *set, const struct ssf_range *r,
+			int cnt)
 {
-	while (len > 0) {
-		struct inet_diag_bc_op *op = (struct inet_diag_bc_op*)a;
-		if (op->no == len+4)
-			op->no += reloc;
-		len -= op->yes;
-		a += op->yes;
-	}
-	if (len < 0)
+	set->range = realloc(set->range, (set->cnt + cnt)*sizeof(*r));
+	if (!set->range)
 		abort();
+	memcpy(set->range + set->cnt, r, cnt*sizeof(*r));
+	set->cnt += cnt;
 }
 
-static int ssfilter_bytecompile(struct ssfilter *f, char **bytecode)
+static void ssf_set_normalize(struct ssf_node *set)
 {
-	switch (f->type) {
-		case SSF_S_AUTO:
-	{
-		if (!(*bytecode=malloc(4))) abort();
-		((struct inet_diag_bc_op*)*bytecode)[0] = (struct inet_diag_bc_op){ INET_DIAG_BC_AUTO, 4, 8 };
-		return 8;
-	}
-		case SSF_DCOND:
-		case SSF_SCOND:
-	{
-		struct aafilter *a = (void*)f->pred;
-		struct aafilter *b;
-		char *ptr;
-		int  code = (f->type == SSF_DCOND ? INET_DIAG_BC_D_COND : INET_DIAG_BC_S_COND);
-		int len = 0;
-
-		for (b=a; b; b=b->next) {
-			len += 4 + sizeof(struct inet_diag_hostcond);
-			if (a->addr.family == AF_INET6)
-				len += 16;
-			else
-				len += 4;
-			if (b->next)
-				len += 4;
-		}
-		if (!(ptr = malloc(len))) abort();
-		*bytecode = ptr;
-		for (b=a; b; b=b->next) {
-			struct inet_diag_bc_op *op = (struct inet_diag_bc_op *)ptr;
-			int alen = (a->addr.family == AF_INET6 ? 16 : 4);
-			int oplen = alen + 4 + sizeof(struct inet_diag_hostcond);
-			struct inet_diag_hostcond *cond = (struct inet_diag_hostcond*)(ptr+4);
-
-			*op = (struct inet_diag_bc_op){ code, oplen, oplen+4 };
-			cond->family = a->addr.family;
-			cond->port = a->port;
-			cond->prefix_len = a->addr.bitlen;
-			memcpy(cond->addr, a->addr.data, alen);
-			ptr += oplen;
-			if (b->next) {
-				op = (struct inet_diag_bc_op *)ptr;
-				*op = (struct inet_diag_bc_op){ INET_DIAG_BC_JMP, 4, len - (ptr-*bytecode)};
-				ptr += 4;
-			}
+	int i, j = 0;
+
+	qsort(set->range, set->cnt, sizeof(*set->range), ssf_range_cmp);
+	for (i = 1; i < set->cnt; i++) {
+		if (set->range[i].lo <= set->range[j].hi + 1) {
+			if (set->range[i].hi > set->range[j].hi)
+				set->range[j].hi = set->range[i].hi;
+		} else {
+			set->range[++j] = set->range[i];
 		}
-		return ptr - *bytecode;
-	}
-		case SSF_D_GE:
-	{
-		struct aafilter *x = (void*)f->pred;
-		if (!(*bytecode=malloc(8))) abort();
-		((struct inet_diag_bc_op*)*bytecode)[0] = (struct inet_diag_bc_op){ INET_DIAG_BC_D_GE, 8, 12 };
-		((struct inet_diag_bc_op*)*bytecode)[1] = (struct inet_diag_bc_op){ 0, 0, x->port };
-		return 8;
-	}
-		case SSF_D_LE:
-	{
-		struct aafilter *x = (void*)f->pred;
-		if (!(*bytecode=malloc(8))) abort();
-		((struct inet_diag_bc_op*)*bytecode)[0] = (struct inet_diag_bc_op){ INET_DIAG_BC_D_LE, 8, 12 };
-		((struct inet_diag_bc_op*)*bytecode)[1] = (struct inet_diag_bc_op){ 0, 0, x->port };
-		return 8;
-	}
-		case SSF_S_GE:
-	{
-		struct aafilter *x = (void*)f->pred;
-		if (!(*bytecode=malloc(8))) abort();
-		((struct inet_diag_bc_op*)*bytecode)[0] = (struct inet_diag_bc_op){ INET_DIAG_BC_S_GE, 8, 12 };
-		((struct inet_diag_bc_op*)*bytecode)[1] = (struct inet_diag_bc_op){ 0, 0, x->port };
-		return 8;
-	}
-		case SSF_S_LE:
-	{
-		struct aafilter *x = (void*)f->pred;
-		if (!(*bytecode=malloc(8))) abort();
-		((struct inet_diag_bc_op*)*bytecode)[0] = (struct inet_diag_bc_op){ INET_DIAG_BC_S_LE, 8, 12 };
-		((struct inet_diag_bc_op*)*bytecode)[1] = (struct inet_diag_bc_op){ 0, 0, x->port };
-		return 8;
 	}
+	set->cnt = j + 1;
+}
 
-		case SSF_AND:
-	{
-		char *a1, *a2, *a, l1, l2;
-		l1 = ssfilter_bytecompile(f->pred, &a1);
-		l2 = ssfilter_bytecompile(f->post, &a2);
-		if (!(a = malloc(l1+l2))) abort();
-		memcpy(a, a1, l1);
-		memcpy(a+l1, a2, l2);
-		free(a1); free(a2);
-		ssfilter_patch(a, l1, l2);
-		*bytecode = a;
-		return l1+l2;
-	}
-		case SSF_OR:
-	{
-		char *a1, *a2, *a, l1, l2;
-		l1 = ssfilter_bytecompile(f->pred, &a1);
-		l2 = ssfilter_bytecompile(f->post, &a2);
-		if (!(a = malloc(l1+l2+4))) abort();
-		memcpy(a, a1, l1);
-		memcpy(a+l1+4, a2, l2);
-		free(a1); free(a2);
-		*(struct inet_diag_bc_op*)(a+l1) = (struct inet_diag_bc_op){ INET_DIAG_BC_JMP, 4, l2+4 };
-		*bytecode = a;
-		return l1+l2+4;
-	}
-		case SSF_NOT:
-	{
-		char *a1, *a, l1;
-		l1 = ssfilter_bytecompile(f->pred, &a1);
-		if (!(a = malloc(l1+4))) abort();
-		memcpy(a, a1, l1);
-		free(a1);
-		*(struct inet_diag_bc_op*)(a+l1) = (struct inet_diag_bc_op){ INET_DIAG_BC_JMP, 4, 8 };
-		*bytecode = a;
-		return l1+4;
-	}
-		default:
-		abort();
+static struct ssf_node *ssf_not(struct ssf_node *k)
+{
+	struct ssf_node *n;
+
+	if (k->type == SSF_TRUE || k->type == SSF_FALSE) {
+		k->type = k->type == SSF_TRUE ? SSF_FALSE : SSF_TRUE;
+		return k;
 	}
+	if (k->type == SSF_NOT)
+		return k->kid[0];
+	n = ssf_new(SSF_NOT);
+	ssf_add(n, k);
+	return n;
 }
 
-static int remember_he(struct aafilter *a, struct hostent *he)
+/* Collect the port tests of an OR, or the negated ones of an AND */
+static void ssf_merge_ports(struct ssf_node *n)
 {
-	char **ptr = he->h_addr_list;
-	int cnt = 0;
-	int len;
+	struct ssf_node *set[2] = { NULL, NULL };
+	int i, j, found[2] = { 0, 0 };
 
-	if (he->h_addrtype == AF_INET)
-		len = 4;
-	else if (he->h_addrtype == AF_INET6)
-		len = 16;
-	else
-		return 0;
+	for (i = 0; i < n->cnt; i++) {
+		struct ssf_node *k = n->kid[i];
+		struct ssf_range r;
+		int side;
 
-	while (*ptr) {
-		struct aafilter *b = a;
-		if (a->addr.bitlen) {
-			if ((b = malloc(sizeof(*b))) == NULL)
-				return cnt;
-			*b = *a;
-			b->next = a->next;
-			a->next = b;
+		if (n->type == SSF_AND) {
+			if (k->type != SSF_NOT)
+				continue;
+			k = k->kid[0];
 		}
-		memcpy(b->addr.data, *ptr, len);
-		b->addr.bytelen = len;
-		b->addr.bitlen = len*8;
-		b->addr.family = he->h_addrtype;
-		ptr++;
-		cnt++;
+		if (ssf_is_set(k) || ssf_port_range(k, &side, &r))
+			found[ssf_is_set(k) ? k->type == SSF_D_SET :
+			      side == 'D']++;
 	}
-	return cnt;
-}
 
-static int get_dns_host(struct aafilter *a, const char *addr, int fam)
-{
-	static int notfirst;
-	int cnt = 0;
-	struct hostent *he;
+	for (i = j = 0; i < n->cnt; i++) {
+		struct ssf_node *k = n->kid[i];
+		struct ssf_range r;
+		int side, d;
 
-	a->addr.bitlen = 0;
-	if (!notfirst) {
-		sethostent(1);
-		notfirst = 1;
-	}
-	he = gethostbyname2(addr, fam == AF_UNSPEC ? AF_INET : fam);
-	if (he)
-		cnt = remember_he(a, he);
-	if (fam == AF_UNSPEC) {
-		he = gethostbyname2(addr, AF_INET6);
-		if (he)
-			cnt += remember_he(a, he);
+		if (n->type == SSF_AND && k->type == SSF_NOT)
+			k = k->kid[0];
+		else if (n->type == SSF_AND)
+			goto keep;
+
+		if (ssf_is_set(k))
+			d = k->type == SSF_D_SET;
+		else if (ssf_port_range(k, &side, &r))
+			d = side == 'D';
+		else
+			goto keep;
+		if (found[d] < 2)
+			goto keep;
+
+		if (!set[d]) {
+			set[d] = ssf_new(d ? SSF_D_SET : SSF_S_SET);
+			n->kid[j++] = n->type == SSF_AND ? ssf_not(set[d]) : set[d];
+		}
+		if (ssf_is_set(k))
+			ssf_set_add(set[d], k->range, k->cnt);
+		else
+			ssf_set_add(set[d], &r, 1);
+		continue;
+keep:
+		n->kid[j++] = n->kid[i];
 	}
-	return !cnt;
-}
+	n->cnt = j;
 
-static int xll_initted = 0;
+	for (i = 0; i < 2; i++)
+		if (set[i])
+			ssf_set_normalize(set[i]);
+}
+
+static int ssf_cost(struct ssf_node *n)
+{
+	int i, c;
+
+	switch (n->type) {
+	case SSF_SCOND:
+	case SSF_DCOND:
+		if (n->a->addr.family == AF_UNIX)
+			return 8;
+		return n->a->addr.bitlen ? 3 : 1;
+	case SSF_S_SET:
+	case SSF_D_SET:
+		for (c = 2, i = n->cnt; i > 1; i >>= 1)
+			c++;
+		return c;
+	case SSF_S_AUTO:
+		return 2;
+	case SSF_AND:
+	case SSF_OR:
+	case SSF_NOT:
+		for (c = 1, i = 0; i < n->cnt; i++)
+			c += n->kid[i]->cost;
+		return c;
+	}
+	return 1;
+}
+
+static int ssf_cost_cmp(const void *a, const void *b)
+{
+	const struct ssf_node *x = *(struct ssf_node **)a;
+	const struct ssf_node *y = *(struct ssf_node **)b;
+
+	if (x->cost != y->cost)
+		return x->cost - y->cost;
+	/* Keep the parsed order otherwise */
+	return x->seq - y->seq;
+}
+
+static struct ssf_node *ssf_simplify(struct ssf_node *n)
+{
+	int neutral = n->type == SSF_AND ? SSF_TRUE : SSF_FALSE;
+	int absorb = n->type == SSF_AND ? SSF_FALSE : SSF_TRUE;
+	int i, j, k;
+
+	ssf_merge_ports(n);
+
+	for (i = j = 0; i < n->cnt; i++) {
+		struct ssf_node *c = n->kid[i];
+
+		if (ssf_is_set(c) && c->cnt == 1 &&
+		    c->range[0].lo <= 0 && c->range[0].hi >= 65535)
+			c->type = SSF_TRUE;
+		else if (c->type == SSF_NOT && ssf_is_set(c->kid[0]) &&
+			 c->kid[0]->cnt == 1 && c->kid[0]->range[0].lo <= 0 &&
+			 c->kid[0]->range[0].hi >= 65535)
+			c->type = SSF_FALSE;
+
+		if (c->type == neutral)
+			continue;
+		if (c->type == absorb)
+			return c;
+		for (k = 0; k < j; k++)
+			if (ssf_equal(n->kid[k], c))
+				break;
+		if (k == j)
+			n->kid[j++] = c;
+	}
+	n->cnt = j;
+
+	if (n->cnt == 0)
+		return ssf_new(neutral);
+	if (n->cnt == 1)
+		return n->kid[0];
+
+	for (i = 0; i < n->cnt; i++) {
+		n->kid[i]->cost = ssf_cost(n->kid[i]);
+		n->kid[i]->seq = i;
+	}
+	qsort(n->kid, n->cnt, sizeof(*n->kid), ssf_cost_cmp);
+	return n;
+}
+
+static struct ssf_node *ssf_leaf(int type, struct aafilter *a)
+{
+	struct ssf_node *n;
+
+	/* "dst *" and friends */
+	if ((type == SSF_SCOND || type == SSF_DCOND) &&
+	    a->addr.family == AF_UNSPEC && !a->addr.bitlen && a->port == -1)
+		return ssf_new(SSF_TRUE);
+	n = ssf_new(type);
+	n->a = a;
+	return n;
+}
+
+static struct ssf_node *ssf_build(struct ssfilter *f)
+{
+	struct ssf_node *n, *k;
+	struct ssfilter *sub[2];
+	struct aafilter *a;
+	int i, j;
+
+	switch (f->type) {
+	case SSF_AND:
+	case SSF_OR:
+		n = ssf_new(f->type);
+		sub[0] = f->pred;
+		sub[1] = f->post;
+		for (i = 0; i < 2; i++) {
+			k = ssf_build(sub[i]);
+			if (k->type != n->type) {
+				ssf_add(n, k);
+				continue;
+			}
+			for (j = 0; j < k->cnt; j++)
+				ssf_add(n, k->kid[j]);
+		}
+		return ssf_simplify(n);
+	case SSF_NOT:
+		return ssf_not(ssf_build(f->pred));
+	case SSF_SCOND:
+	case SSF_DCOND:
+		a = (void*)f->pred;
+		if (!a->next)
+			return ssf_leaf(f->type, a);
+		/* A resolved name is a choice of its addresses */
+		n = ssf_new(SSF_OR);
+		for (; a; a = a->next) {
+			struct aafilter *b = malloc(sizeof(*b));
+
+			if (!b)
+				abort();
+			*b = *a;
+			b->next = NULL;
+			ssf_add(n, ssf_leaf(f->type, b));
+		}
+		return ssf_simplify(n);
+	}
+	return ssf_leaf(f->type, (void*)f->pred);
+}
+
+struct ssf_gen
+{
+	struct ssf_prog	*prog;
+	int		size;
+	int		*label;
+	int		nlabels;
+};
+
+#define SSF_REJECT	0
+
+static int ssf_label(struct ssf_gen *g)
+{
+	if ((g->nlabels & (g->nlabels - 1)) == 0) {
+		g->label = realloc(g->label, 2*(g->nlabels + 1)*sizeof(int));
+		if (!g->label)
+			abort();
+	}
+	g->label[g->nlabels] = -1;
+	return g->nlabels++;
+}
+
+static void ssf_place(struct ssf_gen *g, int l)
+{
+	g->label[l] = g->prog->len;
+}
+
+static void ssf_emit(struct ssf_gen *g, int code, int no, int port,
+		     struct aafilter *a)
+{
+	struct ssf_prog *p = g->prog;
+
+	if (p->len == g->size) {
+		g->size = g->size ? 2*g->size : 16;
+		p->insn = realloc(p->insn, g->size*sizeof(*p->insn));
+		if (!p->insn)
+			abort();
+	}
+	p->insn[p->len++] = (struct ssf_insn){ code, no, port, a };
+}
+
+/* Binary search over sorted disjoint ranges */
+static void ssf_gen_set(struct ssf_gen *g, const struct ssf_node *n,
+			int l, int r, int no)
+{
+	int d = n->type == SSF_D_SET;
+	int mid, low, done;
+
+	if (l == r) {
+		if (n->range[l].lo > 0)
+			ssf_emit(g, d ? INET_DIAG_BC_D_GE : INET_DIAG_BC_S_GE,
+				 no, n->range[l].lo, NULL);
+		if (n->range[l].hi < 65535)
+			ssf_emit(g, d ? INET_DIAG_BC_D_LE : INET_DIAG_BC_S_LE,
+				 no, n->range[l].hi, NULL);
+		return;
+	}
+
+	mid = (l + r + 1) / 2;
+	low = ssf_label(g);
+	done = ssf_label(g);
+	ssf_emit(g, d ? INET_DIAG_BC_D_GE : INET_DIAG_BC_S_GE,
+		 low, n->range[mid].lo, NULL);
+	ssf_gen_set(g, n, mid, r, no);
+	ssf_emit(g, INET_DIAG_BC_JMP, done, 0, NULL);
+	ssf_place(g, low);
+	ssf_gen_set(g, n, l, mid - 1, no);
+	ssf_place(g, done);
+}
+
+/* Falls through when n holds, jumps to label "no" otherwise */
+static void ssf_gen(struct ssf_gen *g, const struct ssf_node *n, int no)
+{
+	int i, next, done;
+
+	switch (n->type) {
+	case SSF_TRUE:
+		return;
+	case SSF_FALSE:
+		ssf_emit(g, INET_DIAG_BC_JMP, no, 0, NULL);
+		return;
+	case SSF_AND:
+		for (i = 0; i < n->cnt; i++)
+			ssf_gen(g, n->kid[i], no);
+		return;
+	case SSF_OR:
+		done = ssf_label(g);
+		for (i = 0; i < n->cnt - 1; i++) {
+			next = ssf_label(g);
+			ssf_gen(g, n->kid[i], next);
+			ssf_emit(g, INET_DIAG_BC_JMP, done, 0, NULL);
+			ssf_place(g, next);
+		}
+		ssf_gen(g, n->kid[i], no);
+		ssf_place(g, done);
+		return;
+	case SSF_NOT:
+		next = ssf_label(g);
+		ssf_gen(g, n->kid[0], next);
+		ssf_emit(g, INET_DIAG_BC_JMP, no, 0, NULL);
+		ssf_place(g, next);
+		return;
+	case SSF_S_SET:
+	case SSF_D_SET:
+		ssf_gen_set(g, n, 0, n->cnt - 1, no);
+		return;
+	case SSF_S_AUTO:
+		ssf_emit(g, INET_DIAG_BC_AUTO, no, 0, NULL);
+		return;
+	case SSF_SCOND:
+		ssf_emit(g, INET_DIAG_BC_S_COND, no, 0, n->a);
+		return;
+	case SSF_DCOND:
+		ssf_emit(g, INET_DIAG_BC_D_COND, no, 0, n->a);
+		return;
+	case SSF_S_GE:
+		ssf_emit(g, INET_DIAG_BC_S_GE, no, n->a->port, NULL);
+		return;
+	case SSF_S_LE:
+		ssf_emit(g, INET_DIAG_BC_S_LE, no, n->a->port, NULL);
+		return;
+	case SSF_D_GE:
+		ssf_emit(g, INET_DIAG_BC_D_GE, no, n->a->port, NULL);
+		return;
+	case SSF_D_LE:
+		ssf_emit(g, INET_DIAG_BC_D_LE, no, n->a->port, NULL);
+		return;
+	}
+	abort();
+}
+
+static struct ssf_prog *ssfilter_compile(struct ssfilter *f)
+{
+	struct ssf_prog *p = calloc(1, sizeof(*p));
+	struct ssf_gen g = { .prog = p };
+	int i;
+
+	if (!p)
+		abort();
+
+	ssf_label(&g);
+	ssf_gen(&g, ssf_build(f), SSF_REJECT);
+	g.label[SSF_REJECT] = p->len + 1;
+	for (i = 0; i < p->len; i++)
+		p->insn[i].no = g.label[p->insn[i].no];
+	free(g.label);
+	return p;
+}
+
+static int ssf_test(const struct ssf_insn *i, const struct tcpstat *s)
+{
+	switch (i->code) {
+	case INET_DIAG_BC_JMP:
+		return 0;
+	case INET_DIAG_BC_AUTO:
+	{
+                static int low, high=65535;
+
+		if (s->local.family == AF_UNIX) {
+			char *p;
+			memcpy(&p, s->local.data, sizeof(p));
+			return p == NULL || (p[0] == '@' && strlen(p) == 6 &&
+					     strspn(p+1, "0123456789abcdef") == 5);
+		}
+		if (s->local.family == AF_PACKET)
+			return s->lport == 0 && s->local.data == 0;
+		if (s->local.family == AF_NETLINK)
+			return s->lport < 0;
+
+                if (!low) {
+			FILE *fp = ephemeral_ports_open();
+			if (fp) {
+				fscanf(fp, "%d%d", &low, &high);
+				fclose(fp);
+			}
+		}
+		return s->lport >= low && s->lport <= high;
+	}
+	case INET_DIAG_BC_D_COND:
+	case INET_DIAG_BC_S_COND:
+	{
+		struct aafilter *a = i->a;
+		const inet_prefix *addr;
+		int port;
+
+		if (i->code == INET_DIAG_BC_D_COND) {
+			addr = &s->remote;
+			port = s->rport;
+		} else {
+			addr = &s->local;
+			port = s->lport;
+		}
+		if (a->addr.family == AF_UNIX)
+			return unix_match(addr, &a->addr);
+		if (a->port != -1 && a->port != port)
+			return 0;
+		if (a->addr.bitlen)
+			return !inet2_addr_match(addr, &a->addr, a->addr.bitlen);
+		return 1;
+	}
+	case INET_DIAG_BC_D_GE:
+		return s->rport >= i->port;
+	case INET_DIAG_BC_D_LE:
+		return s->rport <= i->port;
+	case INET_DIAG_BC_S_GE:
+		return s->lport >= i->port;
+	case INET_DIAG_BC_S_LE:
+		return s->lport <= i->port;
+	}
+	abort();
+}
+
+int run_ssfilter(const struct filter *f, struct tcpstat *s)
+{
+	const struct ssf_prog *p = f->prog;
+	int pc = 0;
+
+	while (pc < p->len) {
+		const struct ssf_insn *i = &p->insn[pc];
+
+		pc = ssf_test(i, s) ? pc + 1 : i->no;
+	}
+	return pc == p->len;
+}
+
+static int ssf_insn_len(const struct ssf_insn *i)
+{
+	switch (i->code) {
+	case INET_DIAG_BC_S_COND:
+	case INET_DIAG_BC_D_COND:
+		return sizeof(struct inet_diag_bc_op) +
+			sizeof(struct inet_diag_hostcond) +
+			(i->a->addr.family == AF_INET6 ? 16 : 4);
+	case INET_DIAG_BC_S_GE:
+	case INET_DIAG_BC_S_LE:
+	case INET_DIAG_BC_D_GE:
+	case INET_DIAG_BC_D_LE:
+		return 2*sizeof(struct inet_diag_bc_op);
+	}
+	return sizeof(struct inet_diag_bc_op);
+}
+
+static int ssfilter_bytecompile(const struct filter *f, char **bytecode)
+{
+	const struct ssf_prog *p = f->prog;
+	int *off, i, len;
+	char *bc;
+
+	/* Nothing left to test */
+	*bytecode = NULL;
+	if (p->len == 0)
+		return 0;
+
+	if (!(off = malloc((p->len + 2)*sizeof(int))))
+		abort();
+	off[0] = 0;
+	for (i = 0; i < p->len; i++)
+		off[i+1] = off[i] + ssf_insn_len(&p->insn[i]);
+	off[p->len+1] = off[p->len] + 4;
+
+	if (!(bc = calloc(1, off[p->len])))
+		abort();
+	for (i = 0; i < p->len; i++) {
+		const struct ssf_insn *in = &p->insn[i];
+		struct inet_diag_bc_op *op = (void*)(bc + off[i]);
+		int len = off[i+1] - off[i];
+
+		*op = (struct inet_diag_bc_op){ in->code, len,
+						off[in->no] - off[i] };
+		if (len == 2*sizeof(*op))
+			op[1] = (struct inet_diag_bc_op){ 0, 0, in->port };
+		if (in->a) {
+			struct inet_diag_hostcond *cond = (void*)(op + 1);
+
+			cond->family = in->a->addr.family;
+			cond->port = in->a->port;
+			cond->prefix_len = in->a->addr.bitlen;
+			memcpy(cond->addr, in->a->addr.data,
+			       len - sizeof(*op) - sizeof(*cond));
+		}
+	}
+	len = off[p->len];
+	free(off);
+	*bytecode = bc;
+	return len;
+}
+
+static int remember_he(struct aafilter *a, struct hostent *he)
+{
+	char **ptr = he->h_addr_list;
+	int cnt = 0;
+	int len;
+
+	if (he->h_addrtype == AF_INET)
+		len = 4;
+	else if (he->h_addrtype == AF_INET6)
+		len = 16;
+	else
+		return 0;
+
+	while (*ptr) {
+		struct aafilter *b = a;
+		if (a->addr.bitlen) {
+			if ((b = malloc(sizeof(*b))) == NULL)
+				return cnt;
+			*b = *a;
+			b->next = a->next;
+			a->next = b;
+		}
+		memcpy(b->addr.data, *ptr, len);
+		b->addr.bytelen = len;
+		b->addr.bitlen = len*8;
+		b->addr.family = he->h_addrtype;
+		ptr++;
+		cnt++;
+	}
+	return cnt;
+}
+
+static int get_dns_host(struct aafilter *a, const char *addr, int fam)
+{
+	static int notfirst;
+	int cnt = 0;
+	struct hostent *he;
+
+	a->addr.bitlen = 0;
+	if (!notfirst) {
+		sethostent(1);
+		notfirst = 1;
+	}
+	he = gethostbyname2(addr, fam == AF_UNSPEC ? AF_INET : fam);
+	if (he)
+		cnt = remember_he(a, he);
+	if (fam == AF_UNSPEC) {
+		he = gethostbyname2(addr, AF_INET6);
+		if (he)
+			cnt += remember_he(a, he);
+	}
+	return !cnt;
+}
+
+static int xll_initted = 0;
 
 static void xll_init(void)
 {
@@ -1157,68 +1803,686 @@ void *parse_hostcond(char *addr)
 	return res;
 }
 
-static int tcp_show_line(char *line, const struct filter *f, int family)
+/* tcp_info as recent kernels fill it, older ones leave the tail zeroed */
+struct tcp_info_v2
 {
-	struct tcpstat s;
-	char *loc, *rem, *data;
-	char opt[256];
-	int n;
-	char *p;
+	struct tcp_info	base;
+	__u64		tcpi_pacing_rate;
+	__u64		tcpi_max_pacing_rate;
+	__u64		tcpi_bytes_acked;
+	__u64		tcpi_bytes_received;
+};
 
-	if ((p = strchr(line, ':')) == NULL)
-		return -1;
-	loc = p+2;
+static int tcp_diag_info(const struct nlmsghdr *nlh,
+			 const struct inet_diag_msg *r,
+			 struct tcp_info_v2 *info, const char **cong)
+{
+	struct rtattr *tb[INET_DIAG_MAX+1];
+	int len;
 
-	if ((p = strchr(loc, ':')) == NULL)
-		return -1;
-	p[5] = 0;
-	rem = p+6;
+	parse_rtattr(tb, INET_DIAG_MAX, (struct rtattr*)(r+1),
+		     nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+	if (cong)
+		*cong = tb[INET_DIAG_CONG] ? RTA_DATA(tb[INET_DIAG_CONG]) : NULL;
 
-	if ((p = strchr(rem, ':')) == NULL)
+	memset(info, 0, sizeof(*info));
+	if (!tb[INET_DIAG_INFO])
 		return -1;
-	p[5] = 0;
-	data = p+6;
+	len = RTA_PAYLOAD(tb[INET_DIAG_INFO]);
+	memcpy(info, RTA_DATA(tb[INET_DIAG_INFO]),
+	       len < sizeof(*info) ? len : sizeof(*info));
+	return 0;
+}
 
-	do {
-		int state = (data[1] >= 'A') ? (data[1] - 'A' + 10) : (data[1] - '0');
+/*
+ * -W: dump TCP sockets every interval and write one CSV row per socket
+ * that appeared, changed or went away since the previous dump. Sockets
+ * are remembered by address, ports and inode, so a reused 4-tuple shows
+ * up as a new connection.
+ */
 
-		if (!(f->states & (1<<state)))
-			return 0;
-	} while (0);
+struct watch_key
+{
+	int		family;
+	int		lport, rport;
+	__u32		local[4], remote[4];
+	unsigned	ino;
+};
 
-	s.local.family = s.remote.family = family;
-	if (family == AF_INET) {
-		sscanf(loc, "%x:%x", s.local.data, (unsigned*)&s.lport);
-		sscanf(rem, "%x:%x", s.remote.data, (unsigned*)&s.rport);
-		s.local.bytelen = s.remote.bytelen = 4;
-	} else {
-		sscanf(loc, "%08x%08x%08x%08x:%x",
-		       s.local.data,
-		       s.local.data+1,
-		       s.local.data+2,
-		       s.local.data+3,
-		       &s.lport);
-		sscanf(rem, "%08x%08x%08x%08x:%x",
-		       s.remote.data,
-		       s.remote.data+1,
-		       s.remote.data+2,
-		       s.remote.data+3,
-		       &s.rport);
-		s.local.bytelen = s.remote.bytelen = 16;
+struct watch_ent
+{
+	struct watch_ent *next;
+	unsigned	hash;
+	unsigned	gen;
+	struct watch_key key;
+	int		state;
+	__u64		acked;
+	unsigned	retrans;
+	unsigned	rtt;
+};
+
+static double watch_interval;
+static unsigned watch_gen;
+static struct watch_ent **watch_hash;
+static unsigned watch_hash_size, watch_cnt;
+static unsigned watch_rows, watch_socks;
+static char watch_time[32];
+
+static unsigned fnv_hash(const void *data, int len)
+{
+	const unsigned char *p = data;
+	unsigned h = 2166136261U;
+
+	while (len-- > 0)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+static void watch_grow(void)
+{
+	unsigned size = watch_hash_size ? 2*watch_hash_size : 1024;
+	struct watch_ent **nh = calloc(size, sizeof(*nh));
+	struct watch_ent *e;
+	unsigned i;
+
+	if (!nh)
+		abort();
+	for (i = 0; i < watch_hash_size; i++) {
+		while ((e = watch_hash[i]) != NULL) {
+			watch_hash[i] = e->next;
+			e->next = nh[e->hash & (size - 1)];
+			nh[e->hash & (size - 1)] = e;
+		}
+	}
+	free(watch_hash);
+	watch_hash = nh;
+	watch_hash_size = size;
+}
+
+static void watch_row(const char *event, const struct watch_ent *e,
+		      unsigned long long acked, unsigned retrans, int drtt)
+{
+	char lb[INET6_ADDRSTRLEN], rb[INET6_ADDRSTRLEN];
+
+	inet_ntop(e->key.family, e->key.local, lb, sizeof(lb));
+	inet_ntop(e->key.family, e->key.remote, rb, sizeof(rb));
+	printf("%s,%s,%s,%s,%d,%s,%d,%u,%llu,%u,%u,%d\n",
+	       watch_time, event, sstate_name[e->state],
+	       lb, e->key.lport, rb, e->key.rport, e->key.ino,
+	       acked, retrans, e->rtt, drtt);
+	watch_rows++;
+}
+
+static void watch_add(const struct tcpstat *s, const struct tcp_info_v2 *info)
+{
+	struct watch_ent *e;
+	struct watch_key k;
+	unsigned h;
+
+	memset(&k, 0, sizeof(k));
+	k.family = s->local.family;
+	k.lport = s->lport;
+	k.rport = s->rport;
+	memcpy(k.local, s->local.data, s->local.bytelen);
+	memcpy(k.remote, s->remote.data, s->remote.bytelen);
+	k.ino = s->ino;
+	h = fnv_hash(&k, sizeof(k));
+	watch_socks++;
+
+	if (watch_hash_size) {
+		for (e = watch_hash[h & (watch_hash_size - 1)]; e; e = e->next)
+			if (e->hash == h && memcmp(&e->key, &k, sizeof(k)) == 0)
+				break;
+		if (e) {
+			__u64 acked = info->tcpi_bytes_acked - e->acked;
+			unsigned retrans = info->base.tcpi_total_retrans - e->retrans;
+			int drtt = info->base.tcpi_rtt - e->rtt;
+
+			e->gen = watch_gen;
+			e->acked = info->tcpi_bytes_acked;
+			e->retrans = info->base.tcpi_total_retrans;
+			e->rtt = info->base.tcpi_rtt;
+			if (acked || retrans || drtt || e->state != s->state) {
+				e->state = s->state;
+				watch_row("delta", e, acked, retrans, drtt);
+			}
+			return;
+		}
+	}
+
+	if (watch_cnt >= watch_hash_size)
+		watch_grow();
+	if (!(e = malloc(sizeof(*e))))
+		abort();
+	e->hash = h;
+	e->gen = watch_gen;
+	e->key = k;
+	e->state = s->state;
+	e->acked = info->tcpi_bytes_acked;
+	e->retrans = info->base.tcpi_total_retrans;
+	e->rtt = info->base.tcpi_rtt;
+	e->next = watch_hash[h & (watch_hash_size - 1)];
+	watch_hash[h & (watch_hash_size - 1)] = e;
+	watch_cnt++;
+	watch_row("new", e, e->acked, e->retrans, 0);
+}
+
+/* Whatever the last dump did not see is gone */
+static void watch_sweep(void)
+{
+	struct watch_ent **pp, *e;
+	unsigned i;
+
+	for (i = 0; i < watch_hash_size; i++) {
+		pp = &watch_hash[i];
+		while ((e = *pp) != NULL) {
+			if (e->gen == watch_gen) {
+				pp = &e->next;
+				continue;
+			}
+			watch_row("close", e, 0, 0, 0);
+			*pp = e->next;
+			free(e);
+			watch_cnt--;
+		}
+	}
+}
+
+static double tv_ms(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000. + (b->tv_usec - a->tv_usec) / 1000.;
+}
+
+static int tcp_show_netlink(struct filter *f, FILE *dump_fp, int socktype);
+
+static void watch_run(struct filter *f)
+{
+	struct timeval next;
+
+	printf("time,event,state,local,lport,peer,pport,ino,"
+	       "bytes_acked,retrans,rtt_us,rtt_delta_us\n");
+
+	gettimeofday(&next, NULL);
+	for (;;) {
+		struct timeval t0, t1;
+		struct rusage r0, r1;
+		double wait;
+
+		gettimeofday(&t0, NULL);
+		getrusage(RUSAGE_SELF, &r0);
+		snprintf(watch_time, sizeof(watch_time), "%ld.%06ld",
+			 (long)t0.tv_sec, (long)t0.tv_usec);
+
+		watch_gen++;
+		watch_rows = watch_socks = 0;
+		if (tcp_show_netlink(f, NULL, TCPDIAG_GETSOCK) < 0) {
+			fprintf(stderr, "ss: -W needs the inet_diag netlink interface.\n");
+			exit(-1);
+		}
+		watch_sweep();
+		fflush(stdout);
+
+		gettimeofday(&t1, NULL);
+		getrusage(RUSAGE_SELF, &r1);
+		fprintf(stderr, "# %s sockets %u rows %u wall %.3fms "
+			"cpu %.3fms\n", watch_time, watch_socks, watch_rows,
+			tv_ms(&t0, &t1),
+			tv_ms(&r0.ru_utime, &r1.ru_utime) +
+			tv_ms(&r0.ru_stime, &r1.ru_stime));
+
+		/* Keep to the schedule however long the dump took */
+		next.tv_sec += (long)watch_interval;
+		next.tv_usec += (watch_interval - (long)watch_interval) * 1000000;
+		if (next.tv_usec >= 1000000) {
+			next.tv_sec++;
+			next.tv_usec -= 1000000;
+		}
+		wait = tv_ms(&t1, &next);
+		if (wait > 0) {
+			struct timespec ts;
+
+			ts.tv_sec = wait / 1000;
+			ts.tv_nsec = (wait - ts.tv_sec * 1000.) * 1000000;
+			nanosleep(&ts, NULL);
+		} else
+			next = t1;
+	}
+}
+
+/*
+ * -G: sockets are counted into groups as the dump arrives instead of
+ * being printed, so memory depends on the number of groups only.
+ * Distributions are kept in log2 histograms, eight buckets per power
+ * of two, so values below 16 are exact and the rest within 1/16.
+ */
+
+enum {
+	AGG_NETID,
+	AGG_STATE,
+	AGG_PORT,
+	AGG_DST,
+	AGG_CONG,
+	AGG_PROCESS,
+};
+
+#define AGG_HIST	240
+
+struct agg_hist
+{
+	unsigned	cnt;
+	unsigned	b[AGG_HIST];
+};
+
+struct agg_key
+{
+	const char	*netid;
+	int		state;
+	int		port;
+	inet_prefix	dst;
+	char		cong[16];
+	char		process[16];
+};
+
+struct agg_group
+{
+	struct agg_group *next;
+	unsigned	hash;
+	struct agg_key	key;
+	unsigned long long count, rq, wq;
+	struct agg_hist	rtt, cwnd;
+};
+
+static int agg_keys;
+static int agg_plen4 = 32, agg_plen6 = 128;
+static struct agg_group **agg_hash;
+static unsigned agg_hash_size, agg_cnt;
+
+static int agg_parse(char *arg)
+{
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (strcmp(tok, "netid") == 0)
+			agg_keys |= 1<<AGG_NETID;
+		else if (strcmp(tok, "state") == 0)
+			agg_keys |= 1<<AGG_STATE;
+		else if (strcmp(tok, "port") == 0 || strcmp(tok, "sport") == 0)
+			agg_keys |= 1<<AGG_PORT;
+		else if (strcmp(tok, "cong") == 0)
+			agg_keys |= 1<<AGG_CONG;
+		else if (strcmp(tok, "process") == 0)
+			agg_keys |= 1<<AGG_PROCESS;
+		else if (strncmp(tok, "dst", 3) == 0 &&
+			 (tok[3] == 0 || tok[3] == '/')) {
+			char *p6;
+
+			agg_keys |= 1<<AGG_DST;
+			if (tok[3] == 0)
+				continue;
+			if ((p6 = strchr(tok + 4, '/')) != NULL) {
+				*p6++ = 0;
+				if (get_integer(&agg_plen6, p6, 0) ||
+				    agg_plen6 < 0 || agg_plen6 > 128)
+					return -1;
+			}
+			if (get_integer(&agg_plen4, tok + 4, 0) ||
+			    agg_plen4 < 0 || agg_plen4 > 32)
+				return -1;
+		} else
+			return -1;
+	}
+	return agg_keys ? 0 : -1;
+}
+
+static void agg_hist_add(struct agg_hist *h, unsigned v)
+{
+	int i = v;
+
+	if (v >= 8) {
+		int e = 31 - __builtin_clz(v);
+
+		i = 8*(e - 2) + ((v >> (e - 3)) & 7);
+	}
+	h->b[i]++;
+	h->cnt++;
+}
+
+static double agg_hist_pct(const struct agg_hist *h, int pct)
+{
+	unsigned rank = ((unsigned long long)h->cnt * pct + 99) / 100;
+	unsigned seen = 0;
+	int i, e;
+
+	for (i = 0; i < AGG_HIST - 1; i++) {
+		seen += h->b[i];
+		if (seen >= rank)
+			break;
 	}
+	if (i < 8)
+		return i;
+	/* Middle of the bucket */
+	e = i/8 + 2;
+	return (double)((8 + i%8) << (e - 3)) + ((1 << (e - 3)) - 1) / 2.;
+}
+
+static struct agg_group *agg_lookup(const struct agg_key *k)
+{
+	unsigned h = fnv_hash(k, sizeof(*k));
+	struct agg_group *g;
+	unsigned i;
+
+	if (agg_hash_size) {
+		for (g = agg_hash[h & (agg_hash_size - 1)]; g; g = g->next)
+			if (g->hash == h && memcmp(&g->key, k, sizeof(*k)) == 0)
+				return g;
+	}
+
+	if (agg_cnt >= agg_hash_size) {
+		unsigned size = agg_hash_size ? 2*agg_hash_size : 256;
+		struct agg_group **nh = calloc(size, sizeof(*nh));
+
+		if (!nh)
+			abort();
+		for (i = 0; i < agg_hash_size; i++) {
+			while ((g = agg_hash[i]) != NULL) {
+				agg_hash[i] = g->next;
+				g->next = nh[g->hash & (size - 1)];
+				nh[g->hash & (size - 1)] = g;
+			}
+		}
+		free(agg_hash);
+		agg_hash = nh;
+		agg_hash_size = size;
+	}
+
+	if (!(g = calloc(1, sizeof(*g))))
+		abort();
+	g->hash = h;
+	g->key = *k;
+	g->next = agg_hash[h & (agg_hash_size - 1)];
+	agg_hash[h & (agg_hash_size - 1)] = g;
+	agg_cnt++;
+	return g;
+}
+
+/* rtt is in usec, rtt and cwnd are -1 when unknown */
+static void agg_add(const struct tcpstat *s, const char *netid,
+		    const char *cong, int rtt, int cwnd)
+{
+	struct agg_group *g;
+	struct agg_key k;
+
+
+	memset(&k, 0, sizeof(k));
+	if (agg_keys & (1<<AGG_NETID))
+		k.netid = netid;
+	if (agg_keys & (1<<AGG_STATE))
+		k.state = s->state;
+	if (agg_keys & (1<<AGG_PORT))
+		k.port = s->lport;
+	if (agg_keys & (1<<AGG_DST)) {
+		int plen = s->remote.family == AF_INET ? agg_plen4 : agg_plen6;
+		int i;
+
+		k.dst.family = s->remote.family;
+		k.dst.bytelen = s->remote.bytelen;
+		k.dst.bitlen = plen;
+		for (i = 0; i < plen / 32; i++)
+			k.dst.data[i] = s->remote.data[i];
+		if (plen % 32)
+			k.dst.data[i] = s->remote.data[i] &
+				htonl(~0U << (32 - plen % 32));
+	}
+	if ((agg_keys & (1<<AGG_CONG)) && cong)
+		strncpy(k.cong, cong, sizeof(k.cong) - 1);
+	if (agg_keys & (1<<AGG_PROCESS)) {
+		const char *p = find_process(s->ino);
+
+		if (p)
+			strncpy(k.process, p, sizeof(k.process) - 1);
+	}
+
+	g = agg_lookup(&k);
+	g->count++;
+	g->rq += s->rq;
+	g->wq += s->wq;
+	if (rtt >= 0)
+		agg_hist_add(&g->rtt, rtt);
+	if (cwnd >= 0)
+		agg_hist_add(&g->cwnd, cwnd);
+}
 
-	if (f->f && run_ssfilter(f->f, &s) == 0)
+static int agg_cmp(const void *a, const void *b)
+{
+	const struct agg_group *x = *(struct agg_group **)a;
+	const struct agg_group *y = *(struct agg_group **)b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return memcmp(&x->key, &y->key, sizeof(x->key));
+}
+
+static void agg_print(void)
+{
+	struct agg_group **all, *g;
+	char buf[256];
+	unsigned i, n = 0;
+
+	if (!(all = malloc((agg_cnt + 1) * sizeof(*all))))
+		abort();
+	for (i = 0; i < agg_hash_size; i++)
+		for (g = agg_hash[i]; g; g = g->next)
+			all[n++] = g;
+	qsort(all, n, sizeof(*all), agg_cmp);
+
+	if (agg_keys & (1<<AGG_NETID))
+		printf("%-5s ", "Netid");
+	if (agg_keys & (1<<AGG_STATE))
+		printf("%-10s ", "State");
+	if (agg_keys & (1<<AGG_PORT))
+		printf("%-*s ", serv_width, "Port");
+	if (agg_keys & (1<<AGG_DST))
+		printf("%-*s ", addr_width, "Peer Prefix");
+	if (agg_keys & (1<<AGG_CONG))
+		printf("%-8s ", "Cong");
+	if (agg_keys & (1<<AGG_PROCESS))
+		printf("%-15s ", "Process");
+	printf("%-8s %-8s %-8s %-20s %s\n", "Count", "Recv-Q", "Send-Q",
+	       "rtt:p50/p90/p99", "cwnd:p50/p90/p99");
+
+	for (i = 0; i < n; i++) {
+		g = all[i];
+
+		if (agg_keys & (1<<AGG_NETID))
+			printf("%-5s ", g->key.netid);
+		if (agg_keys & (1<<AGG_STATE))
+			printf("%-10s ", sstate_name[g->key.state]);
+		if (agg_keys & (1<<AGG_PORT))
+			printf("%-*s ", serv_width, resolve_service(g->key.port));
+		if (agg_keys & (1<<AGG_DST)) {
+			snprintf(buf, sizeof(buf), "%s/%d",
+				 format_host(g->key.dst.family,
+					     g->key.dst.bytelen,
+					     g->key.dst.data, buf + 128, 128),
+				 g->key.dst.bitlen);
+			printf("%-*s ", addr_width, buf);
+		}
+		if (agg_keys & (1<<AGG_CONG))
+			printf("%-8s ", g->key.cong[0] ? g->key.cong : "-");
+		if (agg_keys & (1<<AGG_PROCESS))
+			printf("%-15s ", g->key.process[0] ? g->key.process : "-");
+		printf("%-8llu %-8llu %-8llu ", g->count, g->rq, g->wq);
+
+		if (g->rtt.cnt)
+			snprintf(buf, sizeof(buf), "%g/%g/%g",
+				 agg_hist_pct(&g->rtt, 50) / 1000,
+				 agg_hist_pct(&g->rtt, 90) / 1000,
+				 agg_hist_pct(&g->rtt, 99) / 1000);
+		else
+			strcpy(buf, "-");
+		printf("%-20s ", buf);
+		if (g->cwnd.cnt)
+			printf("%g/%g/%g", agg_hist_pct(&g->cwnd, 50),
+			       agg_hist_pct(&g->cwnd, 90),
+			       agg_hist_pct(&g->cwnd, 99));
+		else
+			printf("-");
+		printf("\n");
+	}
+	free(all);
+}
+
+/*
+ * /proc/net/{tcp,udp,raw}{,6} print everything up to the retransmit
+ * count at fixed widths, so those fields are decoded in place, without
+ * sscanf, and the state is looked at before anything else.
+ */
+
+/* Upper or lower case, the caller checks the separators */
+static inline unsigned hex_fixed(const char *p, int width)
+{
+	unsigned v = 0;
+	int i;
+
+	for (i = 0; i < width; i++) {
+		unsigned c = (unsigned char)p[i];
+
+		v = (v << 4) | ((c & 0xF) + 9 * (c >> 6));
+	}
+	return v;
+}
+
+/* Next space separated number, returns 0 at the end of the line */
+static int proc_num(char **pp, unsigned long long *val, int base)
+{
+	unsigned long long v = 0;
+	char *p = *pp;
+	int neg = 0;
+
+	while (*p == ' ')
+		p++;
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+	if (!(base == 16 ? isxdigit(*p) : isdigit(*p))) {
+		*pp = p;
 		return 0;
+	}
+	for (;; p++) {
+		unsigned c = (unsigned char)*p;
 
-	opt[0] = 0;
-	n = sscanf(data, "%x %x:%x %x:%x %x %d %d %u %d %llx %d %d %d %d %d %[^\n]\n",
-		   &s.state, &s.wq, &s.rq,
-		   &s.timer, &s.timeout, &s.retrs, &s.uid, &s.probes, &s.ino,
-		   &s.refcnt, &s.sk, &s.rto, &s.ato, &s.qack,
-		   &s.cwnd, &s.ssthresh, opt);
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (base == 16 && isxdigit(c))
+			c = (c & 0xF) + 9;
+		else
+			break;
+		v = v * base + c;
+	}
+	*val = neg ? -v : v;
+	*pp = p;
+	return 1;
+}
+
+/*
+ *   sl  local:port remote:port st tx_queue:rx_queue tr:tm->when retrnsmt ...
+ *
+ * Returns 1 with the fixed part of "s" filled in and "*rest" pointing
+ * after it, 0 when the filter rejects the socket and -1 on garbage.
+ */
+static int proc_inet_line(char *line, const struct filter *f, int family,
+			  struct tcpstat *s, char **rest)
+{
+	int alen = family == AF_INET ? 8 : 32;
+	char *loc, *rem, *data;
+	int i;
+
+	if ((loc = strchr(line, ':')) == NULL)
+		return -1;
+	loc += 2;
+	rem = loc + alen + 6;
+	data = rem + alen + 6;
+	if (strlen(loc) < 2*(alen + 6) + 41 ||
+	    loc[alen] != ':' || rem[alen] != ':' || data[-1] != ' ' ||
+	    data[2] != ' ' || data[11] != ':' || data[20] != ' ' ||
+	    data[23] != ':' || data[32] != ' ')
+		return -1;
+
+	s->state = hex_fixed(data, 2);
+	if (!(f->states & (1<<s->state)))
+		return 0;
 
-	if (n < 17)
-		opt[0] = 0;
+	s->local.family = s->remote.family = family;
+	s->local.bytelen = s->remote.bytelen = alen / 2;
+	for (i = 0; i < alen / 8; i++) {
+		s->local.data[i] = hex_fixed(loc + 8*i, 8);
+		s->remote.data[i] = hex_fixed(rem + 8*i, 8);
+	}
+	s->lport = hex_fixed(loc + alen + 1, 4);
+	s->rport = hex_fixed(rem + alen + 1, 4);
+
+	if (f->f && run_ssfilter(f, s) == 0)
+		return 0;
+
+	s->wq = hex_fixed(data + 3, 8);
+	s->rq = hex_fixed(data + 12, 8);
+	s->timer = hex_fixed(data + 21, 2);
+	s->timeout = hex_fixed(data + 24, 8);
+	s->retrs = hex_fixed(data + 33, 8);
+	*rest = data + 41;
+	return 1;
+}
+
+/* What is left of the line, trailing padding dropped */
+static void proc_opt(char *p, char *opt, int len)
+{
+	int n;
+
+	while (*p == ' ')
+		p++;
+	n = strlen(p);
+	while (n > 0 && p[n-1] == ' ')
+		n--;
+	if (n >= len)
+		n = len - 1;
+	memcpy(opt, p, n);
+	opt[n] = 0;
+}
+
+static int tcp_show_line(char *line, const struct filter *f, int family)
+{
+	unsigned long long v[10];
+	struct tcpstat s;
+	char opt[256];
+	char *p;
+	int n;
+
+	if ((n = proc_inet_line(line, f, family, &s, &p)) <= 0)
+		return n;
+
+	/* uid probes ino refcnt sk rto ato qack cwnd ssthresh */
+	memset(v, 0, sizeof(v));
+	for (n = 6; n < 16; n++)
+		if (!proc_num(&p, &v[n - 6], n == 10 ? 16 : 10))
+			break;
+	s.uid = v[0];
+	s.probes = v[1];
+	s.ino = v[2];
+	s.refcnt = v[3];
+	s.sk = v[4];
+	s.rto = v[5];
+	s.ato = v[6];
+	s.qack = v[7];
+	s.cwnd = v[8];
+	s.ssthresh = v[9];
+
+	opt[0] = 0;
+	if (n == 16) {
+		proc_opt(p, opt, sizeof(opt));
+		if (opt[0])
+			n++;
+	}
 
 	if (n < 12) {
 		s.rto = 0;
@@ -1227,6 +2491,11 @@ static int tcp_show_line(char *line, const struct filter *f, int family)
 		s.ato = s.qack = 0;
 	}
 
+	if (agg_keys) {
+		agg_add(&s, "tcp", NULL, -1, n >= 15 ? s.cwnd : -1);
+		return 0;
+	}
+
 	if (netid_width)
 		printf("%-*s ", netid_width, "tcp");
 	if (state_width)
@@ -1275,35 +2544,156 @@ static int tcp_show_line(char *line, const struct filter *f, int family)
 		if (opt[0])
 			printf(" opt:\"%s\"", opt);
 	}
-	printf("\n");
+	printf("\n");
+
+	return 0;
+}
+
+/*
+ * All sockets of a received batch are looked at before the first of
+ * them is printed: -r starts the lookups of their names, which the name
+ * service then answers in parallel, and -p wants their owners, so the
+ * walk of /proc stops as soon as it has found them.
+ */
+static int peek_names(void)
+{
+	return resolve_hosts && !agg_keys && !watch_interval;
+}
+
+static int peek_users(void)
+{
+	if (agg_keys)
+		return agg_keys & (1<<AGG_PROCESS);
+	return show_users;
+}
+
+static int sock_peeking(void)
+{
+	return peek_names() || peek_users();
+}
+
+static void sock_peek(const inet_prefix *local, const inet_prefix *remote,
+		      unsigned int ino)
+{
+	if (peek_names()) {
+		/* formatted_print() shows 0.0.0.0 as "*" */
+		if (local->family != AF_INET || local->data[0])
+			resolve_host_prefetch(local->family, local->bytelen,
+					      local->data);
+		if (remote->family != AF_INET || remote->data[0])
+			resolve_host_prefetch(remote->family, remote->bytelen,
+					      remote->data);
+	}
+	if (peek_users())
+		user_want(ino);
+}
 
-	return 0;
+static void inet_line_peek(char *line, const struct filter *f, int family)
+{
+	unsigned long long v[3] = { 0 };
+	struct tcpstat s;
+	char *rest;
+	int i;
+
+	if (proc_inet_line(line, f, family, &s, &rest) <= 0)
+		return;
+	/* uid, timeout or probes, then the inode */
+	for (i = 0; i < 3; i++)
+		if (!proc_num(&rest, &v[i], 10))
+			break;
+	sock_peek(&s.local, &s.remote, v[2]);
 }
 
+static void inet_diag_peek(struct nlmsghdr *h, void *arg)
+{
+	const struct inet_diag_msg *r = NLMSG_DATA(h);
+	inet_prefix local = { .family = r->idiag_family };
+	inet_prefix remote = { .family = r->idiag_family };
+
+	local.bytelen = remote.bytelen = r->idiag_family == AF_INET ? 4 : 16;
+	memcpy(local.data, r->id.idiag_src, local.bytelen);
+	memcpy(remote.data, r->id.idiag_dst, remote.bytelen);
+	sock_peek(&local, &remote, r->idiag_inode);
+}
+
+/*
+ * The tables are read in big chunks straight from the file descriptor,
+ * the FILE is only there to open and close them. "peek" sees all lines
+ * of a chunk before "worker" gets the first of them and must leave them
+ * as they are.
+ */
 static int generic_record_read(FILE *fp,
 			       int (*worker)(char*, const struct filter *, int),
+			       void (*peek)(char*, const struct filter *, int),
 			       const struct filter *f, int fam)
 {
-	char line[256];
+	int size = 256*1024, len = 0, skip = 1, err = 0;
+	int fd = fileno(fp);
+	char *buf;
+
+	if ((buf = malloc(size)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
 
-	/* skip header */
-	if (fgets(line, sizeof(line), fp) == NULL)
-		goto outerr;
+	for (;;) {
+		char *line = buf, *end = buf, *nl;
+		int n = read(fd, buf + len, size - len);
 
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		int n = strlen(line);
-		if (n == 0 || line[n-1] != '\n') {
-			errno = -EINVAL;
-			return -1;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -1;
+			break;
+		}
+		if (n == 0) {
+			/* The last line lacks its newline */
+			if (len) {
+				errno = EINVAL;
+				err = -1;
+			}
+			break;
 		}
-		line[n-1] = 0;
+		len += n;
 
-		if (worker(line, f, fam) < 0)
-			return 0;
+		/* Complete lines only, the rest waits for the next read */
+		while ((nl = memchr(end, '\n', buf + len - end)) != NULL) {
+			*nl = 0;
+			end = nl + 1;
+		}
+		if (skip && end > buf) {
+			line += strlen(line) + 1;
+			skip = 0;
+		}
+		if (peek)
+			for (nl = line; nl < end; nl += strlen(nl) + 1)
+				peek(nl, f, fam);
+		while (line < end) {
+			nl = line + strlen(line) + 1;
+			if (worker(line, f, fam) < 0)
+				goto out;
+			line = nl;
+		}
+		len -= end - buf;
+		if (len == size) {
+			errno = EINVAL;
+			err = -1;
+			break;
+		}
+		memmove(buf, end, len);
 	}
-outerr:
+out:
+	free(buf);
+	return err;
+}
 
-	return ferror(fp) ? -1 : 0;
+static int inet_record_read(FILE *fp,
+			    int (*worker)(char*, const struct filter *, int),
+			    const struct filter *f, int fam)
+{
+	return generic_record_read(fp, worker,
+				   sock_peeking() ? inet_line_peek : NULL,
+				   f, fam);
 }
 
 static char *sprint_bw(char *buf, double bw)
@@ -1401,7 +2791,8 @@ static void tcp_show_info(const struct nlmsghdr *nlh, struct inet_diag_msg *r)
 	}
 }
 
-static int tcp_show_sock(struct nlmsghdr *nlh, struct filter *f)
+static int tcp_show_sock(struct nlmsghdr *nlh, struct filter *f,
+			 const char *netid)
 {
 	struct inet_diag_msg *r = NLMSG_DATA(nlh);
 	struct tcpstat s;
@@ -1418,11 +2809,31 @@ static int tcp_show_sock(struct nlmsghdr *nlh, struct filter *f)
 	memcpy(s.local.data, r->id.idiag_src, s.local.bytelen);
 	memcpy(s.remote.data, r->id.idiag_dst, s.local.bytelen);
 
-	if (f && f->f && run_ssfilter(f->f, &s) == 0)
+	if (f && f->f && run_ssfilter(f, &s) == 0)
+		return 0;
+
+	if (agg_keys || watch_interval) {
+		struct tcp_info_v2 info;
+		const char *cong;
+		int rtt = -1, cwnd = -1;
+
+		s.rq = r->idiag_rqueue;
+		s.wq = r->idiag_wqueue;
+		s.ino = r->idiag_inode;
+		if (tcp_diag_info(nlh, r, &info, &cong) == 0) {
+			if (info.base.tcpi_rtt)
+				rtt = info.base.tcpi_rtt;
+			cwnd = info.base.tcpi_snd_cwnd;
+		}
+		if (watch_interval)
+			watch_add(&s, &info);
+		else
+			agg_add(&s, netid, cong, rtt, cwnd);
 		return 0;
+	}
 
 	if (netid_width)
-		printf("%-*s ", netid_width, "tcp");
+		printf("%-*s ", netid_width, netid);
 	if (state_width)
 		printf("%-*s ", state_width, sstate_name[s.state]);
 
@@ -1465,22 +2876,110 @@ static int tcp_show_sock(struct nlmsghdr *nlh, struct filter *f)
 	return 0;
 }
 
+struct inet_diag_arg
+{
+	struct filter	*f;
+	FILE		*dump_fp;
+	const char	*netid;
+	int		seen;
+};
+
+/* Kernels without the protocol make ss read /proc instead, quietly */
+static int diag_open(struct rtnl_handle *rth, int protocol)
+{
+	int fd = socket(AF_NETLINK, SOCK_RAW, protocol);
+
+	if (fd < 0)
+		return -1;
+	close(fd);
+	return rtnl_open_byproto(rth, 0, protocol);
+}
+
+static int show_one_inet_sock(const struct sockaddr_nl *addr,
+			      struct nlmsghdr *h, void *arg)
+{
+	struct inet_diag_arg *diag_arg = arg;
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+
+	diag_arg->seen++;
+	if (diag_arg->dump_fp) {
+		fwrite(h, 1, NLMSG_ALIGN(h->nlmsg_len), diag_arg->dump_fp);
+		return 0;
+	}
+	if (!(diag_arg->f->families & (1<<r->idiag_family)))
+		return 0;
+	return tcp_show_sock(h, NULL, diag_arg->netid);
+}
+
+static int peek_one_inet_sock(const struct sockaddr_nl *addr,
+			      struct nlmsghdr *h, void *arg)
+{
+	struct inet_diag_arg *diag_arg = arg;
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+
+	if (diag_arg->f->families & (1<<r->idiag_family))
+		inet_diag_peek(h, NULL);
+	return 0;
+}
+
+/* -J, see tcp_show_jobs() */
+#define DIAG_JOBS_MAX	64
+
+static int diag_jobs;
+static int diag_ordered;
+
+static int tcp_diag_ext(void)
+{
+	int ext = 0;
+
+	if (show_mem)
+		ext |= (1<<(INET_DIAG_MEMINFO-1));
+	if (show_tcpinfo) {
+		ext |= (1<<(INET_DIAG_INFO-1));
+		ext |= (1<<(INET_DIAG_VEGASINFO-1));
+		ext |= (1<<(INET_DIAG_CONG-1));
+	}
+	if (agg_keys || watch_interval) {
+		ext |= (1<<(INET_DIAG_INFO-1));
+		ext |= (1<<(INET_DIAG_CONG-1));
+	}
+	return ext;
+}
+
+/*
+ * Returns -1 when nothing could be dumped and /proc must be read, 1 when
+ * the dump broke off after sockets were shown.
+ */
 static int tcp_show_netlink(struct filter *f, FILE *dump_fp, int socktype)
 {
-	int fd;
+	struct rtnl_handle rth;
 	struct sockaddr_nl nladdr;
 	struct {
 		struct nlmsghdr nlh;
 		struct inet_diag_req r;
 	} req;
+	struct inet_diag_arg arg = {
+		.f = f,
+		.dump_fp = dump_fp,
+		.netid = socktype == DCCPDIAG_GETSOCK ? DCCP_PROTO : TCP_PROTO,
+	};
+	const struct rtnl_dump_filter_arg da[2] = {
+		{
+			.filter = show_one_inet_sock,
+			.arg1 = &arg,
+			.peek = !dump_fp && sock_peeking() ?
+				peek_one_inet_sock : NULL,
+		},
+		{ .filter = NULL },
+	};
 	char    *bc = NULL;
 	int	bclen;
 	struct msghdr msg;
 	struct rtattr rta;
-	char	buf[8192];
 	struct iovec iov[3];
+	int err;
 
-	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_INET_DIAG)) < 0)
+	if (diag_open(&rth, NETLINK_INET_DIAG) < 0)
 		return -1;
 
 	memset(&nladdr, 0, sizeof(nladdr));
@@ -1490,25 +2989,17 @@ static int tcp_show_netlink(struct filter *f, FILE *dump_fp, int socktype)
 	req.nlh.nlmsg_type = socktype;
 	req.nlh.nlmsg_flags = NLM_F_ROOT|NLM_F_MATCH|NLM_F_REQUEST;
 	req.nlh.nlmsg_pid = 0;
-	req.nlh.nlmsg_seq = 123456;
+	req.nlh.nlmsg_seq = rth.dump = ++rth.seq;
 	memset(&req.r, 0, sizeof(req.r));
 	req.r.idiag_family = AF_INET;
 	req.r.idiag_states = f->states;
-	if (show_mem)
-		req.r.idiag_ext |= (1<<(INET_DIAG_MEMINFO-1));
-
-	if (show_tcpinfo) {
-		req.r.idiag_ext |= (1<<(INET_DIAG_INFO-1));
-		req.r.idiag_ext |= (1<<(INET_DIAG_VEGASINFO-1));
-		req.r.idiag_ext |= (1<<(INET_DIAG_CONG-1));
-	}
+	req.r.idiag_ext = tcp_diag_ext();
 
 	iov[0] = (struct iovec){
 		.iov_base = &req,
 		.iov_len = sizeof(req)
 	};
-	if (f->f) {
-		bclen = ssfilter_bytecompile(f->f, &bc);
+	if (f->f && (bclen = ssfilter_bytecompile(f, &bc)) > 0) {
 		rta.rta_type = INET_DIAG_REQ_BYTECODE;
 		rta.rta_len = RTA_LENGTH(bclen);
 		iov[1] = (struct iovec){ &rta, sizeof(rta) };
@@ -1520,88 +3011,38 @@ static int tcp_show_netlink(struct filter *f, FILE *dump_fp, int socktype)
 		.msg_name = (void*)&nladdr,
 		.msg_namelen = sizeof(nladdr),
 		.msg_iov = iov,
-		.msg_iovlen = f->f ? 3 : 1,
+		.msg_iovlen = bc ? 3 : 1,
 	};
 
-	if (sendmsg(fd, &msg, 0) < 0)
+	if (sendmsg(rth.fd, &msg, 0) < 0) {
+		rtnl_close(&rth);
 		return -1;
+	}
 
-	iov[0] = (struct iovec){
-		.iov_base = buf,
-		.iov_len = sizeof(buf)
-	};
-
-	while (1) {
-		int status;
-		struct nlmsghdr *h;
-
-		msg = (struct msghdr) {
-			(void*)&nladdr, sizeof(nladdr),
-			iov,	1,
-			NULL,	0,
-			0
+	err = rtnl_dump_filter_l(&rth, da);
+	if (err == 0 && dump_fp) {
+		/* Terminate the capture the way the kernel terminated the dump */
+		struct {
+			struct nlmsghdr nlh;
+			int		len;
+		} done = {
+			.nlh = {
+				.nlmsg_len = NLMSG_LENGTH(sizeof(int)),
+				.nlmsg_type = NLMSG_DONE,
+				.nlmsg_flags = NLM_F_MULTI,
+				.nlmsg_seq = rth.dump,
+			},
 		};
-
-		status = recvmsg(fd, &msg, 0);
-
-		if (status < 0) {
-			if (errno == EINTR)
-				continue;
-			perror("OVERRUN");
-			continue;
-		}
-		if (status == 0) {
-			fprintf(stderr, "EOF on netlink\n");
-			return 0;
-		}
-
-		if (dump_fp)
-			fwrite(buf, 1, NLMSG_ALIGN(status), dump_fp);
-
-		h = (struct nlmsghdr*)buf;
-		while (NLMSG_OK(h, status)) {
-			int err;
-			struct inet_diag_msg *r = NLMSG_DATA(h);
-
-			if (/*h->nlmsg_pid != rth->local.nl_pid ||*/
-			    h->nlmsg_seq != 123456)
-				goto skip_it;
-
-			if (h->nlmsg_type == NLMSG_DONE)
-				return 0;
-			if (h->nlmsg_type == NLMSG_ERROR) {
-				struct nlmsgerr *err = (struct nlmsgerr*)NLMSG_DATA(h);
-				if (h->nlmsg_len < NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
-					fprintf(stderr, "ERROR truncated\n");
-				} else {
-					errno = -err->error;
-					perror("TCPDIAG answers");
-				}
-				return 0;
-			}
-			if (!dump_fp) {
-				if (!(f->families & (1<<r->idiag_family))) {
-					h = NLMSG_NEXT(h, status);
-					continue;
-				}
-				err = tcp_show_sock(h, NULL);
-				if (err < 0)
-					return err;
-			}
-
-skip_it:
-			h = NLMSG_NEXT(h, status);
-		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			fprintf(stderr, "Message truncated\n");
-			continue;
-		}
-		if (status) {
-			fprintf(stderr, "!!!Remnant of size %d\n", status);
-			exit(1);
-		}
+		fwrite(&done, 1, sizeof(done), dump_fp);
 	}
-	return 0;
+	rtnl_close(&rth);
+	/* Sockets shown already would be shown again from /proc */
+	if (err < 0 && arg.seen) {
+		fprintf(stderr, "ss: inet_diag dump broke off after %d sockets\n",
+			arg.seen);
+		return 1;
+	}
+	return err;
 }
 
 static int tcp_show_netlink_file(struct filter *f)
@@ -1654,82 +3095,53 @@ static int tcp_show_netlink_file(struct filter *f)
 			return -1;
 		}
 
-		err = tcp_show_sock(h, f);
+		err = tcp_show_sock(h, f, TCP_PROTO);
 		if (err < 0)
 			return err;
 	}
 }
 
+static int tcp_show_jobs(struct filter *f, int socktype);
+
 static int tcp_show(struct filter *f, int socktype)
 {
 	FILE *fp = NULL;
-	char *buf = NULL;
-	int bufsize = 64*1024;
+	int err;
 
 	dg_proto = TCP_PROTO;
 
 	if (getenv("TCPDIAG_FILE"))
 		return tcp_show_netlink_file(f);
 
-	if (!getenv("PROC_NET_TCP") && !getenv("PROC_ROOT")
-	    && tcp_show_netlink(f, NULL, socktype) == 0)
-		return 0;
-
-	/* Sigh... We have to parse /proc/net/tcp... */
-
-
-	/* Estimate amount of sockets and try to allocate
-	 * huge buffer to read all the table at one read.
-	 * Limit it by 16MB though. The assumption is: as soon as
-	 * kernel was able to hold information about N connections,
-	 * it is able to give us some memory for snapshot.
-	 */
-	if (1) {
-		int guess = slabstat.socks+slabstat.tcp_syns;
-		if (f->states&(1<<SS_TIME_WAIT))
-			guess += slabstat.tcp_tws;
-		if (guess > (16*1024*1024)/128)
-			guess = (16*1024*1024)/128;
-		guess *= 128;
-		if (guess > bufsize)
-			bufsize = guess;
-	}
-	while (bufsize >= 64*1024) {
-		if ((buf = malloc(bufsize)) != NULL)
-			break;
-		bufsize /= 2;
-	}
-	if (buf == NULL) {
-		errno = ENOMEM;
-		return -1;
+	if (!getenv("PROC_NET_TCP") && !getenv("PROC_ROOT")) {
+		if (diag_jobs > 1 && tcp_show_jobs(f, socktype) == 0)
+			return 0;
+		if ((err = tcp_show_netlink(f, NULL, socktype)) >= 0)
+			return err ? -1 : 0;
 	}
 
+	/* Sigh... We have to parse /proc/net/tcp... */
 	if (f->families & (1<<AF_INET)) {
 		if ((fp = net_tcp_open()) == NULL)
 			goto outerr;
 
-		setbuffer(fp, buf, bufsize);
-		if (generic_record_read(fp, tcp_show_line, f, AF_INET))
+		if (inet_record_read(fp, tcp_show_line, f, AF_INET))
 			goto outerr;
 		fclose(fp);
 	}
 
 	if ((f->families & (1<<AF_INET6)) &&
 	    (fp = net_tcp6_open()) != NULL) {
-		setbuffer(fp, buf, bufsize);
-		if (generic_record_read(fp, tcp_show_line, f, AF_INET6))
+		if (inet_record_read(fp, tcp_show_line, f, AF_INET6))
 			goto outerr;
 		fclose(fp);
 	}
 
-	free(buf);
 	return 0;
 
 outerr:
 	do {
 		int saved_errno = errno;
-		if (buf)
-			free(buf);
 		if (fp)
 			fclose(fp);
 		errno = saved_errno;
@@ -1738,97 +3150,450 @@ outerr:
 }
 
 
-int dgram_show_line(char *line, const struct filter *f, int family)
+struct sockdiag_arg
 {
-	struct tcpstat s;
-	char *loc, *rem, *data;
-	char opt[256];
-	int n;
-	char *p;
+	int		(*show)(struct nlmsghdr *h, void *arg);
+	void		(*peek)(struct nlmsghdr *h, void *arg);
+	void		*arg;
+	int		seen;
+};
 
-	if ((p = strchr(line, ':')) == NULL)
-		return -1;
-	loc = p+2;
+static int sockdiag_one(const struct sockaddr_nl *who, struct nlmsghdr *h,
+			void *arg)
+{
+	struct sockdiag_arg *a = arg;
 
-	if ((p = strchr(loc, ':')) == NULL)
-		return -1;
-	p[5] = 0;
-	rem = p+6;
+	a->seen++;
+	return a->show(h, a->arg);
+}
+
+static int sockdiag_peek(const struct sockaddr_nl *who, struct nlmsghdr *h,
+			 void *arg)
+{
+	struct sockdiag_arg *a = arg;
+
+	a->peek(h, a->arg);
+	return 0;
+}
 
-	if ((p = strchr(rem, ':')) == NULL)
+/*
+ * Run a SOCK_DIAG_BY_FAMILY dump. "req" starts with the netlink header
+ * and is followed by the optional inet_diag bytecode. The optional
+ * "peek" sees each received batch before "show" gets it. Kernel errors
+ * are not reported. Returns 0 when the dump completes, -1 when it fails
+ * before any socket was passed to "show", so the caller can read /proc
+ * instead, and the number of sockets passed on when it fails later.
+ */
+static int sockdiag_dump(struct nlmsghdr *req, int len, char *bc, int bclen,
+			 int (*show)(struct nlmsghdr *h, void *arg),
+			 void (*peek)(struct nlmsghdr *h, void *arg), void *arg)
+{
+	struct sockdiag_arg a = { .show = show, .peek = peek, .arg = arg };
+	const struct rtnl_dump_filter_arg da[2] = {
+		{
+			.filter = sockdiag_one,
+			.arg1 = &a,
+			.peek = peek ? sockdiag_peek : NULL,
+		},
+		{ .filter = NULL },
+	};
+	struct rtnl_handle rth;
+	struct sockaddr_nl nladdr;
+	struct msghdr msg;
+	struct rtattr rta;
+	struct iovec iov[3];
+	int err = -1;
+
+	if (diag_open(&rth, NETLINK_SOCK_DIAG) < 0)
 		return -1;
-	p[5] = 0;
-	data = p+6;
 
-	do {
-		int state = (data[1] >= 'A') ? (data[1] - 'A' + 10) : (data[1] - '0');
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
 
-		if (!(f->states & (1<<state)))
-			return 0;
-	} while (0);
+	req->nlmsg_len = len;
+	req->nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req->nlmsg_flags = NLM_F_ROOT|NLM_F_MATCH|NLM_F_REQUEST;
+	req->nlmsg_pid = 0;
+	req->nlmsg_seq = rth.dump = ++rth.seq;
+
+	iov[0] = (struct iovec){ req, len };
+	if (bc) {
+		rta.rta_type = INET_DIAG_REQ_BYTECODE;
+		rta.rta_len = RTA_LENGTH(bclen);
+		iov[1] = (struct iovec){ &rta, sizeof(rta) };
+		iov[2] = (struct iovec){ bc, bclen };
+		req->nlmsg_len += RTA_LENGTH(bclen);
+	}
+
+	msg = (struct msghdr) {
+		.msg_name = (void*)&nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = iov,
+		.msg_iovlen = bc ? 3 : 1,
+	};
+
+	if (sendmsg(rth.fd, &msg, 0) >= 0)
+		err = rtnl_dump_filter_quiet(&rth, da);
+	rtnl_close(&rth);
+	if (err < 0 && a.seen)
+		return a.seen;
+	return err < 0 ? -1 : 0;
+}
+
+/* Sockets shown already would be shown again from /proc */
+static int sockdiag_broke_off(const char *what, int err)
+{
+	if (err > 0) {
+		fprintf(stderr, "ss: %s dump broke off after %d sockets\n",
+			what, err);
+		return 1;
+	}
+	return err;
+}
+
+/*
+ * -J: TCP and DCCP are dumped with one request per family and state
+ * subset, each on its own netlink socket and thread, so the kernel
+ * fills them on several cores. Threads only keep the raw replies in
+ * their own buffer; the main thread prints each buffer as soon as it is
+ * complete or, with --ordered, in request order.
+ */
+
+struct diag_job
+{
+	int		family;
+	int		protocol;
+	unsigned	states;
+	char		*buf;
+	int		len;
+	int		size;
+	int		status;		/* 0 running, 1 done, -1 failed */
+	int		shown;
+};
+
+struct diag_jobs
+{
+	struct diag_job	*job;
+	int		n;
+	int		next;
+	char		*bc;
+	int		bclen;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+};
+
+static int diag_job_store(struct nlmsghdr *h, void *arg)
+{
+	struct diag_job *job = arg;
+	int len = NLMSG_ALIGN(h->nlmsg_len);
+
+	if (job->len + len > job->size) {
+		int size = job->size ? 2*job->size : 64*1024;
+		char *buf;
+
+		while (size < job->len + len)
+			size *= 2;
+		if ((buf = realloc(job->buf, size)) == NULL)
+			return -1;
+		job->buf = buf;
+		job->size = size;
+	}
+	memcpy(job->buf + job->len, h, len);
+	job->len += len;
+	return 0;
+}
+
+static void *diag_job_thread(void *arg)
+{
+	struct diag_jobs *js = arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&js->next, 1)) < js->n) {
+		struct diag_job *job = &js->job[i];
+		struct {
+			struct nlmsghdr		nlh;
+			struct inet_diag_req_v2	r;
+		} req;
+		int err;
+
+		memset(&req, 0, sizeof(req));
+		req.r.sdiag_family = job->family;
+		req.r.sdiag_protocol = job->protocol;
+		req.r.idiag_ext = tcp_diag_ext();
+		req.r.idiag_states = job->states;
+
+		err = sockdiag_dump(&req.nlh, sizeof(req), js->bc, js->bclen,
+				    diag_job_store, NULL, job);
+
+		pthread_mutex_lock(&js->lock);
+		job->status = err ? -1 : 1;
+		pthread_cond_signal(&js->cond);
+		pthread_mutex_unlock(&js->lock);
+	}
+	return NULL;
+}
+
+/* Next finished buffer to print, NULL when all are shown */
+static struct diag_job *diag_job_wait(struct diag_jobs *js)
+{
+	struct diag_job *job = NULL;
+	int i, left;
+
+	pthread_mutex_lock(&js->lock);
+	for (;;) {
+		for (i = 0, left = 0; i < js->n; i++) {
+			if (js->job[i].shown)
+				continue;
+			left++;
+			if (js->job[i].status) {
+				job = &js->job[i];
+				break;
+			}
+			if (diag_ordered)
+				break;
+		}
+		if (job || !left)
+			break;
+		pthread_cond_wait(&js->cond, &js->lock);
+	}
+	pthread_mutex_unlock(&js->lock);
+	return job;
+}
+
+/*
+ * A finished job holds a whole batch of sockets, so -r can start the
+ * lookups for all of them before the first line of it is printed.
+ */
+static void diag_job_prefetch(const struct diag_job *jp)
+{
+	struct nlmsghdr *h;
+	int len = jp->len;
+
+	if (!sock_peeking())
+		return;
+
+	for (h = (struct nlmsghdr*)jp->buf; NLMSG_OK(h, len);
+	     h = NLMSG_NEXT(h, len))
+		inet_diag_peek(h, NULL);
+}
+
+static int tcp_show_jobs(struct filter *f, int socktype)
+{
+	static const int families[] = { AF_INET, AF_INET6 };
+	struct diag_job job[DIAG_JOBS_MAX];
+	pthread_t threads[DIAG_JOBS_MAX];
+	struct diag_jobs js = {
+		.job = job,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct diag_job *jp;
+	int protocol = socktype == DCCPDIAG_GETSOCK ? IPPROTO_DCCP : IPPROTO_TCP;
+	const char *netid = protocol == IPPROTO_DCCP ? DCCP_PROTO : TCP_PROTO;
+	int i, nfam = 0, nthreads, shown = 0, err = 0;
+
+	for (i = 0; i < ARRAY_SIZE(families); i++)
+		if (f->families & (1<<families[i]))
+			nfam++;
+	if (!nfam)
+		return 0;
+
+	/*
+	 * Listening sockets live in a table of their own. All other states
+	 * come from the same walk of the established table, and splitting
+	 * them by state shares out the work of filling the replies.
+	 */
+	memset(job, 0, sizeof(job));
+	for (i = 0; i < ARRAY_SIZE(families); i++) {
+		unsigned rest = f->states & ~(1<<SS_LISTEN);
+		int listen = !!(f->states & (1<<SS_LISTEN));
+		int chunks, c, bit;
+
+		if (!(f->families & (1<<families[i])))
+			continue;
+
+		chunks = diag_jobs / nfam - listen;
+		if (chunks > __builtin_popcount(rest))
+			chunks = __builtin_popcount(rest);
+		if (chunks < 1)
+			chunks = 1;
+		if (listen)
+			job[js.n++].states = 1<<SS_LISTEN;
+		if (!rest)
+			chunks = 0;
+		for (bit = 0, c = 0; bit < SS_MAX; bit++) {
+			if (!(rest & (1<<bit)))
+				continue;
+			job[js.n + c].states |= 1<<bit;
+			c = (c + 1) % chunks;
+		}
+		js.n += chunks;
+		for (c = 0; c < js.n; c++) {
+			if (job[c].family)
+				continue;
+			job[c].family = families[i];
+			job[c].protocol = protocol;
+		}
+	}
+
+	if (f->f && (js.bclen = ssfilter_bytecompile(f, &js.bc)) <= 0)
+		js.bc = NULL;
+
+	nthreads = js.n < diag_jobs ? js.n : diag_jobs;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, diag_job_thread, &js))
+			break;
+	nthreads = i;
+	if (!nthreads)
+		diag_job_thread(&js);
 
-	s.local.family = s.remote.family = family;
-	if (family == AF_INET) {
-		sscanf(loc, "%x:%x", s.local.data, (unsigned*)&s.lport);
-		sscanf(rem, "%x:%x", s.remote.data, (unsigned*)&s.rport);
-		s.local.bytelen = s.remote.bytelen = 4;
-	} else {
-		sscanf(loc, "%08x%08x%08x%08x:%x",
-		       s.local.data,
-		       s.local.data+1,
-		       s.local.data+2,
-		       s.local.data+3,
-		       &s.lport);
-		sscanf(rem, "%08x%08x%08x%08x:%x",
-		       s.remote.data,
-		       s.remote.data+1,
-		       s.remote.data+2,
-		       s.remote.data+3,
-		       &s.rport);
-		s.local.bytelen = s.remote.bytelen = 16;
+	while ((jp = diag_job_wait(&js)) != NULL) {
+		struct nlmsghdr *h;
+		int len = jp->len;
+
+		jp->shown = 1;
+		if (err || jp->status < 0) {
+			err = -1;
+			continue;
+		}
+		diag_job_prefetch(jp);
+		for (h = (struct nlmsghdr*)jp->buf; NLMSG_OK(h, len);
+		     h = NLMSG_NEXT(h, len))
+			tcp_show_sock(h, NULL, netid);
+		shown++;
 	}
 
-	if (f->f && run_ssfilter(f->f, &s) == 0)
-		return 0;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < js.n; i++)
+		free(job[i].buf);
+	free(js.bc);
 
-	opt[0] = 0;
-	n = sscanf(data, "%x %x:%x %*x:%*x %*x %d %*d %u %d %llx %[^\n]\n",
-	       &s.state, &s.wq, &s.rq,
-	       &s.uid, &s.ino,
-	       &s.refcnt, &s.sk, opt);
+	/* Without SOCK_DIAG_BY_FAMILY the first request fails already */
+	if (err && shown)
+		fprintf(stderr, "ss: parallel dump failed, output is incomplete\n");
+	return shown ? 0 : err;
+}
 
-	if (n < 9)
-		opt[0] = 0;
+static void dgram_show_sock(const struct tcpstat *s, const char *opt)
+{
+	if (agg_keys) {
+		agg_add(s, dg_proto, NULL, -1, -1);
+		return;
+	}
 
 	if (netid_width)
 		printf("%-*s ", netid_width, dg_proto);
 	if (state_width)
-		printf("%-*s ", state_width, sstate_name[s.state]);
+		printf("%-*s ", state_width, sstate_name[s->state]);
 
-	printf("%-6d %-6d ", s.rq, s.wq);
+	printf("%-6d %-6d ", s->rq, s->wq);
 
-	formatted_print(&s.local, s.lport);
-	formatted_print(&s.remote, s.rport);
+	formatted_print(&s->local, s->lport);
+	formatted_print(&s->remote, s->rport);
 
 	if (show_users) {
 		char ubuf[4096];
-		if (find_users(s.ino, ubuf, sizeof(ubuf)) > 0)
+		if (find_users(s->ino, ubuf, sizeof(ubuf)) > 0)
 			printf(" users:(%s)", ubuf);
 	}
 
 	if (show_details) {
-		if (s.uid)
-			printf(" uid=%u", (unsigned)s.uid);
-		printf(" ino=%u", s.ino);
-		printf(" sk=%llx", s.sk);
+		if (s->uid)
+			printf(" uid=%u", (unsigned)s->uid);
+		printf(" ino=%u", s->ino);
+		printf(" sk=%llx", s->sk);
 		if (opt[0])
 			printf(" opt:\"%s\"", opt);
 	}
 	printf("\n");
+}
+
+int dgram_show_line(char *line, const struct filter *f, int family)
+{
+	unsigned long long v[5];
+	struct tcpstat s;
+	char *p;
+	int n;
+
+	if ((n = proc_inet_line(line, f, family, &s, &p)) <= 0)
+		return n;
+
+	/* uid timeout ino refcnt sk */
+	memset(v, 0, sizeof(v));
+	for (n = 0; n < 5; n++)
+		if (!proc_num(&p, &v[n], n == 4 ? 16 : 10))
+			break;
+	s.uid = v[0];
+	s.ino = v[2];
+	s.refcnt = v[3];
+	s.sk = v[4];
+
+	dgram_show_sock(&s, "");
+	return 0;
+}
 
+static int dgram_show_diag(struct nlmsghdr *nlh, void *arg)
+{
+	struct inet_diag_msg *r = NLMSG_DATA(nlh);
+	struct tcpstat s;
+
+	s.state = r->idiag_state;
+	s.local.family = s.remote.family = r->idiag_family;
+	s.lport = ntohs(r->id.idiag_sport);
+	s.rport = ntohs(r->id.idiag_dport);
+	if (s.local.family == AF_INET) {
+		s.local.bytelen = s.remote.bytelen = 4;
+	} else {
+		s.local.bytelen = s.remote.bytelen = 16;
+	}
+	memcpy(s.local.data, r->id.idiag_src, s.local.bytelen);
+	memcpy(s.remote.data, r->id.idiag_dst, s.local.bytelen);
+
+	/* The kernel ran the filter already */
+	s.rq = r->idiag_rqueue;
+	s.wq = r->idiag_wqueue;
+	s.uid = r->idiag_uid;
+	s.ino = r->idiag_inode;
+	s.sk = (unsigned long long)r->id.idiag_cookie[1] << 32 |
+	       r->id.idiag_cookie[0];
+
+	dgram_show_sock(&s, "");
 	return 0;
 }
 
+/*
+ * Returns -1 when the kernel cannot dump this table and /proc must be
+ * read, 1 when the dump broke off after sockets were shown.
+ */
+static int dgram_show_netlink(struct filter *f, const char *env,
+			      int family, int protocol)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+	} req;
+	char *bc = NULL;
+	int bclen = 0, err;
+
+	if (getenv(env) || getenv("PROC_ROOT"))
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.r.sdiag_family = family;
+	req.r.sdiag_protocol = protocol;
+	/* For IPPROTO_RAW the pad is the raw protocol, 0 dumps all of them */
+	req.r.pad = 0;
+	req.r.idiag_states = f->states;
+	if (f->f)
+		bclen = ssfilter_bytecompile(f, &bc);
+
+	err = sockdiag_dump(&req.nlh, sizeof(req), bc, bclen, dgram_show_diag,
+			    sock_peeking() ? inet_diag_peek : NULL, f);
+	free(bc);
+	return sockdiag_broke_off(dg_proto, err);
+}
+
 
 int udp_show(struct filter *f)
 {
@@ -1836,17 +3601,19 @@ int udp_show(struct filter *f)
 
 	dg_proto = UDP_PROTO;
 
-	if (f->families&(1<<AF_INET)) {
+	if ((f->families&(1<<AF_INET)) &&
+	    dgram_show_netlink(f, "PROC_NET_UDP", AF_INET, IPPROTO_UDP) < 0) {
 		if ((fp = net_udp_open()) == NULL)
 			goto outerr;
-		if (generic_record_read(fp, dgram_show_line, f, AF_INET))
+		if (inet_record_read(fp, dgram_show_line, f, AF_INET))
 			goto outerr;
 		fclose(fp);
 	}
 
 	if ((f->families&(1<<AF_INET6)) &&
+	    dgram_show_netlink(f, "PROC_NET_UDP6", AF_INET6, IPPROTO_UDP) < 0 &&
 	    (fp = net_udp6_open()) != NULL) {
-		if (generic_record_read(fp, dgram_show_line, f, AF_INET6))
+		if (inet_record_read(fp, dgram_show_line, f, AF_INET6))
 			goto outerr;
 		fclose(fp);
 	}
@@ -1868,17 +3635,19 @@ int raw_show(struct filter *f)
 
 	dg_proto = RAW_PROTO;
 
-	if (f->families&(1<<AF_INET)) {
+	if ((f->families&(1<<AF_INET)) &&
+	    dgram_show_netlink(f, "PROC_NET_RAW", AF_INET, IPPROTO_RAW) < 0) {
 		if ((fp = net_raw_open()) == NULL)
 			goto outerr;
-		if (generic_record_read(fp, dgram_show_line, f, AF_INET))
+		if (inet_record_read(fp, dgram_show_line, f, AF_INET))
 			goto outerr;
 		fclose(fp);
 	}
 
 	if ((f->families&(1<<AF_INET6)) &&
+	    dgram_show_netlink(f, "PROC_NET_RAW6", AF_INET6, IPPROTO_RAW) < 0 &&
 	    (fp = net_raw6_open()) != NULL) {
-		if (generic_record_read(fp, dgram_show_line, f, AF_INET6))
+		if (inet_record_read(fp, dgram_show_line, f, AF_INET6))
 			goto outerr;
 		fclose(fp);
 	}
@@ -1897,7 +3666,6 @@ outerr:
 
 struct unixstat
 {
-	struct unixstat *next;
 	int ino;
 	int peer;
 	int rq;
@@ -1907,64 +3675,113 @@ struct unixstat
 	char *name;
 };
 
-
+struct unix_list
+{
+	struct unixstat *s;
+	int cnt;
+	int size;
+};
 
 int unix_state_map[] = { SS_CLOSE, SS_SYN_SENT,
 			 SS_ESTABLISHED, SS_CLOSING };
 
+static struct unixstat *unix_list_add(struct unix_list *l)
+{
+	if (l->cnt == l->size) {
+		int size = l->size ? 2*l->size : 1024;
+		struct unixstat *s = realloc(l->s, size*sizeof(*s));
 
-#define MAX_UNIX_REMEMBER (1024*1024/sizeof(struct unixstat))
+		if (!s)
+			return NULL;
+		l->s = s;
+		l->size = size;
+	}
+	memset(&l->s[l->cnt], 0, sizeof(struct unixstat));
+	return &l->s[l->cnt++];
+}
 
-void unix_list_free(struct unixstat *list)
+void unix_list_free(struct unix_list *l)
 {
-	while (list) {
-		struct unixstat *s = list;
-		list = list->next;
-		if (s->name)
-			free(s->name);
-		free(s);
-	}
+	int i;
+
+	for (i = 0; i < l->cnt; i++)
+		free(l->s[i].name);
+	free(l->s);
+	memset(l, 0, sizeof(*l));
 }
 
-void unix_list_print(struct unixstat *list, struct filter *f)
+static int unix_cmp(const void *a, const void *b)
 {
-	struct unixstat *s;
-	char *peer;
+	const struct unixstat *x = a, *y = b;
 
-	for (s = list; s; s = s->next) {
-		if (!(f->states & (1<<s->state)))
-			continue;
-		if (s->type == SOCK_STREAM && !(f->dbs&(1<<UNIX_ST_DB)))
-			continue;
-		if (s->type == SOCK_DGRAM && !(f->dbs&(1<<UNIX_DG_DB)))
-			continue;
+	if (x->type != y->type)
+		return x->type < y->type ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
 
-		peer = "*";
-		if (s->peer) {
-			struct unixstat *p;
-			for (p = list; p; p = p->next) {
-				if (s->peer == p->ino)
-					break;
-			}
-			if (!p) {
-				peer = "?";
-			} else {
-				peer = p->name ? : "*";
-			}
-		}
+/* Name of the peer of "s", NULL when the socket is filtered out */
+static char *unix_list_match(struct unix_list *l, struct unixstat *s,
+			     struct filter *f)
+{
+	char *peer;
 
-		if (f->f) {
-			struct tcpstat tst;
-			tst.local.family = AF_UNIX;
-			tst.remote.family = AF_UNIX;
-			memcpy(tst.local.data, &s->name, sizeof(s->name));
-			if (strcmp(peer, "*") == 0)
-				memset(tst.remote.data, 0, sizeof(peer));
-			else
-				memcpy(tst.remote.data, &peer, sizeof(peer));
-			if (run_ssfilter(f->f, &tst) == 0)
-				continue;
+	if (!(f->states & (1<<s->state)))
+		return NULL;
+	if (s->type == SOCK_STREAM && !(f->dbs&(1<<UNIX_ST_DB)))
+		return NULL;
+	if (s->type == SOCK_DGRAM && !(f->dbs&(1<<UNIX_DG_DB)))
+		return NULL;
+
+	peer = "*";
+	if (s->peer) {
+		struct unixstat key = { .type = s->type, .ino = s->peer };
+		struct unixstat *p;
+
+		p = bsearch(&key, l->s, l->cnt, sizeof(struct unixstat),
+			    unix_cmp);
+		if (!p) {
+			peer = "?";
+		} else {
+			peer = p->name ? : "*";
 		}
+	}
+
+	if (f->f) {
+		struct tcpstat tst;
+		tst.local.family = AF_UNIX;
+		tst.remote.family = AF_UNIX;
+		memcpy(tst.local.data, &s->name, sizeof(s->name));
+		if (strcmp(peer, "*") == 0)
+			memset(tst.remote.data, 0, sizeof(peer));
+		else
+			memcpy(tst.remote.data, &peer, sizeof(peer));
+		if (run_ssfilter(f, &tst) == 0)
+			return NULL;
+	}
+	return peer;
+}
+
+void unix_list_print(struct unix_list *l, struct filter *f)
+{
+	int i;
+
+	/* Sorted by type and inode, so peers are found by bisection */
+	qsort(l->s, l->cnt, sizeof(struct unixstat), unix_cmp);
+
+	/* The owners of all of them are looked for in one go */
+	if (show_users)
+		for (i = 0; i < l->cnt; i++)
+			if (unix_list_match(l, &l->s[i], f))
+				user_want(l->s[i].ino);
+
+	for (i = 0; i < l->cnt; i++) {
+		struct unixstat *s = &l->s[i];
+		char *peer;
+
+		if ((peer = unix_list_match(l, s, f)) == NULL)
+			continue;
 
 		if (netid_width)
 			printf("%-*s ", netid_width,
@@ -1984,14 +3801,89 @@ void unix_list_print(struct unixstat *list, struct filter *f)
 	}
 }
 
+static int unix_show_diag(struct nlmsghdr *nlh, void *arg)
+{
+	struct unix_diag_msg *r = NLMSG_DATA(nlh);
+	struct rtattr *tb[UNIX_DIAG_MAX+1];
+	struct unixstat *u;
+
+	if (!(u = unix_list_add(arg)))
+		return -1;
+
+	parse_rtattr(tb, UNIX_DIAG_MAX, (struct rtattr*)(r+1),
+		     nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+
+	u->type = r->udiag_type;
+	u->state = r->udiag_state;
+	u->ino = r->udiag_ino;
+	if (tb[UNIX_DIAG_PEER])
+		u->peer = *(__u32*)RTA_DATA(tb[UNIX_DIAG_PEER]);
+	if (tb[UNIX_DIAG_RQLEN]) {
+		struct unix_diag_rqlen *rql = RTA_DATA(tb[UNIX_DIAG_RQLEN]);
+
+		u->rq = rql->udiag_rqueue;
+		u->wq = rql->udiag_wqueue;
+	}
+	if (tb[UNIX_DIAG_NAME]) {
+		const char *name = RTA_DATA(tb[UNIX_DIAG_NAME]);
+		int i, len = RTA_PAYLOAD(tb[UNIX_DIAG_NAME]);
+
+		if ((u->name = malloc(len + 1)) == NULL)
+			return -1;
+		/* Spelled the way /proc/net/unix does */
+		if (len && name[0]) {
+			len = strnlen(name, len);
+			memcpy(u->name, name, len);
+		} else {
+			for (i = 0; i < len; i++)
+				u->name[i] = name[i] ? : '@';
+		}
+		u->name[len] = 0;
+	}
+
+	if (u->type == SOCK_DGRAM &&
+	    u->state == SS_CLOSE &&
+	    u->peer)
+		u->state = SS_ESTABLISHED;
+	return 0;
+}
+
+static int unix_show_netlink(struct filter *f, struct unix_list *l)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct unix_diag_req r;
+	} req;
+
+	if (getenv("PROC_NET_UNIX") || getenv("PROC_ROOT"))
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.r.sdiag_family = AF_UNIX;
+	req.r.udiag_states = f->states;
+	/* Connected datagram sockets may be in CLOSE and shown as ESTAB */
+	if (f->states & (1<<SS_ESTABLISHED))
+		req.r.udiag_states |= (1<<SS_CLOSE);
+	req.r.udiag_show = UDIAG_SHOW_NAME|UDIAG_SHOW_PEER|UDIAG_SHOW_RQLEN;
+
+	return sockdiag_dump(&req.nlh, sizeof(req), NULL, 0,
+			     unix_show_diag, NULL, l);
+}
+
 int unix_show(struct filter *f)
 {
 	FILE *fp;
 	char buf[256];
 	char name[128];
 	int  newformat = 0;
-	int  cnt;
-	struct unixstat *list = NULL;
+	struct unix_list list = { NULL, 0, 0 };
+
+	/* Nothing is printed before the list is complete, so a dump that
+	 * broke off half way is dropped and /proc read instead.
+	 */
+	if (unix_show_netlink(f, &list) == 0)
+		goto print;
+	unix_list_free(&list);
 
 	if ((fp = net_unix_open()) == NULL)
 		return -1;
@@ -1999,15 +3891,13 @@ int unix_show(struct filter *f)
 
 	if (memcmp(buf, "Peer", 4) == 0)
 		newformat = 1;
-	cnt = 0;
 
 	while (fgets(buf, sizeof(buf)-1, fp)) {
-		struct unixstat *u, **insp;
+		struct unixstat *u;
 		int flags;
 
-		if (!(u = malloc(sizeof(*u))))
+		if (!(u = unix_list_add(&list)))
 			break;
-		u->name = NULL;
 
 		if (sscanf(buf, "%x: %x %x %x %x %x %d %s",
 			   &u->peer, &u->rq, &u->wq, &flags, &u->type,
@@ -2030,40 +3920,148 @@ int unix_show(struct filter *f)
 			u->wq = 0;
 		}
 
-		insp = &list;
-		while (*insp) {
-			if (u->type < (*insp)->type ||
-			    (u->type == (*insp)->type &&
-			     u->ino < (*insp)->ino))
-				break;
-			insp = &(*insp)->next;
-		}
-		u->next = *insp;
-		*insp = u;
-
 		if (name[0]) {
 			if ((u->name = malloc(strlen(name)+1)) == NULL)
 				break;
 			strcpy(u->name, name);
 		}
-		if (++cnt > MAX_UNIX_REMEMBER) {
-			unix_list_print(list, f);
-			unix_list_free(list);
-			list = NULL;
-			cnt = 0;
-		}
 	}
+	fclose(fp);
+
+print:
+	unix_list_print(&list, f);
+	unix_list_free(&list);
+	return 0;
+}
+
+
+static int packet_match(const struct filter *f, int type, int prot,
+			int iface)
+{
+	if (type == SOCK_RAW && !(f->dbs&(1<<PACKET_R_DB)))
+		return 0;
+	if (type == SOCK_DGRAM && !(f->dbs&(1<<PACKET_DG_DB)))
+		return 0;
+	if (f->f) {
+		struct tcpstat tst;
+		tst.local.family = AF_PACKET;
+		tst.remote.family = AF_PACKET;
+		tst.rport = 0;
+		tst.lport = iface;
+		tst.local.data[0] = prot;
+		tst.remote.data[0] = 0;
+		if (run_ssfilter(f, &tst) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int packet_show_sock(struct filter *f, int type, int prot, int iface,
+			    int rq, unsigned uid, unsigned ino,
+			    unsigned long long sk)
+{
+	if (!packet_match(f, type, prot, iface))
+		return 0;
 
-	if (list) {
-		unix_list_print(list, f);
-		unix_list_free(list);
-		list = NULL;
-		cnt = 0;
+	if (netid_width)
+		printf("%-*s ", netid_width,
+		       type == SOCK_RAW ? "p_raw" : "p_dgr");
+	if (state_width)
+		printf("%-*s ", state_width, "UNCONN");
+	printf("%-6d %-6d ", rq, 0);
+	if (prot == 3) {
+		printf("%*s:", addr_width, "*");
+	} else {
+		char tb[16];
+		printf("%*s:", addr_width,
+		       ll_proto_n2a(htons(prot), tb, sizeof(tb)));
 	}
+	if (iface == 0) {
+		printf("%-*s ", serv_width, "*");
+	} else {
+		printf("%-*s ", serv_width, xll_index_to_name(iface));
+	}
+	printf("%*s*%-*s",
+	       addr_width, "", serv_width, "");
 
+	if (show_users) {
+		char ubuf[4096];
+		if (find_users(ino, ubuf, sizeof(ubuf)) > 0)
+			printf(" users:(%s)", ubuf);
+	}
+	if (show_details) {
+		printf(" ino=%u uid=%u sk=%llx", ino, uid, sk);
+	}
+	printf("\n");
 	return 0;
 }
 
+static int packet_show_diag(struct nlmsghdr *nlh, void *arg)
+{
+	struct packet_diag_msg *r = NLMSG_DATA(nlh);
+	struct rtattr *tb[PACKET_DIAG_MAX+1];
+	int iface = 0, rq = 0;
+	unsigned uid = 0;
+
+	parse_rtattr(tb, PACKET_DIAG_MAX, (struct rtattr*)(r+1),
+		     nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+
+	if (tb[PACKET_DIAG_INFO]) {
+		struct packet_diag_info *pinfo = RTA_DATA(tb[PACKET_DIAG_INFO]);
+
+		iface = pinfo->pdi_index;
+	}
+	if (tb[PACKET_DIAG_UID])
+		uid = *(__u32*)RTA_DATA(tb[PACKET_DIAG_UID]);
+	if (tb[PACKET_DIAG_MEMINFO]) {
+		__u32 *mem = RTA_DATA(tb[PACKET_DIAG_MEMINFO]);
+
+		rq = mem[SK_MEMINFO_RMEM_ALLOC];
+	}
+
+	return packet_show_sock(arg, r->pdiag_type, r->pdiag_num, iface, rq,
+				uid, r->pdiag_ino,
+				(unsigned long long)r->pdiag_cookie[1] << 32 |
+				r->pdiag_cookie[0]);
+}
+
+static void packet_peek_diag(struct nlmsghdr *nlh, void *arg)
+{
+	struct packet_diag_msg *r = NLMSG_DATA(nlh);
+	struct rtattr *tb[PACKET_DIAG_MAX+1];
+	int iface = 0;
+
+	parse_rtattr(tb, PACKET_DIAG_MAX, (struct rtattr*)(r+1),
+		     nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+	if (tb[PACKET_DIAG_INFO]) {
+		struct packet_diag_info *pinfo = RTA_DATA(tb[PACKET_DIAG_INFO]);
+
+		iface = pinfo->pdi_index;
+	}
+	if (packet_match(arg, r->pdiag_type, r->pdiag_num, iface))
+		user_want(r->pdiag_ino);
+}
+
+static int packet_show_netlink(struct filter *f)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct packet_diag_req r;
+	} req;
+
+	if (getenv("PROC_NET_PACKET") || getenv("PROC_ROOT"))
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.r.sdiag_family = AF_PACKET;
+	req.r.pdiag_show = PACKET_SHOW_INFO|PACKET_SHOW_MEMINFO;
+
+	return sockdiag_broke_off("packet",
+				  sockdiag_dump(&req.nlh, sizeof(req), NULL, 0,
+						packet_show_diag,
+						show_users ? packet_peek_diag : NULL,
+						f));
+}
 
 int packet_show(struct filter *f)
 {
@@ -2081,6 +4079,9 @@ int packet_show(struct filter *f)
 	if (!(f->states & (1<<SS_CLOSE)))
 		return 0;
 
+	if (packet_show_netlink(f) >= 0)
+		return 0;
+
 	if ((fp = net_packet_open()) == NULL)
 		return -1;
 	fgets(buf, sizeof(buf)-1, fp);
@@ -2091,57 +4092,13 @@ int packet_show(struct filter *f)
 		       &type, &prot, &iface, &state,
 		       &rq, &uid, &ino);
 
-		if (type == SOCK_RAW && !(f->dbs&(1<<PACKET_R_DB)))
-			continue;
-		if (type == SOCK_DGRAM && !(f->dbs&(1<<PACKET_DG_DB)))
-			continue;
-		if (f->f) {
-			struct tcpstat tst;
-			tst.local.family = AF_PACKET;
-			tst.remote.family = AF_PACKET;
-			tst.rport = 0;
-			tst.lport = iface;
-			tst.local.data[0] = prot;
-			tst.remote.data[0] = 0;
-			if (run_ssfilter(f->f, &tst) == 0)
-				continue;
-		}
-
-		if (netid_width)
-			printf("%-*s ", netid_width,
-			       type == SOCK_RAW ? "p_raw" : "p_dgr");
-		if (state_width)
-			printf("%-*s ", state_width, "UNCONN");
-		printf("%-6d %-6d ", rq, 0);
-		if (prot == 3) {
-			printf("%*s:", addr_width, "*");
-		} else {
-			char tb[16];
-			printf("%*s:", addr_width,
-			       ll_proto_n2a(htons(prot), tb, sizeof(tb)));
-		}
-		if (iface == 0) {
-			printf("%-*s ", serv_width, "*");
-		} else {
-			printf("%-*s ", serv_width, xll_index_to_name(iface));
-		}
-		printf("%*s*%-*s",
-		       addr_width, "", serv_width, "");
-
-		if (show_users) {
-			char ubuf[4096];
-			if (find_users(ino, ubuf, sizeof(ubuf)) > 0)
-				printf(" users:(%s)", ubuf);
-		}
-		if (show_details) {
-			printf(" ino=%u uid=%u sk=%llx", ino, uid, sk);
-		}
-		printf("\n");
+		packet_show_sock(f, type, prot, iface, rq, uid, ino, sk);
 	}
 
 	return 0;
 }
 
+
 int netlink_show(struct filter *f)
 {
 	FILE *fp;
@@ -2171,7 +4128,7 @@ int netlink_show(struct filter *f)
 			tst.lport = pid;
 			tst.local.data[0] = prot;
 			tst.remote.data[0] = 0;
-			if (run_ssfilter(f->f, &tst) == 0)
+			if (run_ssfilter(f, &tst) == 0)
 				continue;
 		}
 
@@ -2421,6 +4378,12 @@ static void _usage(FILE *dest)
 "\n"
 "   -F, --filter=FILE   read filter information from FILE\n"
 "       FILTER := [ state TCP-STATE ] [ EXPRESSION ]\n"
+"\n"
+"   -G, --group=KEYS    show counts of inet sockets grouped by KEYS\n"
+"       KEYS := {netid|state|port|dst[/PLEN[/PLEN6]]|cong|process}[,KEYS]\n"
+"   -W, --watch=SECS    write TCP socket changes as CSV every SECS seconds\n"
+"   -J, --jobs=N        dump TCP sockets with up to N parallel requests\n"
+"       --ordered       print parallel dumps in request order\n"
 		);
 }
 
@@ -2466,6 +4429,24 @@ int scan_state(const char *state)
 	return 0;
 }
 
+static void show_sockets(struct filter *f)
+{
+	if (f->dbs & (1<<NETLINK_DB))
+		netlink_show(f);
+	if (f->dbs & PACKET_DBM)
+		packet_show(f);
+	if (f->dbs & UNIX_DBM)
+		unix_show(f);
+	if (f->dbs & (1<<RAW_DB))
+		raw_show(f);
+	if (f->dbs & (1<<UDP_DB))
+		udp_show(f);
+	if (f->dbs & (1<<TCP_DB))
+		tcp_show(f, TCPDIAG_GETSOCK);
+	if (f->dbs & (1<<DCCP_DB))
+		tcp_show(f, DCCPDIAG_GETSOCK);
+}
+
 static const struct option long_opts[] = {
 	{ "numeric", 0, 0, 'n' },
 	{ "resolve", 0, 0, 'r' },
@@ -2489,6 +4470,10 @@ static const struct option long_opts[] = {
 	{ "summary", 0, 0, 's' },
 	{ "diag", 0, 0, 'D' },
 	{ "filter", 1, 0, 'F' },
+	{ "group", 1, 0, 'G' },
+	{ "watch", 1, 0, 'W' },
+	{ "jobs", 1, 0, 'J' },
+	{ "ordered", 0, 0, 'O' },
 	{ "version", 0, 0, 'V' },
 	{ "help", 0, 0, 'h' },
 	{ 0 }
@@ -2509,7 +4494,7 @@ int main(int argc, char *argv[])
 
 	current_filter.states = default_filter.states;
 
-	while ((ch = getopt_long(argc, argv, "dhaletuwxnro460spf:miA:D:F:vV",
+	while ((ch = getopt_long(argc, argv, "dhaletuwxnro460spf:miA:D:F:G:W:J:vV",
 				 long_opts, NULL)) != EOF) {
 		switch(ch) {
 		case 'n':
@@ -2533,7 +4518,6 @@ int main(int argc, char *argv[])
 			break;
 		case 'p':
 			show_users++;
-			user_ent_hash_build();
 			break;
 		case 'd':
 			current_filter.dbs |= (1<<DCCP_DB);
@@ -2658,6 +4642,33 @@ int main(int argc, char *argv[])
 				exit(-1);
 			}
 			break;
+		case 'G':
+			if (agg_parse(optarg)) {
+				fprintf(stderr, "ss: \"%s\" is invalid group key list\n", optarg);
+				usage();
+			}
+			break;
+		case 'W':
+		{
+			char *end;
+
+			watch_interval = strtod(optarg, &end);
+			if (*end || end == optarg || watch_interval <= 0) {
+				fprintf(stderr, "ss: \"%s\" is invalid watch interval\n", optarg);
+				usage();
+			}
+			break;
+		}
+		case 'J':
+			if (get_integer(&diag_jobs, optarg, 0) ||
+			    diag_jobs < 1 || diag_jobs > DIAG_JOBS_MAX) {
+				fprintf(stderr, "ss: \"%s\" is invalid number of jobs\n", optarg);
+				usage();
+			}
+			break;
+		case 'O':
+			diag_ordered = 1;
+			break;
 		case 'v':
 		case 'V':
 			printf("ss utility, iproute2-ss%s\n", SNAPSHOT);
@@ -2719,6 +4730,13 @@ int main(int argc, char *argv[])
 		else
 			current_filter.families = default_filter.families;
 	}
+	if (agg_keys) {
+		current_filter.dbs &= (1<<TCP_DB)|(1<<DCCP_DB)|(1<<UDP_DB)|(1<<RAW_DB);
+		if (current_filter.dbs == 0) {
+			fprintf(stderr, "ss: -G groups only TCP, DCCP, UDP and RAW sockets.\n");
+			exit(0);
+		}
+	}
 	if (current_filter.dbs == 0) {
 		fprintf(stderr, "ss: no socket tables to show with such filter.\n");
 		exit(0);
@@ -2760,11 +4778,22 @@ int main(int argc, char *argv[])
 		argc--; argv++;
 	}
 
+	if (current_filter.f)
+		current_filter.prog = ssfilter_compile(current_filter.f);
+
 	if (current_filter.states == 0) {
 		fprintf(stderr, "ss: no socket states to show with such filter.\n");
 		exit(0);
 	}
 
+	if (watch_interval) {
+		if (!(current_filter.dbs & (1<<TCP_DB))) {
+			fprintf(stderr, "ss: -W watches TCP sockets and no tcp in filter.\n");
+			exit(0);
+		}
+		watch_run(&current_filter);
+	}
+
 	if (dump_tcpdiag) {
 		FILE *dump_fp = stdout;
 		if (!(current_filter.dbs & (1<<TCP_DB))) {
@@ -2823,6 +4852,12 @@ int main(int argc, char *argv[])
 
 	addr_width = addrp_width - serv_width - 1;
 
+	if (agg_keys) {
+		show_sockets(&current_filter);
+		agg_print();
+		return 0;
+	}
+
 	if (netid_width)
 		printf("%-*s ", netid_width, "Netid");
 	if (state_width)
@@ -2835,19 +4870,6 @@ int main(int argc, char *argv[])
 
 	fflush(stdout);
 
-	if (current_filter.dbs & (1<<NETLINK_DB))
-		netlink_show(&current_filter);
-	if (current_filter.dbs & PACKET_DBM)
-		packet_show(&current_filter);
-	if (current_filter.dbs & UNIX_DBM)
-		unix_show(&current_filter);
-	if (current_filter.dbs & (1<<RAW_DB))
-		raw_show(&current_filter);
-	if (current_filter.dbs & (1<<UDP_DB))
-		udp_show(&current_filter);
-	if (current_filter.dbs & (1<<TCP_DB))
-		tcp_show(&current_filter, TCPDIAG_GETSOCK);
-	if (current_filter.dbs & (1<<DCCP_DB))
-		tcp_show(&current_filter, DCCPDIAG_GETSOCK);
+	show_sockets(&current_filter);
 	return 0;
 }
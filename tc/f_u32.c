@@ -20,6 +20,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <math.h>
 #include <linux/if.h>
 #include <linux/if_ether.h>
 
@@ -35,7 +36,7 @@ static void explain(void)
 	fprintf(stderr, "               [ police POLICE_SPEC ]"
 		" [ offset OFFSET_SPEC ]\n");
 	fprintf(stderr, "               [ ht HTID ] [ hashkey HASHKEY_SPEC ]\n");
-	fprintf(stderr, "               [ sample SAMPLE ]\n");
+	fprintf(stderr, "               [ sample SAMPLE ] [ optimize ]\n");
 	fprintf(stderr, "or         u32 divisor DIVISOR\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Where: SELECTOR := SAMPLE SAMPLE ...\n");
@@ -146,12 +147,34 @@ static int pack_key(struct tc_u32_sel *sel, __u32 key, __u32 mask,
 	return 0;
 }
 
+/* Spread a host order 32 bit match at any offset over the aligned
+ * words it covers, so sub-word matches on neighbouring bytes share keys.
+ */
+static int pack_key_at(struct tc_u32_sel *sel, __u32 key, __u32 mask,
+		       int off, int offmask)
+{
+	int shift = (off & 3) * 8;
+
+	if (shift == 0)
+		return pack_key(sel, htonl(key), htonl(mask), off, offmask);
+
+	off &= ~3;
+	key &= mask;
+	if ((mask >> shift) &&
+	    pack_key(sel, htonl(key >> shift), htonl(mask >> shift),
+		     off, offmask) < 0)
+		return -1;
+	if ((mask << (32 - shift)) &&
+	    pack_key(sel, htonl(key << (32 - shift)),
+		     htonl(mask << (32 - shift)), off + 4, offmask) < 0)
+		return -1;
+	return 0;
+}
+
 static int pack_key32(struct tc_u32_sel *sel, __u32 key, __u32 mask,
 		      int off, int offmask)
 {
-	key = htonl(key);
-	mask = htonl(mask);
-	return pack_key(sel, key, mask, off, offmask);
+	return pack_key_at(sel, key, mask, off, offmask);
 }
 
 static int pack_key16(struct tc_u32_sel *sel, __u32 key, __u32 mask,
@@ -160,15 +183,7 @@ static int pack_key16(struct tc_u32_sel *sel, __u32 key, __u32 mask,
 	if (key > 0xFFFF || mask > 0xFFFF)
 		return -1;
 
-	if ((off & 3) == 0) {
-		key <<= 16;
-		mask <<= 16;
-	}
-	off &= ~3;
-	key = htonl(key);
-	mask = htonl(mask);
-
-	return pack_key(sel, key, mask, off, offmask);
+	return pack_key_at(sel, key << 16, mask << 16, off, offmask);
 }
 
 static int pack_key8(struct tc_u32_sel *sel, __u32 key, __u32 mask, int off, int offmask)
@@ -176,23 +191,127 @@ static int pack_key8(struct tc_u32_sel *sel, __u32 key, __u32 mask, int off, int
 	if (key > 0xFF || mask > 0xFF)
 		return -1;
 
-	if ((off & 3) == 0) {
-		key <<= 24;
-		mask <<= 24;
-	} else if ((off & 3) == 1) {
-		key <<= 16;
-		mask <<= 16;
-	} else if ((off & 3) == 2) {
-		key <<= 8;
-		mask <<= 8;
-	}
-	off &= ~3;
-	key = htonl(key);
-	mask = htonl(mask);
+	return pack_key_at(sel, key << 24, mask << 24, off, offmask);
+}
+
+/* Bits set in a mask, a crude estimate of how selective a key is */
+static int u32_mask_bits(__u32 mask)
+{
+	int n = 0;
 
-	return pack_key(sel, key, mask, off, offmask);
+	for (; mask; mask &= mask - 1)
+		n++;
+	return n;
 }
 
+/*
+ * The kernel gives up on the whole filter list as soon as a key reads past
+ * the end of the packet, so keys only trade places where that cannot
+ * show: key x may be tried before key y, right ahead of it, if both read
+ * the same offset, or if x reads nearer and an earlier key already reads
+ * as far as y ("reach" is the furthest offset read before y).
+ */
+static int u32_key_may_pass(const struct tc_u32_key *x,
+			    const struct tc_u32_key *y, int reach)
+{
+	if (x->offmask != y->offmask)
+		return 0;
+	if (x->off == y->off)
+		return 1;
+	return x->off < y->off && y->off <= reach;
+}
+
+/* Furthest offset read by the first n keys like "k", or -1 */
+static int u32_key_reach(const struct tc_u32_key *keys, int n,
+			 const struct tc_u32_key *k)
+{
+	int i, reach = -1;
+
+	for (i = 0; i < n; i++)
+		if (keys[i].offmask == k->offmask && keys[i].off > reach)
+			reach = keys[i].off;
+	return reach;
+}
+
+/*
+ * Rewrite a selector into the cheapest equivalent key list: keys on the
+ * same word are merged, empty keys already implied by an earlier key
+ * further out are dropped and the rest are ordered so the key most
+ * likely to fail is tried first, as far as u32_key_may_pass() allows.
+ * With the node's perf counters the order follows how often each key let
+ * packets through; without them wider masks go first.  Contradicting
+ * keys are left as they are.  Returns the number of keys removed.
+ */
+int u32_optimize_sel(struct tc_u32_sel *sel, const struct tc_u32_pcnt *pf)
+{
+	struct tc_u32_key *k = sel->keys;
+	double pass[128];
+	int n = sel->nkeys;
+	int i, j, m;
+
+	if (n > 128)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		__u64 tried = pf ? (i ? pf->kcnts[i - 1] : pf->rcnt) : 0;
+
+		if (tried)
+			pass[i] = (double)pf->kcnts[i] / tried;
+		else
+			pass[i] = ldexp(1.0, -u32_mask_bits(k[i].mask));
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (k[j].off != k[i].off || k[j].offmask != k[i].offmask)
+				continue;
+			if ((k[i].val ^ k[j].val) & k[i].mask & k[j].mask)
+				continue;
+			/* k[j] has to get past everything in between */
+			for (m = j - 1; m > i; m--)
+				if (!u32_key_may_pass(&k[j], &k[m],
+						      u32_key_reach(k, m, &k[m])))
+					break;
+			if (m > i)
+				continue;
+			k[i].val |= k[j].val & k[j].mask;
+			k[i].mask |= k[j].mask;
+			pass[i] *= pass[j];
+			memmove(k + j, k + j + 1, (n - j - 1) * sizeof(*k));
+			memmove(pass + j, pass + j + 1, (n - j - 1) * sizeof(*pass));
+			n--;
+			j--;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (k[i].mask || u32_key_reach(k, i, &k[i]) < k[i].off)
+			continue;
+		memmove(k + i, k + i + 1, (n - i - 1) * sizeof(*k));
+		memmove(pass + i, pass + i + 1, (n - i - 1) * sizeof(*pass));
+		n--;
+		i--;
+	}
+
+	/* Stable, so ties keep the order they were written in */
+	for (i = 1; i < n; i++) {
+		struct tc_u32_key tk = k[i];
+		double tp = pass[i];
+
+		for (j = i; j > 0 && pass[j - 1] > tp &&
+		     u32_key_may_pass(&tk, &k[j - 1],
+				      u32_key_reach(k, j - 1, &k[j - 1])); j--) {
+			k[j] = k[j - 1];
+			pass[j] = pass[j - 1];
+		}
+		k[j] = tk;
+		pass[j] = tp;
+	}
+
+	i = sel->nkeys - n;
+	sel->nkeys = n;
+	return i;
+}
 
 int parse_at(int *argc_p, char ***argv_p, int *off, int *offmask)
 {
@@ -985,6 +1104,7 @@ static int u32_parse_opt(struct filter_util *qu, char *handle,
 	struct rtattr *tail;
 	int sel_ok = 0, terminal_ok = 0;
 	int sample_ok = 0;
+	int optimize = 0;
 	__u32 htid = 0;
 	__u32 order = 0;
 
@@ -1140,6 +1260,8 @@ static int u32_parse_opt(struct filter_util *qu, char *handle,
 			}
 			terminal_ok++;
 			continue;
+		} else if (matches(*argv, "optimize") == 0) {
+			optimize = 1;
 		} else if (strcmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -1165,6 +1287,8 @@ static int u32_parse_opt(struct filter_util *qu, char *handle,
 
 	if (htid)
 		addattr_l(n, MAX_MSG, TCA_U32_HASH, &htid, 4);
+	if (optimize)
+		u32_optimize_sel(&sel.sel, NULL);
 	if (sel_ok)
 		addattr_l(n, MAX_MSG, TCA_U32_SEL, &sel, 
 			  sizeof(sel.sel)+sel.sel.nkeys*sizeof(struct tc_u32_key));
@@ -35,7 +35,7 @@ int pedit_debug = 1;
 static void
 explain(void)
 {
-	fprintf(stderr, "Usage: ... pedit munge <MUNGE>\n");
+	fprintf(stderr, "Usage: ... pedit munge <MUNGE> [munge <MUNGE> ...] [dry-run]\n");
 	fprintf(stderr,
 		"Where: MUNGE := <RAW>|<LAYERED>\n"
 		"\t<RAW>:= <OFFSETC>[ATC]<CMD>\n "
@@ -47,6 +47,8 @@ explain(void)
 		"\t\tCMD:= clear | invert | set <setval>| retain\n "
 		"\t<LAYERED>:= ip <ipdata> | ip6 <ip6data> \n "
 		" \t\t| udp <udpdata> | tcp <tcpdata> | icmp <icmpdata> \n"
+		"Munges of the same 32 bit word are merged into one key,\n"
+		"dry-run shows the keys before and after and changes nothing\n"
 		"For Example usage look at the examples directory\n");
 
 }
@@ -184,14 +186,10 @@ pack_key16(__u32 retain,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey)
 		return -1;
 	}
 
+	/* As in pack_key32(), "retain" has the bits the key may change */
 	stride = 8 * ind;
-	tkey->val = htons(tkey->val);
-	if (stride > 0) {
-		tkey->val <<= stride;
-		tkey->mask <<= stride;
-		retain <<= stride;
-	}
-	tkey->mask = retain|m[ind];
+	tkey->val = htons(tkey->val & retain) << stride;
+	tkey->mask = htons((tkey->mask | ~retain) & 0xFFFF) << stride | m[ind];
 
 	tkey->off &= ~3;
 
@@ -222,10 +220,8 @@ pack_key8(__u32 retain,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey)
 
 	ind = tkey->off & 3;
 	stride = 8 * ind;
-	tkey->val <<= stride;
-	tkey->mask <<= stride;
-	retain <<= stride;
-	tkey->mask = retain|m[ind];
+	tkey->val = (tkey->val & retain) << stride;
+	tkey->mask = ((tkey->mask | ~retain) & 0xFF) << stride | m[ind];
 	tkey->off &= ~3;
 
 	if (pedit_debug)
@@ -233,6 +229,69 @@ pack_key8(__u32 retain,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey)
 	return pack_key(sel,tkey);
 }
 
+static int
+pedit_same_word(struct tc_pedit_key *a, struct tc_pedit_key *b)
+{
+	if (a->off != b->off || a->offmask != b->offmask)
+		return 0;
+	return !a->offmask || (a->at == b->at && a->shift == b->shift);
+}
+
+/*
+ * Two keys on one word compose into one: ((x & m1) ^ v1) & m2 ^ v2 is
+ * x & (m1 & m2) ^ ((v1 & m2) ^ v2). A key is folded into the last one
+ * on its word unless a key in between may touch that word, which only
+ * keys with an offmask can do. Keys left doing nothing are dropped,
+ * but the kernel wants at least one.
+ */
+int
+pedit_compact(struct tc_pedit_sel *sel)
+{
+	struct tc_pedit_key *k = sel->keys;
+	int i, j, n = sel->nkeys;
+
+	for (j = 1; j < n; j++) {
+		for (i = j - 1; i >= 0; i--)
+			if (pedit_same_word(&k[i], &k[j]) ||
+			    k[i].offmask || k[j].offmask)
+				break;
+		if (i < 0 || !pedit_same_word(&k[i], &k[j]))
+			continue;
+		k[i].val = (k[i].val & k[j].mask) ^ k[j].val;
+		k[i].mask &= k[j].mask;
+		memmove(k + j, k + j + 1, (n - j - 1) * sizeof(*k));
+		n--;
+		j--;
+	}
+
+	for (j = 0; j < n && n > 1; j++) {
+		if (k[j].mask != 0xFFFFFFFF || k[j].val)
+			continue;
+		memmove(k + j, k + j + 1, (n - j - 1) * sizeof(*k));
+		n--;
+		j--;
+	}
+
+	i = sel->nkeys - n;
+	sel->nkeys = n;
+	return i;
+}
+
+static void
+pedit_print_keys(FILE *f, struct tc_pedit_sel *sel)
+{
+	int i;
+	struct tc_pedit_key *key = sel->keys;
+
+	for (i=0; i<sel->nkeys; i++, key++) {
+		fprintf(f, "\n\t key #%d",i);
+		fprintf(f, "  at %d: val %08x mask %08x",
+		(unsigned int)key->off,
+		(unsigned int)ntohl(key->val),
+		(unsigned int)ntohl(key->mask));
+	}
+}
+
 int
 parse_val(int *argc_p, char ***argv_p, __u32 * val, int type)
 {
@@ -285,13 +344,13 @@ parse_cmd(int *argc_p, char ***argv_p, __u32 len, int type,__u32 retain,struct t
 		o = 0xFFFFFFFF;
 
 	if (matches(*argv, "invert") == 0) {
-		retain = val = mask = o;
+		val = mask = o;
 	} else if (matches(*argv, "set") == 0) {
 		NEXT_ARG();
 		if (parse_val(&argc, &argv, &val, type))
 			return -1;
 	} else if (matches(*argv, "preserve") == 0) {
-		retain = mask = o;
+		mask = o;
 	} else {
 		if (matches(*argv, "clear") != 0)
 			return -1;
@@ -307,19 +366,17 @@ parse_cmd(int *argc_p, char ***argv_p, __u32 len, int type,__u32 retain,struct t
 	}
 
 	tkey->val = val;
+	tkey->mask = mask;
 
 	if (len == 1) {
-		tkey->mask = 0xFF;
 		res = pack_key8(retain,sel,tkey);
 		goto done;
 	}
 	if (len == 2) {
-		tkey->mask = mask;
 		res = pack_key16(retain,sel,tkey);
 		goto done;
 	}
 	if (len == 4) {
-		tkey->mask = mask;
 		res = pack_key32(retain,sel,tkey);
 		goto done;
 	}
@@ -364,12 +421,12 @@ parse_offset(int *argc_p, char ***argv_p,struct tc_pedit_sel *sel,struct tc_pedi
 	}
 	if (matches(*argv, "u16") == 0) {
 		len = 2;
-		retain = 0x0;
+		retain = 0xFFFF;
 		goto done;
 	}
 	if (matches(*argv, "u8") == 0) {
 		len = 1;
-		retain = 0x0;
+		retain = 0xFF;
 		goto done;
 	}
 
@@ -438,6 +495,7 @@ parse_munge(int *argc_p, char ***argv_p,struct tc_pedit_sel *sel)
 			p = get_pedit_kind(k);
 			if (NULL == p)
 				goto bad_val;
+			NEXT_ARG();
 			res = p->parse_peopt(&argc, &argv, sel,&tkey);
 			if (res < 0) {
 				fprintf(stderr,"bad pedit parsing\n");
@@ -467,7 +525,7 @@ parse_pedit(struct action_util *a, int *argc_p, char ***argv_p, int tca_id, stru
 
 	int argc = *argc_p;
 	char **argv = *argv_p;
-	int ok = 0, iok = 0;
+	int ok = 0, iok = 0, dry = 0;
 	struct rtattr *tail;
 
 	memset(&sel, 0, sizeof(sel));
@@ -494,6 +552,10 @@ parse_pedit(struct action_util *a, int *argc_p, char ***argv_p, int tca_id, stru
 				return -1;
 			}
 			ok++;
+		} else if (strcmp(*argv, "dry-run") == 0) {
+			dry = 1;
+			argc--;
+			argv++;
 		} else {
 			break;
 		}
@@ -538,6 +600,18 @@ parse_pedit(struct action_util *a, int *argc_p, char ***argv_p, int tca_id, stru
 		}
 	}
 
+	if (dry) {
+		fprintf(stdout, "pedit: %d keys as written", sel.sel.nkeys);
+		pedit_print_keys(stdout, &sel.sel);
+	}
+	pedit_compact(&sel.sel);
+	if (dry) {
+		fprintf(stdout, "\npedit: %d keys merged", sel.sel.nkeys);
+		pedit_print_keys(stdout, &sel.sel);
+		fprintf(stdout, "\n");
+		exit(0);
+	}
+
 	tail = NLMSG_TAIL(n);
 	addattr_l(n, MAX_MSG, tca_id, NULL, 0);
 	addattr_l(n, MAX_MSG, TCA_PEDIT_PARMS,&sel, sizeof(sel.sel)+sel.sel.nkeys*sizeof(struct tc_pedit_key));
@@ -576,16 +650,7 @@ print_pedit(struct action_util *au,FILE * f, struct rtattr *arg)
 		}
 	}
 	if (sel->nkeys) {
-		int i;
-		struct tc_pedit_key *key = sel->keys;
-
-		for (i=0; i<sel->nkeys; i++, key++) {
-			fprintf(f, "\n\t key #%d",i);
-			fprintf(f, "  at %d: val %08x mask %08x",
-			(unsigned int)key->off,
-			(unsigned int)ntohl(key->val),
-			(unsigned int)ntohl(key->mask));
-		}
+		pedit_print_keys(f, sel);
 	} else {
 		fprintf(f, "\npedit %x keys %d is not LEGIT", sel->index,sel->nkeys);
 	}
@@ -52,6 +52,7 @@ extern int pack_key(struct tc_pedit_sel *sel,struct tc_pedit_key *tkey);
 extern int pack_key32(__u32 retain,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey);
 extern int pack_key16(__u32 retain,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey);
 extern int pack_key8(__u32 retain,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey);
+extern int pedit_compact(struct tc_pedit_sel *sel);
 extern int parse_val(int *argc_p, char ***argv_p, __u32 * val, int type);
 extern int parse_cmd(int *argc_p, char ***argv_p, __u32 len, int type,__u32 retain,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey);
 extern int parse_offset(int *argc_p, char ***argv_p,struct tc_pedit_sel *sel,struct tc_pedit_key *tkey);
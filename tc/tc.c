@@ -24,6 +24,8 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <dirent.h>
 
 #include "SNAPSHOT.h"
 #include "utils.h"
@@ -40,6 +42,9 @@ int use_iec = 0;
 int force = 0;
 struct rtnl_handle rth;
 
+static unsigned batch_window = 0;
+static char *server_path = NULL;
+
 static void *BODY = NULL;	/* cached handle dlopen(NULL) */
 static struct qdisc_util * qdisc_list;
 static struct filter_util * filter_list;
@@ -182,9 +187,11 @@ noexist:
 static void usage(void)
 {
 	fprintf(stderr, "Usage: tc [ OPTIONS ] OBJECT { COMMAND | help }\n"
-			"       tc [-force] -batch filename\n"
-	                "where  OBJECT := { qdisc | class | filter | action | monitor }\n"
-	                "       OPTIONS := { -s[tatistics] | -d[etails] | -r[aw] | -p[retty] | -b[atch] [filename] }\n");
+			"       tc [-force] [-window SIZE] -batch filename\n"
+			"       tc [ OPTIONS ] -server SOCKET\n"
+	                "where  OBJECT := { qdisc | class | filter | action | monitor | compile | simulate | reconcile }\n"
+	                "       OPTIONS := { -s[tatistics] | -d[etails] | -r[aw] | -p[retty] | -b[atch] [filename] |\n"
+	                "                    -w[indow] SIZE }\n");
 }
 
 static int do_cmd(int argc, char **argv)
@@ -204,6 +211,13 @@ static int do_cmd(int argc, char **argv)
 	if (matches(*argv, "monitor") == 0)
 		return do_tcmonitor(argc-1, argv+1);
 
+	if (matches(*argv, "compile") == 0)
+		return do_compile(argc-1, argv+1);
+	if (matches(*argv, "simulate") == 0)
+		return do_simulate(argc-1, argv+1);
+	if (matches(*argv, "reconcile") == 0)
+		return do_reconcile(argc-1, argv+1);
+
 	if (matches(*argv, "help") == 0) {
 		usage();
 		return 0;
@@ -214,11 +228,121 @@ static int do_cmd(int argc, char **argv)
 	return -1;
 }
 
+/* How get_qdisc_kind() and friends name module files and symbols */
+static const struct {
+	const char	*file;
+	const char	*sym;
+} server_modules[3] = {
+	{ "q_", "_qdisc_util" },
+	{ "f_", "_filter_util" },
+	{ "m_", "_action_util" },
+};
+
+static void server_preload(const char *name, int len)
+{
+	char kind[64];
+	int i, n;
+
+	for (i = 0; i < 3; i++) {
+		n = len - strlen(server_modules[i].sym);
+		if (n <= 0 || n >= sizeof(kind) ||
+		    strncmp(name + n, server_modules[i].sym, len - n))
+			continue;
+		memcpy(kind, name, n);
+		kind[n] = 0;
+		if (i == 0)
+			get_qdisc_kind(kind);
+		else if (i == 1)
+			get_filter_kind(kind);
+		else
+			get_action_kind(kind);
+		return;
+	}
+}
+
+/* Modules linked into tc, by the symbol get_qdisc_kind() and friends look up */
+static void server_preload_body(void)
+{
+	static const char *syms[] = {
+#include "tc_kinds.h"
+		NULL
+	};
+	int i;
+
+	for (i = 0; syms[i]; i++)
+		server_preload(syms[i], strlen(syms[i]));
+}
+
+/* Modules installed in the tc library directory, "q_<kind>.so" etc. */
+static void server_preload_lib(void)
+{
+	struct dirent *de;
+	char name[128];
+	DIR *dir;
+	int i, n;
+
+	if ((dir = opendir(get_tc_lib())) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		n = strlen(de->d_name) - 3;
+		if (n <= 2 || strcmp(de->d_name + n, ".so"))
+			continue;
+		for (i = 0; i < 3; i++)
+			if (strncmp(de->d_name, server_modules[i].file, 2) == 0)
+				break;
+		if (i == 3)
+			continue;
+		snprintf(name, sizeof(name), "%.*s%s", n - 2, de->d_name + 2,
+			 server_modules[i].sym);
+		server_preload(name, strlen(name));
+	}
+	closedir(dir);
+}
+
+static int server(const char *path)
+{
+	/* Resolve every module before forking, not once per command */
+	tc_core_init();
+	server_preload_body();
+	server_preload_lib();
+
+	if (rtnl_open(&rth, 0) < 0) {
+		fprintf(stderr, "Cannot open rtnetlink\n");
+		return -1;
+	}
+	return cmd_server(path, &rth, do_cmd) < 0 ? 1 : 0;
+}
+
+static int batch_error(int lineno, int error, void *arg)
+{
+	fprintf(stderr, "Command failed %s:%d\n", (const char *)arg, lineno);
+	return 0;
+}
+
+static void batch_summary(struct timeval *start, int cmds)
+{
+	struct rtnl_window *w = rth.window;
+	struct timeval now;
+	double secs;
+
+	gettimeofday(&now, NULL);
+	secs = (now.tv_sec - start->tv_sec) +
+		(now.tv_usec - start->tv_usec) / 1000000.;
+	if (secs <= 0)
+		secs = 1e-6;
+
+	fprintf(stderr, "%d commands in %.3f sec (%.0f cmd/sec), "
+		"%lu requests, %llu bytes sent, %lu failed\n",
+		cmds, secs, cmds / secs, w->sent, w->bytes, w->errors);
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
 	size_t len = 0;
 	int ret = 0;
+	int cmds = 0;
+	struct timeval start;
 
 	if (name && strcmp(name, "-") != 0) {
 		if (freopen(name, "r", stdin) == NULL) {
@@ -235,6 +359,13 @@ static int batch(const char *name)
 		return -1;
 	}
 
+	if (batch_window &&
+	    rtnl_window_open(&rth, batch_window, batch_error, (void *)name) < 0) {
+		rtnl_close(&rth);
+		return -1;
+	}
+	gettimeofday(&start, NULL);
+
 	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
 		char *largv[100];
@@ -244,16 +375,30 @@ static int batch(const char *name)
 		if (largc == 0)
 			continue;	/* blank line */
 
+		cmds++;
+		rtnl_window_tag(&rth, cmdlineno);
 		if (do_cmd(largc, largv)) {
 			fprintf(stderr, "Command failed %s:%d\n", name, cmdlineno);
 			ret = 1;
 			if (!force)
 				break;
 		}
+		if (rth.window && rth.window->errors) {
+			ret = 1;
+			if (!force)
+				break;
+		}
 	}
 	if (line)
 		free(line);
 
+	if (rth.window) {
+		if (rtnl_window_flush(&rth) < 0 || rth.window->errors)
+			ret = 1;
+		if (show_stats)
+			batch_summary(&start, cmds);
+		rtnl_window_close(&rth);
+	}
 	rtnl_close(&rth);
 	return ret;
 }
@@ -292,6 +437,19 @@ int main(int argc, char **argv)
 			if (argc > 2)
 				batchfile = argv[2];
 			argc--;	argv++;
+		} else if (matches(argv[1], "-server") == 0) {
+			if (argc <= 2) {
+				usage();
+				return -1;
+			}
+			server_path = argv[2];
+			argc--;	argv++;
+		} else if (matches(argv[1], "-window") == 0) {
+			if (argc <= 2 || get_unsigned(&batch_window, argv[2], 0)) {
+				fprintf(stderr, "Invalid window size\n");
+				return -1;
+			}
+			argc--;	argv++;
 		} else {
 			fprintf(stderr, "Option \"%s\" is unknown, try \"tc -help\".\n", argv[1]);
 			return -1;
@@ -299,9 +457,15 @@ int main(int argc, char **argv)
 		argc--;	argv++;
 	}
 
+	/* Commands name a device or two, not the table of the host */
+	ll_map_lazy = 1;
+
 	if (do_batching)
 		return batch(batchfile);
 
+	if (server_path)
+		return server(server_path);
+
 	if (argc <= 1) {
 		usage();
 		return 0;
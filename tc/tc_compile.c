@@ -0,0 +1,739 @@
+/*
+ * tc_compile.c		"tc compile": lay out a flat rule file as u32
+ *			hash tables.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Each line of the rule file lists IPv4 matches followed by what u32
+ * should do on a hit, first matching line wins:
+ *
+ *	dst 10.1.0.0/16 classid 1:10
+ *	src 192.168.0.7 dport 443 action drop
+ *
+ * The rules are spread over hash tables keyed on whichever header bits
+ * tell them apart best, recursively, and written out as "tc -batch"
+ * commands. A rule that does not care about the hashed bits is copied
+ * into every bucket it may match, so order is kept within each bucket.
+ * Bits a bucket already guarantees are not matched again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rt_names.h"
+#include "utils.h"
+#include "tc_util.h"
+#include "tc_common.h"
+
+#define U32C_WORDS	4	/* protocol, src, dst, ports */
+#define U32C_LEAF	8	/* buckets this small stay a list */
+#define U32C_DEPTH	4
+#define U32C_HTMAX	0x7ff	/* 800: and up are the kernel's own */
+#define U32C_CAND	3	/* windows per word scored exactly */
+#define U32C_BITS	8	/* u32 divisors go up to 256 */
+#define U32C_BUDGET	(64L << 20)	/* overlap tests per table */
+#define U32C_COPIES	1	/* extra copies allowed per rule */
+
+static const int u32c_off[U32C_WORDS] = { 8, 12, 16, 20 };
+
+struct u32c_rule
+{
+	__u32		val[U32C_WORDS];
+	__u32		mask[U32C_WORDS];
+	char		*target;
+	int		tid;		/* first rule with this target */
+};
+
+struct u32c_table;
+
+struct u32c_bucket
+{
+	int			cnt;
+	int			*rules;
+	struct u32c_table	*child;
+};
+
+struct u32c_table
+{
+	int			htid;
+	int			word;
+	int			shift;
+	int			bits;
+	struct u32c_bucket	*buckets;
+	int			ntail;
+	int			*tail;		/* rules after the link */
+	struct u32c_table	*next;		/* or a table of them */
+};
+
+/* Header bits fixed by the tables on the way to a bucket */
+struct u32c_path
+{
+	__u32		fixed[U32C_WORDS];
+};
+
+struct u32c_cost
+{
+	int		filters;
+	int		keys;
+};
+
+static struct u32c_rule *rules;
+static int nrules;
+static int ntables;
+static int nfilters;
+static long copies;
+static char prefix[256];
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: tc compile u32 rules FILE dev STRING { root | parent CLASSID }\n");
+	fprintf(stderr, "                      [ prio PRIO ]\n");
+	fprintf(stderr, "Where: FILE has one rule per line, the first match wins\n");
+	fprintf(stderr, "       RULE := [ MATCH ]... TARGET\n");
+	fprintf(stderr, "       MATCH := { src PREFIX | dst PREFIX | sport PORT | dport PORT |\n");
+	fprintf(stderr, "                  protocol PROTO }\n");
+	fprintf(stderr, "       TARGET := { classid CLASSID | action ACTION_SPEC | ... }\n");
+}
+
+static int u32c_match(struct u32c_rule *r, int w, __u32 val, __u32 mask)
+{
+	if ((r->val[w] ^ val) & r->mask[w] & mask)
+		return -1;
+	r->val[w] |= val & mask;
+	r->mask[w] |= mask;
+	return 0;
+}
+
+static int u32c_parse_rule(struct u32c_rule *r, int argc, char **argv)
+{
+	int len = 0, i;
+
+	memset(r, 0, sizeof(*r));
+	while (argc > 1) {
+		__u32 val, mask;
+		int w;
+
+		if (strcmp(*argv, "src") == 0 || strcmp(*argv, "dst") == 0) {
+			inet_prefix p;
+
+			w = **argv == 's' ? 1 : 2;
+			if (get_prefix(&p, argv[1], AF_INET)) {
+				fprintf(stderr, "Illegal \"%s\" prefix \"%s\"\n",
+					*argv, argv[1]);
+				return -1;
+			}
+			val = ntohl(p.data[0]);
+			mask = p.bitlen ? ~0U << (32 - p.bitlen) : 0;
+		} else if (strcmp(*argv, "sport") == 0 ||
+			   strcmp(*argv, "dport") == 0) {
+			__u16 port;
+
+			w = 3;
+			if (get_u16(&port, argv[1], 0)) {
+				fprintf(stderr, "Illegal \"%s\" \"%s\"\n",
+					*argv, argv[1]);
+				return -1;
+			}
+			val = port;
+			mask = 0xFFFF;
+			if (**argv == 's') {
+				val <<= 16;
+				mask <<= 16;
+			}
+		} else if (strcmp(*argv, "protocol") == 0) {
+			int proto = inet_proto_a2n(argv[1]);
+
+			w = 0;
+			if (proto < 0 || proto > 255) {
+				fprintf(stderr, "Illegal \"protocol\" \"%s\"\n",
+					argv[1]);
+				return -1;
+			}
+			val = proto << 16;
+			mask = 0x00FF0000;
+		} else
+			break;
+
+		if (u32c_match(r, w, val, mask)) {
+			fprintf(stderr, "\"%s %s\" contradicts the rule\n",
+				*argv, argv[1]);
+			return -1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc == 0) {
+		fprintf(stderr, "Rule has no classid or action\n");
+		return -1;
+	}
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	r->target = malloc(len + 1);
+	if (r->target == NULL)
+		return -1;
+	r->target[0] = 0;
+	for (i = 0; i < argc; i++) {
+		if (i)
+			strcat(r->target, " ");
+		strcat(r->target, argv[i]);
+	}
+	return 0;
+}
+
+static int u32c_load(const char *name)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int size = 0, ret = 0, saved = cmdlineno;
+	FILE *fp;
+
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "Cannot open rule file \"%s\": %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	cmdlineno = 0;
+	while (getcmdline(&line, &len, fp) != -1) {
+		char *largv[100];
+		int largc;
+
+		largc = makeargs(line, largv, 100);
+		if (largc == 0)
+			continue;
+		if (nrules == size) {
+			size = size ? 2 * size : 1024;
+			rules = realloc(rules, size * sizeof(*rules));
+			if (rules == NULL) {
+				ret = -1;
+				break;
+			}
+		}
+		if (u32c_parse_rule(&rules[nrules], largc, largv)) {
+			fprintf(stderr, "Bad rule %s:%d\n", name, cmdlineno);
+			ret = -1;
+			break;
+		}
+		nrules++;
+	}
+
+	free(line);
+	fclose(fp);
+	cmdlineno = saved;
+	return ret;
+}
+
+/* Rules with the same target may be matched in either order */
+static void u32c_intern(void)
+{
+	int size, i, *slot;
+
+	for (size = 16; size < 2 * nrules; size <<= 1)
+		;
+	slot = malloc(size * sizeof(int));
+	if (slot == NULL)
+		abort();
+	memset(slot, -1, size * sizeof(int));
+
+	for (i = 0; i < nrules; i++) {
+		const unsigned char *c;
+		unsigned h = 5381;
+
+		for (c = (unsigned char *)rules[i].target; *c; c++)
+			h = h * 33 + *c;
+		for (;; h++) {
+			int *sl = &slot[h & (size - 1)];
+
+			if (*sl < 0) {
+				*sl = i;
+				rules[i].tid = i;
+				break;
+			}
+			if (strcmp(rules[*sl].target, rules[i].target) == 0) {
+				rules[i].tid = rules[*sl].tid;
+				break;
+			}
+		}
+	}
+	free(slot);
+}
+
+static int u32c_disjoint(const struct u32c_rule *a, const struct u32c_rule *b)
+{
+	int w;
+
+	for (w = 0; w < U32C_WORDS; w++)
+		if ((a->val[w] ^ b->val[w]) & a->mask[w] & b->mask[w])
+			return 1;
+	return 0;
+}
+
+/*
+ * Mark the rules that do not look at the window and can wait behind the
+ * table: a packet that finds nothing in its bucket comes back to the
+ * nodes after the link. That is only right if no later rule that goes
+ * into the buckets, hashed or copied into all of them, could have
+ * matched the same packet with another target. Going backwards, whether
+ * a later rule stays behind the table is known when it is needed.
+ */
+static int u32c_tail(const int *idx, int n, int w, __u32 win, char *tail,
+		     int *inside)
+{
+	long budget = U32C_BUDGET;
+	int i, j, nin = 0, cnt = 0;
+
+	for (i = n - 1; i >= 0; i--) {
+		const struct u32c_rule *r = &rules[idx[i]];
+
+		tail[i] = 0;
+		if (!(r->mask[w] & win)) {
+			tail[i] = 1;
+			for (j = 0; j < nin; j++) {
+				const struct u32c_rule *q = &rules[idx[inside[j]]];
+
+				if (q->tid == r->tid)
+					continue;
+				if (--budget < 0 || !u32c_disjoint(r, q)) {
+					tail[i] = 0;
+					break;
+				}
+			}
+		}
+		if (tail[i])
+			cnt++;
+		else
+			inside[nin++] = i;
+	}
+	return cnt;
+}
+
+/*
+ * Count what hashing on bits [shift, shift + bits) of word w does to the
+ * rules not in the tail: load[] per bucket, the worst of them returned
+ * and every copy summed in *total.
+ */
+static int u32c_spread(const int *idx, int n, const char *tail, int w,
+		       int shift, int bits, int *load, long *total)
+{
+	__u32 win = (1U << bits) - 1;
+	int i, b, max = 0, all = 0;
+	long tot = 0;
+
+	memset(load, 0, sizeof(int) << bits);
+	for (i = 0; i < n; i++) {
+		const struct u32c_rule *r = &rules[idx[i]];
+		__u32 m = (r->mask[w] >> shift) & win;
+		__u32 v = (r->val[w] >> shift) & m;
+		__u32 f = ~m & win, s = 0;
+
+		if (tail[i])
+			continue;
+		if (m == 0) {
+			all++;
+			continue;
+		}
+		/* Every bucket agreeing with the rule on the bits it matches */
+		do {
+			load[v | s]++;
+			tot++;
+			s = (s - f) & f;
+		} while (s);
+	}
+	for (b = 0; b <= win; b++) {
+		load[b] += all;
+		if (load[b] > max)
+			max = load[b];
+	}
+	*total = tot + ((long)all << bits);
+	return max;
+}
+
+static struct u32c_table *u32c_build(const int *idx, int n,
+				     const struct u32c_path *path, int depth)
+{
+	static int load[1 << U32C_BITS];
+	struct u32c_table *t;
+	struct u32c_path down;
+	char *tail, *best_tail;
+	int *inside;
+	int bits, maxbits, w, b, i;
+	int best_cost = n, best_w = -1, best_shift = 0, best_bits = 0;
+	long best_total, best_extra = 0;
+
+	if (n <= U32C_LEAF || depth >= U32C_DEPTH || ntables >= U32C_HTMAX)
+		return NULL;
+
+	for (maxbits = 1; maxbits < U32C_BITS && (1 << maxbits) < n; maxbits++)
+		;
+
+	tail = malloc(n);
+	best_tail = malloc(n);
+	inside = malloc(n * sizeof(int));
+	if (tail == NULL || best_tail == NULL || inside == NULL)
+		abort();
+
+	for (w = 0; w < U32C_WORDS; w++) {
+		int ones[32], cover[32], cand[U32C_CAND];
+		long score[U32C_CAND];
+		int shift, j;
+
+		/* How evenly each bit splits the rules that match it */
+		memset(ones, 0, sizeof(ones));
+		memset(cover, 0, sizeof(cover));
+		for (i = 0; i < n; i++) {
+			const struct u32c_rule *r = &rules[idx[i]];
+
+			if (r->mask[w] == 0)
+				continue;
+			for (j = 0; j < 32; j++) {
+				if (!(r->mask[w] & (1U << j)))
+					continue;
+				cover[j]++;
+				if (r->val[w] & (1U << j))
+					ones[j]++;
+			}
+		}
+
+		/* Fewer buckets copy wildcards less often */
+		for (bits = maxbits; bits > 0; bits -= 2) {
+			for (j = 0; j < U32C_CAND; j++) {
+				cand[j] = -1;
+				score[j] = 0;
+			}
+			for (shift = 0; shift + bits <= 32; shift++) {
+				__u32 win = ((1U << bits) - 1) << shift;
+				long s = 0;
+
+				if (path->fixed[w] & win)
+					continue;
+				for (j = shift; j < shift + bits; j++)
+					s += ones[j] < cover[j] - ones[j] ?
+						ones[j] : cover[j] - ones[j];
+				if (s == 0)
+					continue;
+				for (j = U32C_CAND - 1; j >= 0 && s > score[j]; j--) {
+					if (j + 1 < U32C_CAND) {
+						cand[j + 1] = cand[j];
+						score[j + 1] = score[j];
+					}
+					cand[j] = shift;
+					score[j] = s;
+				}
+			}
+
+			for (j = 0; j < U32C_CAND && cand[j] >= 0; j++) {
+				__u32 win = ((1U << bits) - 1) << cand[j];
+				long total, extra;
+				int cost, max, ntail;
+
+				ntail = u32c_tail(idx, n, w, win, tail, inside);
+				max = u32c_spread(idx, n, tail, w, cand[j], bits,
+						  load, &total);
+				cost = ntail + max;
+
+				/* Copies of rules, all tables together, are bounded */
+				extra = total + ntail - n;
+				if (copies + extra > U32C_COPIES * (long)nrules)
+					continue;
+				if (cost < best_cost ||
+				    (cost == best_cost && best_w >= 0 && extra < best_extra)) {
+					best_cost = cost;
+					best_extra = extra;
+					best_w = w;
+					best_shift = cand[j];
+					best_bits = bits;
+					memcpy(best_tail, tail, n);
+				}
+			}
+		}
+	}
+	free(tail);
+	free(inside);
+
+	/* Another table only pays if it takes more than its own link */
+	if (best_w < 0 || best_cost + 1 >= n) {
+		free(best_tail);
+		return NULL;
+	}
+	bits = best_bits;
+	copies += best_extra;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		abort();
+	t->buckets = calloc(1 << bits, sizeof(struct u32c_bucket));
+	t->tail = malloc(n * sizeof(int));
+	if (t->buckets == NULL || t->tail == NULL)
+		abort();
+	t->htid = ++ntables;
+	t->word = best_w;
+	t->shift = best_shift;
+	t->bits = bits;
+
+	u32c_spread(idx, n, best_tail, best_w, best_shift, bits, load,
+		    &best_total);
+	for (b = 0; b < (1 << bits); b++) {
+		t->buckets[b].rules = malloc(load[b] * sizeof(int) + 1);
+		if (t->buckets[b].rules == NULL)
+			abort();
+	}
+	for (i = 0; i < n; i++) {
+		const struct u32c_rule *r = &rules[idx[i]];
+		__u32 win = (1U << bits) - 1;
+		__u32 m = (r->mask[best_w] >> best_shift) & win;
+		__u32 v = (r->val[best_w] >> best_shift) & m;
+		__u32 f = ~m & win, s = 0;
+
+		if (best_tail[i]) {
+			t->tail[t->ntail++] = idx[i];
+			continue;
+		}
+		do {
+			struct u32c_bucket *bk = &t->buckets[v | s];
+
+			bk->rules[bk->cnt++] = idx[i];
+			s = (s - f) & f;
+		} while (s);
+	}
+	free(best_tail);
+
+	down = *path;
+	down.fixed[best_w] |= ((1U << bits) - 1) << best_shift;
+	for (b = 0; b < (1 << bits); b++) {
+		struct u32c_bucket *bk = &t->buckets[b];
+
+		bk->child = u32c_build(bk->rules, bk->cnt, &down, depth + 1);
+		if (bk->child) {
+			free(bk->rules);
+			bk->rules = NULL;
+			bk->cnt = 0;
+		}
+	}
+
+	t->next = u32c_build(t->tail, t->ntail, path, depth);
+	if (t->next) {
+		free(t->tail);
+		t->tail = NULL;
+		t->ntail = 0;
+	}
+	return t;
+}
+
+static int u32c_rule(FILE *fp, const char *ht, const struct u32c_rule *r,
+		     const struct u32c_path *path)
+{
+	int w, keys = 0;
+
+	if (fp)
+		fprintf(fp, "%s u32 ht %s", prefix, ht);
+	for (w = 0; w < U32C_WORDS; w++) {
+		__u32 m = r->mask[w] & ~path->fixed[w];
+
+		if (m == 0)
+			continue;
+		if (fp)
+			fprintf(fp, " match u32 0x%08x 0x%08x at %d",
+				r->val[w] & m, m, u32c_off[w]);
+		keys++;
+	}
+	if (fp)
+		fprintf(fp, "%s %s\n", keys ? "" : " match u32 0 0 at 0",
+			r->target);
+	nfilters++;
+	return keys ? keys : 1;
+}
+
+static void u32c_link(FILE *fp, const char *ht, const struct u32c_table *t)
+{
+	if (fp)
+		fprintf(fp, "%s u32 ht %s match u32 0 0 at 0 hashkey mask 0x%08x at %d link %x:\n",
+			prefix, ht, ((1U << t->bits) - 1) << t->shift,
+			u32c_off[t->word], t->htid);
+	nfilters++;
+}
+
+static struct u32c_cost u32c_emit_link(FILE *fp, const char *ht,
+					const struct u32c_table *t,
+					const struct u32c_path *path);
+
+/*
+ * Write out a table, its children before it is linked to them, and
+ * return the worst case below it. Without fp only count.
+ */
+static struct u32c_cost u32c_emit(FILE *fp, const struct u32c_table *t,
+				  const struct u32c_path *path)
+{
+	struct u32c_cost worst = { 0, 0 };
+	struct u32c_path down = *path;
+	int b, i;
+
+	down.fixed[t->word] |= ((1U << t->bits) - 1) << t->shift;
+
+	if (fp)
+		fprintf(fp, "%s handle %x: u32 divisor %d\n", prefix, t->htid,
+			1 << t->bits);
+	nfilters++;
+
+	for (b = 0; b < (1 << t->bits); b++) {
+		const struct u32c_bucket *bk = &t->buckets[b];
+		struct u32c_cost c = { 0, 0 };
+		char ht[32];
+
+		snprintf(ht, sizeof(ht), "%x:%x:", t->htid, b);
+		if (bk->child)
+			c = u32c_emit_link(fp, ht, bk->child, &down);
+		for (i = 0; i < bk->cnt; i++) {
+			c.keys += u32c_rule(fp, ht, &rules[bk->rules[i]], &down);
+			c.filters++;
+		}
+		if (c.filters > worst.filters)
+			worst.filters = c.filters;
+		if (c.keys > worst.keys)
+			worst.keys = c.keys;
+	}
+	return worst;
+}
+
+/* A table, the link to it from ht and the rules waiting behind it */
+static struct u32c_cost u32c_emit_link(FILE *fp, const char *ht,
+					const struct u32c_table *t,
+					const struct u32c_path *path)
+{
+	struct u32c_cost c;
+	int i;
+
+	c = u32c_emit(fp, t, path);
+	u32c_link(fp, ht, t);
+	c.filters++;
+	c.keys++;
+	if (t->next) {
+		struct u32c_cost n = u32c_emit_link(fp, ht, t->next, path);
+
+		c.filters += n.filters;
+		c.keys += n.keys;
+	}
+	for (i = 0; i < t->ntail; i++) {
+		c.keys += u32c_rule(fp, ht, &rules[t->tail[i]], path);
+		c.filters++;
+	}
+	return c;
+}
+
+static struct u32c_cost u32c_emit_root(FILE *fp, const struct u32c_table *t)
+{
+	struct u32c_path path;
+	struct u32c_cost c = { 0, 0 };
+	int i;
+
+	memset(&path, 0, sizeof(path));
+	nfilters = 0;
+	if (t)
+		return u32c_emit_link(fp, "800::", t, &path);
+	for (i = 0; i < nrules; i++) {
+		c.keys += u32c_rule(fp, "800::", &rules[i], &path);
+		c.filters++;
+	}
+	return c;
+}
+
+int do_compile(int argc, char **argv)
+{
+	struct u32c_table *root;
+	struct u32c_path path;
+	struct u32c_cost worst;
+	char *file = NULL, *dev = NULL, *parent = NULL;
+	__u32 prio = 1;
+	long flat = 0;
+	int *idx, i, w;
+
+	if (argc < 1 || matches(*argv, "help") == 0) {
+		usage();
+		return argc < 1 ? -1 : 0;
+	}
+	if (strcmp(*argv, "u32") != 0) {
+		fprintf(stderr, "Cannot compile \"%s\", only u32 is supported\n",
+			*argv);
+		return -1;
+	}
+	argc--; argv++;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "rules") == 0) {
+			NEXT_ARG();
+			file = *argv;
+		} else if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			dev = *argv;
+		} else if (strcmp(*argv, "root") == 0) {
+			parent = "root";
+		} else if (strcmp(*argv, "parent") == 0) {
+			__u32 handle;
+
+			NEXT_ARG();
+			if (get_tc_classid(&handle, *argv))
+				invarg(*argv, "invalid parent ID");
+			parent = *argv;
+		} else if (matches(*argv, "priority") == 0 ||
+			   matches(*argv, "preference") == 0) {
+			NEXT_ARG();
+			if (get_u32(&prio, *argv, 0) || prio == 0 || prio > 0xFFFF)
+				invarg(*argv, "invalid priority");
+		} else if (matches(*argv, "help") == 0) {
+			usage();
+			return 0;
+		} else {
+			fprintf(stderr, "What is \"%s\"? Try \"tc compile help\".\n",
+				*argv);
+			return -1;
+		}
+		argc--; argv++;
+	}
+
+	if (!file || !dev || !parent) {
+		fprintf(stderr, "\"rules\", \"dev\" and \"parent\" are required.\n");
+		return -1;
+	}
+
+	if (u32c_load(file))
+		return -1;
+	u32c_intern();
+
+	idx = malloc(nrules * sizeof(int) + 1);
+	if (idx == NULL)
+		return -1;
+	for (i = 0; i < nrules; i++) {
+		int keys = 0;
+
+		idx[i] = i;
+		for (w = 0; w < U32C_WORDS; w++)
+			if (rules[i].mask[w])
+				keys++;
+		flat += keys ? keys : 1;
+	}
+	memset(&path, 0, sizeof(path));
+	root = u32c_build(idx, nrules, &path, 0);
+	free(idx);
+
+	snprintf(prefix, sizeof(prefix),
+		 "filter add dev %s %s%s prio %u protocol ip", dev,
+		 strcmp(parent, "root") ? "parent " : "", parent, prio);
+
+	worst = u32c_emit_root(NULL, root);
+	printf("# %d rules in %d hash tables, %d filters\n",
+	       nrules, ntables, nfilters);
+	printf("# worst case lookup: %d filters, %d keys "
+	       "(a flat chain: %d filters, %ld keys)\n",
+	       worst.filters, worst.keys, nrules, flat);
+	u32c_emit_root(stdout, root);
+	return 0;
+}
@@ -0,0 +1,35 @@
+"police_action_util",
+"bfifo_qdisc_util",
+"pfifo_qdisc_util",
+"pfifo_head_drop_qdisc_util",
+"pfifo_fast_qdisc_util",
+"sfq_qdisc_util",
+"red_qdisc_util",
+"prio_qdisc_util",
+"tbf_qdisc_util",
+"cbq_qdisc_util",
+"rr_qdisc_util",
+"multiq_qdisc_util",
+"netem_qdisc_util",
+"rsvp_filter_util",
+"rsvp6_filter_util",
+"u32_filter_util",
+"route_filter_util",
+"fw_filter_util",
+"basic_filter_util",
+"flow_filter_util",
+"cgroup_filter_util",
+"dsmark_qdisc_util",
+"gred_qdisc_util",
+"tcindex_filter_util",
+"ingress_qdisc_util",
+"hfsc_qdisc_util",
+"htb_qdisc_util",
+"htb2_qdisc_util",
+"drr_qdisc_util",
+"gact_action_util",
+"mirred_action_util",
+"nat_action_util",
+"pedit_action_util",
+"skbedit_action_util",
+"ipt_action_util",
@@ -0,0 +1,1436 @@
+/*
+ * tc_reconcile.c	"tc reconcile": bring the qdiscs, classes and filters
+ *			of a device in line with a file.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * The file holds the wanted tree as "qdisc add", "class add" and
+ * "filter add" commands in batch syntax. The tree on the device is
+ * dumped as "tc qdisc/class/filter show" do it, and both sides are put
+ * through the same printers, so an object is left alone when it would
+ * show the same. What differs is deleted, changed or added:
+ *
+ *  - a qdisc is matched by its parent and replaced when its handle
+ *    differs, deleted and added again when only its kind does (the
+ *    kernel will not swap the kind under a handle), changed when its
+ *    options do, or deleted and added again when its kind has no
+ *    "change" in the kernel;
+ *  - a class is matched by its classid and deleted and added again
+ *    when its kind or parent differ, changed when its options do;
+ *  - filters are matched a whole priority at a time, the classifier
+ *    instance the kernel keeps for it, and a priority whose filters
+ *    differ is deleted and added again;
+ *  - except for u32, whose hash tables all priorities of a qdisc share:
+ *    its tables and nodes are matched by handle and deleted or added
+ *    one at a time, see rc_u32_nodes().
+ *
+ * Options are compared as the parser fills them in, so one left out
+ * of a line stands for the value "add" would give it. Only a line with
+ * no options at all, or a "key 0" pair the kernel does not report,
+ * leaves the value to the kernel.
+ *
+ * Deletions go first: filters, so no class is still bound to one, then
+ * classes from the leaves up and qdiscs. Qdiscs and classes are then
+ * added and changed from the root down and filters come last.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+#include "rt_names.h"
+#include "utils.h"
+#include "tc_util.h"
+#include "tc_common.h"
+
+#define RC_ARGS		100
+
+enum { RC_QDISC, RC_CLASS, RC_FILTER };
+
+enum {
+	RC_KEEP,
+	RC_CHANGE,
+	RC_ADD,
+	RC_REPLACE,		/* qdisc of another kind or handle */
+	RC_DELETE,
+	RC_GONE,		/* goes away with its parent */
+};
+
+struct rc_obj
+{
+	struct rc_obj		*next;
+	struct rc_obj		*peer;		/* same object on the other side */
+	int			type;
+	int			line;		/* 0 if dumped */
+	int			op;
+	int			explicit;	/* handle given in the file */
+	__u32			handle;
+	__u32			parent;
+	__u32			info;		/* filters: prio and protocol */
+	__u32			location;	/* u32: table, or bucket of a node */
+	int			table;		/* u32: a hash table */
+	struct rc_group		*root;		/* u32: node in its root table */
+	__u32			node;		/* u32: node id, foreseen if wanted */
+	int			kindpos;	/* wanted: where argv has the kind */
+	char			kind[16];
+	char			*text;
+	struct nlmsghdr		*n;
+	int			argc;		/* wanted: command after its verb */
+	char			**argv;
+};
+
+/* The filters of one parent and priority, wanted [0] and dumped [1] */
+struct rc_group
+{
+	struct rc_group		*next;
+	__u32			parent;
+	__u32			info;
+	int			u32;
+	__u32			htid[2];	/* u32: root table, foreseen and dumped */
+	int			del, add;
+	int			nodes;		/* u32: some go or come on their own */
+	int			gone;		/* dumped ones go with their parent */
+	int			line;
+	int			cnt[2];
+	struct rc_obj		**f[2];
+};
+
+struct rc_cmd
+{
+	struct rc_cmd		*next;
+	int			argc;
+	char			**argv;
+};
+
+static struct rc_obj *want, **want_tail = &want;
+static struct rc_obj *have, **have_tail = &have;
+static struct rc_group *groups;
+static struct rc_cmd *cmds, **cmds_tail = &cmds;
+static int ifindex;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: tc reconcile file FILE dev STRING [ plan ]\n");
+	fprintf(stderr, "Where: FILE has \"qdisc add\", \"class add\" and \"filter add\"\n");
+	fprintf(stderr, "       lines in batch syntax; filters need a \"prio\".\n");
+	fprintf(stderr, "       \"plan\" prints the commands instead of running them.\n");
+}
+
+static struct rc_obj *rc_find(struct rc_obj *list, int type, __u32 handle)
+{
+	for (; list; list = list->next)
+		if (list->type == type && list->handle == handle)
+			return list;
+	return NULL;
+}
+
+/* What a qdisc, class or filter hangs off: a class, or a qdisc */
+static struct rc_obj *rc_owner(struct rc_obj *list, __u32 parent)
+{
+	if (parent == TC_H_ROOT || parent == TC_H_INGRESS)
+		return NULL;
+	if (TC_H_MIN(parent))
+		return rc_find(list, RC_CLASS, parent);
+	return rc_find(list, RC_QDISC, parent);
+}
+
+static int rc_depth(struct rc_obj *list, struct rc_obj *o)
+{
+	int depth = 0;
+
+	while (o && depth < 64) {
+		o = rc_owner(list, o->parent);
+		depth++;
+	}
+	return depth;
+}
+
+static int rc_parse(struct rc_obj *o, int argc, char **argv, const char *dev)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct tcmsg	t;
+		char		buf[MAX_MSG];
+	} req;
+	struct qdisc_util *q = NULL;
+	struct filter_util *fu = NULL;
+	struct tc_estimator est;
+	char *fhandle = NULL, *d = NULL, **argv0 = argv;
+	__u32 prio = 0, protocol = ETH_P_ALL;
+	static const int cmd[] = { RTM_NEWQDISC, RTM_NEWTCLASS, RTM_NEWTFILTER };
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_type = cmd[o->type];
+	req.t.tcm_family = AF_UNSPEC;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			d = *argv;
+		} else if (strcmp(*argv, "root") == 0) {
+			req.t.tcm_parent = TC_H_ROOT;
+		} else if (o->type == RC_QDISC && strcmp(*argv, "ingress") == 0) {
+			req.t.tcm_parent = TC_H_INGRESS;
+			req.t.tcm_handle = 0xffff0000;
+			strcpy(o->kind, "ingress");
+			q = get_qdisc_kind(o->kind);
+			argc--; argv++;
+			break;
+		} else if (strcmp(*argv, "parent") == 0) {
+			NEXT_ARG();
+			if (get_tc_classid(&req.t.tcm_parent, *argv))
+				invarg(*argv, "invalid parent ID");
+		} else if (o->type == RC_QDISC && strcmp(*argv, "handle") == 0) {
+			NEXT_ARG();
+			if (get_qdisc_handle(&req.t.tcm_handle, *argv))
+				invarg(*argv, "invalid qdisc ID");
+		} else if (o->type == RC_CLASS && strcmp(*argv, "classid") == 0) {
+			NEXT_ARG();
+			if (get_tc_classid(&req.t.tcm_handle, *argv))
+				invarg(*argv, "invalid class ID");
+		} else if (o->type == RC_FILTER && strcmp(*argv, "handle") == 0) {
+			NEXT_ARG();
+			fhandle = *argv;
+		} else if (o->type == RC_FILTER &&
+			   (matches(*argv, "preference") == 0 ||
+			    matches(*argv, "priority") == 0)) {
+			NEXT_ARG();
+			if (get_u32(&prio, *argv, 0) || prio > 0xFFFF)
+				invarg(*argv, "invalid priority value");
+		} else if (o->type == RC_FILTER && matches(*argv, "protocol") == 0) {
+			__u16 id;
+
+			NEXT_ARG();
+			if (ll_proto_a2n(&id, *argv))
+				invarg(*argv, "invalid protocol");
+			protocol = id;
+		} else if (matches(*argv, "estimator") == 0) {
+			if (parse_estimator(&argc, &argv, &est))
+				return -1;
+		} else {
+			strncpy(o->kind, *argv, sizeof(o->kind)-1);
+			o->kindpos = argv - argv0;
+			if (o->type == RC_FILTER)
+				fu = get_filter_kind(o->kind);
+			else
+				q = get_qdisc_kind(o->kind);
+			argc--; argv++;
+			break;
+		}
+		argc--; argv++;
+	}
+
+	if (d == NULL) {
+		fprintf(stderr, "No \"dev\" given\n");
+		return -1;
+	}
+	if (strcmp(d, dev))
+		return 1;
+	if (o->kind[0] == 0) {
+		fprintf(stderr, "No kind given\n");
+		return -1;
+	}
+	if (o->type == RC_CLASS && req.t.tcm_handle == 0) {
+		fprintf(stderr, "Classes need a \"classid\"\n");
+		return -1;
+	}
+	if (o->type == RC_FILTER && prio == 0) {
+		fprintf(stderr, "Filters need a \"prio\" to be told apart\n");
+		return -1;
+	}
+	if (o->type != RC_QDISC && req.t.tcm_parent == 0) {
+		fprintf(stderr, "No \"parent\" given\n");
+		return -1;
+	}
+
+	addattr_l(&req.n, sizeof(req), TCA_KIND, o->kind, strlen(o->kind)+1);
+	if (o->type == RC_FILTER) {
+		req.t.tcm_info = TC_H_MAKE(prio<<16, protocol);
+		if (fu == NULL) {
+			fprintf(stderr, "Unknown filter \"%s\"\n", o->kind);
+			return -1;
+		}
+		if (fu->parse_fopt(fu, fhandle, argc, argv, &req.n))
+			return -1;
+	} else if (o->type == RC_CLASS) {
+		if (q == NULL || q->parse_copt == NULL) {
+			fprintf(stderr, "\"%s\" has no classes\n", o->kind);
+			return -1;
+		}
+		if (q->parse_copt(q, argc, argv, &req.n))
+			return -1;
+	} else if (q && q->parse_qopt) {
+		if (q->parse_qopt(q, argc, argv, &req.n))
+			return -1;
+	} else if (argc) {
+		fprintf(stderr, "Cannot parse \"%s\" options\n", o->kind);
+		return -1;
+	}
+	req.t.tcm_ifindex = ifindex;
+
+	o->handle = req.t.tcm_handle;
+	o->parent = req.t.tcm_parent;
+	o->info = req.t.tcm_info;
+	o->explicit = o->type == RC_FILTER ? fhandle != NULL : o->handle != 0;
+	o->n = malloc(req.n.nlmsg_len);
+	if (o->n == NULL)
+		return -1;
+	memcpy(o->n, &req.n, req.n.nlmsg_len);
+	return 0;
+}
+
+static int rc_load(const char *name, const char *dev)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int ret = 0, saved = cmdlineno;
+	FILE *fp;
+
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "Cannot open \"%s\": %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	cmdlineno = 0;
+	while (getcmdline(&line, &len, fp) != -1) {
+		char *largv[RC_ARGS], *copy;
+		struct rc_obj *o;
+		int largc, err;
+
+		if ((copy = strdup(line)) == NULL) {
+			ret = -1;
+			break;
+		}
+		largc = makeargs(line, largv, RC_ARGS);
+		if (largc == 0) {
+			free(copy);
+			continue;
+		}
+		if (largc < 2 || (matches(largv[1], "add") &&
+				  matches(largv[1], "replace"))) {
+			fprintf(stderr, "Only additions make a tree, %s:%d\n",
+				name, cmdlineno);
+			ret = -1;
+			break;
+		}
+
+		o = calloc(1, sizeof(*o));
+		if (o == NULL) {
+			ret = -1;
+			break;
+		}
+		if (matches(largv[0], "qdisc") == 0)
+			o->type = RC_QDISC;
+		else if (matches(largv[0], "class") == 0)
+			o->type = RC_CLASS;
+		else if (matches(largv[0], "filter") == 0)
+			o->type = RC_FILTER;
+		else {
+			fprintf(stderr, "What is \"%s\"? %s:%d\n", largv[0],
+				name, cmdlineno);
+			free(o);
+			ret = -1;
+			break;
+		}
+		o->line = cmdlineno;
+
+		err = rc_parse(o, largc - 2, largv + 2, dev);
+		if (err) {
+			free(o);
+			free(copy);
+			if (err > 0)
+				continue;
+			fprintf(stderr, "Bad line %s:%d\n", name, cmdlineno);
+			ret = -1;
+			break;
+		}
+
+		/* Parsers may scribble on their arguments, keep the words */
+		o->argv = malloc(RC_ARGS * sizeof(char *));
+		if (o->argv == NULL) {
+			ret = -1;
+			break;
+		}
+		o->argc = makeargs(copy, o->argv, RC_ARGS) - 2;
+		o->argv += 2;
+		*want_tail = o;
+		want_tail = &o->next;
+	}
+
+	free(line);
+	fclose(fp);
+	cmdlineno = saved;
+	return ret;
+}
+
+struct rc_dump_arg
+{
+	int		type;
+	__u32		parent;
+};
+
+static int rc_dump_one(const struct sockaddr_nl *who, struct nlmsghdr *n,
+		       void *arg)
+{
+	struct rc_dump_arg *a = arg;
+	struct tcmsg *t = NLMSG_DATA(n);
+	struct rtattr *tb[TCA_MAX+1];
+	struct rc_obj *o;
+	int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*t));
+
+	if (len < 0 || t->tcm_ifindex != ifindex)
+		return 0;
+	parse_rtattr(tb, TCA_MAX, TCA_RTA(t), len);
+	if (tb[TCA_KIND] == NULL)
+		return 0;
+	/*
+	 * Default qdiscs nobody added have no handle, and each filter
+	 * priority leads with a header that has none either.
+	 */
+	if (a->type != RC_CLASS && t->tcm_handle == 0)
+		return 0;
+	/* Top level classes come back as children of "root" */
+	if (a->type == RC_CLASS && t->tcm_parent == TC_H_ROOT)
+		t->tcm_parent = TC_H_MAJ(t->tcm_handle);
+
+	o = calloc(1, sizeof(*o));
+	if (o == NULL || (o->n = malloc(n->nlmsg_len)) == NULL)
+		return -1;
+	memcpy(o->n, n, n->nlmsg_len);
+	o->type = a->type;
+	o->handle = t->tcm_handle;
+	o->parent = a->type == RC_FILTER ? a->parent : t->tcm_parent;
+	o->info = t->tcm_info;
+	strncpy(o->kind, RTA_DATA(tb[TCA_KIND]), sizeof(o->kind)-1);
+	*have_tail = o;
+	have_tail = &o->next;
+	return 0;
+}
+
+static int rc_dump(int type, __u32 parent)
+{
+	static const int cmd[] = { RTM_GETQDISC, RTM_GETTCLASS, RTM_GETTFILTER };
+	struct rc_dump_arg a = { type, parent };
+	struct tcmsg t;
+
+	memset(&t, 0, sizeof(t));
+	t.tcm_family = AF_UNSPEC;
+	t.tcm_ifindex = ifindex;
+	t.tcm_parent = parent;
+
+	if (rtnl_dump_request(&rth, cmd[type], &t, sizeof(t)) < 0) {
+		perror("Cannot send dump request");
+		return -1;
+	}
+	if (rtnl_dump_filter(&rth, rc_dump_one, &a, NULL, NULL) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* As "tc qdisc show", then the classes, then the filters of each */
+static int rc_dump_tree(void)
+{
+	struct rc_obj *o;
+
+	if (rc_dump(RC_QDISC, 0) || rc_dump(RC_CLASS, 0))
+		return -1;
+	for (o = have; o && o->type != RC_FILTER; o = o->next)
+		if (rc_dump(RC_FILTER, o->handle))
+			return -1;
+	return 0;
+}
+
+/*
+ * Where a u32 filter sits is not something the printer shows the same
+ * for both sides, so take it out of the message: tables by handle,
+ * nodes by table and bucket, 0 when the file leaves it to the kernel.
+ */
+static void rc_u32_locate(struct rc_obj *o)
+{
+	struct tcmsg *t = NLMSG_DATA(o->n);
+	struct rtattr *tb[TCA_MAX+1], *opt[TCA_U32_MAX+1];
+
+	parse_rtattr(tb, TCA_MAX, TCA_RTA(t),
+		     o->n->nlmsg_len - NLMSG_LENGTH(sizeof(*t)));
+	if (tb[TCA_OPTIONS] == NULL)
+		return;
+	parse_rtattr_nested(opt, TCA_U32_MAX, tb[TCA_OPTIONS]);
+	if (opt[TCA_U32_DIVISOR]) {
+		o->table = 1;
+		o->location = TC_U32_HTID(o->handle);
+	} else if (opt[TCA_U32_HASH]) {
+		o->location = *(__u32 *)RTA_DATA(opt[TCA_U32_HASH]);
+		opt[TCA_U32_HASH]->rta_type = TCA_U32_UNSPEC;
+	}
+}
+
+static char *rc_text(struct rc_obj *o, int keep_handle)
+{
+	struct tcmsg *t = NLMSG_DATA(o->n);
+	int stats = show_stats, details = show_details;
+	__u32 handle = t->tcm_handle;
+	char *buf = NULL;
+	size_t len;
+	FILE *fp;
+
+	if ((fp = open_memstream(&buf, &len)) == NULL)
+		return NULL;
+	show_stats = show_details = 0;
+	if (!keep_handle)
+		t->tcm_handle = 0;
+	if (o->type == RC_QDISC)
+		print_qdisc(NULL, o->n, fp);
+	else if (o->type == RC_CLASS)
+		print_class(NULL, o->n, fp);
+	else
+		print_filter(NULL, o->n, fp);
+	t->tcm_handle = handle;
+	show_stats = stats;
+	show_details = details;
+	fclose(fp);
+	return buf;
+}
+
+/* A "key 0" the kernel leaves out of its dump */
+static int rc_zero(const char *s)
+{
+	if (strncmp(s, "0x", 2) == 0)
+		s += 2;
+	if (*s != '0')
+		return 0;
+	s += strspn(s, "0");
+	return s[strspn(s, "abcdefghijklmnopqrstuvwxyz:")] == 0;
+}
+
+/* Words followed by what the kernel hands out or counts */
+static int rc_counter(const char *s)
+{
+	static const char *words[] = { "index", "ref", "bind", "police",
+				       "(success", "direct_packets_stat" };
+	int i;
+
+	for (i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+		if (strcmp(s, words[i]) == 0)
+			return 1;
+	return 0;
+}
+
+static int rc_bare(struct rc_obj *o)
+{
+	struct tcmsg *t = NLMSG_DATA(o->n);
+	struct rtattr *tb[TCA_MAX+1];
+
+	parse_rtattr(tb, TCA_MAX, TCA_RTA(t),
+		     o->n->nlmsg_len - NLMSG_LENGTH(sizeof(*t)));
+	return tb[TCA_OPTIONS] == NULL;
+}
+
+static int rc_split(char *s, char **v, int max)
+{
+	char *save;
+	int n = 0;
+
+	for (s = strtok_r(s, " \t\n", &save); s && n < max;
+	     s = strtok_r(NULL, " \t\n", &save))
+		v[n++] = s;
+	return n;
+}
+
+static int rc_reports(char **v, int n, const char *key)
+{
+	while (n-- > 0)
+		if (strcmp(v[n], key) == 0)
+			return 1;
+	return 0;
+}
+
+static int rc_same(const char *want_text, const char *have_text, int type)
+{
+	char *a = strdup(want_text), *b = strdup(have_text);
+	char *wa[256], *wb[256];
+	int na, nb, i = 0, j = 0;
+
+	if (a == NULL || b == NULL) {
+		free(a);
+		free(b);
+		return 0;
+	}
+	na = rc_split(a, wa, 256);
+	nb = rc_split(b, wb, 256);
+	while (i < na && j < nb) {
+		if (strcmp(wa[i], wb[j]) == 0 ||
+		    (i > 0 && rc_counter(wa[i-1]))) {
+			i++, j++;
+			continue;
+		}
+		/* "key 0" the kernel does not report at all */
+		if (type != RC_FILTER && i+1 < na && rc_zero(wa[i+1]) &&
+		    !rc_reports(wb, nb, wa[i])) {
+			i += 2;
+			continue;
+		}
+		break;
+	}
+	while (type != RC_FILTER && i+1 < na && rc_zero(wa[i+1]) &&
+	       !rc_reports(wb, nb, wa[i]))
+		i += 2;
+	free(a);
+	free(b);
+	return i == na && j == nb;
+}
+
+static int rc_gone(struct rc_obj *o)
+{
+	return o && (o->op == RC_DELETE || o->op == RC_GONE);
+}
+
+static int rc_new(struct rc_obj *o)
+{
+	return o && (o->op == RC_ADD || o->op == RC_REPLACE);
+}
+
+/* Going with the parent beats being deleted on its own */
+static void rc_drop(struct rc_obj *h, int op, int *changed)
+{
+	if (h->op == op || h->op == RC_GONE ||
+	    (h->op == RC_DELETE && op != RC_GONE))
+		return;
+	h->op = op;
+	if (h->peer && h->peer->op != RC_ADD && h->peer->op != RC_REPLACE)
+		h->peer->op = RC_ADD;
+	*changed = 1;
+}
+
+/* Qdiscs the kernel only takes options for when they are added */
+static int rc_fixed(const char *kind)
+{
+	static const char *kinds[] = { "htb", "cbq", "drr", "dsmark", "atm",
+				       "mq", "mqprio" };
+	int i;
+
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+		if (strcmp(kind, kinds[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/* What goes away or comes anew takes what hangs off it along */
+static void rc_settle(void)
+{
+	struct rc_obj *w, *h, *o;
+	int changed;
+
+	do {
+		changed = 0;
+		for (h = have; h; h = h->next) {
+			if (h->type == RC_FILTER)
+				continue;
+			if (h->type == RC_CLASS &&
+			    rc_gone(rc_find(have, RC_QDISC, TC_H_MAJ(h->handle))))
+				rc_drop(h, RC_GONE, &changed);
+			o = rc_owner(have, h->parent);
+			if (h->type == RC_CLASS && o && o->type == RC_CLASS) {
+				/* a class with children cannot be deleted */
+				if (o->op == RC_GONE)
+					rc_drop(h, RC_GONE, &changed);
+				else if (o->op == RC_DELETE)
+					rc_drop(h, RC_DELETE, &changed);
+			}
+			if (h->type == RC_QDISC && rc_gone(o))
+				rc_drop(h, RC_GONE, &changed);
+		}
+		for (w = want; w; w = w->next) {
+			int op = w->op;
+
+			if (w->type == RC_FILTER ||
+			    (op != RC_KEEP && op != RC_CHANGE))
+				continue;
+			if (w->type == RC_CLASS &&
+			    rc_new(rc_find(want, RC_QDISC, TC_H_MAJ(w->handle))))
+				w->op = RC_ADD;
+			if (rc_new(rc_owner(want, w->parent)))
+				w->op = RC_ADD;
+			if (w->op != op) {
+				if (w->peer && w->peer->op == RC_KEEP)
+					w->peer->op = RC_DELETE;
+				changed = 1;
+			}
+		}
+	} while (changed);
+}
+
+/* Pair up qdiscs and classes and settle what happens to each */
+static void rc_diff_tree(void)
+{
+	struct rc_obj *w, *h;
+	int rebuilt = 0;
+
+	for (w = want; w; w = w->next) {
+		if (w->type == RC_QDISC) {
+			for (h = have; h; h = h->next)
+				if (h->type == RC_QDISC && h->parent == w->parent)
+					break;
+		} else if (w->type == RC_CLASS)
+			h = rc_find(have, RC_CLASS, w->handle);
+		else
+			continue;
+
+		w->op = RC_ADD;
+		if (h == NULL)
+			continue;
+		w->peer = h;
+		h->peer = w;
+		if (w->type == RC_QDISC && w->explicit && w->handle != h->handle)
+			w->op = RC_REPLACE;
+		else if (strcmp(w->kind, h->kind))
+			/* the kernel only replaces a handle with its own kind */
+			w->op = RC_ADD;
+		else if (w->type == RC_CLASS && w->parent != h->parent)
+			w->op = RC_ADD;
+		else
+			w->op = RC_KEEP;
+		if (w->type == RC_QDISC && !w->explicit)
+			w->handle = h->handle;
+	}
+	for (h = have; h; h = h->next) {
+		if (h->type == RC_FILTER)
+			continue;
+		if (h->peer == NULL || h->peer->op == RC_ADD)
+			h->op = RC_DELETE;
+		else if (h->peer->op == RC_REPLACE)
+			h->op = RC_GONE;
+	}
+
+	rc_settle();
+
+	for (w = want; w; w = w->next) {
+		struct tcmsg *t;
+
+		if (w->type == RC_FILTER || w->op != RC_KEEP)
+			continue;
+		/* No options at all leaves every one of them to the kernel */
+		if (rc_bare(w))
+			continue;
+		/* refcnt and leaf qdisc are for the kernel to say */
+		t = NLMSG_DATA(w->n);
+		t->tcm_info = ((struct tcmsg *)NLMSG_DATA(w->peer->n))->tcm_info;
+		w->text = rc_text(w, 1);
+		w->peer->text = rc_text(w->peer, 1);
+		if (w->text && w->peer->text &&
+		    rc_same(w->text, w->peer->text, w->type))
+			continue;
+		if (w->type == RC_QDISC && rc_fixed(w->kind)) {
+			w->op = RC_ADD;
+			w->peer->op = RC_DELETE;
+			rebuilt = 1;
+		} else
+			w->op = RC_CHANGE;
+	}
+	/* A rebuilt qdisc comes back without its classes and filters */
+	if (rebuilt)
+		rc_settle();
+}
+
+static struct rc_group *rc_group_get(__u32 parent, __u32 info)
+{
+	struct rc_group *g, **gp;
+
+	for (gp = &groups; (g = *gp) != NULL; gp = &g->next)
+		if (g->parent == parent && g->info == info)
+			return g;
+	g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		return NULL;
+	g->parent = parent;
+	g->info = info;
+	*gp = g;
+	return g;
+}
+
+static int rc_group_add(struct rc_group *g, int side, struct rc_obj *o)
+{
+	struct tcmsg *t = NLMSG_DATA(o->n);
+	struct rc_obj **f;
+
+	t->tcm_parent = g->parent;
+	f = realloc(g->f[side], (g->cnt[side] + 1) * sizeof(*f));
+	if (f == NULL)
+		return -1;
+	f[g->cnt[side]++] = o;
+	g->f[side] = f;
+	if (strcmp(o->kind, "u32") == 0) {
+		g->u32 = 1;
+		rc_u32_locate(o);
+	}
+	return 0;
+}
+
+static int rc_text_cmp(const void *a, const void *b)
+{
+	const struct rc_obj *x = *(struct rc_obj **)a, *y = *(struct rc_obj **)b;
+
+	return strcmp(x->text, y->text);
+}
+
+static int rc_group_same(struct rc_group *g)
+{
+	int side, i, keep = 1;
+
+	if (g->cnt[0] != g->cnt[1])
+		return 0;
+	for (i = 0; i < g->cnt[0]; i++)
+		keep &= g->f[0][i]->explicit;
+	for (side = 0; side < 2; side++) {
+		for (i = 0; i < g->cnt[side]; i++) {
+			struct rc_obj *o = g->f[side][i];
+
+			if ((o->text = rc_text(o, keep)) == NULL)
+				return 0;
+		}
+		qsort(g->f[side], g->cnt[side], sizeof(struct rc_obj *),
+		      rc_text_cmp);
+	}
+	for (i = 0; i < g->cnt[0]; i++)
+		if (!rc_same(g->f[0][i]->text, g->f[1][i]->text, RC_FILTER))
+			return 0;
+	return 1;
+}
+
+/* Does a dumped filter send packets to a class that is to be deleted? */
+static int rc_binds(struct rc_obj *o)
+{
+	char *s, *word, *prev = "";
+	int hit = 0;
+
+	if ((s = strdup(o->text)) == NULL)
+		return 1;
+	for (word = strtok(s, " \t\n"); word && !hit;
+	     prev = word, word = strtok(NULL, " \t\n")) {
+		struct rc_obj *c;
+		__u32 id;
+
+		if (strstr(prev, "flowid") == NULL &&
+		    strcmp(prev, "classid") && strcmp(prev, "baseclass"))
+			continue;
+		if (get_tc_classid(&id, word) == 0 &&
+		    (c = rc_find(have, RC_CLASS, id)) && c->op == RC_DELETE)
+			hit = 1;
+	}
+	free(s);
+	return hit;
+}
+
+static int rc_group_binds(struct rc_group *g)
+{
+	int i;
+
+	for (i = 0; i < g->cnt[1]; i++)
+		if (rc_binds(g->f[1][i]))
+			return 1;
+	return 0;
+}
+
+/* Does the file make the u32 table htid on the qdisc of parent? */
+static int rc_u32_made(__u32 htid, __u32 parent)
+{
+	struct rc_obj *o;
+
+	for (o = want; o; o = o->next)
+		if (o->type == RC_FILTER && o->table && o->location == htid &&
+		    TC_H_MAJ(o->parent) == TC_H_MAJ(parent))
+			return 1;
+	return 0;
+}
+
+/*
+ * A node is dumped with the priority that made its table, not the one
+ * that added it, so leave priority and protocol out of what is compared.
+ */
+/* Does a line of the file put a u32 node in table htid on that qdisc? */
+static int rc_u32_named(__u32 htid, __u32 parent)
+{
+	struct rc_obj *o;
+
+	for (o = want; o; o = o->next)
+		if (o->type == RC_FILTER && !o->table &&
+		    TC_U32_HTID(o->location) == htid &&
+		    TC_H_MAJ(o->parent) == TC_H_MAJ(parent))
+			return 1;
+	return 0;
+}
+
+static char *rc_u32_text(struct rc_obj *o)
+{
+	struct tcmsg *t = NLMSG_DATA(o->n);
+	__u32 info = t->tcm_info;
+
+	free(o->text);
+	t->tcm_info = 0;
+	o->text = rc_text(o, 0);
+	t->tcm_info = info;
+	return o->text;
+}
+
+static int rc_group_line_cmp(const void *a, const void *b)
+{
+	const struct rc_group *x = *(struct rc_group **)a, *y = *(struct rc_group **)b;
+
+	return x->line - y->line;
+}
+
+/* Tables first, then nodes by table, bucket and node id */
+static int rc_u32_key(const struct rc_obj *x, const struct rc_obj *y)
+{
+	if (x->table != y->table)
+		return y->table - x->table;
+	if (x->root != y->root)
+		return (unsigned long)x->root < (unsigned long)y->root ? -1 : 1;
+	if (x->location != y->location)
+		return x->location < y->location ? -1 : 1;
+	if (x->node != y->node)
+		return x->node < y->node ? -1 : 1;
+	return 0;
+}
+
+static int rc_u32_key_cmp(const void *a, const void *b)
+{
+	const struct rc_obj *x = *(struct rc_obj **)a, *y = *(struct rc_obj **)b;
+	int c = rc_u32_key(x, y);
+
+	return c ? c : x->line - y->line;
+}
+
+/*
+ * u32 tables are shared by the priorities of a qdisc, and a node lands
+ * in the table its "ht" names, whichever priority adds it. So the u32
+ * filters of a qdisc are compared across its priorities: tables by
+ * handle, nodes by table, bucket and node id. The root table of a
+ * priority stands for the priority; the kernel numbers them 800:, 801:
+ * and on as the priorities are made, so that is where the file has
+ * them, and a node without "ht" is in its own priority's. Node ids the
+ * file leaves to the kernel are foreseen the way it hands them out, one
+ * past the highest in the bucket.
+ *
+ * Nodes that differ are deleted and added again by handle. Returns 1
+ * when all u32 priorities of the qdisc are to be built again instead:
+ * when a table's divisor changes, a priority's root table is not where
+ * the file has it, or a priority goes that holds tables; -1 on errors.
+ */
+static int rc_u32_nodes(struct rc_group **sg, int ng)
+{
+	struct rc_obj **v[2] = { NULL, NULL };
+	int cnt[2] = { 0, 0 };
+	int side, i, j, k, ret = 1, fresh = 1;
+	__u32 id = 0x800;
+
+	qsort(sg, ng, sizeof(*sg), rc_group_line_cmp);
+	for (i = 0; i < ng; i++) {
+		struct rc_group *g = sg[i];
+
+		if (g->gone || rc_new(rc_owner(want, g->parent)))
+			return 1;
+		if (g->cnt[0] == 0) {
+			/* The priority goes, with what is in its tables */
+			g->del = 1;
+			for (j = 0; j < g->cnt[1]; j++)
+				if (g->f[1][j]->table)
+					return 1;
+			continue;
+		}
+		while (rc_u32_made(id << 20, g->parent))
+			id++;
+		g->htid[0] = id++ << 20;
+		if (g->htid[1])
+			fresh = 0;
+	}
+	/*
+	 * Only a fresh qdisc numbers its roots from 800: again; else a root
+	 * the file names must be where the kernel has it, and no table the
+	 * file makes may take the handle of one.
+	 */
+	for (i = 0; !fresh && i < ng; i++) {
+		struct rc_group *g = sg[i];
+
+		if (g->del)
+			continue;
+		if (g->htid[0] != g->htid[1] &&
+		    rc_u32_named(g->htid[0], g->parent))
+			return 1;
+		if (g->htid[1] && rc_u32_made(g->htid[1], g->parent))
+			return 1;
+	}
+
+	for (side = 0; side < 2; side++) {
+		for (i = 0; i < ng; i++)
+			cnt[side] += sg[i]->cnt[side];
+		if ((v[side] = malloc((cnt[side] + 1) * sizeof(struct rc_obj *))) == NULL) {
+			ret = -1;
+			goto out;
+		}
+		cnt[side] = 0;
+		for (i = 0; i < ng; i++) {
+			struct rc_group *g = sg[i];
+
+			if (g->del)
+				continue;
+			for (j = 0; j < g->cnt[side]; j++) {
+				struct rc_obj *o = g->f[side][j];
+				__u32 h = TC_U32_HTID(o->location);
+
+				/* A line with no options only makes the priority */
+				if (side == 0 && rc_bare(o)) {
+					if (g->htid[1] == 0 && g->cnt[0] == 1)
+						o->op = RC_ADD;
+					continue;
+				}
+				if (!o->table) {
+					if (side == 0 && (h == 0 || h == TC_U32_ROOT))
+						o->root = g;
+					for (k = 0; !o->root && k < ng; k++)
+						if (h && sg[k]->htid[side] == h)
+							o->root = sg[k];
+					/* Deleting a priority takes its root table */
+					if (o->root && o->root->del)
+						goto out;
+					if (o->root)
+						o->location = TC_U32_HASH(o->location);
+					if (side)
+						o->node = TC_U32_NODE(o->handle);
+				}
+				if ((o->text = rc_u32_text(o)) == NULL) {
+					ret = -1;
+					goto out;
+				}
+				v[side][cnt[side]++] = o;
+			}
+		}
+	}
+
+	/* In file order each bucket gets one past its highest node id */
+	qsort(v[0], cnt[0], sizeof(struct rc_obj *), rc_u32_key_cmp);
+	for (i = 0; i < cnt[0]; i = j) {
+		__u32 last = 0x7FF;
+
+		for (j = i; j < cnt[0] && !v[0][j]->table &&
+			    v[0][j]->root == v[0][i]->root &&
+			    v[0][j]->location == v[0][i]->location; j++) {
+			struct rc_obj *o = v[0][j];
+
+			o->node = TC_U32_NODE(o->handle);
+			if (o->node == 0)
+				o->node = last < 0xFFF ? last + 1 : 0xFFF;
+			if (o->node > last)
+				last = o->node;
+		}
+		if (j == i)
+			j++;
+	}
+	qsort(v[0], cnt[0], sizeof(struct rc_obj *), rc_u32_key_cmp);
+	qsort(v[1], cnt[1], sizeof(struct rc_obj *), rc_u32_key_cmp);
+
+	for (i = j = 0; i < cnt[0] || j < cnt[1]; ) {
+		struct rc_obj *w = i < cnt[0] ? v[0][i] : NULL;
+		struct rc_obj *h = j < cnt[1] ? v[1][j] : NULL;
+		int c = !w ? 1 : !h ? -1 : rc_u32_key(w, h);
+
+		if (c < 0) {
+			w->op = RC_ADD;
+			i++;
+		} else if (c > 0) {
+			h->op = RC_DELETE;
+			j++;
+		} else {
+			if (!rc_same(w->text, h->text, RC_FILTER) ||
+			    rc_binds(h)) {
+				if (w->table)
+					goto out;
+				w->op = RC_ADD;
+				h->op = RC_DELETE;
+			}
+			i++, j++;
+		}
+	}
+	ret = 0;
+out:
+	if (ret)
+		for (side = 0; side < 2; side++)
+			for (i = 0; i < cnt[side]; i++)
+				v[side][i]->op = RC_KEEP;
+	free(v[0]);
+	free(v[1]);
+	return ret;
+}
+
+static int rc_diff_filters(void)
+{
+	struct rc_obj *o, *root;
+	struct rc_group *g, *u, **sg;
+	int i, n, ng;
+
+	for (root = want; root; root = root->next)
+		if (root->type == RC_QDISC && root->parent == TC_H_ROOT)
+			break;
+
+	for (o = want; o; o = o->next) {
+		if (o->type != RC_FILTER)
+			continue;
+		if (o->parent == TC_H_ROOT) {
+			if (root == NULL || root->handle == 0) {
+				fprintf(stderr, "Filter at line %d is on a root "
+					"qdisc without a handle\n", o->line);
+				return -1;
+			}
+			o->parent = root->handle;
+		}
+		if ((g = rc_group_get(o->parent, o->info)) == NULL ||
+		    rc_group_add(g, 0, o))
+			return -1;
+		if (g->line == 0)
+			g->line = o->line;
+	}
+	for (o = have; o; o = o->next)
+		if (o->type == RC_FILTER &&
+		    ((g = rc_group_get(o->parent, o->info)) == NULL ||
+		     rc_group_add(g, 1, o)))
+			return -1;
+
+	for (g = groups; g; g = g->next) {
+		struct rc_obj *r = NULL;
+
+		/* The kernel lists the root table of a priority last */
+		for (i = 0; g->u32 && i < g->cnt[1]; i++)
+			if (g->f[1][i]->table)
+				r = g->f[1][i];
+		if (r) {
+			g->htid[1] = r->location;
+			for (i = 0; g->f[1][i] != r; i++)
+				;
+			memmove(g->f[1] + i, g->f[1] + i + 1,
+				(--g->cnt[1] - i) * sizeof(struct rc_obj *));
+		}
+		if (g->u32)
+			continue;
+
+		g->gone = rc_gone(rc_owner(have, g->parent));
+		if (g->gone || rc_new(rc_owner(want, g->parent)))
+			g->add = g->cnt[0] > 0;
+		else if (g->cnt[1] == 0)
+			g->add = g->cnt[0] > 0;
+		else if (g->cnt[0] == 0)
+			g->del = 1;
+		else if (!rc_group_same(g))
+			g->del = g->add = 1;
+	}
+
+	for (g = groups; g; g = g->next) {
+		if (g->u32 || g->gone || g->del || g->cnt[1] == 0)
+			continue;
+		for (i = 0; i < g->cnt[1]; i++)
+			if (g->f[1][i]->text == NULL &&
+			    (g->f[1][i]->text = rc_text(g->f[1][i], 0)) == NULL)
+				return -1;
+		if (rc_group_binds(g))
+			g->del = g->add = 1;
+	}
+
+	/* u32 a qdisc at a time */
+	for (ng = 0, g = groups; g; g = g->next)
+		ng++;
+	if ((sg = malloc((ng + 1) * sizeof(*sg))) == NULL)
+		return -1;
+	for (g = groups; g; g = g->next) {
+		if (!g->u32 || g->htid[0] || g->del || g->add || g->nodes)
+			continue;
+		for (n = 0, u = groups; u; u = u->next)
+			if (u->u32 && TC_H_MAJ(u->parent) == TC_H_MAJ(g->parent)) {
+				u->gone = rc_gone(rc_owner(have, u->parent));
+				sg[n++] = u;
+			}
+		switch (rc_u32_nodes(sg, n)) {
+		case 0:
+			for (o = have; o; o = o->next)
+				if (o->type == RC_FILTER && o->op == RC_DELETE)
+					rc_group_get(o->parent, o->info)->nodes = 1;
+			for (o = want; o; o = o->next)
+				if (o->type == RC_FILTER && o->op == RC_ADD)
+					rc_group_get(o->parent, o->info)->nodes = 1;
+			break;
+		case 1:
+			for (i = 0; i < n; i++) {
+				sg[i]->del = !sg[i]->gone &&
+					(sg[i]->htid[1] || sg[i]->cnt[1]);
+				sg[i]->add = sg[i]->cnt[0] > 0;
+			}
+			break;
+		default:
+			free(sg);
+			return -1;
+		}
+	}
+	free(sg);
+	return 0;
+}
+
+static int rc_cmd(const char *object, const char *verb, int argc, char **argv)
+{
+	struct rc_cmd *c = calloc(1, sizeof(*c));
+	int i;
+
+	if (c == NULL || (c->argv = calloc(argc + 3, sizeof(char *))) == NULL)
+		return -1;
+	c->argv[0] = (char *)object;
+	c->argv[1] = (char *)verb;
+	for (i = 0; i < argc; i++)
+		c->argv[i + 2] = argv[i];
+	c->argc = argc + 2;
+	*cmds_tail = c;
+	cmds_tail = &c->next;
+	return 0;
+}
+
+static int rc_cmd_del(const char *object, const char *dev, const char *fmt, __u32 id)
+{
+	char buf[64], *line, *argv[RC_ARGS];
+	int argc;
+
+	if (asprintf(&line, "%s %s %s", dev, fmt,
+		     sprint_tc_classid(id, buf)) < 0)
+		return -1;
+	argc = makeargs(line, argv, RC_ARGS);
+	return rc_cmd(object, "del", argc, argv);
+}
+
+static int rc_u32_del(const char *dev, struct rc_obj *o)
+{
+	char pbuf[64], ebuf[64], *line, *argv[RC_ARGS];
+
+	if (asprintf(&line, "%s parent %s prio %u protocol %s handle %x:%x:%x u32",
+		     dev, sprint_tc_classid(o->parent, pbuf),
+		     TC_H_MAJ(o->info) >> 16,
+		     ll_proto_n2a(TC_H_MIN(o->info), ebuf, sizeof(ebuf)),
+		     TC_U32_USERHTID(o->handle), TC_U32_HASH(o->handle),
+		     TC_U32_NODE(o->handle)) < 0)
+		return -1;
+	return rc_cmd("filter", "del", makeargs(line, argv, RC_ARGS), argv);
+}
+
+/* A node the file leaves to the kernel gets the id it was foreseen */
+static int rc_u32_add(struct rc_obj *o)
+{
+	char *argv[RC_ARGS + 2];
+	int i, n = 0;
+
+	if (o->table || TC_U32_NODE(o->handle) || rc_bare(o))
+		return rc_cmd("filter", "add", o->argc, o->argv);
+	for (i = 0; i < o->argc; i++) {
+		argv[n++] = o->argv[i];
+		if (i == o->kindpos) {
+			argv[n++] = "order";
+			if (asprintf(&argv[n++], "0x%x", o->node) < 0)
+				return -1;
+		}
+	}
+	return rc_cmd("filter", "add", n, argv);
+}
+
+static int rc_depth_cmp(const void *a, const void *b)
+{
+	const struct rc_obj *x = *(struct rc_obj **)a, *y = *(struct rc_obj **)b;
+	int dx = rc_depth(x->line ? want : have, (struct rc_obj *)x);
+	int dy = rc_depth(y->line ? want : have, (struct rc_obj *)y);
+
+	if (dx != dy)
+		return x->line ? dx - dy : dy - dx;
+	return x->line - y->line;
+}
+
+static int rc_sorted(struct rc_obj *list, int wanted, struct rc_obj ***v)
+{
+	struct rc_obj *o;
+	int n = 0;
+
+	for (o = list; o; o = o->next)
+		n++;
+	if ((*v = malloc((n + 1) * sizeof(**v))) == NULL)
+		return -1;
+	n = 0;
+	for (o = list; o; o = o->next)
+		if (o->type != RC_FILTER && (wanted ? o->op != RC_KEEP :
+					     o->op == RC_DELETE))
+			(*v)[n++] = o;
+	qsort(*v, n, sizeof(**v), rc_depth_cmp);
+	return n;
+}
+
+static int rc_plan(const char *dev, int *kept)
+{
+	static const char *verbs[] = { NULL, "change", "add", "replace" };
+	char dbuf[64], pbuf[64], ebuf[64], *line, *argv[RC_ARGS];
+	struct rc_obj **v, *o;
+	struct rc_group *g;
+	int n, i;
+
+	snprintf(dbuf, sizeof(dbuf), "dev %s", dev);
+
+	*kept = 0;
+	for (g = groups; g; g = g->next) {
+		if (!g->del) {
+			*kept += !g->add && !g->nodes && g->cnt[0];
+			continue;
+		}
+		if (asprintf(&line, "%s parent %s prio %u protocol %s", dbuf,
+			     sprint_tc_classid(g->parent, pbuf),
+			     TC_H_MAJ(g->info) >> 16,
+			     ll_proto_n2a(TC_H_MIN(g->info), ebuf, sizeof(ebuf))) < 0)
+			return -1;
+		n = makeargs(line, argv, RC_ARGS);
+		if (rc_cmd("filter", "del", n, argv))
+			return -1;
+	}
+
+	/* u32 nodes go before the tables they link to */
+	for (i = 0; i < 2; i++)
+		for (o = have; o; o = o->next)
+			if (o->type == RC_FILTER && o->op == RC_DELETE &&
+			    o->table == i && rc_u32_del(dbuf, o))
+				return -1;
+
+	if ((n = rc_sorted(have, 0, &v)) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		o = v[i];
+		if (o->type == RC_CLASS)
+			rc_cmd_del("class", dbuf, "classid", o->handle);
+		else if (o->parent == TC_H_ROOT || o->parent == TC_H_INGRESS) {
+			if (asprintf(&line, "%s %s", dbuf, o->parent == TC_H_ROOT ?
+				     "root" : "ingress") < 0)
+				return -1;
+			rc_cmd("qdisc", "del", makeargs(line, argv, RC_ARGS), argv);
+		} else
+			rc_cmd_del("qdisc", dbuf, "parent", o->parent);
+	}
+	free(v);
+
+	if ((n = rc_sorted(want, 1, &v)) < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		o = v[i];
+		if (rc_cmd(o->type == RC_QDISC ? "qdisc" : "class",
+			   verbs[o->op], o->argc, o->argv))
+			return -1;
+	}
+	free(v);
+
+	for (o = want; o; o = o->next) {
+		if (o->type != RC_FILTER)
+			*kept += o->op == RC_KEEP;
+		else if ((g = rc_group_get(o->parent, o->info)) && g->add) {
+			if (rc_cmd("filter", "add", o->argc, o->argv))
+				return -1;
+		} else if (o->op == RC_ADD && rc_u32_add(o))
+			return -1;
+	}
+	return 0;
+}
+
+static void rc_print(FILE *fp, struct rc_cmd *c)
+{
+	int i;
+
+	for (i = 0; i < c->argc; i++)
+		fprintf(fp, "%s%s", i ? " " : "", c->argv[i]);
+	fprintf(fp, "\n");
+}
+
+int do_reconcile(int argc, char **argv)
+{
+	char *file = NULL, *dev = NULL;
+	struct rc_cmd *c;
+	int plan = 0, kept, n = 0, done = 0;
+
+	if (argc < 1 || matches(*argv, "help") == 0) {
+		usage();
+		return argc < 1 ? -1 : 0;
+	}
+
+	while (argc > 0) {
+		if (strcmp(*argv, "file") == 0) {
+			NEXT_ARG();
+			file = *argv;
+		} else if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			dev = *argv;
+		} else if (strcmp(*argv, "plan") == 0) {
+			plan = 1;
+		} else if (matches(*argv, "help") == 0) {
+			usage();
+			return 0;
+		} else {
+			fprintf(stderr, "What is \"%s\"? Try \"tc reconcile help\".\n",
+				*argv);
+			return -1;
+		}
+		argc--; argv++;
+	}
+
+	if (!file || !dev) {
+		fprintf(stderr, "\"file\" and \"dev\" are required.\n");
+		return -1;
+	}
+
+	ll_init_map(&rth);
+	if ((ifindex = ll_name_to_index(dev)) == 0) {
+		fprintf(stderr, "Cannot find device \"%s\"\n", dev);
+		return -1;
+	}
+
+	if (rc_load(file, dev) || rc_dump_tree())
+		return -1;
+	rc_diff_tree();
+	if (rc_diff_filters() || rc_plan(dev, &kept))
+		return -1;
+
+	for (c = cmds; c; c = c->next, n++)
+		if (plan)
+			rc_print(stdout, c);
+	if (plan) {
+		printf("# %d commands, %d qdiscs, classes and filter priorities "
+		       "unchanged\n", n, kept);
+		return 0;
+	}
+
+	for (c = cmds; c; c = c->next) {
+		int err;
+
+		if (strcmp(c->argv[0], "qdisc") == 0)
+			err = do_qdisc(c->argc - 1, c->argv + 1);
+		else if (strcmp(c->argv[0], "class") == 0)
+			err = do_class(c->argc - 1, c->argv + 1);
+		else
+			err = do_filter(c->argc - 1, c->argv + 1);
+		if (err) {
+			fprintf(stderr, "Failed to ");
+			rc_print(stderr, c);
+			fprintf(stderr, "%d of %d commands applied, not run:\n",
+				done, n);
+			for (c = c->next; c; c = c->next)
+				rc_print(stderr, c);
+			return -1;
+		}
+		done++;
+	}
+	return 0;
+}
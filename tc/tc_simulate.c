@@ -0,0 +1,1781 @@
+/*
+ * tc_simulate.c	"tc simulate": run filters over a packet capture.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Filters are read as "filter add" commands in batch file syntax and
+ * handed to the classifiers' own parse_fopt(), so they end up as the
+ * very attributes the kernel would get. These are then evaluated the
+ * way cls_u32, cls_basic, cls_fw, cls_flow and the cmp, nbyte, u32 and
+ * meta ematches do, against every packet of a pcap file.
+ *
+ * Packets are taken as they look on egress: there is no socket, route
+ * or conntrack state and skb->mark is given on the command line. Flow
+ * hashing uses a fixed seed where the kernel picks a random one, so
+ * the buckets differ but not how evenly packets land in them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/tc_ematch/tc_em_cmp.h>
+#include <linux/tc_ematch/tc_em_nbyte.h>
+#include <linux/tc_ematch/tc_em_meta.h>
+
+#include "rt_names.h"
+#include "utils.h"
+#include "tc_util.h"
+#include "tc_common.h"
+
+#define SIM_EM_STACK	32	/* CONFIG_NET_EMATCH_STACK */
+#define SIM_LEVELS	8	/* inner classes followed, as TC_HTB_MAXDEPTH */
+#define SIM_TIME	0.5	/* seconds of classification to time */
+#define SIM_HASH_MIN	8	/* chain length worth a hash table */
+
+#define PCAP_MAGIC	0xa1b2c3d4
+#define PCAP_MAGIC_NS	0xa1b23c4d
+#define DLT_EN10MB	1
+#define DLT_RAW		101
+#define DLT_LINUX_SLL	113
+
+struct sim_pkt
+{
+	unsigned char	*data;
+	int		len;		/* captured */
+	int		wirelen;
+	int		nh;		/* network header */
+	int		th;		/* transport header */
+	__u16		protocol;	/* network order, as skb->protocol */
+};
+
+struct sim_ematch
+{
+	__u16		kind;
+	__u16		flags;
+	union {
+		__u32			ref;	/* container */
+		struct tcf_em_cmp	cmp;
+		struct tc_u32_key	u32;
+		struct {
+			struct tcf_em_nbyte	hdr;
+			unsigned char		*needle;
+		} nbyte;
+		struct {
+			struct tcf_meta_hdr	hdr;
+			unsigned long		lval;
+			unsigned long		rval;
+		} meta;
+	} u;
+};
+
+struct sim_tp;
+struct sim_ht;
+
+struct sim_filter
+{
+	struct sim_filter	*next;		/* in file order */
+	struct sim_filter	*link;		/* in its bucket or list */
+	struct sim_tp		*tp;
+	int			line;
+	__u32			handle;
+	__u32			classid;
+	int			action;
+	unsigned long long	hits;
+
+	/* u32 */
+	struct tc_u32_sel	*sel;
+	struct tc_u32_mark	*mark;
+	struct tc_u32_pcnt	*pf;		/* as CONFIG_CLS_U32_PERF */
+	struct sim_ht		*down;
+	int			fshift;
+
+	/* basic and flow */
+	int			nmatches;
+	struct sim_ematch	*matches;
+
+	/* flow */
+	__u32			keymask;
+	__u32			mode;
+	__u32			baseclass;
+	__u32			rshift;
+	__u32			addend;
+	__u32			mask;
+	__u32			xor;
+	__u32			divisor;
+};
+
+struct sim_ht
+{
+	struct sim_ht		*next;
+	__u32			handle;
+	__u32			divisor;	/* buckets - 1 */
+	struct sim_filter	**bucket;
+};
+
+struct sim_tp
+{
+	struct sim_tp		*next;
+	__u32			parent;
+	__u32			prio;
+	__u16			protocol;
+	char			kind[16];
+	struct sim_ht		*root;		/* u32 */
+	struct sim_filter	*list;		/* basic, fw, flow */
+	__u32			fw_mask;
+	__u32			gen;
+	struct sim_filter	*(*classify)(struct sim_tp *tp,
+					     struct sim_pkt *p);
+};
+
+struct sim_chain
+{
+	struct sim_chain	*next;
+	__u32			parent;
+	struct sim_tp		*tp;
+};
+
+static struct sim_chain *chains;
+static struct sim_ht *tables;		/* u32 tables are per qdisc */
+static unsigned u32_roots, u32_hgen;
+static struct sim_filter *filters, **filters_tail = &filters;
+static __u32 root_handle = TC_H_ROOT;
+static __u32 skb_mark;
+
+static unsigned long long nkeys, nvisits;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: tc simulate filters FILE pcap FILE [ dev STRING ]\n");
+	fprintf(stderr, "                   [ root | parent CLASSID ] [ mark MARK ]\n");
+	fprintf(stderr, "                   [ optimize ]\n");
+	fprintf(stderr, "Where: FILE of filters is in batch syntax, \"filter add\" lines\n");
+	fprintf(stderr, "       for the u32, basic, fw and flow classifiers are used,\n");
+	fprintf(stderr, "       \"qdisc add ... root handle\" names the root qdisc and\n");
+	fprintf(stderr, "       other qdisc and class lines are skipped\n");
+}
+
+static int sim_valid(const struct sim_pkt *p, int off, int len)
+{
+	return off >= 0 && len >= 0 && off + len <= p->len;
+}
+
+static __u32 sim_word(const struct sim_pkt *p, int off)
+{
+	__u32 w;
+
+	memcpy(&w, p->data + off, 4);
+	return w;
+}
+
+/* ematches */
+
+static unsigned char *sim_layer(const struct sim_pkt *p, int layer)
+{
+	switch (layer) {
+	case TCF_LAYER_LINK:
+		return p->data;
+	case TCF_LAYER_NETWORK:
+		return p->data + p->nh;
+	case TCF_LAYER_TRANSPORT:
+		return p->data + p->th;
+	}
+	return NULL;
+}
+
+static int sim_em_cmp(const struct sim_pkt *p, const struct tcf_em_cmp *cmp)
+{
+	unsigned char *ptr = sim_layer(p, cmp->layer);
+	__u32 val;
+
+	if (ptr == NULL || !sim_valid(p, ptr - p->data + cmp->off, cmp->align))
+		return 0;
+	ptr += cmp->off;
+
+	switch (cmp->align) {
+	case TCF_EM_ALIGN_U8:
+		val = *ptr;
+		break;
+	case TCF_EM_ALIGN_U16:
+		val = ptr[0] << 8 | ptr[1];
+		if (cmp->flags & TCF_EM_CMP_TRANS)
+			val = ntohs(val);
+		break;
+	case TCF_EM_ALIGN_U32:
+		val = ntohl(sim_word(p, ptr - p->data));
+		if (cmp->flags & TCF_EM_CMP_TRANS)
+			val = ntohl(val);
+		break;
+	default:
+		return 0;
+	}
+
+	if (cmp->mask)
+		val &= cmp->mask;
+
+	switch (cmp->opnd) {
+	case TCF_EM_OPND_EQ:
+		return val == cmp->val;
+	case TCF_EM_OPND_LT:
+		return val < cmp->val;
+	case TCF_EM_OPND_GT:
+		return val > cmp->val;
+	}
+	return 0;
+}
+
+static int sim_em_nbyte(const struct sim_pkt *p, const struct sim_ematch *m)
+{
+	unsigned char *ptr = sim_layer(p, m->u.nbyte.hdr.layer);
+	int off;
+
+	if (ptr == NULL)
+		return 0;
+	off = ptr - p->data + m->u.nbyte.hdr.off;
+	if (!sim_valid(p, off, m->u.nbyte.hdr.len))
+		return 0;
+	return !memcmp(p->data + off, m->u.nbyte.needle, m->u.nbyte.hdr.len);
+}
+
+static int sim_em_u32(const struct sim_pkt *p, const struct tc_u32_key *key)
+{
+	int off = p->nh + key->off;
+
+	if (!sim_valid(p, off, 4))
+		return 0;
+	return !((sim_word(p, off) ^ key->val) & key->mask);
+}
+
+static int sim_meta_get(const struct sim_pkt *p, const struct tcf_meta_val *v,
+			unsigned long val, unsigned long *dst)
+{
+	switch (TCF_META_ID(v->kind)) {
+	case TCF_META_ID_VALUE:
+		*dst = val;
+		return 0;
+	case TCF_META_ID_PRIORITY:
+	case TCF_META_ID_PKTTYPE:
+	case TCF_META_ID_DATALEN:
+	case TCF_META_ID_TCINDEX:
+		*dst = 0;
+		break;
+	case TCF_META_ID_PROTOCOL:
+		*dst = p->protocol;
+		break;
+	case TCF_META_ID_PKTLEN:
+		*dst = p->wirelen;
+		break;
+	case TCF_META_ID_MACLEN:
+		*dst = p->nh;
+		break;
+	case TCF_META_ID_NFMARK:
+		*dst = skb_mark;
+		break;
+	case TCF_META_ID_VLAN_TAG:
+		if (p->protocol != htons(ETH_P_8021Q) || !sim_valid(p, p->nh, 2))
+			return -1;
+		*dst = p->data[p->nh] << 8 | p->data[p->nh + 1];
+		break;
+	default:
+		return -1;
+	}
+
+	if (v->shift)
+		*dst >>= v->shift;
+	if (val)
+		*dst &= val;
+	return 0;
+}
+
+static int sim_em_meta(const struct sim_pkt *p, const struct sim_ematch *m)
+{
+	const struct tcf_meta_hdr *hdr = &m->u.meta.hdr;
+	unsigned long l, r;
+
+	if (sim_meta_get(p, &hdr->left, m->u.meta.lval, &l) < 0 ||
+	    sim_meta_get(p, &hdr->right, m->u.meta.rval, &r) < 0)
+		return 0;
+
+	switch (hdr->left.op) {
+	case TCF_EM_OPND_EQ:
+		return l == r;
+	case TCF_EM_OPND_LT:
+		return l < r;
+	case TCF_EM_OPND_GT:
+		return l > r;
+	}
+	return 0;
+}
+
+static int sim_em_one(const struct sim_pkt *p, const struct sim_ematch *m)
+{
+	int r = 0;
+
+	nkeys++;
+	switch (m->kind) {
+	case TCF_EM_CMP:
+		r = sim_em_cmp(p, &m->u.cmp);
+		break;
+	case TCF_EM_NBYTE:
+		r = sim_em_nbyte(p, m);
+		break;
+	case TCF_EM_U32:
+		r = sim_em_u32(p, &m->u.u32);
+		break;
+	case TCF_EM_META:
+		r = sim_em_meta(p, m);
+		break;
+	}
+	return m->flags & TCF_EM_INVERT ? !r : r;
+}
+
+static int sim_em_end(const struct sim_ematch *m, int r)
+{
+	int rel = m->flags & TCF_EM_REL_MASK;
+
+	return rel == TCF_EM_REL_END ||
+	       (rel == TCF_EM_REL_AND && !r) ||
+	       (rel == TCF_EM_REL_OR && r);
+}
+
+/* As __tcf_em_tree_match() */
+static int sim_em_tree(const struct sim_pkt *p, const struct sim_filter *f)
+{
+	int stack[SIM_EM_STACK];
+	int sp = 0, i = 0, r = 0;
+
+	if (f->nmatches == 0)
+		return 1;
+
+proceed:
+	while (i < f->nmatches) {
+		const struct sim_ematch *m = &f->matches[i];
+
+		if (m->kind == TCF_EM_CONTAINER) {
+			if (sp >= SIM_EM_STACK)
+				return 0;
+			stack[sp++] = i;
+			i = m->u.ref;
+			goto proceed;
+		}
+
+		r = sim_em_one(p, m);
+		if (sim_em_end(m, r))
+			break;
+		i++;
+	}
+
+	while (sp > 0) {
+		const struct sim_ematch *m;
+
+		i = stack[--sp];
+		m = &f->matches[i];
+		if (m->flags & TCF_EM_INVERT)
+			r = !r;
+		if (!sim_em_end(m, r)) {
+			i++;
+			goto proceed;
+		}
+	}
+	return r;
+}
+
+static int sim_em_meta_load(struct sim_ematch *m, void *data, int len)
+{
+	struct rtattr *tb[TCA_EM_META_MAX+1];
+	struct tcf_meta_val *v[2];
+	unsigned long *val[2];
+	int i;
+
+	parse_rtattr(tb, TCA_EM_META_MAX, data, len);
+	if (tb[TCA_EM_META_HDR] == NULL ||
+	    RTA_PAYLOAD(tb[TCA_EM_META_HDR]) < sizeof(m->u.meta.hdr))
+		return -1;
+	memcpy(&m->u.meta.hdr, RTA_DATA(tb[TCA_EM_META_HDR]),
+	       sizeof(m->u.meta.hdr));
+
+	v[0] = &m->u.meta.hdr.left;
+	v[1] = &m->u.meta.hdr.right;
+	val[0] = &m->u.meta.lval;
+	val[1] = &m->u.meta.rval;
+	for (i = 0; i < 2; i++) {
+		struct rtattr *rta = tb[TCA_EM_META_LVALUE + i];
+		struct sim_pkt dummy;
+		unsigned long tmp;
+
+		if (TCF_META_TYPE(v[i]->kind) != TCF_META_TYPE_INT) {
+			fprintf(stderr, "meta: only numeric values can be simulated\n");
+			return -1;
+		}
+		memset(&dummy, 0, sizeof(dummy));
+		if (TCF_META_ID(v[i]->kind) != TCF_META_ID_VALUE &&
+		    TCF_META_ID(v[i]->kind) != TCF_META_ID_VLAN_TAG &&
+		    sim_meta_get(&dummy, v[i], 0, &tmp) < 0) {
+			fprintf(stderr, "meta: id %d cannot be simulated\n",
+				TCF_META_ID(v[i]->kind));
+			return -1;
+		}
+		*val[i] = 0;
+		if (rta && RTA_PAYLOAD(rta) >= 4)
+			*val[i] = *(__u32 *)RTA_DATA(rta);
+		else if (rta && RTA_PAYLOAD(rta) >= 2)
+			*val[i] = *(__u16 *)RTA_DATA(rta);
+	}
+	return 0;
+}
+
+static int sim_em_load(struct sim_filter *f, struct rtattr *rta)
+{
+	struct rtattr *tb[TCA_EMATCH_TREE_MAX+1];
+	struct tcf_ematch_tree_hdr *hdr;
+	struct rtattr *em;
+	int len, i = 0;
+
+	parse_rtattr_nested(tb, TCA_EMATCH_TREE_MAX, rta);
+	if (tb[TCA_EMATCH_TREE_HDR] == NULL || tb[TCA_EMATCH_TREE_LIST] == NULL)
+		return -1;
+	hdr = RTA_DATA(tb[TCA_EMATCH_TREE_HDR]);
+
+	f->nmatches = hdr->nmatches;
+	f->matches = calloc(f->nmatches, sizeof(*f->matches));
+	if (f->matches == NULL)
+		return -1;
+
+	em = RTA_DATA(tb[TCA_EMATCH_TREE_LIST]);
+	len = RTA_PAYLOAD(tb[TCA_EMATCH_TREE_LIST]);
+	for (; RTA_OK(em, len) && i < f->nmatches; em = RTA_NEXT(em, len), i++) {
+		struct sim_ematch *m = &f->matches[i];
+		struct tcf_ematch_hdr *h = RTA_DATA(em);
+		unsigned char *data = (unsigned char *)(h + 1);
+		int dlen = RTA_PAYLOAD(em) - sizeof(*h);
+
+		if (dlen < 0)
+			return -1;
+		m->kind = h->kind;
+		m->flags = h->flags;
+
+		switch (h->kind) {
+		case TCF_EM_CONTAINER:
+			if (dlen < sizeof(__u32))
+				return -1;
+			m->u.ref = *(__u32 *)data;
+			if (m->u.ref <= i || m->u.ref >= f->nmatches)
+				return -1;
+			break;
+		case TCF_EM_CMP:
+			if (dlen < sizeof(m->u.cmp))
+				return -1;
+			memcpy(&m->u.cmp, data, sizeof(m->u.cmp));
+			break;
+		case TCF_EM_U32:
+			if (dlen < sizeof(m->u.u32))
+				return -1;
+			memcpy(&m->u.u32, data, sizeof(m->u.u32));
+			break;
+		case TCF_EM_NBYTE:
+			if (dlen < sizeof(m->u.nbyte.hdr))
+				return -1;
+			memcpy(&m->u.nbyte.hdr, data, sizeof(m->u.nbyte.hdr));
+			if (dlen < sizeof(m->u.nbyte.hdr) + m->u.nbyte.hdr.len)
+				return -1;
+			m->u.nbyte.needle = malloc(m->u.nbyte.hdr.len + 1);
+			if (m->u.nbyte.needle == NULL)
+				return -1;
+			memcpy(m->u.nbyte.needle, data + sizeof(m->u.nbyte.hdr),
+			       m->u.nbyte.hdr.len);
+			break;
+		case TCF_EM_META:
+			if (sim_em_meta_load(m, data, dlen))
+				return -1;
+			break;
+		default:
+			fprintf(stderr, "ematch kind %d cannot be simulated\n",
+				h->kind);
+			return -1;
+		}
+	}
+	return i == f->nmatches ? 0 : -1;
+}
+
+/* u32, as u32_classify() */
+
+static struct sim_ht *sim_ht_lookup(__u32 handle)
+{
+	struct sim_ht *ht;
+
+	for (ht = tables; ht; ht = ht->next)
+		if (ht->handle == handle)
+			return ht;
+	return NULL;
+}
+
+static __u32 sim_ht_gen(void)
+{
+	int i = 0x800;
+
+	do {
+		if (++u32_hgen == 0x7FF)
+			u32_hgen = 1;
+	} while (--i > 0 && sim_ht_lookup((u32_hgen|0x800)<<20));
+
+	return i > 0 ? (u32_hgen|0x800)<<20 : 0;
+}
+
+static struct sim_ht *sim_ht_new(__u32 handle, __u32 divisor)
+{
+	struct sim_ht *ht = calloc(1, sizeof(*ht));
+
+	if (ht == NULL)
+		return NULL;
+	ht->bucket = calloc(divisor + 1, sizeof(*ht->bucket));
+	if (ht->bucket == NULL) {
+		free(ht);
+		return NULL;
+	}
+	ht->handle = handle;
+	ht->divisor = divisor;
+	ht->next = tables;
+	tables = ht;
+	return ht;
+}
+
+static struct sim_filter *sim_u32(struct sim_tp *tp, struct sim_pkt *p)
+{
+	struct {
+		struct sim_filter	*n;
+		int			off;
+	} stack[TC_U32_MAXDEPTH];
+	struct sim_ht *ht = tp->root;
+	struct sim_filter *n;
+	int sdepth = 0, off = p->nh, off2 = 0, sel = 0;
+
+next_ht:
+	n = ht->bucket[sel];
+
+next_knode:
+	if (n) {
+		struct tc_u32_key *key = n->sel->keys;
+		int i;
+
+		nvisits++;
+		if (n->mark && (skb_mark & n->mark->mask) != n->mark->val) {
+			n = n->link;
+			goto next_knode;
+		}
+
+		n->pf->rcnt++;
+		for (i = 0; i < n->sel->nkeys; i++, key++) {
+			int toff = off + key->off + (off2 & key->offmask);
+
+			nkeys++;
+			if (!sim_valid(p, toff, 4))
+				goto out;
+			if ((sim_word(p, toff) ^ key->val) & key->mask) {
+				n = n->link;
+				goto next_knode;
+			}
+			n->pf->kcnts[i]++;
+		}
+		n->pf->rhit++;
+
+		if (n->down == NULL) {
+check_terminal:
+			if (n->sel->flags & TC_U32_TERMINAL)
+				return n;
+			n = n->link;
+			goto next_knode;
+		}
+
+		if (sdepth >= TC_U32_MAXDEPTH)
+			goto out;
+		n->hits++;
+		stack[sdepth].n = n;
+		stack[sdepth].off = off;
+		sdepth++;
+
+		ht = n->down;
+		sel = 0;
+		if (ht->divisor) {
+			if (!sim_valid(p, off + n->sel->hoff, 4))
+				goto out;
+			sel = ht->divisor &
+			      (ntohl(sim_word(p, off + n->sel->hoff) &
+				     n->sel->hmask) >> n->fshift);
+		}
+		if (!(n->sel->flags & (TC_U32_VAROFFSET|TC_U32_OFFSET|TC_U32_EAT)))
+			goto next_ht;
+
+		if (n->sel->flags & (TC_U32_OFFSET|TC_U32_VAROFFSET)) {
+			off2 = n->sel->off + 3;
+			if (n->sel->flags & TC_U32_VAROFFSET) {
+				__u16 w;
+
+				if (!sim_valid(p, off + n->sel->offoff, 2))
+					goto out;
+				memcpy(&w, p->data + off + n->sel->offoff, 2);
+				off2 += ntohs(n->sel->offmask & w) >>
+					n->sel->offshift;
+			}
+			off2 &= ~3;
+		}
+		if (n->sel->flags & TC_U32_EAT) {
+			off += off2;
+			off2 = 0;
+		}
+
+		if (off < p->len)
+			goto next_ht;
+	}
+
+	if (sdepth--) {
+		n = stack[sdepth].n;
+		off = stack[sdepth].off;
+		goto check_terminal;
+	}
+out:
+	return NULL;
+}
+
+static int sim_u32_add(struct sim_tp *tp, __u32 handle, struct rtattr *opt,
+		       struct sim_filter *f)
+{
+	struct rtattr *tb[TCA_U32_MAX+1];
+	struct sim_filter **ins;
+	struct sim_ht *ht;
+	__u32 htid;
+	int len, explicit;
+
+	memset(tb, 0, sizeof(tb));
+	if (opt)
+		parse_rtattr_nested(tb, TCA_U32_MAX, opt);
+
+	if (tp->root == NULL) {
+		__u32 h = u32_roots++ ? sim_ht_gen() : 0x80000000;
+
+		if (h == 0 || (tp->root = sim_ht_new(h, 0)) == NULL)
+			return -1;
+	}
+
+	if (tb[TCA_U32_DIVISOR]) {
+		__u32 divisor = *(__u32 *)RTA_DATA(tb[TCA_U32_DIVISOR]);
+
+		if (--divisor > 0x100 || TC_U32_KEY(handle)) {
+			fprintf(stderr, "Invalid u32 hash table\n");
+			return -1;
+		}
+		if (handle == 0)
+			handle = sim_ht_gen();
+		if (handle == 0 || sim_ht_lookup(handle)) {
+			fprintf(stderr, "Hash table %x: exists\n",
+				TC_U32_USERHTID(handle));
+			return -1;
+		}
+		return sim_ht_new(handle, divisor) ? 1 : -1;
+	}
+
+	if (tb[TCA_U32_HASH]) {
+		htid = *(__u32 *)RTA_DATA(tb[TCA_U32_HASH]);
+		if (TC_U32_HTID(htid) == TC_U32_ROOT) {
+			ht = tp->root;
+			htid = ht->handle;
+		} else
+			ht = sim_ht_lookup(TC_U32_HTID(htid));
+	} else {
+		ht = tp->root;
+		htid = ht->handle;
+	}
+	if (ht == NULL || TC_U32_HASH(htid) > ht->divisor) {
+		fprintf(stderr, "No such u32 hash bucket %x:%x\n",
+			TC_U32_USERHTID(htid), TC_U32_HASH(htid));
+		return -1;
+	}
+
+	ins = &ht->bucket[TC_U32_HASH(htid)];
+	explicit = handle != 0;
+	if (handle) {
+		if (TC_U32_HTID(handle) && TC_U32_HTID(handle^htid)) {
+			fprintf(stderr, "Handle does not match its table\n");
+			return -1;
+		}
+		handle = htid | TC_U32_NODE(handle);
+	} else {
+		/* Past node fff the kernel hands out fff again */
+		unsigned i = 0x7FF;
+		struct sim_filter *n;
+
+		for (n = *ins; n; n = n->link)
+			if (i < TC_U32_NODE(n->handle))
+				i = TC_U32_NODE(n->handle);
+		i++;
+		handle = htid | (i > 0xFFF ? 0xFFF : i);
+	}
+
+	if (tb[TCA_U32_SEL] == NULL) {
+		fprintf(stderr, "u32 filter without a selector\n");
+		return -1;
+	}
+	if (tb[TCA_U32_INDEV]) {
+		fprintf(stderr, "u32 \"indev\" cannot be simulated\n");
+		return -1;
+	}
+	len = RTA_PAYLOAD(tb[TCA_U32_SEL]);
+	f->sel = malloc(len);
+	if (f->sel == NULL)
+		return -1;
+	memcpy(f->sel, RTA_DATA(tb[TCA_U32_SEL]), len);
+	if (len < sizeof(*f->sel) + f->sel->nkeys * sizeof(struct tc_u32_key))
+		return -1;
+	f->fshift = f->sel->hmask ? ffs(ntohl(f->sel->hmask)) - 1 : 0;
+	f->pf = calloc(1, sizeof(*f->pf) + f->sel->nkeys * sizeof(__u64));
+	if (f->pf == NULL)
+		return -1;
+
+	if (tb[TCA_U32_LINK]) {
+		__u32 link = *(__u32 *)RTA_DATA(tb[TCA_U32_LINK]);
+
+		if (TC_U32_KEY(link) || (f->down = sim_ht_lookup(link)) == NULL) {
+			fprintf(stderr, "No u32 hash table %x: to link to\n",
+				TC_U32_USERHTID(link));
+			return -1;
+		}
+	}
+	if (tb[TCA_U32_CLASSID])
+		f->classid = *(__u32 *)RTA_DATA(tb[TCA_U32_CLASSID]);
+	if (tb[TCA_U32_ACT] || tb[TCA_U32_POLICE])
+		f->action = 1;
+	if (tb[TCA_U32_MARK]) {
+		f->mark = malloc(sizeof(*f->mark));
+		if (f->mark == NULL)
+			return -1;
+		memcpy(f->mark, RTA_DATA(tb[TCA_U32_MARK]), sizeof(*f->mark));
+	}
+
+	for (; *ins; ins = &(*ins)->link) {
+		if (explicit && (*ins)->handle == handle) {
+			fprintf(stderr, "Filter %x:%x:%x exists\n",
+				TC_U32_USERHTID(handle), TC_U32_HASH(handle),
+				TC_U32_NODE(handle));
+			return -1;
+		}
+		if (TC_U32_NODE(handle) < TC_U32_NODE((*ins)->handle))
+			break;
+	}
+	f->handle = handle;
+	f->link = *ins;
+	*ins = f;
+	return 0;
+}
+
+/* basic */
+
+static struct sim_filter *sim_basic(struct sim_tp *tp, struct sim_pkt *p)
+{
+	struct sim_filter *f;
+
+	for (f = tp->list; f; f = f->link) {
+		nvisits++;
+		if (sim_em_tree(p, f))
+			return f;
+	}
+	return NULL;
+}
+
+static int sim_basic_add(struct sim_tp *tp, __u32 handle, struct rtattr *opt,
+			 struct sim_filter *f)
+{
+	struct rtattr *tb[TCA_BASIC_MAX+1];
+
+	memset(tb, 0, sizeof(tb));
+	if (opt)
+		parse_rtattr_nested(tb, TCA_BASIC_MAX, opt);
+
+	if (tb[TCA_BASIC_EMATCHES] && sim_em_load(f, tb[TCA_BASIC_EMATCHES])) {
+		fprintf(stderr, "Invalid ematch tree\n");
+		return -1;
+	}
+	if (tb[TCA_BASIC_CLASSID])
+		f->classid = *(__u32 *)RTA_DATA(tb[TCA_BASIC_CLASSID]);
+	if (tb[TCA_BASIC_ACT] || tb[TCA_BASIC_POLICE])
+		f->action = 1;
+
+	f->handle = handle ? handle : ++tp->gen;
+	/* cls_basic puts new filters first */
+	f->link = tp->list;
+	tp->list = f;
+	return 0;
+}
+
+/* fw */
+
+static struct sim_filter *sim_fw(struct sim_tp *tp, struct sim_pkt *p)
+{
+	__u32 id = skb_mark & tp->fw_mask;
+	struct sim_filter *f;
+
+	nkeys++;
+	nvisits++;
+	for (f = tp->list; f; f = f->link)
+		if (f->handle == id)
+			return f;
+	return NULL;
+}
+
+static int sim_fw_add(struct sim_tp *tp, __u32 handle, struct rtattr *opt,
+		      struct sim_filter *f)
+{
+	struct rtattr *tb[TCA_FW_MAX+1];
+	struct sim_filter *n;
+	__u32 mask = 0xFFFFFFFF;
+
+	memset(tb, 0, sizeof(tb));
+	if (opt)
+		parse_rtattr_nested(tb, TCA_FW_MAX, opt);
+
+	if (handle == 0) {
+		fprintf(stderr, "fw filter without a handle\n");
+		return -1;
+	}
+	if (tb[TCA_FW_INDEV]) {
+		fprintf(stderr, "fw \"indev\" cannot be simulated\n");
+		return -1;
+	}
+	if (tb[TCA_FW_MASK])
+		mask = *(__u32 *)RTA_DATA(tb[TCA_FW_MASK]);
+	if (tp->list == NULL)
+		tp->fw_mask = mask;
+	else if (mask != tp->fw_mask) {
+		fprintf(stderr, "fw filters of one priority share a mask\n");
+		return -1;
+	}
+	for (n = tp->list; n; n = n->link)
+		if (n->handle == handle) {
+			fprintf(stderr, "Filter 0x%x exists\n", handle);
+			return -1;
+		}
+
+	if (tb[TCA_FW_CLASSID])
+		f->classid = *(__u32 *)RTA_DATA(tb[TCA_FW_CLASSID]);
+	if (tb[TCA_FW_ACT] || tb[TCA_FW_POLICE])
+		f->action = 1;
+	f->handle = handle;
+	f->link = tp->list;
+	tp->list = f;
+	return 0;
+}
+
+/* flow */
+
+#define JHASH_GOLDEN_RATIO	0x9e3779b9
+
+#define __jhash_mix(a, b, c) \
+{ \
+  a -= b; a -= c; a ^= (c>>13); \
+  b -= c; b -= a; b ^= (a<<8); \
+  c -= a; c -= b; c ^= (b>>13); \
+  a -= b; a -= c; a ^= (c>>12);  \
+  b -= c; b -= a; b ^= (a<<16); \
+  c -= a; c -= b; c ^= (b>>5); \
+  a -= b; a -= c; a ^= (c>>3);  \
+  b -= c; b -= a; b ^= (a<<10); \
+  c -= a; c -= b; c ^= (b>>15); \
+}
+
+static __u32 jhash2(const __u32 *k, __u32 length, __u32 initval)
+{
+	__u32 a, b, c, len;
+
+	a = b = JHASH_GOLDEN_RATIO;
+	c = initval;
+	len = length;
+
+	while (len >= 3) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		__jhash_mix(a, b, c);
+		k += 3; len -= 3;
+	}
+
+	c += length * 4;
+
+	switch (len) {
+	case 2: b += k[1];
+	case 1: a += k[0];
+	}
+
+	__jhash_mix(a, b, c);
+	return c;
+}
+
+static int sim_flow_ports(const struct sim_pkt *p, int *off)
+{
+	int proto;
+
+	if (p->protocol == htons(ETH_P_IP)) {
+		if (!sim_valid(p, p->nh, 20) ||
+		    (p->data[p->nh + 6] & 0x3f) || p->data[p->nh + 7])
+			return 0;
+		proto = p->data[p->nh + 9];
+	} else if (p->protocol == htons(ETH_P_IPV6)) {
+		if (!sim_valid(p, p->nh, 40))
+			return 0;
+		proto = p->data[p->nh + 6];
+	} else
+		return 0;
+
+	switch (proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
+	case IPPROTO_ESP:
+	case IPPROTO_AH:
+		break;
+	default:
+		return 0;
+	}
+	*off = p->th;
+	return sim_valid(p, p->th, 4);
+}
+
+static __u32 sim_flow_key(const struct sim_pkt *p, int key)
+{
+	int off;
+
+	switch (key) {
+	case FLOW_KEY_SRC:
+	case FLOW_KEY_NFCT_SRC:
+		if (p->protocol == htons(ETH_P_IP) && sim_valid(p, p->nh, 20))
+			return ntohl(sim_word(p, p->nh + 12));
+		if (p->protocol == htons(ETH_P_IPV6) && sim_valid(p, p->nh, 40))
+			return ntohl(sim_word(p, p->nh + 20));
+		break;
+	case FLOW_KEY_DST:
+	case FLOW_KEY_NFCT_DST:
+		if (p->protocol == htons(ETH_P_IP) && sim_valid(p, p->nh, 20))
+			return ntohl(sim_word(p, p->nh + 16));
+		if (p->protocol == htons(ETH_P_IPV6) && sim_valid(p, p->nh, 40))
+			return ntohl(sim_word(p, p->nh + 36));
+		break;
+	case FLOW_KEY_PROTO:
+		if (p->protocol == htons(ETH_P_IP) && sim_valid(p, p->nh, 20))
+			return p->data[p->nh + 9];
+		if (p->protocol == htons(ETH_P_IPV6) && sim_valid(p, p->nh, 40))
+			return p->data[p->nh + 6];
+		break;
+	case FLOW_KEY_PROTO_SRC:
+	case FLOW_KEY_NFCT_PROTO_SRC:
+		if (sim_flow_ports(p, &off))
+			return p->data[off] << 8 | p->data[off + 1];
+		break;
+	case FLOW_KEY_PROTO_DST:
+	case FLOW_KEY_NFCT_PROTO_DST:
+		if (sim_flow_ports(p, &off))
+			return p->data[off + 2] << 8 | p->data[off + 3];
+		break;
+	case FLOW_KEY_MARK:
+		return skb_mark;
+	}
+	return 0;
+}
+
+static struct sim_filter *sim_flow(struct sim_tp *tp, struct sim_pkt *p)
+{
+	struct sim_filter *f;
+
+	for (f = tp->list; f; f = f->link) {
+		__u32 keys[FLOW_KEY_MAX + 1];
+		__u32 keymask = f->keymask, classid;
+		int n = 0;
+
+		nvisits++;
+		if (!sim_em_tree(p, f))
+			continue;
+
+		while (keymask) {
+			int key = ffs(keymask) - 1;
+
+			keymask &= ~(1 << key);
+			keys[n++] = sim_flow_key(p, key);
+			nkeys++;
+		}
+
+		if (f->mode == FLOW_MODE_HASH)
+			classid = jhash2(keys, n, 0);
+		else {
+			classid = keys[0];
+			classid = (classid & f->mask) ^ f->xor;
+			classid = (classid >> f->rshift) + f->addend;
+		}
+		if (f->divisor)
+			classid %= f->divisor;
+		f->classid = TC_H_MAKE(f->baseclass, f->baseclass + classid);
+		return f;
+	}
+	return NULL;
+}
+
+static int sim_flow_add(struct sim_tp *tp, __u32 handle, struct rtattr *opt,
+			struct sim_filter *f)
+{
+	struct rtattr *tb[TCA_FLOW_MAX+1];
+	struct sim_filter **ins;
+
+	memset(tb, 0, sizeof(tb));
+	if (opt)
+		parse_rtattr_nested(tb, TCA_FLOW_MAX, opt);
+
+	if (tb[TCA_FLOW_KEYS] == NULL) {
+		fprintf(stderr, "flow filter without keys\n");
+		return -1;
+	}
+	f->keymask = *(__u32 *)RTA_DATA(tb[TCA_FLOW_KEYS]);
+	if (f->keymask == 0 || (f->keymask >> (FLOW_KEY_MAX + 1))) {
+		fprintf(stderr, "Invalid flow keys\n");
+		return -1;
+	}
+	f->mode = FLOW_MODE_MAP;
+	if (tb[TCA_FLOW_MODE])
+		f->mode = *(__u32 *)RTA_DATA(tb[TCA_FLOW_MODE]);
+	if (f->mode != FLOW_MODE_HASH && (f->keymask & (f->keymask - 1))) {
+		fprintf(stderr, "flow map mode takes a single key\n");
+		return -1;
+	}
+	f->mask = ~0U;
+	if (tb[TCA_FLOW_MASK])
+		f->mask = *(__u32 *)RTA_DATA(tb[TCA_FLOW_MASK]);
+	if (tb[TCA_FLOW_XOR])
+		f->xor = *(__u32 *)RTA_DATA(tb[TCA_FLOW_XOR]);
+	if (tb[TCA_FLOW_RSHIFT])
+		f->rshift = *(__u32 *)RTA_DATA(tb[TCA_FLOW_RSHIFT]);
+	if (tb[TCA_FLOW_ADDEND])
+		f->addend = *(__u32 *)RTA_DATA(tb[TCA_FLOW_ADDEND]);
+	if (tb[TCA_FLOW_DIVISOR])
+		f->divisor = *(__u32 *)RTA_DATA(tb[TCA_FLOW_DIVISOR]);
+	if (tb[TCA_FLOW_BASECLASS])
+		f->baseclass = *(__u32 *)RTA_DATA(tb[TCA_FLOW_BASECLASS]);
+	else
+		f->baseclass = TC_H_MAKE(TC_H_MAJ(tp->parent), 1);
+	if (tb[TCA_FLOW_EMATCHES] && sim_em_load(f, tb[TCA_FLOW_EMATCHES])) {
+		fprintf(stderr, "Invalid ematch tree\n");
+		return -1;
+	}
+	if (tb[TCA_FLOW_ACT] || tb[TCA_FLOW_POLICE])
+		f->action = 1;
+
+	f->handle = handle;
+	for (ins = &tp->list; *ins; ins = &(*ins)->link)
+		;
+	*ins = f;
+	return 0;
+}
+
+/* Find or make the classifier instance as tc_ctl_tfilter() would */
+static struct sim_tp *sim_tp_get(__u32 parent, __u32 prio, __u16 protocol,
+				 const char *kind)
+{
+	struct sim_chain *c;
+	struct sim_tp **back, *tp;
+	__u32 want = prio ? prio : 0x8000;
+
+	for (c = chains; c; c = c->next)
+		if (c->parent == parent)
+			break;
+	if (c == NULL) {
+		c = calloc(1, sizeof(*c));
+		if (c == NULL)
+			return NULL;
+		c->parent = parent;
+		c->next = chains;
+		chains = c;
+	}
+
+	for (back = &c->tp; (tp = *back) != NULL; back = &tp->next) {
+		if (tp->prio >= want) {
+			if (tp->prio == want) {
+				if (!prio || (tp->protocol != protocol && protocol)) {
+					fprintf(stderr, "Priority %u is taken\n", want);
+					return NULL;
+				}
+			} else
+				tp = NULL;
+			break;
+		}
+	}
+
+	if (tp) {
+		if (strcmp(tp->kind, kind)) {
+			fprintf(stderr, "Priority %u is a %s classifier\n",
+				tp->prio, tp->kind);
+			return NULL;
+		}
+		return tp;
+	}
+
+	tp = calloc(1, sizeof(*tp));
+	if (tp == NULL)
+		return NULL;
+	if (strcmp(kind, "u32") == 0)
+		tp->classify = sim_u32;
+	else if (strcmp(kind, "basic") == 0)
+		tp->classify = sim_basic;
+	else if (strcmp(kind, "fw") == 0)
+		tp->classify = sim_fw;
+	else if (strcmp(kind, "flow") == 0)
+		tp->classify = sim_flow;
+	else {
+		fprintf(stderr, "Classifier \"%s\" cannot be simulated\n", kind);
+		free(tp);
+		return NULL;
+	}
+	strcpy(tp->kind, kind);
+	tp->parent = parent;
+	tp->protocol = protocol;
+	tp->prio = prio ? prio : (*back ? (*back)->prio - 1 : 0xC000);
+	tp->next = *back;
+	*back = tp;
+	return tp;
+}
+
+static int sim_filter_add(int argc, char **argv, const char *dev, int line)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct tcmsg	t;
+		char		buf[MAX_MSG];
+	} req;
+	struct rtattr *tb[TCA_MAX+1];
+	struct filter_util *q = NULL;
+	struct tc_estimator est;
+	struct sim_filter *f;
+	struct sim_tp *tp;
+	char *fhandle = NULL, *d = NULL;
+	char k[16];
+	__u32 prio = 0, parent = 0;
+	__u16 protocol = htons(ETH_P_ALL);
+	int err;
+
+	memset(&req, 0, sizeof(req));
+	memset(k, 0, sizeof(k));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	req.n.nlmsg_type = RTM_NEWTFILTER;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			d = *argv;
+		} else if (strcmp(*argv, "root") == 0) {
+			parent = TC_H_ROOT;
+		} else if (strcmp(*argv, "parent") == 0) {
+			NEXT_ARG();
+			if (get_tc_classid(&parent, *argv))
+				invarg(*argv, "Invalid parent ID");
+		} else if (strcmp(*argv, "handle") == 0) {
+			NEXT_ARG();
+			fhandle = *argv;
+		} else if (matches(*argv, "preference") == 0 ||
+			   matches(*argv, "priority") == 0) {
+			NEXT_ARG();
+			if (get_u32(&prio, *argv, 0) || prio > 0xFFFF)
+				invarg(*argv, "invalid priority value");
+		} else if (matches(*argv, "protocol") == 0) {
+			NEXT_ARG();
+			if (ll_proto_a2n(&protocol, *argv))
+				invarg(*argv, "invalid protocol");
+		} else if (matches(*argv, "estimator") == 0) {
+			if (parse_estimator(&argc, &argv, &est) < 0)
+				return -1;
+		} else {
+			strncpy(k, *argv, sizeof(k)-1);
+			q = get_filter_kind(k);
+			argc--; argv++;
+			break;
+		}
+		argc--; argv++;
+	}
+
+	if (dev && d && strcmp(d, dev))
+		return 0;
+	if (q == NULL) {
+		fprintf(stderr, "No classifier given\n");
+		return -1;
+	}
+	if (q->parse_fopt(q, fhandle, argc, argv, &req.n))
+		return -1;
+	parse_rtattr(tb, TCA_MAX, TCA_RTA(&req.t),
+		     req.n.nlmsg_len - NLMSG_LENGTH(sizeof(req.t)));
+
+	if (parent == TC_H_ROOT || parent == 0)
+		parent = root_handle;
+	tp = sim_tp_get(parent, prio, protocol, k);
+	if (tp == NULL)
+		return -1;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return -1;
+	f->tp = tp;
+	f->line = line;
+
+	if (tp->classify == sim_u32)
+		err = sim_u32_add(tp, req.t.tcm_handle, tb[TCA_OPTIONS], f);
+	else if (tp->classify == sim_basic)
+		err = sim_basic_add(tp, req.t.tcm_handle, tb[TCA_OPTIONS], f);
+	else if (tp->classify == sim_fw)
+		err = sim_fw_add(tp, req.t.tcm_handle, tb[TCA_OPTIONS], f);
+	else
+		err = sim_flow_add(tp, req.t.tcm_handle, tb[TCA_OPTIONS], f);
+
+	if (err) {
+		free(f);
+		return err < 0 ? -1 : 0;
+	}
+	*filters_tail = f;
+	filters_tail = &f->next;
+	return 0;
+}
+
+static int sim_load_filters(const char *name, const char *dev)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int ret = 0, saved = cmdlineno;
+	FILE *fp;
+
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "Cannot open filter file \"%s\": %s\n",
+			name, strerror(errno));
+		return -1;
+	}
+
+	cmdlineno = 0;
+	while (getcmdline(&line, &len, fp) != -1) {
+		char *largv[100];
+		int largc, i;
+
+		largc = makeargs(line, largv, 100);
+		if (largc == 0)
+			continue;
+
+		if (matches(largv[0], "qdisc") == 0 || matches(largv[0], "class") == 0) {
+			int root = 0;
+
+			if (largc < 2 || matches(largv[0], "qdisc") ||
+			    (matches(largv[1], "add") && matches(largv[1], "replace")))
+				continue;
+			for (i = 2; i < largc; i++) {
+				if (strcmp(largv[i], "root") == 0)
+					root = 1;
+				else if (root && strcmp(largv[i], "handle") == 0 &&
+					 i + 1 < largc &&
+					 get_qdisc_handle(&root_handle, largv[i + 1]) == 0)
+					break;
+			}
+			continue;
+		}
+		if (matches(largv[0], "filter") || largc < 2 ||
+		    matches(largv[1], "add")) {
+			fprintf(stderr, "Only \"filter add\" can be simulated, %s:%d\n",
+				name, cmdlineno);
+			ret = -1;
+			break;
+		}
+		if (sim_filter_add(largc - 2, largv + 2, dev, cmdlineno)) {
+			fprintf(stderr, "Bad filter %s:%d\n", name, cmdlineno);
+			ret = -1;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	cmdlineno = saved;
+	return ret;
+}
+
+static __u32 pcap32(__u32 v, int swap)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+static int sim_pkt_init(struct sim_pkt *p, int linktype)
+{
+	switch (linktype) {
+	case DLT_EN10MB:
+		if (p->len < 14)
+			return -1;
+		p->nh = 14;
+		memcpy(&p->protocol, p->data + 12, 2);
+		break;
+	case DLT_LINUX_SLL:
+		if (p->len < 16)
+			return -1;
+		p->nh = 16;
+		memcpy(&p->protocol, p->data + 14, 2);
+		break;
+	case DLT_RAW:
+	case 12:
+	case 14:
+		if (p->len < 1)
+			return -1;
+		p->nh = 0;
+		p->protocol = htons((p->data[0] >> 4) == 6 ? ETH_P_IPV6 : ETH_P_IP);
+		break;
+	default:
+		return -1;
+	}
+
+	p->th = p->nh;
+	if (p->protocol == htons(ETH_P_IP) && sim_valid(p, p->nh, 20))
+		p->th = p->nh + (p->data[p->nh] & 0xf) * 4;
+	else if (p->protocol == htons(ETH_P_IPV6))
+		p->th = p->nh + 40;
+	return 0;
+}
+
+static struct sim_pkt *sim_load_pcap(const char *name, int *npkts)
+{
+	struct sim_pkt *pkts = NULL;
+	unsigned char *buf = NULL;
+	size_t len = 0, size = 0, pos;
+	int n = 0, alloc = 0, swap, linktype;
+	__u32 magic;
+	FILE *fp;
+
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "Cannot open capture \"%s\": %s\n",
+			name, strerror(errno));
+		return NULL;
+	}
+	for (;;) {
+		size_t r;
+
+		if (len == size) {
+			size = size ? 2 * size : 1 << 20;
+			buf = realloc(buf, size);
+			if (buf == NULL) {
+				fclose(fp);
+				return NULL;
+			}
+		}
+		r = fread(buf + len, 1, size - len, fp);
+		if (r == 0)
+			break;
+		len += r;
+	}
+	fclose(fp);
+
+	if (len < 24)
+		goto bad;
+	memcpy(&magic, buf, 4);
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS)
+		swap = 0;
+	else if (__builtin_bswap32(magic) == PCAP_MAGIC ||
+		 __builtin_bswap32(magic) == PCAP_MAGIC_NS)
+		swap = 1;
+	else
+		goto bad;
+	memcpy(&linktype, buf + 20, 4);
+	linktype = pcap32(linktype, swap) & 0xffff;
+
+	for (pos = 24; pos + 16 <= len; ) {
+		__u32 incl, orig;
+
+		memcpy(&incl, buf + pos + 8, 4);
+		memcpy(&orig, buf + pos + 12, 4);
+		incl = pcap32(incl, swap);
+		orig = pcap32(orig, swap);
+		pos += 16;
+		if (incl > len - pos)
+			break;
+
+		if (n == alloc) {
+			alloc = alloc ? 2 * alloc : 4096;
+			pkts = realloc(pkts, alloc * sizeof(*pkts));
+			if (pkts == NULL)
+				return NULL;
+		}
+		memset(&pkts[n], 0, sizeof(pkts[n]));
+		pkts[n].data = buf + pos;
+		pkts[n].len = incl;
+		pkts[n].wirelen = orig;
+		if (sim_pkt_init(&pkts[n], linktype) < 0) {
+			fprintf(stderr, "Cannot decode packet %d of \"%s\", "
+				"link type %d\n", n + 1, name, linktype);
+			free(pkts);
+			return NULL;
+		}
+		n++;
+		pos += incl;
+	}
+
+	*npkts = n;
+	return pkts;
+
+bad:
+	fprintf(stderr, "\"%s\" is not a pcap file\n", name);
+	free(buf);
+	return NULL;
+}
+
+/* As tc_classify(), then into inner classes that have filters */
+static int sim_classify(struct sim_pkt *p, __u32 parent)
+{
+	int level;
+
+	for (level = 0; level < SIM_LEVELS; level++) {
+		struct sim_filter *f = NULL;
+		struct sim_chain *c;
+		struct sim_tp *tp;
+
+		for (c = chains; c; c = c->next)
+			if (c->parent == parent)
+				break;
+		if (c == NULL)
+			return level > 0;
+
+		for (tp = c->tp; tp && f == NULL; tp = tp->next)
+			if (tp->protocol == p->protocol ||
+			    tp->protocol == htons(ETH_P_ALL))
+				f = tp->classify(tp, p);
+		if (f == NULL)
+			return level > 0;
+
+		f->hits++;
+		if (f->classid == 0 || f->classid == parent)
+			return 1;
+		parent = f->classid;
+	}
+	return 1;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static void sim_print(struct sim_filter *f, unsigned long long passes)
+{
+	char b1[64], b2[64];
+
+	printf("%10llu %5d  parent %s prio %u %s ", f->hits / passes, f->line,
+	       sprint_tc_classid(f->tp->parent, b1), f->tp->prio, f->tp->kind);
+	if (f->tp->classify == sim_u32)
+		printf("handle %x:%x:%x", TC_U32_USERHTID(f->handle),
+		       TC_U32_HASH(f->handle), TC_U32_NODE(f->handle));
+	else
+		printf("handle 0x%x", f->handle);
+
+	if (f->down)
+		printf(" link %x:", TC_U32_USERHTID(f->down->handle));
+	if (f->tp->classify == sim_flow)
+		printf(" baseclass %s", sprint_tc_classid(f->baseclass, b2));
+	else if (f->classid)
+		printf(" classid %s", sprint_tc_classid(f->classid, b2));
+	if (f->action)
+		printf(" action");
+	printf("\n");
+}
+
+/* Every pass gives the same results, repeat them to time enough */
+static unsigned long long sim_run(struct sim_pkt *pkts, int npkts, __u32 parent,
+				  unsigned long long *passes, double *t)
+{
+	unsigned long long classified = 0;
+	struct sim_filter *f;
+	double t0;
+	int i;
+
+	for (f = filters; f; f = f->next) {
+		f->hits = 0;
+		if (f->pf)
+			memset(f->pf, 0, sizeof(*f->pf) +
+			       f->sel->nkeys * sizeof(__u64));
+	}
+	nkeys = nvisits = 0;
+	*passes = 0;
+
+	t0 = now();
+	do {
+		for (i = 0; i < npkts; i++)
+			classified += sim_classify(&pkts[i], parent);
+		(*passes)++;
+		*t = now() - t0;
+	} while (*t < SIM_TIME);
+
+	return classified / *passes;
+}
+
+static int sim_hkey_cmp(const void *a, const void *b)
+{
+	const struct tc_u32_key *x = a, *y = b;
+
+	if (x->off != y->off)
+		return x->off < y->off ? -1 : 1;
+	if (x->mask != y->mask)
+		return ntohl(x->mask) < ntohl(y->mask) ? -1 : 1;
+	if (x->val != y->val)
+		return ntohl(x->val) < ntohl(y->val) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * A hashkey is read before any filter of the bucket, and a key reading
+ * past the end of the packet ends the whole lookup. Hashing on "hk"
+ * classifies short packets the same only if the first filter starts
+ * with that word and no filter reads further out before comparing it.
+ */
+static int sim_hash_safe(const struct sim_filter *chain,
+			 const struct tc_u32_key *hk)
+{
+	const struct sim_filter *f;
+	int i;
+
+	if (chain->sel->nkeys == 0 || chain->sel->keys[0].offmask ||
+	    chain->sel->keys[0].off != hk->off)
+		return 0;
+	for (f = chain; f; f = f->link) {
+		const struct tc_u32_key *k = f->sel->keys;
+
+		for (i = 0; i < f->sel->nkeys; i++)
+			if (k[i].offmask == 0 && k[i].off == hk->off &&
+			    k[i].mask == hk->mask)
+				break;
+		if (i == f->sel->nkeys)
+			continue;
+		while (--i >= 0)
+			if (k[i].offmask || k[i].off > hk->off)
+				return 0;
+	}
+	return 1;
+}
+
+/* Long buckets whose filters mostly differ in one word are better hashed */
+static void sim_hash_hints(void)
+{
+	struct tc_u32_key *keys = NULL;
+	int alloc = 0;
+	struct sim_ht *ht;
+
+	for (ht = tables; ht; ht = ht->next) {
+		unsigned b;
+
+		for (b = 0; b <= ht->divisor; b++) {
+			struct tc_u32_key best = { 0 };
+			unsigned char used[256];
+			int i, j, n = 0, nk = 0, nbest = 0, div, fshift, nb;
+			struct sim_filter *f;
+
+			for (f = ht->bucket[b]; f; f = f->link) {
+				n++;
+				nk += f->sel->nkeys;
+			}
+			if (n < SIM_HASH_MIN)
+				continue;
+			if (nk > alloc) {
+				alloc = nk;
+				keys = realloc(keys, alloc * sizeof(*keys));
+				if (keys == NULL)
+					return;
+			}
+			nk = 0;
+			for (f = ht->bucket[b]; f; f = f->link)
+				for (i = 0; i < f->sel->nkeys; i++)
+					if (f->sel->keys[i].offmask == 0 &&
+					    f->sel->keys[i].mask)
+						keys[nk++] = f->sel->keys[i];
+			qsort(keys, nk, sizeof(*keys), sim_hkey_cmp);
+
+			for (i = 0; i < nk; i = j) {
+				int vals = 1;
+
+				for (j = i + 1; j < nk && keys[j].off == keys[i].off &&
+				     keys[j].mask == keys[i].mask; j++)
+					if (keys[j].val != keys[j - 1].val)
+						vals++;
+				if (vals > nbest &&
+				    sim_hash_safe(ht->bucket[b], &keys[i])) {
+					nbest = vals;
+					best = keys[i];
+				}
+			}
+			if (nbest < SIM_HASH_MIN)
+				continue;
+
+			for (div = 1; div < nbest && div < 256; div <<= 1)
+				;
+			fshift = ffs(ntohl(best.mask)) - 1;
+			memset(used, 0, sizeof(used));
+			for (i = nb = 0; i < nk; i++) {
+				unsigned h;
+
+				if (keys[i].off != best.off || keys[i].mask != best.mask)
+					continue;
+				h = (ntohl(keys[i].val) >> fshift) & (div - 1);
+				nb += !used[h];
+				used[h] = 1;
+			}
+			if (2 * nb < div)
+				continue;
+			printf("# %x:%x: %d filters, %d values of 0x%08x at %d "
+			       "would spread over %d of %d buckets with "
+			       "\"hashkey mask 0x%08x at %d\"\n",
+			       TC_U32_USERHTID(ht->handle), b, n, nbest,
+			       ntohl(best.mask), best.off, nb, div,
+			       ntohl(best.mask), best.off);
+		}
+	}
+	free(keys);
+}
+
+/* Reorder the keys of every u32 filter by the hits of the last run */
+static int sim_optimize(void)
+{
+	struct sim_filter *f;
+	int changed = 0, i;
+
+	for (f = filters; f; f = f->next) {
+		size_t len;
+		struct tc_u32_sel *sel;
+
+		if (f->sel == NULL)
+			continue;
+		len = sizeof(*sel) + f->sel->nkeys * sizeof(struct tc_u32_key);
+		if ((sel = malloc(len)) == NULL)
+			return -1;
+		memcpy(sel, f->sel, len);
+		if (u32_optimize_sel(sel, f->pf) < 0 ||
+		    (sel->nkeys == f->sel->nkeys && memcmp(sel, f->sel, len) == 0)) {
+			free(sel);
+			continue;
+		}
+
+		printf("# line %d:", f->line);
+		for (i = 0; i < sel->nkeys; i++)
+			printf(" match u32 0x%08x 0x%08x at %s%d",
+			       ntohl(sel->keys[i].val), ntohl(sel->keys[i].mask),
+			       sel->keys[i].offmask ? "nexthdr+" : "",
+			       sel->keys[i].off);
+		printf("\n");
+		free(f->sel);
+		f->sel = sel;
+		changed++;
+	}
+	return changed;
+}
+
+int do_simulate(int argc, char **argv)
+{
+	char *ffile = NULL, *pfile = NULL, *dev = NULL;
+	unsigned long long passes, classified;
+	struct sim_pkt *pkts;
+	struct sim_filter *f;
+	__u32 parent = 0;
+	double t, keys;
+	int npkts = 0, optimize = 0;
+
+	if (argc < 1 || matches(*argv, "help") == 0) {
+		usage();
+		return argc < 1 ? -1 : 0;
+	}
+
+	while (argc > 0) {
+		if (strcmp(*argv, "filters") == 0) {
+			NEXT_ARG();
+			ffile = *argv;
+		} else if (strcmp(*argv, "pcap") == 0) {
+			NEXT_ARG();
+			pfile = *argv;
+		} else if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			dev = *argv;
+		} else if (strcmp(*argv, "root") == 0) {
+			parent = TC_H_ROOT;
+		} else if (strcmp(*argv, "parent") == 0) {
+			NEXT_ARG();
+			if (get_tc_classid(&parent, *argv))
+				invarg(*argv, "invalid parent ID");
+		} else if (strcmp(*argv, "mark") == 0) {
+			NEXT_ARG();
+			if (get_u32(&skb_mark, *argv, 0))
+				invarg(*argv, "invalid mark");
+		} else if (matches(*argv, "optimize") == 0) {
+			optimize = 1;
+		} else if (matches(*argv, "help") == 0) {
+			usage();
+			return 0;
+		} else {
+			fprintf(stderr, "What is \"%s\"? Try \"tc simulate help\".\n",
+				*argv);
+			return -1;
+		}
+		argc--; argv++;
+	}
+
+	if (!ffile || !pfile) {
+		fprintf(stderr, "\"filters\" and \"pcap\" are required.\n");
+		return -1;
+	}
+
+	if (sim_load_filters(ffile, dev))
+		return -1;
+	if (filters == NULL) {
+		fprintf(stderr, "No filters in \"%s\"\n", ffile);
+		return -1;
+	}
+	if ((pkts = sim_load_pcap(pfile, &npkts)) == NULL)
+		return -1;
+	if (npkts == 0) {
+		fprintf(stderr, "No packets in \"%s\"\n", pfile);
+		return -1;
+	}
+
+	if (parent == TC_H_ROOT || (parent == 0 && filters->tp->parent == TC_H_ROOT))
+		parent = root_handle;
+	else if (parent == 0)
+		parent = filters->tp->parent;
+
+	classified = sim_run(pkts, npkts, parent, &passes, &t);
+	keys = (double)nkeys / passes / npkts;
+
+	printf("# %d packets, %llu classified, %llu unclassified\n",
+	       npkts, classified, npkts - classified);
+	printf("# %.2f keys and %.2f filters examined per packet\n",
+	       keys, (double)nvisits / passes / npkts);
+	printf("# %.0f packets/sec (%llu passes in %.2f sec)\n",
+	       passes * npkts / t, passes, t);
+	printf("#     hits  line  filter\n");
+	for (f = filters; f; f = f->next)
+		sim_print(f, passes);
+
+	if (!optimize)
+		return 0;
+
+	sim_hash_hints();
+	switch (sim_optimize()) {
+	case -1:
+		return -1;
+	case 0:
+		printf("# keys are in their best order\n");
+		return 0;
+	}
+	if (sim_run(pkts, npkts, parent, &passes, &t) != classified)
+		printf("# reordered keys classify differently\n");
+	printf("# reordered: %.2f keys per packet instead of %.2f, "
+	       "%.0f packets/sec\n",
+	       (double)nkeys / passes / npkts, keys, passes * npkts / t);
+	return 0;
+}
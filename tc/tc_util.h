@@ -55,6 +55,7 @@ extern const char *get_tc_lib(void);
 
 extern struct qdisc_util *get_qdisc_kind(const char *str);
 extern struct filter_util *get_filter_kind(const char *str);
+extern struct action_util *get_action_kind(char *str);
 
 extern int get_qdisc_handle(__u32 *h, const char *str);
 extern int get_rate(unsigned *rate, const char *str);
@@ -101,4 +102,6 @@ extern int  tc_print_ipt(FILE *f, const struct rtattr *tb);
 extern int  parse_action(int *, char ***, int, struct nlmsghdr *);
 extern void print_tm(FILE *f, const struct tcf_t *tm);
 
+extern int u32_optimize_sel(struct tc_u32_sel *sel, const struct tc_u32_pcnt *pf);
+
 #endif
@@ -0,0 +1,68 @@
+#!/bin/bash
+# vim: ft=sh
+
+source lib/generic.sh
+
+ts_qdisc_available "htb"
+if [ $? -eq 0 ]; then
+	ts_log "reconcile: HTB is unsupported by $TC, skipping"
+	exit 127
+fi
+
+TREE=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+EDIT=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+
+cat > $TREE <<EOF
+qdisc add dev $DEV root handle 1: htb default 10
+class add dev $DEV parent 1: classid 1:1 htb rate 10mbit
+class add dev $DEV parent 1:1 classid 1:10 htb rate 5mbit ceil 10mbit prio 3
+class add dev $DEV parent 1:1 classid 1:20 htb rate 5mbit ceil 10mbit
+qdisc add dev $DEV parent 1:10 handle 10: pfifo limit 100
+filter add dev $DEV parent 1: prio 1 protocol ip u32 ht 800:: match ip dst 10.0.0.1/32 flowid 1:10
+filter add dev $DEV parent 1: prio 1 protocol ip u32 ht 800:: match ip dst 10.0.0.2/32 flowid 1:20
+filter add dev $DEV parent 1: prio 1 handle 2: protocol ip u32 divisor 1
+filter add dev $DEV parent 1: prio 1 protocol ip u32 ht 2:: match ip src 10.1.0.1/32 flowid 1:10
+filter add dev $DEV parent 1: prio 2 protocol ip u32 ht 800:: match ip src 10.1.0.0/16 link 2:
+EOF
+
+# How many commands a plan for the file has
+planned()
+{
+	$TC reconcile file $1 dev $DEV plan | sed -n 's/^# \([0-9]*\) commands.*/\1/p'
+}
+
+$TC qdisc del dev $DEV root 2> /dev/null
+ts_tc "reconcile" "building the tree" reconcile file $TREE dev $DEV
+if [ "`planned $TREE`" != "0" ]; then
+	ts_err "reconcile: a tree just built from the file is not left alone"
+fi
+
+# A prio the file leaves out is 0, not whatever the class has
+sed 's/ prio 3//' $TREE > $EDIT
+if ! $TC reconcile file $EDIT dev $DEV plan | grep -q "^class change.* 1:10 "; then
+	ts_err "reconcile: class 1:10 at prio 3 is not taken back to prio 0"
+fi
+
+# u32 nodes go one at a time, leaving the priorities and tables be
+sed 's/10.0.0.2/10.0.0.3/' $TREE > $EDIT
+if [ "`planned $EDIT`" != "2" ]; then
+	ts_err "reconcile: one u32 node changed is not deleted and added alone"
+fi
+ts_tc "reconcile" "changing a u32 node" reconcile file $EDIT dev $DEV
+if [ "`planned $EDIT`" != "0" ]; then
+	ts_err "reconcile: a changed u32 node is not left alone afterwards"
+fi
+
+# HTB takes no "change", its options need the qdisc built again
+sed 's/default 10/default 20/' $TREE > $EDIT
+ts_tc "reconcile" "changing the htb default" reconcile file $EDIT dev $DEV
+if ! $TC qdisc show dev $DEV | grep -q "default 20 "; then
+	ts_err "reconcile: htb default was not changed"
+fi
+if [ "`planned $EDIT`" != "0" ]; then
+	ts_err "reconcile: the rebuilt tree is not left alone"
+fi
+
+ts_tc "reconcile" "qdisc removal" qdisc del dev $DEV root
+
+rm -f $TREE $EDIT
@@ -0,0 +1,20 @@
+#!/bin/bash
+# vim: ft=sh
+
+source lib/generic.sh
+
+# Name lookups against a stand-in for /etc/hosts
+HOSTS=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+echo "127.0.0.1 resolve-t-lo" > $HOSTS
+export RESOLVE_HOSTS=$HOSTS
+
+ts_ip "resolve" "local routes by name" -r route show table local
+
+if ! $IP -r route show table local | grep -q "local resolve-t-lo dev lo"; then
+	ts_err "resolve: 127.0.0.1 was not named from $HOSTS"
+fi
+if $IP -r route show table local | grep -q "localhost"; then
+	ts_err "resolve: names came from the system resolver"
+fi
+
+rm -f $HOSTS
@@ -0,0 +1,111 @@
+#!/bin/bash
+# vim: ft=sh
+
+source lib/generic.sh
+
+RULES=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+BATCH=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+
+for i in `seq 0 255`; do
+	echo "dst 10.0.$i.0/24 classid 1:$((i % 16 + 2))"
+done > $RULES
+echo "src 192.168.0.0/16 dport 22 classid 1:1" >> $RULES
+echo "classid 1:1" >> $RULES
+
+ts_tc "u32-compile" "qdisc creation" \
+	qdisc add dev $DEV root handle 1: htb
+$TC compile u32 rules $RULES dev $DEV parent 1: prio 5 > $BATCH
+ts_tc "u32-compile" "loading the tables" -batch $BATCH
+
+if ! head -2 $BATCH | grep -q "^# worst case lookup"; then
+	ts_err "u32-compile: no cost report"
+fi
+if [ `$TC filter show dev $DEV | grep -c "flowid"` -lt 258 ]; then
+	ts_err "u32-compile: rules are missing"
+fi
+
+ts_tc "u32-compile" "qdisc removal" qdisc del dev $DEV root
+
+# A rule left behind the table must not be overtaken by a later one
+# that is copied into every bucket: TCP from 10/8 belongs to 1:1.
+FLAT=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+PCAP=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+
+echo "protocol 6 src 10.0.0.0/8 classid 1:1" > $RULES
+echo "src 10.0.0.0/8 classid 1:2" >> $RULES
+for i in `seq 0 63`; do
+	echo "protocol 17 dst 10.0.$i.0/24 classid 1:$((i % 16 + 3))"
+done >> $RULES
+sed -e 's/protocol \([0-9]*\)/match ip protocol \1 0xff/' \
+    -e 's/\(src\|dst\) \([0-9./]*\)/match ip \1 \2/g' \
+    -e "s/^/filter add dev $DEV parent 1: prio 5 protocol ip u32 /" \
+	$RULES > $FLAT
+$TC compile u32 rules $RULES dev $DEV parent 1: prio 5 > $BATCH
+
+bytes()
+{
+	for b in "$@"; do
+		printf "\\x$(printf %02x $b)"
+	done
+}
+
+le32()
+{
+	bytes $(($1 & 255)) $(($1 >> 8 & 255)) $(($1 >> 16 & 255)) $(($1 >> 24))
+}
+
+# Raw IPv4 header and ports: protocol, source, destination
+packet()
+{
+	le32 0; le32 0; le32 24; le32 24
+	bytes 0x45 0 0 24 0 0 0 0 64 $1 0 0 ${2//./ } ${3//./ } 4 0 0 80
+}
+
+{
+	le32 0xa1b2c3d4; bytes 2 0 4 0; le32 0; le32 0; le32 65535; le32 101
+	packet 6 10.1.2.3 10.0.5.9
+	packet 17 10.1.2.3 10.0.5.9
+	packet 17 192.168.0.1 10.0.5.9
+	packet 17 192.168.0.1 10.0.40.9
+	packet 6 192.168.0.1 10.0.5.9
+} > $PCAP
+
+# Hits per class, the packets all land in different ones
+classes()
+{
+	$TC simulate filters $1 pcap $PCAP dev $DEV parent 1: |
+		awk '!/^#/ { for (i = 3; i < NF; i++)
+				if ($i == "classid") hits[$(i + 1)] += $1 }
+		     END { for (c in hits) if (hits[c]) print c, hits[c] }' |
+		sort
+}
+
+if [ "`classes $FLAT`" != "`classes $BATCH`" ]; then
+	ts_err "u32-compile: tables classify unlike the flat list"
+	ts_err "flat: `classes $FLAT`"
+	ts_err "tables: `classes $BATCH`"
+fi
+if ! classes $BATCH | grep -q "^1:1 1$"; then
+	ts_err "u32-compile: TCP from 10/8 is not in 1:1"
+fi
+
+rm -f $RULES $BATCH $FLAT $PCAP
+
+# Past 7ff: tables the kernel's own 800: would be handed out again
+RULES=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+BATCH=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+
+awk 'BEGIN { srand(1)
+	     for (i = 0; i < 300000; i++)
+		printf "dst %d.%d.%d.%d/32 classid 1:%d\n",
+			rand() * 256, rand() * 256, rand() * 256,
+			rand() * 256, i % 16 + 1 }' > $RULES
+$TC compile u32 rules $RULES dev $DEV parent 1: prio 5 > $BATCH
+if [ `grep -c "u32 divisor" $BATCH` -lt 2047 ]; then
+	ts_err "u32-compile: too few tables to run out of handles"
+fi
+if grep -q " handle [89a-f][0-9a-f][0-9a-f]: u32 divisor" $BATCH; then
+	ts_err "u32-compile: a table takes a handle of the kernel's own"
+fi
+
+rm -f $RULES $BATCH
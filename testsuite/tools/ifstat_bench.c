@@ -0,0 +1,114 @@
+/*
+ * ifstat_bench.c	Cost of one ifstat daemon sample against the
+ *			number of interfaces.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Feeds a synthetic link dump through get_tab_nlmsg() and times the
+ * sweep and rate update the daemon does every scan interval, without
+ * talking to the kernel.
+ */
+
+#define main ifstat_main
+#include "../../misc/ifstat.c"
+#undef main
+
+#include <sys/time.h>
+
+#define SAMPLES	10
+
+static struct nlmsghdr **make_dump(int links)
+{
+	struct nlmsghdr **dump = malloc(links * sizeof(*dump));
+	int i;
+
+	for (i = 0; i < links; i++) {
+		struct {
+			struct nlmsghdr		n;
+			struct ifinfomsg	i;
+			char			buf[512];
+		} *req = calloc(1, sizeof(*req));
+		unsigned long stats[MAXS];
+		char name[16];
+
+		req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+		req->n.nlmsg_type = RTM_NEWLINK;
+		req->i.ifi_index = i + 1;
+		req->i.ifi_flags = IFF_UP;
+		snprintf(name, sizeof(name), "veth%d", i + 1);
+		memset(stats, 0, sizeof(stats));
+		addattr_l(&req->n, sizeof(*req), IFLA_IFNAME, name, strlen(name) + 1);
+		addattr_l(&req->n, sizeof(*req), IFLA_STATS, stats, sizeof(stats));
+		dump[i] = &req->n;
+	}
+	return dump;
+}
+
+/* Every interface moved some traffic since the last sample */
+static void bump(struct nlmsghdr **dump, int links)
+{
+	int i, k;
+
+	for (i = 0; i < links; i++) {
+		struct ifinfomsg *ifi = NLMSG_DATA(dump[i]);
+		struct rtattr *tb[IFLA_MAX+1];
+		unsigned long *stats;
+
+		parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi),
+			     dump[i]->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi)));
+		stats = RTA_DATA(tb[IFLA_STATS]);
+		for (k = 0; k < 4; k++)
+			stats[k] += 1000 + i;
+	}
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static double run(int links)
+{
+	struct nlmsghdr **dump = make_dump(links);
+	double t = 0;
+	int s, i;
+
+	for (s = 0; s <= SAMPLES; s++) {
+		double t0;
+
+		bump(dump, links);
+		t0 = now();
+		tab.gen++;
+		for (i = 0; i < links; i++)
+			get_tab_nlmsg(NULL, dump[i], NULL);
+		tab_sweep();
+		update_tab(scan_interval);
+		/* The first sample only fills the table */
+		if (s)
+			t += now() - t0;
+	}
+
+	for (i = 0; i < links; i++)
+		free(dump[i]);
+	free(dump);
+	tab.gen++;
+	tab_sweep();
+	return t / SAMPLES;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 10, 100, 1000, 10000, 100000 };
+	int i;
+
+	fprintf(stderr, "%10s %16s\n", "links", "sample ms");
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+		fprintf(stderr, "%10d %16.3f\n", sizes[i], run(sizes[i]) * 1e3);
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * ipaddr_bench.c	Cost of "ip addr show" post-processing against
+ *			the number of links.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Feeds a synthetic link and address dump (one IPv4 and one IPv6
+ * address per link) through store_nlmsg() and times filtering and
+ * printing to /dev/null, without talking to the kernel.
+ */
+
+#include "../../ip/ipaddress.c"
+
+#include <sys/time.h>
+
+int preferred_family = AF_UNSPEC;
+int show_stats = 0;
+int show_details = 0;
+int resolve_hosts = 0;
+int oneline = 0;
+char * _SL_ = "\\";
+struct rtnl_handle rth = { .fd = -1 };
+
+struct link_util *get_link_kind(const char *kind)
+{
+	return NULL;
+}
+
+void iplink_usage(void)
+{
+	exit(1);
+}
+
+static void add_link(struct nlmsg_chain *linfo, int ifindex)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct ifinfomsg	i;
+		char			buf[256];
+	} req;
+	unsigned char mac[6] = { 0x02, 0, 0, 0, ifindex >> 8, ifindex };
+	unsigned mtu = 1500;
+	char name[16];
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_type = RTM_NEWLINK;
+	req.i.ifi_index = ifindex;
+	req.i.ifi_type = ARPHRD_ETHER;
+	req.i.ifi_flags = IFF_UP|IFF_BROADCAST|IFF_MULTICAST;
+	snprintf(name, sizeof(name), "veth%d", ifindex);
+	addattr_l(&req.n, sizeof(req), IFLA_IFNAME, name, strlen(name) + 1);
+	addattr_l(&req.n, sizeof(req), IFLA_MTU, &mtu, sizeof(mtu));
+	addattr_l(&req.n, sizeof(req), IFLA_ADDRESS, mac, sizeof(mac));
+	store_nlmsg(NULL, &req.n, linfo);
+}
+
+static void add_addr(struct nlmsg_chain *ainfo, int ifindex, int family)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct ifaddrmsg	ifa;
+		char			buf[256];
+	} req;
+	unsigned char addr[16] = { 10, ifindex >> 16, ifindex >> 8, ifindex };
+
+	if (family == AF_INET6) {
+		memset(addr, 0, sizeof(addr));
+		addr[0] = 0xfd;
+		addr[13] = ifindex >> 16;
+		addr[14] = ifindex >> 8;
+		addr[15] = ifindex;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req.n.nlmsg_type = RTM_NEWADDR;
+	req.ifa.ifa_family = family;
+	req.ifa.ifa_prefixlen = family == AF_INET ? 24 : 64;
+	req.ifa.ifa_index = ifindex;
+	addattr_l(&req.n, sizeof(req), IFA_LOCAL, addr,
+		  family == AF_INET ? 4 : 16);
+	addattr_l(&req.n, sizeof(req), IFA_ADDRESS, addr,
+		  family == AF_INET ? 4 : 16);
+	store_nlmsg(NULL, &req.n, ainfo);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static double run(int links, int family)
+{
+	struct nlmsg_chain linfo = { NULL, NULL };
+	struct nlmsg_chain ainfo = { NULL, NULL };
+	double t0;
+	int i;
+
+	nlmsg_arena_reset();
+	ipaddr_reset_filter(0);
+	filter.family = family;
+
+	/* The kernel dumps addresses family by family */
+	for (i = 1; i <= links; i++)
+		add_link(&linfo, i);
+	for (i = 1; i <= links; i++)
+		add_addr(&ainfo, i, AF_INET);
+	for (i = 1; i <= links; i++)
+		add_addr(&ainfo, i, AF_INET6);
+
+	t0 = now();
+	ipaddr_filter_and_print(&linfo, &ainfo);
+	return now() - t0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 10, 100, 1000, 10000, 50000 };
+	int i;
+
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("/dev/null");
+		return 1;
+	}
+	ll_map_lazy = 0;
+
+	fprintf(stderr, "%10s %16s %16s\n", "links", "addr show ms", "-4 addr show ms");
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		double all = run(sizes[i], AF_UNSPEC);
+		double inet = run(sizes[i], AF_INET);
+
+		fprintf(stderr, "%10d %16.2f %16.2f\n", sizes[i],
+			all * 1e3, inet * 1e3);
+	}
+	return 0;
+}
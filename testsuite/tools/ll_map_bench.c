@@ -0,0 +1,102 @@
+/*
+ * ll_map_bench.c	Lookup cost of the interface map against its size.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Feeds synthetic RTM_NEWLINK messages to ll_remember_index() and
+ * times ll_index_to_name()/ll_name_to_index() as the map grows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+
+#define LOOKUPS	2000000
+
+static unsigned nr_links;
+
+static unsigned bench_index(unsigned i)
+{
+	/* Sparse, like hosts which keep creating and deleting veths */
+	return i * 7 + 1;
+}
+
+static void add_links(unsigned upto)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct ifinfomsg	i;
+		char			buf[256];
+	} req;
+	char name[16];
+
+	for (; nr_links < upto; nr_links++) {
+		memset(&req, 0, sizeof(req));
+		req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+		req.n.nlmsg_type = RTM_NEWLINK;
+		req.i.ifi_index = bench_index(nr_links);
+		snprintf(name, sizeof(name), "veth%u", nr_links);
+		addattr_l(&req.n, sizeof(req), IFLA_IFNAME, name,
+			  strlen(name) + 1);
+		ll_remember_index(NULL, &req.n, NULL);
+	}
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned sizes[] = { 10, 100, 1000, 10000, 100000 };
+	char (*names)[16];
+	unsigned *which;
+	int i;
+
+	names = malloc(LOOKUPS * sizeof(*names));
+	which = malloc(LOOKUPS * sizeof(*which));
+	if (names == NULL || which == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	printf("%10s %16s %16s\n", "links", "index->name ns", "name->index ns");
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		unsigned long sum = 0;
+		double t0, t1, t2;
+		int j;
+
+		add_links(sizes[i]);
+		srandom(sizes[i]);
+		for (j = 0; j < LOOKUPS; j++) {
+			which[j] = random() % nr_links;
+			snprintf(names[j], 16, "veth%u", which[j]);
+		}
+
+		t0 = now();
+		for (j = 0; j < LOOKUPS; j++)
+			sum += ll_index_to_name(bench_index(which[j]))[4];
+		t1 = now();
+		for (j = 0; j < LOOKUPS; j++)
+			sum += ll_name_to_index(names[j]);
+		t2 = now();
+
+		printf("%10u %16.1f %16.1f\n", nr_links,
+		       (t1 - t0) * 1e9 / LOOKUPS, (t2 - t1) * 1e9 / LOOKUPS);
+		if (sum == 0)
+			fprintf(stderr, "impossible\n");
+	}
+	return 0;
+}
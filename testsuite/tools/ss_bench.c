@@ -0,0 +1,152 @@
+/*
+ * ss_bench.c	Cost of listing UNIX and UDP sockets through sock_diag
+ *		and through /proc/net, against the number of sockets.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Opens the sockets itself and prints to /dev/null. The /proc parsers
+ * are picked the way ss picks them, by setting PROC_NET_UNIX and
+ * PROC_NET_UDP.
+ */
+
+#define main ss_main
+#include "../../misc/ss.c"
+#undef main
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+static int *fds;
+static int nfds;
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static int open_unix(int pairs)
+{
+	while (pairs-- > 0) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds + nfds) < 0)
+			return -1;
+		nfds += 2;
+	}
+	return 0;
+}
+
+static int open_udp(int n)
+{
+	while (n-- > 0) {
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+			.sin_port = htons(9),
+			/* One loopback address each, the port stays the same */
+			.sin_addr.s_addr = htonl(0x7f000000 | (nfds + 0x10000)),
+		};
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+		if (fd < 0)
+			return -1;
+		fds[nfds++] = fd;
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void close_all(void)
+{
+	while (nfds > 0)
+		close(fds[--nfds]);
+}
+
+static void use_proc(int proc)
+{
+	static const char *env[][2] = {
+		{ "PROC_NET_UNIX", "/proc/net/unix" },
+		{ "PROC_NET_UDP", "/proc/net/udp" },
+		{ "PROC_NET_UDP6", "/proc/net/udp6" },
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(env); i++) {
+		if (proc)
+			setenv(env[i][0], env[i][1], 1);
+		else
+			unsetenv(env[i][0]);
+	}
+}
+
+static double run(int (*show)(struct filter *), int proc)
+{
+	double t0;
+
+	use_proc(proc);
+	t0 = now();
+	show(&current_filter);
+	fflush(stdout);
+	return now() - t0;
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1000, 10000, 100000 };
+	struct rlimit rlim;
+	int i;
+
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	getrlimit(RLIMIT_NOFILE, &rlim);
+	rlim.rlim_cur = rlim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rlim);
+	fds = malloc(sizes[ARRAY_SIZE(sizes) - 1] * sizeof(int));
+
+	current_filter.dbs = UNIX_DBM | (1<<UDP_DB);
+	current_filter.states = SS_ALL;
+	current_filter.families = (1<<AF_INET)|(1<<AF_INET6)|(1<<AF_UNIX);
+	addr_width = 20;
+	serv_width = 5;
+	resolve_services = 0;
+	dg_proto = UDP_PROTO;
+
+	fprintf(stderr, "%10s %14s %14s %14s %14s\n", "sockets",
+		"unix diag ms", "unix proc ms", "udp diag ms", "udp proc ms");
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		double ud, up, dd, dp;
+
+		if (sizes[i] + 64 > rlim.rlim_cur) {
+			fprintf(stderr, "%10d skipped, RLIMIT_NOFILE is %lu\n",
+				sizes[i], (unsigned long)rlim.rlim_cur);
+			break;
+		}
+
+		if (open_unix(sizes[i] / 2) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		ud = run(unix_show, 0);
+		up = run(unix_show, 1);
+		close_all();
+
+		if (open_udp(sizes[i]) < 0) {
+			perror("udp");
+			return 1;
+		}
+		dd = run(udp_show, 0);
+		dp = run(udp_show, 1);
+		close_all();
+
+		fprintf(stderr, "%10d %14.2f %14.2f %14.2f %14.2f\n", sizes[i],
+			ud * 1e3, up * 1e3, dd * 1e3, dp * 1e3);
+	}
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * ss_proc_bench.c	Cost of listing TCP sockets from a /proc/net/tcp
+ *			file, as ss does when sock_diag is not available.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Usage: ss_proc_bench [ FILE ]
+ *
+ * FILE is a captured /proc/net/tcp. Without it one million lines in
+ * the kernel's format are written to a temporary file first, one in
+ * ten of them for a TIME-WAIT socket. The output goes to /dev/null.
+ */
+
+#define main ss_main
+#include "../../misc/ss.c"
+#undef main
+
+#include <sys/time.h>
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static int make_table(char *path, int lines)
+{
+	FILE *fp;
+	int fd, i;
+
+	if ((fd = mkstemp(path)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+		return -1;
+
+	fprintf(fp, "%-*s\n", 149, "  sl  local_address rem_address   st tx_queue "
+		"rx_queue tr tm->when retrnsmt   uid  timeout inode");
+	for (i = 0; i < lines; i++) {
+		unsigned laddr = htonl(0x0a000000 | (i & 0xffff));
+		unsigned raddr = htonl(0xc0a80000 | (i >> 8));
+		char line[256];
+
+		if (i % 10 == 9)
+			snprintf(line, sizeof(line),
+				 "%4d: %08X:%04X %08X:%04X %02X %08X:%08X "
+				 "%02X:%08lX %08X %5d %8d %d %d %016llx",
+				 i, laddr, 80, raddr, 1024 + i % 60000,
+				 SS_TIME_WAIT, 0, 0, 3, 1500UL, 0, 0, 0, 0, 3,
+				 0xffff880000000000ULL + i * 256ULL);
+		else
+			snprintf(line, sizeof(line),
+				 "%4d: %08X:%04X %08X:%04X %02X %08X:%08X "
+				 "%02X:%08lX %08X %5u %8d %lu %d %016llx "
+				 "%lu %lu %u %u %d",
+				 i, laddr, 80, raddr, 1024 + i % 60000,
+				 SS_ESTABLISHED, i % 7 * 1448, 0, 1, 20UL, 0,
+				 1000, 0, 100000UL + i, 2,
+				 0xffff880000000000ULL + i * 256ULL,
+				 40UL, 4UL, 0, 10, -1);
+		fprintf(fp, "%-*s\n", 149, line);
+	}
+	return fclose(fp);
+}
+
+static double run(unsigned states, char **filter)
+{
+	int argc = 0;
+	double t0;
+
+	while (filter && filter[argc])
+		argc++;
+
+	current_filter.states = states;
+	current_filter.f = NULL;
+	current_filter.prog = NULL;
+	if (argc) {
+		if (ssfilter_parse(&current_filter.f, argc, filter, NULL))
+			exit(1);
+		current_filter.prog = ssfilter_compile(current_filter.f);
+	}
+
+	t0 = now();
+	tcp_show(&current_filter, TCPDIAG_GETSOCK);
+	fflush(stdout);
+	return now() - t0;
+}
+
+int main(int argc, char **argv)
+{
+	/* The filter parser writes into its arguments */
+	char sport[] = "sport", eq[] = "=", num[] = ":8080";
+	char *port[] = { sport, eq, num, NULL };
+	char path[] = "/tmp/ss_proc_bench.XXXXXX";
+	const char *file = argv[1];
+	double all, none, some;
+
+	if (!file) {
+		if (make_table(path, 1000000) < 0) {
+			perror(path);
+			return 1;
+		}
+		file = path;
+	}
+
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	setenv("PROC_NET_TCP", file, 1);
+	current_filter.dbs = 1<<TCP_DB;
+	current_filter.families = 1<<AF_INET;
+	addr_width = 20;
+	serv_width = 5;
+	resolve_services = 0;
+
+	all = run(SS_ALL, NULL);
+	none = run(1<<SS_SYN_SENT, NULL);
+	some = run(SS_ALL, port);
+
+	if (file == path)
+		unlink(path);
+
+	fprintf(stderr, "%16s %16s %16s\n", "all shown ms",
+		"state miss ms", "port miss ms");
+	fprintf(stderr, "%16.2f %16.2f %16.2f\n", all * 1e3, none * 1e3,
+		some * 1e3);
+	return 0;
+}